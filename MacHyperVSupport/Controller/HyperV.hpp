@@ -14,6 +14,10 @@
 
 #include <Headers/kern_api.hpp>
 
+#include "HyperVEventFlags.hpp"
+#include "HyperVVPSet.hpp"
+#include "HyperVTLBFlush.hpp"
+
 //
 // Hyper-V HRESULT status codes.
 //
@@ -420,6 +424,7 @@ static inline int sync_test_and_clear_bit(long nr, volatile void *addr)
 #define CPUID3_HV_TIME_FREQ    0x0100  /* timer frequency query
              * (TSC, LAPIC) */
 #define CPUID3_HV_MSR_CRASH    0x0400  /* MSRs for guest crash */
+#define CPUID3_HV_STIMER_DIRECT    0x80000  /* synthetic timer direct mode */
 
 #define kHyperVCpuidLeafRecommends    0x40000004
 #define kHyperVCpuidLeafLimits        0x40000005
@@ -437,6 +442,13 @@ static inline int sync_test_and_clear_bit(long nr, volatile void *addr)
 #define kHyperVCpuidMsrReferenceTsc    0x0200
 #define kHyperVCpuidMsrGuestIdle       0x0400
 
+//
+// Hyper-V CPUID recommendations
+//
+#define kHyperVRecommendsRemoteTLBFlush     0x0004
+#define kHyperVRecommendsClusterIPI         0x0400
+#define kHyperVRecommendsExProcessorMasks   0x0800
+
 #define kHyperVTimerNanosecondFactor  100ULL
 #define HYPERV_TIMER_FREQ    (kHyperVNanosecond / kHyperVTimerNanosecondFactor)
 
@@ -502,11 +514,18 @@ static inline int sync_test_and_clear_bit(long nr, volatile void *addr)
 #define kHyperVMsrSTimerConfigPeriodic          0x0002ULL
 #define kHyperVMsrSTimerConfigLazy              0x0004ULL
 #define kHyperVMsrSTimerConfigAutoEnable        0x0008ULL
+#define kHyperVMsrSTimerConfigApicVectorMask    0x0FF0ULL
+#define kHyperVMsrSTimerConfigApicVectorShift   4
+#define kHyperVMsrSTimerConfigDirectMode        0x1000ULL
 #define kHyperVMsrSTimerConfigSIntMask          0x000F0000ULL
 #define kHyperVMsrSTimerConfigSIntShift         16
 
 #define kHyperVMsrSTimer0Count                  0x400000B1
 
+#define kHyperVMsrSTimerStride                  2
+#define kHyperVSyntheticTimerCount              4
+#define kHyperVSyntheticTimerModeKey            "HVSyntheticTimerMode"
+
 //
 // Message types
 //
@@ -516,6 +535,16 @@ typedef enum : UInt32 {
   kHyperVMessageTypeTimerExpired  = 0x80000010
 } HyperVMessageType;
 
+//
+// Timer expiration message payload.
+//
+typedef struct __attribute__((packed)) {
+  UInt32  timerIndex;
+  UInt32  reserved;
+  UInt64  expirationTime;
+  UInt64  deliveryTime;
+} HyperVTimerMessagePayload;
+
 //
 // Hypercall status codes and input values
 //
@@ -574,6 +603,29 @@ typedef enum : UInt16 {
 #define kHypercallTypePostMessage   0x0005C // Slow hypercall, memory-based
 #define kHypercallTypeSignalEvent   0x1005D // Fast hypercall, register-based
 
+//
+// Fast hypercalls pass input in registers.
+// With XMM input, RDX and R8 hold the first 16 bytes, and XMM0-XMM5 hold the next 96 bytes.
+//
+#define kHypercallTypeSendSyntheticClusterIpi   0x0000B // Fast hypercall, register-based
+#define kHypercallTypeSendSyntheticClusterIpiEx 0x00015 // Slow hypercall, memory-based with VP set
+
+#define kHypercallTypeFlushVirtualAddressSpace  0x00002 // Slow hypercall, memory-based
+#define kHypercallTypeFlushVirtualAddressList   0x00003 // Slow rep hypercall, memory-based
+
+#define kHypercallFast                  0x10000
+#define kHypercallVariableHeaderShift   17
+#define kHypercallRepCountShift         32
+#define kHypercallRepStartShift         48
+#define kHypercallRepMask               0xFFF
+#define kHypercallXmmInputRegisterCount 6
+#define kHypercallXmmInputSize          (kHypercallXmmInputRegisterCount * 16)
+
+//
+// Connection ID used by the HvPostMessage benchmark, not assigned by Hyper-V.
+//
+#define kHypercallBenchmarkConnectionId 0x00FFFFFF
+
 #define kHypercallStatusMask        0xFFFF
 
 //
@@ -590,6 +642,31 @@ typedef struct __attribute__((packed)) {
   UInt8               data[kHyperVMessageDataSize];
 } HypercallPostMessage;
 
+typedef struct __attribute__((packed)) {
+  UInt32      vector;
+  UInt8       targetVtl;
+  UInt8       reserved1;
+  UInt16      reserved2;
+  HyperVVPSet vpSet;
+} HypercallSendSyntheticClusterIpiEx;
+
+//
+// Virtual address space flushing.
+//
+#define kHyperVFlushAllProcessors                 BIT(0)
+#define kHyperVFlushAllVirtualAddressSpaces       BIT(1)
+#define kHyperVFlushNonGlobalMappingsOnly         BIT(2)
+
+#define kHypercallFlushGvaListMaxPagesPerEntry    4096
+#define kHypercallFlushGvaListMaxEntries          ((PAGE_SIZE - sizeof (HypercallFlushVirtualAddressSpace)) / sizeof (UInt64))
+
+typedef struct __attribute__((packed)) {
+  UInt64  addressSpace;
+  UInt64  flags;
+  UInt64  processorMask;
+  UInt64  gvaList[];
+} HypercallFlushVirtualAddressSpace;
+
 typedef union {
   UInt8 value;
   struct {
@@ -627,18 +704,18 @@ typedef struct {
   UInt64  pfnArray[];
 } HyperVGPARange;
 
-#define kHyperVEventFlagsByteCount  256
-#define kHyperVEventFlagsDwordCount (kHyperVEventFlagsByteCount / sizeof (UInt32))
-
 //
-// Event flags.
+// Monitored notification (MNF) page.
+// Monitor IDs are split into groups of 32, with the host polling the pending bits of each group.
 //
+#define kHyperVMonitorGroupCount      4
+#define kHyperVMonitorBitsPerGroup    32
+#define kHyperVMonitorIdCount         (kHyperVMonitorGroupCount * kHyperVMonitorBitsPerGroup)
+
 typedef struct __attribute__((packed)) {
-  union {
-    UInt8   flags8[kHyperVEventFlagsByteCount];
-    UInt32  flags32[kHyperVEventFlagsDwordCount];
-  };
-} HyperVEventFlags;
+  volatile UInt32 pending;
+  volatile UInt32 armed;
+} HyperVMonitorTriggerGroup;
 
 typedef struct __attribute__((packed)) {
   UInt32 connectionId;
@@ -646,6 +723,29 @@ typedef struct __attribute__((packed)) {
   UInt16 reserved;
 } HyperVMonitorNotificationParameter;
 
+typedef struct __attribute__((packed)) {
+  UInt32                             triggerState;
+  UInt32                             reserved1;
+  HyperVMonitorTriggerGroup          triggerGroups[kHyperVMonitorGroupCount];
+  UInt64                             reserved2[3];
+  SInt32                             nextCheckTime[kHyperVMonitorGroupCount][kHyperVMonitorBitsPerGroup];
+  UInt16                             latency[kHyperVMonitorGroupCount][kHyperVMonitorBitsPerGroup];
+  UInt64                             reserved3[32];
+  HyperVMonitorNotificationParameter parameters[kHyperVMonitorGroupCount][kHyperVMonitorBitsPerGroup];
+  UInt8                              reserved4[1984];
+} HyperVMonitorPage;
+
+#define kHyperVCPUInterruptsKey             "HVCPUInterrupts"
+#define kHyperVHypercallStatisticsKey       "HVHypercallStatistics"
+#define kHyperVPostMessageBenchmarkKey      "HVPostMessageBenchmark"
+#define kHyperVTLBFlushBenchmarkKey         "HVTLBFlushBenchmark"
+#define kHyperVPVIPIKey                     "HVParavirtualIPI"
+#define kHyperVPVTLBFlushKey                "HVParavirtualTLBFlush"
+
+#define kHyperVTimeSourceKey                "HVTimeSource"
+#define kHyperVTimeSourceReferenceTsc       "ReferenceTSC"
+#define kHyperVTimeSourceMsr                "TimeRefCountMSR"
+
 //
 // DMA buffer structure.
 //
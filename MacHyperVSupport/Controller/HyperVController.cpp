@@ -97,6 +97,17 @@ bool HyperVController::start(IOService *provider) {
       HVSYSLOG("Failed to initialize interrupts");
       break;
     }
+#if DEBUG
+    runPostMessageBenchmark();
+#endif
+
+    //
+    // Reference TSC page is optional, the time reference counter MSR is used otherwise.
+    //
+    if (!initReferenceTsc()) {
+      HVDBGLOG("Reference TSC page is not in use");
+    }
+    initSyntheticTimers();
     
     //
     // Initialize VMBus root.
@@ -106,6 +117,12 @@ bool HyperVController::start(IOService *provider) {
       break;
     }
 
+    //
+    // Paravirtual hooks are installed last, as the platform provider keeps a pointer to this controller.
+    //
+    initPVIPI();
+    initPVTLBFlush();
+
     registerService();
 
     //
@@ -117,11 +134,88 @@ bool HyperVController::start(IOService *provider) {
   } while (false);
   
   if (!result) {
+    destroyReferenceTsc();
     super::stop(provider);
   }
   return result;
 }
 
+bool HyperVController::serializeProperties(OSSerialize *serialize) const {
+  HyperVController *controller = (HyperVController *) this;
+  OSArray          *cpuArray;
+  OSDictionary     *cpuDict;
+  OSDictionary     *statsDict;
+  OSNumber         *number;
+
+  //
+  // Refresh per-CPU interrupt information each time the registry is read.
+  //
+  if (_cpuData != nullptr) {
+    cpuArray = OSArray::withCapacity(_cpuDataCount);
+    if (cpuArray != nullptr) {
+      for (UInt32 i = 0; i < _cpuDataCount; i++) {
+        cpuDict = OSDictionary::withCapacity(4);
+        if (cpuDict == nullptr) {
+          continue;
+        }
+
+        number = OSNumber::withNumber(_cpuData[i].virtualCPUIndex, 32);
+        if (number != nullptr) {
+          cpuDict->setObject("VirtualProcessorIndex", number);
+          number->release();
+        }
+        number = OSNumber::withNumber(_cpuData[i].interruptCounter, 64);
+        if (number != nullptr) {
+          cpuDict->setObject("Interrupts", number);
+          number->release();
+        }
+        cpuDict->setObject("SynICVerified", _cpuData[i].synICVerified ? kOSBooleanTrue : kOSBooleanFalse);
+        cpuDict->setObject("InterruptDelivered", _cpuData[i].interruptDelivered ? kOSBooleanTrue : kOSBooleanFalse);
+
+        cpuArray->setObject(cpuDict);
+        cpuDict->release();
+      }
+
+      controller->setProperty(kHyperVCPUInterruptsKey, cpuArray);
+      cpuArray->release();
+    }
+  }
+
+  //
+  // Refresh HvPostMessage statistics.
+  //
+  const struct {
+    const char *key;
+    UInt64     value;
+  } hypercallCounters[] = {
+    { "PostMessageFast",       _numPostMessageFast },
+    { "PostMessageFastCycles", _postMessageFastCycles },
+    { "PostMessageSlow",       _numPostMessageSlow },
+    { "PostMessageSlowCycles", _postMessageSlowCycles },
+    { "PVIPIs",                _numPVIPIs },
+    { "PVIPIFailures",         _numPVIPIFailures },
+    { "PVTLBFlushes",          _numPVTLBFlushes },
+    { "PVTLBFlushLists",       _numPVTLBFlushLists },
+    { "PVTLBFlushFailures",    _numPVTLBFlushFailures }
+  };
+
+  statsDict = OSDictionary::withCapacity(arrsize(hypercallCounters) + 1);
+  if (statsDict != nullptr) {
+    for (UInt32 i = 0; i < arrsize(hypercallCounters); i++) {
+      number = OSNumber::withNumber(hypercallCounters[i].value, 64);
+      if (number != nullptr) {
+        statsDict->setObject(hypercallCounters[i].key, number);
+        number->release();
+      }
+    }
+    statsDict->setObject("XMMInput", _hypercallXmmInputSupported ? kOSBooleanTrue : kOSBooleanFalse);
+    controller->setProperty(kHyperVHypercallStatisticsKey, statsDict);
+    statsDict->release();
+  }
+
+  return super::serializeProperties(serialize);
+}
+
 bool HyperVController::identifyHyperV() {
   bool isHyperV = false;
   uint32_t regs[4];
@@ -266,14 +360,18 @@ bool HyperVController::initVMBus() {
   return true;
 }
 
-bool HyperVController::allocateDmaBuffer(HyperVDMABuffer *dmaBuf, size_t size) {
+bool HyperVController::allocateDmaBuffer(HyperVDMABuffer *dmaBuf, size_t size, bool contiguous) {
   IOBufferMemoryDescriptor *bufDesc;
   
   //
   // Create page-aligned DMA buffer and get physical address.
   //
+  // Large buffers that are only ever handed to Hyper-V through a GPADL do not need to be
+  // physically contiguous, and are allocated page-by-page to avoid requiring long physical runs.
+  // The physical address of such buffers refers to the first page only.
+  //
   bufDesc = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task,
-                                                             kIODirectionInOut | kIOMemoryPhysicallyContiguous,
+                                                             kIODirectionInOut | (contiguous ? kIOMemoryPhysicallyContiguous : 0),
                                                              size, 0xFFFFFFFFFFFFF000ULL);
   if (bufDesc == nullptr) {
     HVSYSLOG("Failed to allocate DMA buffer memory of %u bytes", size);
@@ -287,7 +385,7 @@ bool HyperVController::allocateDmaBuffer(HyperVDMABuffer *dmaBuf, size_t size) {
   dmaBuf->size     = size;
   
   memset(dmaBuf->buffer, 0, dmaBuf->size);
-  HVDBGLOG("Mapped buffer of %u bytes to 0x%llX", dmaBuf->size, dmaBuf->physAddr);
+  HVDBGLOG("Mapped buffer of %u bytes to 0x%llX (contiguous: %u)", dmaBuf->size, dmaBuf->physAddr, contiguous);
   return true;
 }
 
@@ -12,6 +12,7 @@
 #include <IOKit/IOService.h>
 
 #include "HyperV.hpp"
+#include "HyperVReferenceTsc.hpp"
 
 extern "C" {
 #include <i386/cpuid.h>
@@ -25,6 +26,8 @@ typedef struct {
   
   UInt64                  interruptCounter;
   UInt64                  virtualCPUIndex;
+  bool                    synICVerified;
+  volatile bool           interruptDelivered;
   
   HyperVDMABuffer         messageDma;
   HyperVDMABuffer         eventFlagsDma;
@@ -33,8 +36,24 @@ typedef struct {
   volatile HyperVEventFlags        *eventFlags; //TODO: testing
   
   HyperVDMABuffer         postMessageDma;
+  HyperVDMABuffer         hypercallInputDma;
 } HyperVCPUData;
 
+//
+// Synthetic timer, invoked in interrupt context on expiry.
+//
+typedef void (*HyperVSyntheticTimerAction)(OSObject *target, void *refCon);
+
+typedef struct {
+  volatile UInt32             allocated;
+  volatile UInt32             armed;
+  volatile UInt32             cpu;
+  volatile UInt64             expiration;
+  OSObject                    *target;
+  HyperVSyntheticTimerAction  action;
+  void                        *refCon;
+} HyperVSyntheticTimer;
+
 class HyperVInterruptController;
 class HyperVVMBus;
 class HyperVUserClient;
@@ -65,7 +84,47 @@ private:
   //
   void                *hypercallPage = nullptr;
   IOMemoryDescriptor  *hypercallDesc = nullptr;
+  bool                _hypercallXmmInputSupported = false;
+
+  //
+  // HvPostMessage cost tracking, in TSC cycles.
+  //
+  UInt64              _numPostMessageFast    = 0;
+  UInt64              _numPostMessageSlow    = 0;
+  UInt64              _postMessageFastCycles = 0;
+  UInt64              _postMessageSlowCycles = 0;
+
+  //
+  // Paravirtual IPIs.
+  //
+  bool                _pvIPIEnabled     = false;
+  bool                _pvIPIExSupported = false;
+  UInt64              _numPVIPIs        = 0;
+  UInt64              _numPVIPIFailures = 0;
+  UInt32              _cpuVPIndexes[kHyperVVPSetBankSize] = { };
+  UInt32              _cpuVPIndexesCount                  = 0;
+
+  //
+  // Paravirtual TLB flushes.
+  //
+  bool                _pvTLBFlushEnabled      = false;
+  UInt64              _numPVTLBFlushes        = 0;
+  UInt64              _numPVTLBFlushLists     = 0;
+  UInt64              _numPVTLBFlushFailures  = 0;
   
+  //
+  // Reference TSC page.
+  //
+  HyperVDMABuffer         _referenceTscBuffer = { };
+  HyperVReferenceTscPage  *_referenceTscPage  = nullptr;
+
+  //
+  // Synthetic timers.
+  //
+  bool                  _syntheticTimersSupported  = false;
+  bool                  _syntheticTimersDirectMode = false;
+  HyperVSyntheticTimer  _syntheticTimers[kHyperVSyntheticTimerCount] = { };
+
   //
   // Interrupt and event data.
   //
@@ -73,6 +132,7 @@ private:
   HyperVCPUData     *_cpuData            = nullptr;
   UInt32            _interruptVector     = 0;
   bool              _supportsHvVpIndex   = false;
+  bool              _interruptDeliveryChecked = false;
   bool              _useLegacyEventFlags = false;
   HyperVEventFlags  *_vmbusRxEventFlags  = nullptr;
   
@@ -92,10 +152,65 @@ private:
   bool initHypercalls();
   void destroyHypercalls();
   void freeHypercallPage();
+  HypercallStatus hypercallSendSyntheticClusterIpi(UInt32 vector, UInt64 vpMask);
+  HypercallStatus hypercallSendSyntheticClusterIpiEx(UInt32 vector, UInt64 cpuMask);
+  HypercallStatus hypercallFlushVirtualAddressSpace(UInt64 addressSpace, UInt64 flags);
+  HypercallStatus hypercallFlushVirtualAddressList(UInt64 addressSpace, UInt64 flags, UInt64 startAddress, UInt64 pageCount);
+  UInt64 hypercallWithInput(UInt64 control, UInt64 inputPhysAddr);
+  HypercallStatus hypercallPostMessagePage(UInt32 connectionId, HyperVMessageType messageType, void *data, UInt32 size);
+#if defined(__x86_64__)
+  bool hypercallPostMessageXmm(UInt32 connectionId, HyperVMessageType messageType, void *data, UInt32 size, HypercallStatus *hvStatus);
+#endif
+#if DEBUG
+  void runPostMessageBenchmark();
+#endif
   bool allocateInterruptBuffers();
   bool initInterrupts();
   void destroySynIC();
+  void checkCPUInterruptDelivery();
   void handleInterrupt(OSObject *target, void *refCon, IOService *nub, int source);
+  void handleEventFlags(volatile HyperVEventFlags *eventFlags);
+
+  //
+  // Paravirtual IPIs.
+  //
+  void initPVIPI();
+  static bool handlePVIPI(void *target, UInt64 cpuMask, UInt32 vector);
+  bool sendPVIPI(UInt64 cpuMask, UInt32 vector);
+
+  //
+  // Paravirtual TLB flushes.
+  //
+  void initPVTLBFlush();
+  static bool handlePVTLBFlush(void *target, UInt64 addressSpace, UInt64 startAddress, UInt64 endAddress);
+  bool flushTLBs(UInt64 addressSpace, UInt64 startAddress, UInt64 endAddress);
+#if DEBUG
+  void runTLBFlushBenchmark();
+#endif
+
+  //
+  // Synthetic timers.
+  //
+  void initSyntheticTimers();
+  void handleSyntheticTimerMessage(HyperVMessage *message);
+  void handleSyntheticTimerDirect();
+  void fireSyntheticTimer(UInt32 timerId);
+
+  //
+  // Reference TSC.
+  //
+  bool initReferenceTsc();
+  void destroyReferenceTsc();
+  static inline UInt64 readTscOrdered() {
+    //
+    // Prevent the TSC read from being executed before the sequence is read.
+    //
+    __asm__ volatile ("lfence" ::: "memory");
+    return rdtsc64();
+  }
+  inline bool readReferenceTsc(UInt64 *refCount) {
+    return readReferenceTscPage(_referenceTscPage, readTscOrdered, refCount);
+  }
   
 public:
   //
@@ -106,7 +221,8 @@ public:
   //
   // Misc functions.
   //
-  bool allocateDmaBuffer(HyperVDMABuffer *dmaBuf, size_t size);
+  bool serializeProperties(OSSerialize *serialize) const APPLE_KEXT_OVERRIDE;
+  bool allocateDmaBuffer(HyperVDMABuffer *dmaBuf, size_t size, bool contiguous = true);
   void freeDmaBuffer(HyperVDMABuffer *dmaBuf);
   bool addInterruptProperties(OSDictionary *dict, UInt32 interruptVector);
   
@@ -118,12 +234,33 @@ public:
   bool enableInterrupts(HyperVEventFlags *legacyEventFlags = nullptr);
   void disableInterrupts();
   void sendSynICEOM(UInt32 cpu);
+  inline UInt32 getCPUCount() { return _cpuDataCount; }
+  inline bool isCPUInterruptCapable(UInt32 cpu) {
+    return (cpu < _cpuDataCount) && _cpuData[cpu].synICVerified && (cpu == 0 || _cpuData[cpu].interruptDelivered);
+  }
+  inline UInt32 getVirtualProcessorIndex(UInt32 cpu) { return (UInt32) _cpuData[cpu].virtualCPUIndex; }
   
   //
   // Time reference counter.
+  // Reference TSC page is used if enabled, falling back to the MSR if the page is currently invalid.
   //
   inline bool isTimeRefCounterSupported() { return (_hvFeatures & kHyperVCpuidMsrTimeRefCnt); }
-  inline UInt64 readTimeRefCounter() { return isTimeRefCounterSupported() ? rdmsr64(kHyperVMsrTimeRefCount) : 0; }
+  inline UInt64 readTimeRefCounter() {
+    UInt64 refCount;
+    if (_referenceTscPage != nullptr && readReferenceTsc(&refCount)) {
+      return refCount;
+    }
+    return isTimeRefCounterSupported() ? rdmsr64(kHyperVMsrTimeRefCount) : 0;
+  }
+
+  //
+  // Synthetic timers.
+  //
+  inline bool isSyntheticTimerSupported() { return _syntheticTimersSupported; }
+  IOReturn allocateSyntheticTimer(OSObject *target, HyperVSyntheticTimerAction action, void *refCon, UInt32 *timerId);
+  void freeSyntheticTimer(UInt32 timerId);
+  IOReturn armSyntheticTimer(UInt32 timerId, UInt64 delayNs);
+  void cancelSyntheticTimer(UInt32 timerId);
 
   //
   // Messages.
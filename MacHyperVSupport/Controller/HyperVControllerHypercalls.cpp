@@ -64,7 +64,13 @@ bool HyperVController::initHypercalls() {
     return false;
   }
 
-  HVDBGLOG("Hypercalls are now enabled");
+  //
+  // XMM fast hypercall input is only used on 64-bit, as R8 is required.
+  //
+#if defined(__x86_64__)
+  _hypercallXmmInputSupported = (_hvFeatures3 & CPUID3_HV_XMM_HYPERCALL) != 0 && !checkKernelArgument("-hvctrlnoxmm");
+#endif
+  HVDBGLOG("Hypercalls are now enabled (XMM input %s)", _hypercallXmmInputSupported ? "enabled" : "disabled");
   return true;
 }
 
@@ -94,14 +100,104 @@ void HyperVController::freeHypercallPage() {
   }
 }
 
+#if defined(__x86_64__)
+bool HyperVController::hypercallPostMessageXmm(UInt32 connectionId, HyperVMessageType messageType, void *data, UInt32 size,
+                                               HypercallStatus *hvStatus) {
+  UInt8         xmmInput[kHypercallXmmInputSize] __attribute__((aligned(16)));
+  UInt8         xmmSaved[kHypercallXmmInputSize] __attribute__((aligned(16)));
+  UInt64        status;
+  UInt64        cr0;
+  bool          intsEnabled;
+
+  //
+  // RDX holds the connection ID, R8 holds the message type and size.
+  //
+  UInt64          control = kHypercallTypePostMessage | kHypercallFast;
+  UInt64          input1  = connectionId;
+  register UInt64 input2 asm("r8") = ((UInt64) size << 32) | messageType;
+
+  bzero(xmmInput, sizeof (xmmInput));
+  memcpy(xmmInput, data, size);
+
+  //
+  // XMM registers belong to the current thread's FPU state, and must be preserved.
+  // Interrupts are disabled so the thread cannot be switched out while they are in use.
+  // If the FPU is not currently usable in the kernel (CR0.TS set), the memory-based hypercall must be used instead.
+  //
+  intsEnabled = ml_set_interrupts_enabled(false);
+  asm volatile ("mov %%cr0, %0" : "=r" (cr0));
+  if (cr0 & CR0_TS) {
+    ml_set_interrupts_enabled(intsEnabled);
+    return false;
+  }
+
+  asm volatile ("movdqa %%xmm0, 0x00(%%rdi)\n"
+                "movdqa %%xmm1, 0x10(%%rdi)\n"
+                "movdqa %%xmm2, 0x20(%%rdi)\n"
+                "movdqa %%xmm3, 0x30(%%rdi)\n"
+                "movdqa %%xmm4, 0x40(%%rdi)\n"
+                "movdqa %%xmm5, 0x50(%%rdi)\n"
+                "movdqa 0x00(%%rsi), %%xmm0\n"
+                "movdqa 0x10(%%rsi), %%xmm1\n"
+                "movdqa 0x20(%%rsi), %%xmm2\n"
+                "movdqa 0x30(%%rsi), %%xmm3\n"
+                "movdqa 0x40(%%rsi), %%xmm4\n"
+                "movdqa 0x50(%%rsi), %%xmm5\n"
+                "call *%4\n"
+                "movdqa 0x00(%%rdi), %%xmm0\n"
+                "movdqa 0x10(%%rdi), %%xmm1\n"
+                "movdqa 0x20(%%rdi), %%xmm2\n"
+                "movdqa 0x30(%%rdi), %%xmm3\n"
+                "movdqa 0x40(%%rdi), %%xmm4\n"
+                "movdqa 0x50(%%rdi), %%xmm5\n"
+                : "=a" (status)
+                : "c" (control), "d" (input1), "r" (input2), "m" (hypercallPage), "S" (xmmInput), "D" (xmmSaved)
+                : "memory");
+
+  ml_set_interrupts_enabled(intsEnabled);
+  *hvStatus = (HypercallStatus)(status & kHypercallStatusMask);
+  return true;
+}
+#endif
+
 HypercallStatus HyperVController::hypercallPostMessage(UInt32 connectionId, HyperVMessageType messageType, void *data, UInt32 size) {
-  UInt64 status;
+  HypercallStatus status;
+  UInt64          startCycles;
 
   if (size > kHyperVMessageDataSize) {
     HVSYSLOG("Attempted to send message that is too big of %u bytes", size);
     return kHypercallStatusInvalidParameter;
   }
 
+  //
+  // Use XMM register input if supported and the message fits, avoiding the post message page.
+  // If Hyper-V rejects XMM input, it is not used again. The memory-based hypercall is tried instead,
+  // with the cycles of the rejected attempt counted against it.
+  //
+  startCycles = rdtsc64();
+#if defined(__x86_64__)
+  if (_hypercallXmmInputSupported && size <= kHypercallXmmInputSize
+      && hypercallPostMessageXmm(connectionId, messageType, data, size, &status)) {
+    if (status != kHypercallStatusInvalidHypercallInput) {
+      __sync_fetch_and_add(&_numPostMessageFast, 1);
+      __sync_fetch_and_add(&_postMessageFastCycles, rdtsc64() - startCycles);
+      return status;
+    }
+
+    _hypercallXmmInputSupported = false;
+    HVSYSLOG("XMM hypercall input was rejected by Hyper-V, using post message page");
+  }
+#endif
+
+  status = hypercallPostMessagePage(connectionId, messageType, data, size);
+  __sync_fetch_and_add(&_numPostMessageSlow, 1);
+  __sync_fetch_and_add(&_postMessageSlowCycles, rdtsc64() - startCycles);
+  return status;
+}
+
+HypercallStatus HyperVController::hypercallPostMessagePage(UInt32 connectionId, HyperVMessageType messageType, void *data, UInt32 size) {
+  UInt64 status;
+
   //
   // Get per-CPU hypercall post message page.
   //
@@ -130,6 +226,89 @@ HypercallStatus HyperVController::hypercallPostMessage(UInt32 connectionId, Hype
   return (HypercallStatus)(status & kHypercallStatusMask);
 }
 
+#if DEBUG
+void HyperVController::runPostMessageBenchmark() {
+  static const UInt32 messageSizes[] = { 16, 48, kHypercallXmmInputSize };
+  UInt8               message[kHypercallXmmInputSize] = { };
+  UInt32              iterations = 0;
+  OSArray             *resultsArray;
+  OSDictionary        *resultDict;
+  OSNumber            *number;
+  UInt64              startCycles;
+  UInt64              pageCycles;
+  UInt64              xmmCycles;
+  HypercallStatus     pageStatus;
+  HypercallStatus     xmmStatus;
+
+  //
+  // Optional HvPostMessage microbenchmark in DEBUG builds, comparing the post message page and XMM input paths.
+  // An invalid connection ID is used, so Hyper-V validates and rejects each message without delivering it.
+  //
+  if (!PE_parse_boot_argn("hvctrlpostbench", &iterations, sizeof (iterations)) || iterations == 0) {
+    return;
+  }
+
+  resultsArray = OSArray::withCapacity(arrsize(messageSizes));
+  if (resultsArray == nullptr) {
+    return;
+  }
+
+  for (UInt32 i = 0; i < arrsize(messageSizes); i++) {
+    pageStatus = kHypercallStatusSuccess;
+    startCycles = rdtsc64();
+    for (UInt32 j = 0; j < iterations; j++) {
+      pageStatus = hypercallPostMessagePage(kHypercallBenchmarkConnectionId, kHyperVMessageTypeChannel, message, messageSizes[i]);
+    }
+    pageCycles = (rdtsc64() - startCycles) / iterations;
+
+    xmmStatus = kHypercallStatusFeatureUnavailable;
+    xmmCycles = 0;
+#if defined(__x86_64__)
+    if ((_hvFeatures3 & CPUID3_HV_XMM_HYPERCALL) != 0) {
+      startCycles = rdtsc64();
+      for (UInt32 j = 0; j < iterations; j++) {
+        if (!hypercallPostMessageXmm(kHypercallBenchmarkConnectionId, kHyperVMessageTypeChannel, message, messageSizes[i], &xmmStatus)) {
+          xmmStatus = kHypercallStatusFeatureUnavailable;
+          break;
+        }
+      }
+      xmmCycles = (rdtsc64() - startCycles) / iterations;
+    }
+#endif
+
+    HVSYSLOG("HvPostMessage %u bytes: page %llu cycles (status 0x%X), XMM %llu cycles (status 0x%X)",
+             messageSizes[i], pageCycles, pageStatus, xmmCycles, xmmStatus);
+
+    resultDict = OSDictionary::withCapacity(5);
+    if (resultDict == nullptr) {
+      continue;
+    }
+    const struct {
+      const char *key;
+      UInt64     value;
+    } results[] = {
+      { "Size",       messageSizes[i] },
+      { "PageCycles", pageCycles },
+      { "PageStatus", pageStatus },
+      { "XMMCycles",  xmmCycles },
+      { "XMMStatus",  xmmStatus }
+    };
+    for (UInt32 j = 0; j < arrsize(results); j++) {
+      number = OSNumber::withNumber(results[j].value, 64);
+      if (number != nullptr) {
+        resultDict->setObject(results[j].key, number);
+        number->release();
+      }
+    }
+    resultsArray->setObject(resultDict);
+    resultDict->release();
+  }
+
+  setProperty(kHyperVPostMessageBenchmarkKey, resultsArray);
+  resultsArray->release();
+}
+#endif
+
 HypercallStatus HyperVController::hypercallSignalEvent(UInt32 connectionId) {
   UInt64 status;
 
@@ -145,3 +324,146 @@ HypercallStatus HyperVController::hypercallSignalEvent(UInt32 connectionId) {
 #endif
   return (HypercallStatus)(status & kHypercallStatusMask);
 }
+
+HypercallStatus HyperVController::hypercallSendSyntheticClusterIpi(UInt32 vector, UInt64 vpMask) {
+  UInt64 status;
+
+  //
+  // Perform a fast version of HvCallSendSyntheticClusterIpi hypercall.
+  // Input is the vector followed by a mask of VP indexes 0-63.
+  //
+#if defined(__i386__)
+  asm volatile ("call *%7" : "=A" (status) : "d" (0), "a" (kHypercallTypeSendSyntheticClusterIpi | kHypercallFast), "b" (0), "c" (vector),
+                "D" ((UInt32) (vpMask >> 32)), "S" ((UInt32) vpMask), "m" (hypercallPage));
+#elif defined(__x86_64__)
+  register UInt64 input2 asm("r8") = vpMask;
+  asm volatile ("call *%4" : "=a" (status) : "c" (kHypercallTypeSendSyntheticClusterIpi | kHypercallFast), "d" ((UInt64) vector),
+                "r" (input2), "m" (hypercallPage));
+#else
+#error Unsupported arch
+#endif
+  return (HypercallStatus)(status & kHypercallStatusMask);
+}
+
+HypercallStatus HyperVController::hypercallSendSyntheticClusterIpiEx(UInt32 vector, UInt64 cpuMask) {
+  HypercallSendSyntheticClusterIpiEx  *ipiInput;
+  HyperVDMABuffer                     *inputBuffer;
+  UInt64                              control;
+  UInt64                              status;
+  UInt32                              bankCount;
+  bool                                intsEnabled;
+
+  //
+  // Per-CPU input page may be used from interrupt context, keep interrupts disabled while it is in use.
+  //
+  intsEnabled = ml_set_interrupts_enabled(false);
+  inputBuffer = &_cpuData[cpu_number()].hypercallInputDma;
+  ipiInput    = (HypercallSendSyntheticClusterIpiEx*) inputBuffer->buffer;
+
+  ipiInput->vector    = vector;
+  ipiInput->targetVtl = 0;
+  ipiInput->reserved1 = 0;
+  ipiInput->reserved2 = 0;
+  bankCount = encodeVPSet(_cpuVPIndexes, _cpuVPIndexesCount, cpuMask, &ipiInput->vpSet);
+  if (bankCount == 0) {
+    ml_set_interrupts_enabled(intsEnabled);
+    return kHypercallStatusInvalidParameter;
+  }
+
+  //
+  // Perform HvCallSendSyntheticClusterIpiEx hypercall.
+  // Bank contents are the variable portion of the header, in 8 byte units.
+  //
+  control = kHypercallTypeSendSyntheticClusterIpiEx | ((UInt64) bankCount << kHypercallVariableHeaderShift);
+  status  = hypercallWithInput(control, inputBuffer->physAddr);
+
+  ml_set_interrupts_enabled(intsEnabled);
+  return (HypercallStatus)(status & kHypercallStatusMask);
+}
+
+HypercallStatus HyperVController::hypercallFlushVirtualAddressSpace(UInt64 addressSpace, UInt64 flags) {
+  HypercallFlushVirtualAddressSpace *flushInput;
+  HyperVDMABuffer                   *inputBuffer;
+  UInt64                            status;
+  bool                              intsEnabled;
+
+  intsEnabled = ml_set_interrupts_enabled(false);
+  inputBuffer = &_cpuData[cpu_number()].hypercallInputDma;
+  flushInput  = (HypercallFlushVirtualAddressSpace*) inputBuffer->buffer;
+
+  flushInput->addressSpace  = addressSpace;
+  flushInput->flags         = flags;
+  flushInput->processorMask = 0;
+  status = hypercallWithInput(kHypercallTypeFlushVirtualAddressSpace, inputBuffer->physAddr);
+
+  ml_set_interrupts_enabled(intsEnabled);
+  return (HypercallStatus)(status & kHypercallStatusMask);
+}
+
+HypercallStatus HyperVController::hypercallFlushVirtualAddressList(UInt64 addressSpace, UInt64 flags, UInt64 startAddress, UInt64 pageCount) {
+  HypercallFlushVirtualAddressSpace *flushInput;
+  HyperVDMABuffer                   *inputBuffer;
+  UInt64                            control;
+  UInt64                            status;
+  UInt32                            repCount = 0;
+  UInt32                            repsComplete;
+  UInt64                            entryPages;
+  bool                              intsEnabled;
+
+  intsEnabled = ml_set_interrupts_enabled(false);
+  inputBuffer = &_cpuData[cpu_number()].hypercallInputDma;
+  flushInput  = (HypercallFlushVirtualAddressSpace*) inputBuffer->buffer;
+
+  flushInput->addressSpace  = addressSpace;
+  flushInput->flags         = flags;
+  flushInput->processorMask = 0;
+
+  //
+  // Each list entry is a page address, with the number of additional pages to flush in the low bits.
+  //
+  startAddress &= ~((UInt64) PAGE_MASK);
+  while (pageCount > 0) {
+    if (repCount >= kHypercallFlushGvaListMaxEntries) {
+      ml_set_interrupts_enabled(intsEnabled);
+      return kHypercallStatusInvalidParameter;
+    }
+
+    entryPages = (pageCount > kHypercallFlushGvaListMaxPagesPerEntry) ? kHypercallFlushGvaListMaxPagesPerEntry : pageCount;
+    flushInput->gvaList[repCount++] = startAddress | (entryPages - 1);
+    startAddress += entryPages << PAGE_SHIFT;
+    pageCount    -= entryPages;
+  }
+
+  //
+  // Perform HvFlushVirtualAddressList rep hypercall.
+  // Hyper-V may return before all entries are processed, continue from the last completed entry.
+  //
+  repsComplete = 0;
+  do {
+    control = kHypercallTypeFlushVirtualAddressList | ((UInt64) repCount << kHypercallRepCountShift)
+              | ((UInt64) repsComplete << kHypercallRepStartShift);
+    status       = hypercallWithInput(control, inputBuffer->physAddr);
+    repsComplete = (UInt32) ((status >> kHypercallRepCountShift) & kHypercallRepMask);
+  } while ((status & kHypercallStatusMask) == kHypercallStatusSuccess && repsComplete < repCount);
+
+  ml_set_interrupts_enabled(intsEnabled);
+  return (HypercallStatus)(status & kHypercallStatusMask);
+}
+
+UInt64 HyperVController::hypercallWithInput(UInt64 control, UInt64 inputPhysAddr) {
+  UInt64 status;
+
+  //
+  // Perform a memory-based hypercall with no output.
+  //
+#if defined(__i386__)
+  asm volatile ("call *%7" : "=A" (status) : "d" ((UInt32) (control >> 32)), "a" ((UInt32) control),
+                "b" ((UInt32) (inputPhysAddr >> 32)), "c" ((UInt32) inputPhysAddr), "D" (0), "S" (0), "m" (hypercallPage));
+#elif defined(__x86_64__)
+  register UInt64 output asm("r8") = 0;
+  asm volatile ("call *%4" : "=a" (status) : "c" (control), "d" (inputPhysAddr), "r" (output), "m" (hypercallPage));
+#else
+#error Unsupported arch
+#endif
+  return status;
+}
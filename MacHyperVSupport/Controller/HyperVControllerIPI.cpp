@@ -0,0 +1,80 @@
+//
+//  HyperVControllerIPI.cpp
+//  Hyper-V paravirtual IPI support
+//
+//  Copyright © 2022 Goldfish64. All rights reserved.
+//
+
+#include "HyperVController.hpp"
+#include "HyperVPlatformProvider.hpp"
+
+void HyperVController::initPVIPI() {
+  HyperVPlatformProvider *platformProvider;
+
+  //
+  // Synthetic cluster IPIs target VP indexes, and should only be used if recommended by Hyper-V.
+  //
+  if ((_hvRecommends & kHyperVRecommendsClusterIPI) == 0 || !_supportsHvVpIndex) {
+    HVDBGLOG("Paravirtual IPIs are not recommended");
+    return;
+  }
+  if (checkKernelArgument("-hvctrlnopvipi")) {
+    HVDBGLOG("Paravirtual IPIs are disabled");
+    return;
+  }
+
+  platformProvider = HyperVPlatformProvider::getInstance();
+  if (platformProvider == nullptr || !platformProvider->isIPIHookInstalled()) {
+    HVSYSLOG("Paravirtual IPIs are unavailable, IPI function was not hooked");
+    return;
+  }
+
+  //
+  // Cache VP index of each CPU for encoding targets, only the first 64 CPUs can be targeted.
+  //
+  _cpuVPIndexesCount = (_cpuDataCount < kHyperVVPSetBankSize) ? _cpuDataCount : kHyperVVPSetBankSize;
+  for (UInt32 i = 0; i < _cpuVPIndexesCount; i++) {
+    _cpuVPIndexes[i] = (UInt32) _cpuData[i].virtualCPUIndex;
+  }
+
+  //
+  // Extended VP sets are needed for VP indexes of 64 and above.
+  //
+  _pvIPIExSupported = (_hvRecommends & kHyperVRecommendsExProcessorMasks) != 0;
+  _pvIPIEnabled     = true;
+  platformProvider->setPVIPIAction(&HyperVController::handlePVIPI, this);
+
+  HVDBGLOG("Paravirtual IPIs are enabled (extended VP sets: %s)", _pvIPIExSupported ? "yes" : "no");
+  setProperty(kHyperVPVIPIKey, kOSBooleanTrue);
+}
+
+bool HyperVController::handlePVIPI(void *target, UInt64 cpuMask, UInt32 vector) {
+  return static_cast<HyperVController*>(target)->sendPVIPI(cpuMask, vector);
+}
+
+bool HyperVController::sendPVIPI(UInt64 cpuMask, UInt32 vector) {
+  HypercallStatus status;
+  UInt64          vpMask;
+
+  if (!_pvIPIEnabled) {
+    return false;
+  }
+
+  if (encodeVPMask(_cpuVPIndexes, _cpuVPIndexesCount, cpuMask, &vpMask)) {
+    status = hypercallSendSyntheticClusterIpi(vector, vpMask);
+  } else if (_pvIPIExSupported) {
+    status = hypercallSendSyntheticClusterIpiEx(vector, cpuMask);
+  } else {
+    return false;
+  }
+
+  //
+  // On failure, the caller falls back to sending the IPI through the local APIC.
+  //
+  if (status != kHypercallStatusSuccess) {
+    __sync_fetch_and_add(&_numPVIPIFailures, 1);
+    return false;
+  }
+  __sync_fetch_and_add(&_numPVIPIs, 1);
+  return true;
+}
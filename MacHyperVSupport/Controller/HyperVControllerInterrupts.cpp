@@ -45,6 +45,13 @@ extern "C" {
   void mp_rendezvous_no_intrs(void (*action_func)(void*), void *arg);
 }
 
+//
+// Interrupt delivery check, using a synthetic timer on each processor that fires after 1 ms.
+//
+#define kHyperVInterruptTestTimer       0
+#define kHyperVInterruptTestDelay       (1000000ULL / kHyperVTimerNanosecondFactor)
+#define kHyperVInterruptTestTimeoutMs   100
+
 extern "C" void initCPUSyncIC(void *cpuData) {
   HyperVCPUData *hvCPUData = &(static_cast<HyperVCPUData*>(cpuData)[cpu_number()]);
 
@@ -83,6 +90,40 @@ extern "C" void initCPUSyncIC(void *cpuData) {
   wrmsr64(kHyperVMsrSyncICControl, kHyperVMsrSyncICControlEnable | (rdmsr64(kHyperVMsrSyncICControl) & kHyperVMsrSyncICControlRsvdMask));
 }
 
+extern "C" void verifyCPUSyncIC(void *cpuData) {
+  HyperVCPUData *hvCPUData = &(static_cast<HyperVCPUData*>(cpuData)[cpu_number()]);
+  UInt64        simp;
+  UInt64        siefp;
+  UInt64        sint;
+
+  //
+  // Read back SynIC configuration, channel events can only be targeted to processors where all of it took effect.
+  //
+  simp  = rdmsr64(kHyperVMsrSimp);
+  siefp = rdmsr64(kHyperVMsrSiefp);
+  sint  = rdmsr64(kHyperVMsrSInt0 + kVMBusInterruptMessage);
+
+  hvCPUData->synICVerified = (rdmsr64(kHyperVMsrSyncICControl) & kHyperVMsrSyncICControlEnable)
+                             && (simp & kHyperVMsrSimpEnable)
+                             && ((simp >> kHyperVMsrSimpPageShift) == (hvCPUData->messageDma.physAddr >> PAGE_SHIFT))
+                             && (siefp & kHyperVMsrSiefpEnable)
+                             && ((siefp >> kHyperVMsrSiefpPageShift) == (hvCPUData->eventFlagsDma.physAddr >> PAGE_SHIFT))
+                             && ((sint & kHyperVMsrSIntVectorMask) == *hvCPUData->interruptVector)
+                             && !(sint & kHyperVMsrSIntMasked);
+}
+
+extern "C" void armCPUInterruptTestTimer(void *timerConfig) {
+  UInt64 *config = static_cast<UInt64*>(timerConfig);
+
+  //
+  // Program this processor's test timer, a zero configuration disables it.
+  //
+  wrmsr64(kHyperVMsrSTimer0Config + (kHyperVInterruptTestTimer * kHyperVMsrSTimerStride), config[0]);
+  if (config[0] != 0) {
+    wrmsr64(kHyperVMsrSTimer0Count + (kHyperVInterruptTestTimer * kHyperVMsrSTimerStride), config[1]);
+  }
+}
+
 #if __MAC_OS_X_VERSION_MIN_REQUIRED < __MAC_10_6
 extern "C" void doAllCpuSyncICEOM(void *cpu) {
   int currentCpuIndex  = cpu_number();
@@ -115,6 +156,9 @@ bool HyperVController::allocateInterruptBuffers() {
     if (!allocateDmaBuffer(&_cpuData[i].postMessageDma, sizeof (HypercallPostMessage))) {
       return false;
     }
+    if (!allocateDmaBuffer(&_cpuData[i].hypercallInputDma, PAGE_SIZE)) {
+      return false;
+    }
 
     //
     // Setup message and event interrupts.
@@ -232,26 +276,101 @@ bool HyperVController::initInterrupts() {
 
   //
   // Setup SynIC interrupts on all processors.
+  // The Hyper-V virtual processor index is needed to target channel interrupts at a processor.
   //
+  _supportsHvVpIndex = (_hvFeatures & kHyperVCpuidMsrVPIndex) != 0;
   mp_rendezvous_no_intrs(initCPUSyncIC, _cpuData);
+  mp_rendezvous_no_intrs(verifyCPUSyncIC, _cpuData);
+
+  for (UInt32 i = 0; i < _cpuDataCount; i++) {
+    HVDBGLOG("CPU %u is virtual processor %llu, SynIC verified: %s", i, _cpuData[i].virtualCPUIndex,
+             _cpuData[i].synICVerified ? "yes" : "no");
+  }
+  if (!_cpuData[0].synICVerified) {
+    HVSYSLOG("SynIC configuration failed on CPU 0");
+    return false;
+  }
   return true;
 }
 
+void HyperVController::checkCPUInterruptDelivery() {
+  UInt64 timerConfig[2];
+  UInt32 deliveredCount;
+
+  //
+  // SynIC configuration alone does not guarantee that XNU dispatches the interrupt on every processor.
+  // Arm a synthetic timer on each processor and only target channels at processors where it arrives.
+  // This runs before any VMBus children can allocate synthetic timers.
+  //
+  if (_interruptDeliveryChecked) {
+    return;
+  }
+  _interruptDeliveryChecked = true;
+
+  if (!_syntheticTimersSupported) {
+    HVSYSLOG("Interrupt delivery cannot be checked without synthetic timers, channel interrupts will target CPU 0");
+    return;
+  }
+
+  for (UInt32 i = 0; i < _cpuDataCount; i++) {
+    _cpuData[i].interruptDelivered = false;
+  }
+
+  if (_syntheticTimersDirectMode) {
+    timerConfig[0] = kHyperVMsrSTimerConfigEnable | kHyperVMsrSTimerConfigDirectMode
+                     | ((((UInt64) _interruptVector) << kHyperVMsrSTimerConfigApicVectorShift) & kHyperVMsrSTimerConfigApicVectorMask);
+  } else {
+    timerConfig[0] = kHyperVMsrSTimerConfigEnable | (((UInt64) kVMBusInterruptTimer) << kHyperVMsrSTimerConfigSIntShift);
+  }
+  timerConfig[1] = readTimeRefCounter() + kHyperVInterruptTestDelay;
+  mp_rendezvous_no_intrs(armCPUInterruptTestTimer, timerConfig);
+
+  for (UInt32 ms = 0; ms < kHyperVInterruptTestTimeoutMs; ms++) {
+    deliveredCount = 0;
+    for (UInt32 i = 0; i < _cpuDataCount; i++) {
+      deliveredCount += _cpuData[i].interruptDelivered ? 1 : 0;
+    }
+    if (deliveredCount == _cpuDataCount) {
+      break;
+    }
+    IOSleep(1);
+  }
+
+  timerConfig[0] = 0;
+  mp_rendezvous_no_intrs(armCPUInterruptTestTimer, timerConfig);
+
+  for (UInt32 i = 0; i < _cpuDataCount; i++) {
+    if (_cpuData[i].synICVerified && !_cpuData[i].interruptDelivered) {
+      HVSYSLOG("Interrupts are not delivered on CPU %u, channel interrupts will not target it", i);
+    } else {
+      HVDBGLOG("CPU %u interrupt delivery: %s", i, _cpuData[i].interruptDelivered ? "yes" : "no");
+    }
+  }
+}
+
 void HyperVController::handleInterrupt(OSObject *target, void *refCon, IOService *nub, int source) {
   UInt32 cpuIndex = cpu_number();
   HyperVMessage *message;
 
+  _cpuData[cpuIndex].interruptCounter++;
+  _cpuData[cpuIndex].interruptDelivered = true;
+
   //
   // Handle timer messages.
+  // Direct mode timers share the VMBus interrupt vector and do not post messages, check deadlines instead.
   //
   message = getPendingMessage(cpuIndex, kVMBusInterruptTimer);
   if (message->type == kHyperVMessageTypeTimerExpired) {
+    handleSyntheticTimerMessage(message);
     message->type = kHyperVMessageTypeNone;
 
     if (message->flags.messagePending) {
       wrmsr64(kHyperVMsrEom, 0);
     }
   }
+  if (_syntheticTimersDirectMode) {
+    handleSyntheticTimerDirect();
+  }
 
   //
   // Handle VMBus channel events.
@@ -260,24 +379,12 @@ void HyperVController::handleInterrupt(OSObject *target, void *refCon, IOService
   // On Windows Server 2008 R2 and older, both the global event flags and the RX event flags need to be checked.
   // On Windows 8/Server 2012 and newer, each channel has its own bit in the global event flags.
   //
-  if (_useLegacyEventFlags && sync_test_and_clear_bit(0, _cpuData[cpuIndex].eventFlags[kVMBusInterruptMessage].flags32)) {
-    //
-    // Check each channel for pending interrupt and invoke handler.
-    //
-    for (UInt32 i = 1; i < kVMBusMaxChannels; i++) {
-      if (sync_test_and_clear_bit(i, _vmbusRxEventFlags->flags32)) {
-        _hvInterruptController->handleInterrupt(nullptr, nullptr, i);
-      }
+  if (_useLegacyEventFlags) {
+    if (sync_test_and_clear_bit(0, _cpuData[cpuIndex].eventFlags[kVMBusInterruptMessage].flags32)) {
+      handleEventFlags(_vmbusRxEventFlags);
     }
   } else {
-    //
-    // Check each channel for pending interrupt and invoke handler.
-    //
-    for (UInt32 i = 1; i < kVMBusMaxChannels; i++) {
-      if (sync_test_and_clear_bit(i, _cpuData[cpuIndex].eventFlags[kVMBusInterruptMessage].flags32)) {
-        _hvInterruptController->handleInterrupt(nullptr, nullptr, i);
-      }
-    }
+    handleEventFlags(&_cpuData[cpuIndex].eventFlags[kVMBusInterruptMessage]);
   }
 
   //
@@ -289,6 +396,12 @@ void HyperVController::handleInterrupt(OSObject *target, void *refCon, IOService
   }
 }
 
+void HyperVController::handleEventFlags(volatile HyperVEventFlags *eventFlags) {
+  scanEventFlags(eventFlags, kVMBusMaxChannels, [this](UInt32 channelId) {
+    _hvInterruptController->handleInterrupt(nullptr, nullptr, channelId);
+  });
+}
+
 bool HyperVController::enableInterrupts(HyperVEventFlags *legacyEventFlags) {
   disableInterrupts();
 
@@ -298,7 +411,12 @@ bool HyperVController::enableInterrupts(HyperVEventFlags *legacyEventFlags) {
   //
   // Store VMBus event information and enable interrupts.
   //
-  return getProvider()->enableInterrupt(0) == kIOReturnSuccess;
+  if (getProvider()->enableInterrupt(0) != kIOReturnSuccess) {
+    return false;
+  }
+
+  checkCPUInterruptDelivery();
+  return true;
 }
 
 void HyperVController::disableInterrupts() {
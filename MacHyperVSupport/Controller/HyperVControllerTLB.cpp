@@ -0,0 +1,196 @@
+//
+//  HyperVControllerTLB.cpp
+//  Hyper-V paravirtual TLB flush support
+//
+//  Copyright © 2022 Goldfish64. All rights reserved.
+//
+
+#include "HyperVController.hpp"
+#include "HyperVPlatformProvider.hpp"
+
+void HyperVController::initPVTLBFlush() {
+  HyperVPlatformProvider *platformProvider;
+
+  if ((_hvRecommends & kHyperVRecommendsRemoteTLBFlush) == 0) {
+    HVDBGLOG("Paravirtual TLB flushes are not recommended");
+    return;
+  }
+  if (checkKernelArgument("-hvctrlnopvtlb")) {
+    HVDBGLOG("Paravirtual TLB flushes are disabled");
+    return;
+  }
+
+  platformProvider = HyperVPlatformProvider::getInstance();
+  if (platformProvider == nullptr || !platformProvider->isTLBFlushHookInstalled()) {
+    HVSYSLOG("Paravirtual TLB flushes are unavailable, TLB flush function was not hooked");
+    return;
+  }
+
+  _pvTLBFlushEnabled = true;
+  platformProvider->setPVTLBFlushAction(&HyperVController::handlePVTLBFlush, this);
+
+  HVDBGLOG("Paravirtual TLB flushes are enabled");
+  setProperty(kHyperVPVTLBFlushKey, kOSBooleanTrue);
+#if DEBUG
+  runTLBFlushBenchmark();
+#endif
+}
+
+bool HyperVController::handlePVTLBFlush(void *target, UInt64 addressSpace, UInt64 startAddress, UInt64 endAddress) {
+  return static_cast<HyperVController*>(target)->flushTLBs(addressSpace, startAddress, endAddress);
+}
+
+bool HyperVController::flushTLBs(UInt64 addressSpace, UInt64 startAddress, UInt64 endAddress) {
+  HypercallStatus status;
+  UInt64          flags;
+  UInt64          pageCount;
+  UInt64          address;
+  uintptr_t       cr4;
+  bool            intsEnabled;
+
+  if (!_pvTLBFlushEnabled) {
+    return false;
+  }
+
+  //
+  // Flush the specified range, or everything, on all virtual processors.
+  // Hyper-V completes the flush on each virtual processor before returning, including those not currently running.
+  // A single address space covers every PCID using that page table root, otherwise all address spaces are flushed.
+  //
+  flags = kHyperVFlushAllProcessors;
+  if (addressSpace == 0) {
+    flags |= kHyperVFlushAllVirtualAddressSpaces;
+  }
+
+  pageCount = getTLBFlushListPageCount(startAddress, endAddress);
+  if (pageCount != 0) {
+    status = hypercallFlushVirtualAddressList(addressSpace, flags, startAddress, pageCount);
+    if (status == kHypercallStatusSuccess) {
+      __sync_fetch_and_add(&_numPVTLBFlushLists, 1);
+    }
+  } else {
+    status = hypercallFlushVirtualAddressSpace(addressSpace, flags);
+  }
+
+  //
+  // On failure, the caller falls back to IPI-based shootdowns.
+  //
+  if (status != kHypercallStatusSuccess) {
+    __sync_fetch_and_add(&_numPVTLBFlushFailures, 1);
+    return false;
+  }
+
+  //
+  // Flush the local TLB as well, as the kernel would have done.
+  // Ranges are flushed by address in the current context, including global pages.
+  // Otherwise toggling CR4.PGE flushes everything, including global pages and all PCIDs.
+  //
+  intsEnabled = ml_set_interrupts_enabled(false);
+  if (pageCount != 0) {
+    address = startAddress & ~((UInt64) PAGE_MASK);
+    for (UInt64 i = 0; i < pageCount; i++) {
+      asm volatile ("invlpg (%0)" : : "r" ((uintptr_t) address) : "memory");
+      address += PAGE_SIZE;
+    }
+  } else {
+    asm volatile ("mov %%cr4, %0" : "=r" (cr4));
+    asm volatile ("mov %0, %%cr4" : : "r" (cr4 ^ CR4_PGE) : "memory");
+    asm volatile ("mov %0, %%cr4" : : "r" (cr4) : "memory");
+  }
+  ml_set_interrupts_enabled(intsEnabled);
+
+  __sync_fetch_and_add(&_numPVTLBFlushes, 1);
+  return true;
+}
+
+#if DEBUG
+void HyperVController::runTLBFlushBenchmark() {
+  static const UInt64     pageCounts[] = { 1, kHyperVTLBFlushListMaxPages, 0 };
+  HyperVPlatformProvider  *platformProvider;
+  IOSimpleLock            *benchLock;
+  UInt32                  iterations = 0;
+  OSArray                 *resultsArray;
+  OSDictionary            *resultDict;
+  OSNumber                *number;
+  UInt64                  startAddress;
+  UInt64                  endAddress;
+  UInt64                  startCycles;
+  UInt64                  ipiCycles;
+  UInt64                  pvCycles;
+  UInt64                  pvFailures;
+
+  //
+  // Optional TLB shootdown microbenchmark in DEBUG builds, comparing the IPI-based shootdown with the flush hypercalls.
+  // Kernel addresses are flushed, so all virtual processors and address spaces are covered by both paths.
+  //
+  if (!PE_parse_boot_argn("hvctrltlbbench", &iterations, sizeof (iterations)) || iterations == 0) {
+    return;
+  }
+
+  platformProvider = HyperVPlatformProvider::getInstance();
+  benchLock        = IOSimpleLockAlloc();
+  resultsArray     = OSArray::withCapacity(arrsize(pageCounts));
+  if (platformProvider == nullptr || benchLock == nullptr || resultsArray == nullptr) {
+    OSSafeReleaseNULL(resultsArray);
+    if (benchLock != nullptr) {
+      IOSimpleLockFree(benchLock);
+    }
+    return;
+  }
+
+  for (UInt32 i = 0; i < arrsize(pageCounts); i++) {
+    startAddress = trunc_page((UInt64) (uintptr_t) this);
+    endAddress   = startAddress + (pageCounts[i] << PAGE_SHIFT);
+
+    //
+    // Shootdowns are performed with preemption disabled, as the kernel does while holding the pmap lock.
+    //
+    IOSimpleLockLock(benchLock);
+    startCycles = rdtsc64();
+    for (UInt32 j = 0; j < iterations; j++) {
+      platformProvider->flushKernelTLBsNative(startAddress, endAddress);
+    }
+    ipiCycles = (rdtsc64() - startCycles) / iterations;
+
+    pvFailures  = 0;
+    startCycles = rdtsc64();
+    for (UInt32 j = 0; j < iterations; j++) {
+      if (!flushTLBs(0, startAddress, endAddress)) {
+        pvFailures++;
+      }
+    }
+    pvCycles = (rdtsc64() - startCycles) / iterations;
+    IOSimpleLockUnlock(benchLock);
+
+    HVSYSLOG("TLB flush %llu pages: IPI %llu cycles, hypercall %llu cycles (%llu failures)",
+             pageCounts[i], ipiCycles, pvCycles, pvFailures);
+
+    resultDict = OSDictionary::withCapacity(4);
+    if (resultDict == nullptr) {
+      continue;
+    }
+    const struct {
+      const char *key;
+      UInt64     value;
+    } results[] = {
+      { "Pages",      pageCounts[i] },
+      { "IPICycles",  ipiCycles },
+      { "PVCycles",   pvCycles },
+      { "PVFailures", pvFailures }
+    };
+    for (UInt32 j = 0; j < arrsize(results); j++) {
+      number = OSNumber::withNumber(results[j].value, 64);
+      if (number != nullptr) {
+        resultDict->setObject(results[j].key, number);
+        number->release();
+      }
+    }
+    resultsArray->setObject(resultDict);
+    resultDict->release();
+  }
+
+  setProperty(kHyperVTLBFlushBenchmarkKey, resultsArray);
+  resultsArray->release();
+  IOSimpleLockFree(benchLock);
+}
+#endif
@@ -0,0 +1,65 @@
+//
+//  HyperVControllerTime.cpp
+//  Hyper-V reference time support
+//
+//  Copyright © 2022 Goldfish64. All rights reserved.
+//
+
+#include "HyperVController.hpp"
+
+bool HyperVController::initReferenceTsc() {
+  UInt64 hvReferenceTsc;
+
+  if ((_hvFeatures & kHyperVCpuidMsrReferenceTsc) == 0) {
+    HVDBGLOG("Reference TSC page is not supported");
+    setProperty(kHyperVTimeSourceKey, kHyperVTimeSourceMsr);
+    return false;
+  }
+
+  //
+  // Allocate page for Hyper-V to populate with the TSC scale and offset.
+  //
+  if (!allocateDmaBuffer(&_referenceTscBuffer, PAGE_SIZE)) {
+    HVSYSLOG("Failed to allocate reference TSC page");
+    setProperty(kHyperVTimeSourceKey, kHyperVTimeSourceMsr);
+    return false;
+  }
+
+  hvReferenceTsc = rdmsr64(kHyperVMsrReferenceTsc);
+  HVDBGLOG("Reference TSC MSR current value: 0x%llX", hvReferenceTsc);
+
+  hvReferenceTsc = ((_referenceTscBuffer.physAddr >> PAGE_SHIFT) << kHyperVMsrReferenceTscPageShift)
+                   | (hvReferenceTsc & kHyperVMsrReferenceTscRsvdMask) | kHyperVMsrReferenceTscEnable;
+  wrmsr64(kHyperVMsrReferenceTsc, hvReferenceTsc);
+
+  hvReferenceTsc = rdmsr64(kHyperVMsrReferenceTsc);
+  HVDBGLOG("Reference TSC MSR new value: 0x%llX", hvReferenceTsc);
+
+  if ((hvReferenceTsc & kHyperVMsrReferenceTscEnable) == 0) {
+    HVSYSLOG("Failed to enable reference TSC page");
+    freeDmaBuffer(&_referenceTscBuffer);
+    setProperty(kHyperVTimeSourceKey, kHyperVTimeSourceMsr);
+    return false;
+  }
+
+  _referenceTscPage = (HyperVReferenceTscPage*) _referenceTscBuffer.buffer;
+  HVDBGLOG("Reference TSC page enabled at phys 0x%llX (sequence %u, scale 0x%llX, offset %lld)", _referenceTscBuffer.physAddr,
+           _referenceTscPage->sequence, _referenceTscPage->scale, _referenceTscPage->offset);
+  setProperty(kHyperVTimeSourceKey, kHyperVTimeSourceReferenceTsc);
+  return true;
+}
+
+void HyperVController::destroyReferenceTsc() {
+  if (_referenceTscPage == nullptr) {
+    return;
+  }
+
+  //
+  // Disable reference TSC page before freeing it.
+  //
+  wrmsr64(kHyperVMsrReferenceTsc, rdmsr64(kHyperVMsrReferenceTsc) & kHyperVMsrReferenceTscRsvdMask);
+  _referenceTscPage = nullptr;
+  freeDmaBuffer(&_referenceTscBuffer);
+
+  HVDBGLOG("Reference TSC page is now disabled");
+}
@@ -0,0 +1,171 @@
+//
+//  HyperVControllerTimers.cpp
+//  Hyper-V synthetic timer support
+//
+//  Copyright © 2022 Goldfish64. All rights reserved.
+//
+
+#include "HyperVController.hpp"
+#include "VMBus.hpp"
+
+#define kHyperVMsrSTimerConfig(x)   (kHyperVMsrSTimer0Config + ((x) * kHyperVMsrSTimerStride))
+#define kHyperVMsrSTimerCount(x)    (kHyperVMsrSTimer0Count + ((x) * kHyperVMsrSTimerStride))
+
+void HyperVController::initSyntheticTimers() {
+  //
+  // Synthetic timers are programmed with absolute reference counter times.
+  //
+  _syntheticTimersSupported = (_hvFeatures & kHyperVCpuidMsrSynTimer) && (_hvFeatures & kHyperVCpuidMsrSynIC)
+                              && isTimeRefCounterSupported();
+  if (!_syntheticTimersSupported) {
+    HVDBGLOG("Synthetic timers are not supported");
+    return;
+  }
+
+  //
+  // Direct mode raises the interrupt vector directly, skipping the message page.
+  //
+  _syntheticTimersDirectMode = (_hvFeatures3 & CPUID3_HV_STIMER_DIRECT) != 0;
+  HVDBGLOG("Synthetic timers are supported (direct mode: %s)", _syntheticTimersDirectMode ? "yes" : "no");
+  setProperty(kHyperVSyntheticTimerModeKey, _syntheticTimersDirectMode ? "Direct" : "Message");
+}
+
+IOReturn HyperVController::allocateSyntheticTimer(OSObject *target, HyperVSyntheticTimerAction action, void *refCon, UInt32 *timerId) {
+  if (!_syntheticTimersSupported) {
+    return kIOReturnUnsupported;
+  }
+  if (action == nullptr || timerId == nullptr) {
+    return kIOReturnBadArgument;
+  }
+
+  for (UInt32 i = 0; i < kHyperVSyntheticTimerCount; i++) {
+    if (!__sync_bool_compare_and_swap(&_syntheticTimers[i].allocated, 0, 1)) {
+      continue;
+    }
+
+    _syntheticTimers[i].armed  = 0;
+    _syntheticTimers[i].target = target;
+    _syntheticTimers[i].action = action;
+    _syntheticTimers[i].refCon = refCon;
+    *timerId = i;
+
+    HVDBGLOG("Allocated synthetic timer %u", i);
+    return kIOReturnSuccess;
+  }
+  return kIOReturnNoResources;
+}
+
+void HyperVController::freeSyntheticTimer(UInt32 timerId) {
+  if (timerId >= kHyperVSyntheticTimerCount || !_syntheticTimers[timerId].allocated) {
+    return;
+  }
+
+  cancelSyntheticTimer(timerId);
+  _syntheticTimers[timerId].action = nullptr;
+  _syntheticTimers[timerId].target = nullptr;
+  _syntheticTimers[timerId].refCon = nullptr;
+  __sync_synchronize();
+  _syntheticTimers[timerId].allocated = 0;
+
+  HVDBGLOG("Freed synthetic timer %u", timerId);
+}
+
+IOReturn HyperVController::armSyntheticTimer(UInt32 timerId, UInt64 delayNs) {
+  HyperVSyntheticTimer *timer;
+  UInt64               config;
+  UInt64               delay;
+  bool                 intsEnabled;
+
+  if (timerId >= kHyperVSyntheticTimerCount || !_syntheticTimers[timerId].allocated) {
+    return kIOReturnBadArgument;
+  }
+  timer = &_syntheticTimers[timerId];
+
+  //
+  // Timers are per-processor, arm on the current processor with interrupts disabled so it cannot change.
+  // An earlier arm on another processor may still expire there, and is ignored as the timer no longer belongs to it.
+  //
+  delay = (delayNs + kHyperVTimerNanosecondFactor - 1) / kHyperVTimerNanosecondFactor;
+  if (delay == 0) {
+    delay = 1;
+  }
+
+  if (_syntheticTimersDirectMode) {
+    config = kHyperVMsrSTimerConfigEnable | kHyperVMsrSTimerConfigDirectMode
+             | ((((UInt64) _interruptVector) << kHyperVMsrSTimerConfigApicVectorShift) & kHyperVMsrSTimerConfigApicVectorMask);
+  } else {
+    config = kHyperVMsrSTimerConfigEnable | (((UInt64) kVMBusInterruptTimer) << kHyperVMsrSTimerConfigSIntShift);
+  }
+
+  intsEnabled = ml_set_interrupts_enabled(false);
+  timer->cpu        = cpu_number();
+  timer->expiration = readTimeRefCounter() + delay;
+  __sync_synchronize();
+  timer->armed      = 1;
+
+  wrmsr64(kHyperVMsrSTimerConfig(timerId), config);
+  wrmsr64(kHyperVMsrSTimerCount(timerId), timer->expiration);
+  ml_set_interrupts_enabled(intsEnabled);
+
+  return kIOReturnSuccess;
+}
+
+void HyperVController::cancelSyntheticTimer(UInt32 timerId) {
+  HyperVSyntheticTimer *timer;
+  bool                 intsEnabled;
+
+  if (timerId >= kHyperVSyntheticTimerCount) {
+    return;
+  }
+  timer = &_syntheticTimers[timerId];
+
+  //
+  // Disable the hardware timer if it is on this processor, otherwise let it expire and be ignored.
+  //
+  intsEnabled  = ml_set_interrupts_enabled(false);
+  timer->armed = 0;
+  if (timer->cpu == (UInt32) cpu_number()) {
+    wrmsr64(kHyperVMsrSTimerConfig(timerId), 0);
+  }
+  ml_set_interrupts_enabled(intsEnabled);
+}
+
+void HyperVController::fireSyntheticTimer(UInt32 timerId) {
+  HyperVSyntheticTimer *timer = &_syntheticTimers[timerId];
+
+  if (timer->cpu != (UInt32) cpu_number() || !__sync_bool_compare_and_swap(&timer->armed, 1, 0)) {
+    return;
+  }
+
+  if (timer->action != nullptr) {
+    (*timer->action)(timer->target, timer->refCon);
+  }
+}
+
+void HyperVController::handleSyntheticTimerMessage(HyperVMessage *message) {
+  HyperVTimerMessagePayload *payload = (HyperVTimerMessagePayload*) message->data;
+
+  if (payload->timerIndex < kHyperVSyntheticTimerCount) {
+    fireSyntheticTimer(payload->timerIndex);
+  }
+}
+
+void HyperVController::handleSyntheticTimerDirect() {
+  UInt64 now = 0;
+
+  //
+  // No indication is given of which timer expired, check each armed timer on this processor against the current time.
+  //
+  for (UInt32 i = 0; i < kHyperVSyntheticTimerCount; i++) {
+    if (!_syntheticTimers[i].armed || _syntheticTimers[i].cpu != (UInt32) cpu_number()) {
+      continue;
+    }
+
+    if (now == 0) {
+      now = readTimeRefCounter();
+    }
+    if (now >= _syntheticTimers[i].expiration) {
+      fireSyntheticTimer(i);
+    }
+  }
+}
@@ -0,0 +1,62 @@
+//
+//  HyperVEventFlags.hpp
+//  Hyper-V SynIC event flags
+//
+//  Copyright © 2022 Goldfish64. All rights reserved.
+//
+
+#ifndef HyperVEventFlags_hpp
+#define HyperVEventFlags_hpp
+
+//
+// Event flags layout and scan routine.
+// This header has no IOKit dependencies so it can also be built in userspace by Tests.
+//
+#include <libkern/OSTypes.h>
+
+#define kHyperVEventFlagsByteCount  256
+#define kHyperVEventFlagsDwordCount (kHyperVEventFlagsByteCount / sizeof (UInt32))
+
+//
+// Event flags.
+// Not packed, the flags are read a native word at a time.
+//
+typedef struct {
+  union {
+    UInt8   flags8[kHyperVEventFlagsByteCount];
+    UInt32  flags32[kHyperVEventFlagsDwordCount];
+  };
+} HyperVEventFlags;
+
+//
+// Event flags are scanned one native word at a time.
+//
+#define kHyperVEventFlagsWordBits   (sizeof (unsigned long) * 8)
+
+//
+// Takes each non-zero word of the first channelCount flags at once, and invokes handler for each channel with its bit set.
+// Channel 0 is not used for channel events.
+//
+template <typename EventHandlerFunc>
+static inline void scanEventFlags(volatile HyperVEventFlags *eventFlags, UInt32 channelCount, EventHandlerFunc handler) {
+  volatile unsigned long  *eventWords = (volatile unsigned long*) eventFlags->flags32;
+  unsigned long           pendingBits;
+  UInt32                  channelId;
+
+  for (UInt32 i = 0; i < channelCount / kHyperVEventFlagsWordBits; i++) {
+    if (eventWords[i] == 0) {
+      continue;
+    }
+
+    pendingBits = __sync_lock_test_and_set(&eventWords[i], 0);
+    while (pendingBits != 0) {
+      channelId    = (UInt32) ((i * kHyperVEventFlagsWordBits) + __builtin_ctzl(pendingBits));
+      pendingBits &= pendingBits - 1;
+      if (channelId != 0) {
+        handler(channelId);
+      }
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,83 @@
+//
+//  HyperVReferenceTsc.hpp
+//  Hyper-V reference TSC page
+//
+//  Copyright © 2022 Goldfish64. All rights reserved.
+//
+
+#ifndef HyperVReferenceTsc_hpp
+#define HyperVReferenceTsc_hpp
+
+//
+// Reference TSC page layout and read routines.
+// This header has no IOKit dependencies so it can also be built in userspace by Tests.
+//
+#include <libkern/OSTypes.h>
+
+//
+// Reference TSC page.
+// Reference time is ((TSC * scale) >> 64) + offset, valid only while sequence is non-zero and unchanged.
+//
+#define kHyperVReferenceTscSequenceInvalid  0
+
+typedef struct __attribute__((packed)) {
+  volatile UInt32 sequence;
+  UInt32          reserved1;
+  volatile UInt64 scale;
+  volatile SInt64 offset;
+} HyperVReferenceTscPage;
+
+//
+// Returns the high 64 bits of a 64x64 multiply by combining the four 32x32 partial products.
+//
+static inline UInt64 multiplyHigh64Partial(UInt64 a, UInt64 b) {
+  UInt64 loLo  = (a & UINT32_MAX) * (b & UINT32_MAX);
+  UInt64 hiLo  = (a >> 32) * (b & UINT32_MAX);
+  UInt64 loHi  = (a & UINT32_MAX) * (b >> 32);
+  UInt64 hiHi  = (a >> 32) * (b >> 32);
+  UInt64 cross = (loLo >> 32) + (hiLo & UINT32_MAX) + loHi;
+  return hiHi + (hiLo >> 32) + (cross >> 32);
+}
+
+static inline UInt64 multiplyHigh64(UInt64 a, UInt64 b) {
+#if defined(__x86_64__)
+  return (UInt64) (((unsigned __int128) a * b) >> 64);
+#else
+  //
+  // No 128-bit integers on 32-bit.
+  //
+  return multiplyHigh64Partial(a, b);
+#endif
+}
+
+//
+// Reads the reference time from the page using readTsc to sample the TSC.
+// readTsc must not be executed before the preceding sequence read.
+//
+template <typename ReadTscFunc>
+static inline bool readReferenceTscPage(const HyperVReferenceTscPage *page, ReadTscFunc readTsc, UInt64 *refCount) {
+  UInt32 sequence;
+  UInt64 tsc;
+  UInt64 scale;
+  SInt64 offset;
+
+  //
+  // Retry if the host updates the page during the read.
+  //
+  do {
+    sequence = page->sequence;
+    if (sequence == kHyperVReferenceTscSequenceInvalid) {
+      return false;
+    }
+
+    tsc    = readTsc();
+    scale  = page->scale;
+    offset = page->offset;
+    __asm__ volatile ("" ::: "memory");
+  } while (page->sequence != sequence);
+
+  *refCount = multiplyHigh64(tsc, scale) + offset;
+  return true;
+}
+
+#endif
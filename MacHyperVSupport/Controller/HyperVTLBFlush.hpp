@@ -0,0 +1,51 @@
+//
+//  HyperVTLBFlush.hpp
+//  Hyper-V paravirtual TLB flush range helpers
+//
+//  Copyright © 2022 Goldfish64. All rights reserved.
+//
+
+#ifndef HyperVTLBFlush_hpp
+#define HyperVTLBFlush_hpp
+
+//
+// TLB flush range helpers.
+// This header has no IOKit dependencies so it can also be built in userspace by Tests.
+//
+#include <libkern/OSTypes.h>
+
+#define kHyperVTLBFlushPageShift        12
+
+//
+// Ranges up to this many pages are flushed by address, larger ranges flush everything.
+//
+#define kHyperVTLBFlushListMaxPages     64
+
+//
+// Page table root bits of CR3, PCID and cache control bits are excluded.
+//
+#define kHyperVTLBFlushCR3AddressMask   0x000FFFFFFFFFF000ULL
+
+//
+// Gets the number of pages touched by the range, or 0 if the entire address space should be flushed instead.
+// An empty range flushes the entire address space.
+//
+static inline UInt64 getTLBFlushListPageCount(UInt64 startAddress, UInt64 endAddress) {
+  UInt64 pageCount;
+
+  if (endAddress <= startAddress) {
+    return 0;
+  }
+
+  pageCount = ((endAddress - 1) >> kHyperVTLBFlushPageShift) - (startAddress >> kHyperVTLBFlushPageShift) + 1;
+  return (pageCount <= kHyperVTLBFlushListMaxPages) ? pageCount : 0;
+}
+
+//
+// Gets the Hyper-V address space for a CR3 value, which is the page table root regardless of PCID.
+//
+static inline UInt64 getTLBFlushAddressSpace(UInt64 cr3) {
+  return cr3 & kHyperVTLBFlushCR3AddressMask;
+}
+
+#endif
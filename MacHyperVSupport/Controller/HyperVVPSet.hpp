@@ -0,0 +1,109 @@
+//
+//  HyperVVPSet.hpp
+//  Hyper-V virtual processor set encoding
+//
+//  Copyright © 2022 Goldfish64. All rights reserved.
+//
+
+#ifndef HyperVVPSet_hpp
+#define HyperVVPSet_hpp
+
+//
+// Virtual processor mask and set encoders.
+// This header has no IOKit dependencies so it can also be built in userspace by Tests.
+//
+#include <libkern/OSTypes.h>
+
+//
+// Virtual processor sets.
+// Sparse format splits VP indexes into banks of 64, with only banks marked valid present in order.
+//
+#define kHyperVVPSetFormatSparse4K    0
+#define kHyperVVPSetBankSize          64
+#define kHyperVVPSetMaxBanks          64
+
+typedef struct __attribute__((packed)) {
+  UInt64  format;
+  UInt64  validBankMask;
+  UInt64  bankContents[];
+} HyperVVPSet;
+
+//
+// Encodes the CPUs in cpuMask as a simple mask of VP indexes, using the CPU to VP index map in cpuVPIndexes.
+// Simple mask can only be used if all target VP indexes are below 64.
+//
+static inline bool encodeVPMask(const UInt32 *cpuVPIndexes, UInt32 cpuCount, UInt64 cpuMask, UInt64 *vpMask) {
+  UInt32 cpu;
+  UInt32 vpIndex;
+
+  *vpMask = 0;
+  while (cpuMask != 0) {
+    cpu     = __builtin_ctzll(cpuMask);
+    cpuMask &= cpuMask - 1;
+    if (cpu >= cpuCount) {
+      return false;
+    }
+
+    vpIndex = cpuVPIndexes[cpu];
+    if (vpIndex >= kHyperVVPSetBankSize) {
+      return false;
+    }
+    *vpMask |= 1ULL << vpIndex;
+  }
+  return true;
+}
+
+//
+// Encodes the CPUs in cpuMask as a sparse VP set, using the CPU to VP index map in cpuVPIndexes.
+// Returns the number of banks present, or 0 if a CPU or VP index is out of range.
+//
+static inline UInt32 encodeVPSet(const UInt32 *cpuVPIndexes, UInt32 cpuCount, UInt64 cpuMask, HyperVVPSet *vpSet) {
+  UInt64 remainingMask;
+  UInt64 validBankMask = 0;
+  UInt32 vpIndex;
+  UInt32 cpu;
+  UInt32 bank;
+  UInt32 bankCount;
+
+  //
+  // Determine which banks are present.
+  //
+  remainingMask = cpuMask;
+  while (remainingMask != 0) {
+    cpu           = __builtin_ctzll(remainingMask);
+    remainingMask &= remainingMask - 1;
+    if (cpu >= cpuCount) {
+      return 0;
+    }
+
+    vpIndex = cpuVPIndexes[cpu];
+    if (vpIndex >= (kHyperVVPSetBankSize * kHyperVVPSetMaxBanks)) {
+      return 0;
+    }
+    validBankMask |= 1ULL << (vpIndex / kHyperVVPSetBankSize);
+  }
+
+  //
+  // Present banks are stored in order, a bank's position is the number of present banks below it.
+  //
+  bankCount            = __builtin_popcountll(validBankMask);
+  vpSet->format        = kHyperVVPSetFormatSparse4K;
+  vpSet->validBankMask = validBankMask;
+  for (UInt32 i = 0; i < bankCount; i++) {
+    vpSet->bankContents[i] = 0;
+  }
+
+  remainingMask = cpuMask;
+  while (remainingMask != 0) {
+    cpu           = __builtin_ctzll(remainingMask);
+    remainingMask &= remainingMask - 1;
+
+    vpIndex = cpuVPIndexes[cpu];
+    bank    = vpIndex / kHyperVVPSetBankSize;
+    vpSet->bankContents[__builtin_popcountll(validBankMask & ((1ULL << bank) - 1))] |= 1ULL << (vpIndex % kHyperVVPSetBankSize);
+  }
+
+  return bankCount;
+}
+
+#endif
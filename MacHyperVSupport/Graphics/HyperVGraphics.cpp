@@ -93,6 +93,7 @@ bool HyperVGraphics::start(IOService *provider) {
     }
 
     registerService();
+    _hvDevice->recordBootPhase(kHyperVVMBusDeviceBootPhaseRegistered);
     HVDBGLOG("Initialized Hyper-V Synthetic Graphics");
     result = true;
   } while (false);
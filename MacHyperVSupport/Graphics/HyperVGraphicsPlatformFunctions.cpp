@@ -50,6 +50,7 @@ IOReturn HyperVGraphics::platformInitGraphics(VMBusVersion *outVersion, IOPhysic
     return kIOReturnUnsupported;
   }
   _gfxVersion = graphicsVersion;
+  _hvDevice->recordBootPhase(kHyperVVMBusDeviceBootPhaseProtocolNegotiated);
 
   //
   // Allocate graphics memory.
@@ -57,6 +57,10 @@ bool HyperVICService::start(IOService *provider) {
       break;
     }
 
+    //
+    // Negotiation is initiated by the host once the channel is open, and is recorded separately.
+    //
+    _hvDevice->recordBootPhase(kHyperVVMBusDeviceBootPhaseRegistered);
     result = true;
   } while (false);
   
@@ -154,6 +158,7 @@ bool HyperVICService::processNegotiationResponse(VMBusICMessageNegotiate *negMsg
     if (msgVersionUsed != nullptr) {
       *msgVersionUsed = msgVersion;
     }
+    _hvDevice->recordBootPhase(kHyperVVMBusDeviceBootPhaseProtocolNegotiated);
   } else {
     HVDBGLOG("Unsupported fw/msg version");
     negMsg->frameworkVersionCount = 0;
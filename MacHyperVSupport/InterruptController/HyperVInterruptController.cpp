@@ -67,12 +67,15 @@ IOReturn HyperVInterruptController::handleInterrupt(void *refCon, IOService *nub
     return kIOReturnSuccess;
   }
   
+  //
+  // Channel interrupts may be targeted at any processor, count active handlers instead of using a flag.
+  //
   vector = &vectors[source];
-  vector->interruptActive = 1;
+  __sync_fetch_and_add(&vector->interruptActive, 1);
   if (vector->interruptRegistered && !vector->interruptDisabledHard) {
     vector->handler(vector->target, vector->refCon, vector->nub, vector->source);
   }
-  vector->interruptActive = 0;
+  __sync_fetch_and_sub(&vector->interruptActive, 1);
   
   return kIOReturnSuccess;
 }
@@ -64,7 +64,9 @@ bool HyperVKeyboard::start(IOService *provider) {
       HVSYSLOG("Failed to connect to keyboard device with status 0x%X", status);
       break;
     }
+    _hvDevice->recordBootPhase(kHyperVVMBusDeviceBootPhaseProtocolNegotiated);
 
+    _hvDevice->recordBootPhase(kHyperVVMBusDeviceBootPhaseRegistered);
     HVDBGLOG("Initialized Hyper-V Synthetic Keyboard");
     result = true;
   } while (false);
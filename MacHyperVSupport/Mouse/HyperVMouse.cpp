@@ -71,7 +71,9 @@ bool HyperVMouse::handleStart(IOService *provider) {
       HVSYSLOG("Unable to setup mouse device");
       break;
     }
+    _hvDevice->recordBootPhase(kHyperVVMBusDeviceBootPhaseProtocolNegotiated);
 
+    _hvDevice->recordBootPhase(kHyperVVMBusDeviceBootPhaseRegistered);
     HVDBGLOG("Initialized Hyper-V Synthetic Mouse");
     result = true;
   } while (false);
@@ -72,8 +72,16 @@ bool HyperVNetwork::start(IOService *provider) {
       return status;
     }
     
-    // TODO
-    connectNetwork();
+    if (!connectNetwork()) {
+      HVSYSLOG("Failed to connect to network");
+      break;
+    }
+    _hvDevice->recordBootPhase(kHyperVVMBusDeviceBootPhaseProtocolNegotiated);
+
+    //
+    // Watch for a paired SR-IOV VF to use as an accelerated datapath.
+    //
+    initVF();
     
     //
     // Attach and register network interface.
@@ -83,6 +91,7 @@ bool HyperVNetwork::start(IOService *provider) {
       break;
     }
     _ethInterface->registerService();
+    _hvDevice->recordBootPhase(kHyperVVMBusDeviceBootPhaseRegistered);
 
     HVDBGLOG("Initialized Hyper-V Synthetic Networking");
     result = true;
@@ -96,6 +105,8 @@ bool HyperVNetwork::start(IOService *provider) {
 
 void HyperVNetwork::stop(IOService *provider) {
   HVDBGLOG("Stopping Hyper-V Synthetic Networking");
+
+  freeVF();
   
   if (_ethInterface != nullptr) {
     detachInterface(_ethInterface);
@@ -205,6 +216,19 @@ IOReturn HyperVNetwork::setPromiscuousMode(bool active) {
   return kIOReturnSuccess;
 }
 
+IOReturn HyperVNetwork::getChecksumSupport(UInt32 *checksumMask, UInt32 checksumFamily, bool isOutput) {
+  if (checksumFamily != kChecksumFamilyTCPIP) {
+    return kIOReturnUnsupported;
+  }
+
+  //
+  // IPv4, TCP, and UDP checksums are computed while copying into the send buffer.
+  // Received packets are not validated.
+  //
+  *checksumMask = isOutput ? (kChecksumIP | kChecksumTCP | kChecksumUDP) : 0;
+  return kIOReturnSuccess;
+}
+
 IOReturn HyperVNetwork::getHardwareAddress(IOEthernetAddress *addrP) {
   *addrP = _ethAddress;
   return kIOReturnSuccess;
@@ -214,10 +238,22 @@ UInt32 HyperVNetwork::outputPacket(mbuf_t m, void *param) {
   IOReturn status;
   size_t   packetLength;
   UInt32   sendIndex;
+  UInt32   dataOffset;
+  UInt16   vlanTag;
+  UInt32   checksumDemand = 0;
+
+  UInt8                                     *rndisBuffer;
+  HyperVNetworkRNDISMessage                 *rndisMsg;
+  HyperVNetworkRNDISPerPacketInfoIEEE8021Q  *vlanInfo;
+  HyperVNetworkMessage                      netMsg;
 
-  UInt8                     *rndisBuffer;
-  HyperVNetworkRNDISMessage *rndisMsg;
-  HyperVNetworkMessage      netMsg;
+  //
+  // Send packet through the VF if the datapath has been switched to it.
+  //
+  getChecksumDemand(m, kChecksumFamilyTCPIP, &checksumDemand);
+  if (_vfDataPathActive && outputVFPacket(m, checksumDemand)) {
+    return kIOReturnOutputSuccess;
+  }
 
   //
   // Get next available send section.
@@ -234,41 +270,49 @@ UInt32 HyperVNetwork::outputPacket(mbuf_t m, void *param) {
   packetLength = mbuf_pkthdr_len(m);
   rndisBuffer  = &_sendBuffer.buffer[_sendSectionSize * sendIndex];
   rndisMsg     = (HyperVNetworkRNDISMessage *)rndisBuffer;
-  bzero(rndisMsg, sizeof (*rndisMsg));
+  initRNDISDataPacket(rndisMsg);
 
-  rndisMsg->header.type           = kHyperVNetworkRNDISMessageTypePacket;
-  rndisMsg->dataPacket.dataOffset = sizeof (rndisMsg->dataPacket);
-  rndisMsg->dataPacket.dataLength = (UInt32)packetLength;
-  rndisMsg->header.length         = sizeof (rndisMsg->header) + sizeof (rndisMsg->dataPacket) + rndisMsg->dataPacket.dataLength;
+  //
+  // Add 802.1Q per-packet info if the packet is to be tagged.
+  //
+  if (mbuf_get_vlan_tag(m, &vlanTag) == 0) {
+    vlanInfo = (HyperVNetworkRNDISPerPacketInfoIEEE8021Q *)addRNDISPerPacketInfo(&rndisMsg->dataPacket, kHyperVNetworkRNDISPerPacketInfoTypeIEEE8021Q,
+                                                                                 sizeof (*vlanInfo));
+    setRNDISVLANInfo(vlanInfo, vlanTag);
+  }
+  dataOffset = finishRNDISDataPacket(rndisMsg, (UInt32)packetLength);
 
   if (packetLength == 0 || rndisMsg->header.length > _sendSectionSize) {
     HVSYSLOG("Packet of %u bytes is too large or invalid, send section size is %u bytes", packetLength, _sendSectionSize);
+    releaseSendIndex(sendIndex);
     return kIOReturnOutputDropped;
   }
 
   //
   // Copy packet data to send section.
+  // Any checksums requested by the stack are computed during the copy.
   //
-  rndisBuffer += sizeof (rndisMsg->header) + rndisMsg->dataPacket.dataOffset;
-  for (mbuf_t pktCurrent = m; pktCurrent != nullptr; pktCurrent = mbuf_next(pktCurrent)) {
-    size_t pktCurrentLength = mbuf_len(pktCurrent);
-    memcpy(rndisBuffer, mbuf_data(pktCurrent), pktCurrentLength);
-    rndisBuffer += pktCurrentLength;
+  rndisBuffer += dataOffset;
+  if (checksumDemand & (kChecksumIP | kChecksumTCP | kChecksumUDP)) {
+    copyPacketWithChecksum(m, rndisBuffer, checksumDemand);
+  } else {
+    for (mbuf_t pktCurrent = m; pktCurrent != nullptr; pktCurrent = mbuf_next(pktCurrent)) {
+      size_t pktCurrentLength = mbuf_len(pktCurrent);
+      memcpy(rndisBuffer, mbuf_data(pktCurrent), pktCurrentLength);
+      rndisBuffer += pktCurrentLength;
+    }
   }
 
   //
   // Create and send packet for sending the RNDIS data packet.
   //
-  bzero(&netMsg, sizeof (netMsg));
-  netMsg.messageType                               = kHyperVNetworkMessageTypeV1SendRNDISPacket;
-  netMsg.v1.sendRNDISPacket.channelType            = kHyperVNetworkRNDISChannelTypeData;
-  netMsg.v1.sendRNDISPacket.sendBufferSectionIndex = sendIndex;
-  netMsg.v1.sendRNDISPacket.sendBufferSectionSize  = rndisMsg->header.length;
+  buildSendRNDISPacketMessage(&netMsg, kHyperVNetworkRNDISChannelTypeData, sendIndex, rndisMsg->header.length);
 
   HVDATADBGLOG("Preparing to send packet of %u bytes using send section %u/%u", rndisMsg->header.length, sendIndex, _sendSectionCount);
-  status = _hvDevice->writeInbandPacketWithTransactionId(&netMsg, sizeof (netMsg), sendIndex | kHyperVNetworkSendTransIdBits, true);
+  status = _hvDevice->writeInbandPacketWithTransactionId(&netMsg, sizeof (netMsg), getSendTransactionId(sendIndex), true);
   if (status != kIOReturnSuccess) {
     HVSYSLOG("Failed to send packet with status 0x%X", status);
+    releaseSendIndex(sendIndex);
     return kIOReturnOutputStall;
   }
 
@@ -16,10 +16,15 @@
 #include <IOKit/network/IOOutputQueue.h>
 
 #include "HyperVVMBusDevice.hpp"
-#include "HyperVNetworkRegs.hpp"
+#include "HyperVNetworkProtocol.hpp"
+#include "HyperVNetworkChecksum.hpp"
+#include "HyperVPCIBridgeRegs.hpp"
 
 extern "C" {
+#include <netinet/in.h>
 #include <sys/kpi_mbuf.h>
+#include <net/kpi_interface.h>
+#include <net/kpi_interfacefilter.h>
 }
 
 typedef struct HyperVNetworkRNDISRequest {
@@ -50,6 +55,7 @@ private:
   IOEthernetInterface          *_ethInterface    = nullptr;
   IOEthernetAddress            _ethAddress       = { };
   bool                         _isLinkUp         = false;
+  bool                         _isVLANEnabled    = false;
 
   UInt32 _packetFilterAdditional = 0;
 
@@ -82,6 +88,28 @@ private:
   IOLock                    *_rndisLock = nullptr;
   UInt32                    _rndisTransId = 0;
   HyperVNetworkRNDISRequest *_rndisRequests;
+
+  //
+  // SR-IOV virtual function datapath.
+  //
+  IONotifier          *_vfPublishNotifier   = nullptr;
+  IONotifier          *_vfTerminateNotifier = nullptr;
+  thread_call_t       _vfUpdateThread       = nullptr;
+  IOLock              *_vfLock              = nullptr;
+  volatile SInt32     _vfUpdatesOutstanding = 0;
+  volatile bool       _vfStopping           = false;
+  IOEthernetInterface *_vfInterface         = nullptr;
+  ifnet_t             _vfIfnet              = nullptr;
+  interface_filter_t  _vfFilter             = nullptr;
+  volatile bool       _vfFilterAttached     = false;
+  volatile bool       _vfDataPathActive     = false;
+
+  //
+  // Latest VF association from Hyper-V, written from the packet handler.
+  // Serial number is in the low 32 bits and the allocated flag in the high 32 bits,
+  // so both are always read and updated together.
+  //
+  volatile UInt64     _vfAssociation        = 0;
   
 
   
@@ -103,8 +131,10 @@ private:
   UInt32 getFreeSendIndexCount();
   void releaseSendIndex(UInt32 sendIndex);
   
+  IOReturn sendNDISConfig();
   bool connectNetwork();
   
+  void handleInbandMessage(HyperVNetworkMessage *netMsg, UInt32 msgLength);
   void handleRNDISRanges(VMBusPacketTransferPages *pktPages, UInt32 pktLength);
   void handleCompletion(void *pktData, UInt32 pktLength);
 
@@ -123,6 +153,32 @@ private:
   IOReturn getRNDISOID(HyperVNetworkRNDISOID oid, void *value, UInt32 *valueSize);
   IOReturn setRNDISOID(HyperVNetworkRNDISOID oid, void *value, UInt32 valueSize);
   
+  //
+  // Software checksum.
+  //
+  bool parseChecksumOffsets(mbuf_t m, HyperVNetworkChecksumOffsets *offsets);
+  void copyPacketWithChecksum(mbuf_t m, UInt8 *buffer, UInt32 demandMask);
+  bool finalizePacketChecksum(mbuf_t m, UInt32 demandMask);
+
+  //
+  // SR-IOV virtual function datapath.
+  //
+  IOReturn initVF();
+  void freeVF();
+  void setVFAssociation(bool allocated, UInt32 serialNumber);
+  bool getVFAssociation(UInt32 *serialNumber);
+  void scheduleVFUpdate(UInt64 deadline = 0);
+  bool isPairedVFInterface(IOService *service);
+  bool handleVFPublished(void *refCon, IOService *newService, IONotifier *notifier);
+  bool handleVFTerminated(void *refCon, IOService *newService, IONotifier *notifier);
+  void updateVFDataPath();
+  IOReturn switchDataPath(HyperVNetworkDataPath dataPath);
+  IOReturn attachVFDataPath();
+  void detachVFDataPath();
+  bool outputVFPacket(mbuf_t m, UInt32 checksumDemand);
+  static errno_t handleVFInput(void *cookie, ifnet_t interface, protocol_family_t protocol, mbuf_t *data, char **framePtr);
+  static void handleVFFilterDetached(void *cookie, ifnet_t interface);
+
   //
   // Private
   //
@@ -157,6 +213,10 @@ public:
   IOReturn disable(IONetworkInterface *interface) APPLE_KEXT_OVERRIDE;
   IOReturn setMulticastMode(bool active) APPLE_KEXT_OVERRIDE;
   IOReturn setPromiscuousMode(bool active) APPLE_KEXT_OVERRIDE;
+  UInt32 getFeatures() const APPLE_KEXT_OVERRIDE {
+    return _isVLANEnabled ? kIONetworkFeatureHardwareVlan : 0;
+  }
+  IOReturn getChecksumSupport(UInt32 *checksumMask, UInt32 checksumFamily, bool isOutput) APPLE_KEXT_OVERRIDE;
 
   //
   // IOEthernetController overrides.
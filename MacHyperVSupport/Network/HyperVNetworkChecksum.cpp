@@ -0,0 +1,137 @@
+//
+//  HyperVNetworkChecksum.cpp
+//  Hyper-V network driver
+//
+//  Copyright © 2021-2022 Goldfish64. All rights reserved.
+//
+
+#include "HyperVNetwork.hpp"
+
+bool HyperVNetwork::parseChecksumOffsets(mbuf_t m, HyperVNetworkChecksumOffsets *offsets) {
+  UInt8  headers[kHyperVNetworkChecksumMaxHeaderSize];
+  size_t headersLength;
+  UInt32 l3Offset;
+  UInt16 etherType;
+  UInt8  protocol;
+
+  //
+  // Ethernet, IPv4, and TCP/UDP headers are assumed to be within the first bytes of the packet.
+  //
+  headersLength = mbuf_pkthdr_len(m) < sizeof (headers) ? mbuf_pkthdr_len(m) : sizeof (headers);
+  if (headersLength < kHyperVNetworkEthernetHeaderSize + kHyperVNetworkIPv4MinHeaderSize
+      || mbuf_copydata(m, 0, headersLength, headers) != 0) {
+    return false;
+  }
+
+  l3Offset  = kHyperVNetworkEthernetHeaderSize;
+  etherType = (headers[12] << 8) | headers[13];
+  if (etherType == kHyperVNetworkEtherTypeVLAN) {
+    l3Offset  += kHyperVNetworkVLANHeaderSize;
+    etherType  = (headers[16] << 8) | headers[17];
+  }
+  if (etherType != kHyperVNetworkEtherTypeIPv4 || l3Offset + kHyperVNetworkIPv4MinHeaderSize > headersLength) {
+    return false;
+  }
+
+  offsets->l3Offset         = l3Offset;
+  offsets->l3Length         = (headers[l3Offset] & 0x0F) * 4;
+  offsets->l4Offset         = l3Offset + offsets->l3Length;
+  offsets->l4ChecksumOffset = 0;
+  if (offsets->l3Length < kHyperVNetworkIPv4MinHeaderSize || offsets->l4Offset > headersLength) {
+    return false;
+  }
+
+  protocol = headers[l3Offset + kHyperVNetworkIPv4ProtocolOffset];
+  if (protocol == IPPROTO_TCP) {
+    offsets->l4ChecksumOffset = offsets->l4Offset + kHyperVNetworkTCPChecksumOffset;
+  } else if (protocol == IPPROTO_UDP) {
+    offsets->l4ChecksumOffset = offsets->l4Offset + kHyperVNetworkUDPChecksumOffset;
+  }
+  offsets->isUDP = protocol == IPPROTO_UDP;
+  return true;
+}
+
+void HyperVNetwork::copyPacketWithChecksum(mbuf_t m, UInt8 *buffer, UInt32 demandMask) {
+  HyperVNetworkChecksumOffsets  offsets;
+  HyperVNetworkChecksumState    state;
+  UInt8                         *dest = buffer;
+  UInt16                        checksum;
+
+  if (!parseChecksumOffsets(m, &offsets)) {
+    //
+    // Not a packet that can be checksummed, copy as-is.
+    //
+    HVDATADBGLOG("Unable to parse packet headers for checksum demand 0x%X", demandMask);
+    for (mbuf_t pktCurrent = m; pktCurrent != nullptr; pktCurrent = mbuf_next(pktCurrent)) {
+      size_t pktCurrentLength = mbuf_len(pktCurrent);
+      memcpy(dest, mbuf_data(pktCurrent), pktCurrentLength);
+      dest += pktCurrentLength;
+    }
+    return;
+  }
+
+  //
+  // Copy packet, summing TCP/UDP data in the same pass.
+  // The stack has already placed the pseudo-header sum into the TCP/UDP checksum field.
+  //
+  initChecksumState(&state, (demandMask & (kChecksumTCP | kChecksumUDP)) && offsets.l4ChecksumOffset != 0, offsets.l4Offset);
+  for (mbuf_t pktCurrent = m; pktCurrent != nullptr; pktCurrent = mbuf_next(pktCurrent)) {
+    checksumPacketSegment(&state, dest, (UInt8 *)mbuf_data(pktCurrent), mbuf_len(pktCurrent));
+    dest += mbuf_len(pktCurrent);
+  }
+
+  //
+  // Write TCP/UDP checksum into the copied header.
+  //
+  if (state.sumEnabled) {
+    checksum = finishChecksum(&state, offsets.isUDP);
+    memcpy(&buffer[offsets.l4ChecksumOffset], &checksum, sizeof (checksum));
+  }
+
+  //
+  // Compute IPv4 header checksum, field was zeroed by the stack.
+  //
+  if (demandMask & kChecksumIP) {
+    checksum = ~((UInt16)checksumData(&buffer[offsets.l3Offset], offsets.l3Length));
+    memcpy(&buffer[offsets.l3Offset + kHyperVNetworkIPv4ChecksumOffset], &checksum, sizeof (checksum));
+  }
+}
+
+bool HyperVNetwork::finalizePacketChecksum(mbuf_t m, UInt32 demandMask) {
+  HyperVNetworkChecksumOffsets  offsets;
+  HyperVNetworkChecksumState    state;
+  UInt8                         ipHeader[kHyperVNetworkChecksumMaxHeaderSize];
+  UInt16                        checksum;
+
+  if (!parseChecksumOffsets(m, &offsets)) {
+    HVDATADBGLOG("Unable to parse packet headers for checksum demand 0x%X", demandMask);
+    return false;
+  }
+
+  //
+  // Sum TCP/UDP data in place and store the checksum back into the packet.
+  //
+  initChecksumState(&state, (demandMask & (kChecksumTCP | kChecksumUDP)) && offsets.l4ChecksumOffset != 0, offsets.l4Offset);
+  if (state.sumEnabled) {
+    for (mbuf_t pktCurrent = m; pktCurrent != nullptr; pktCurrent = mbuf_next(pktCurrent)) {
+      checksumPacketSegment(&state, nullptr, (UInt8 *)mbuf_data(pktCurrent), mbuf_len(pktCurrent));
+    }
+    checksum = finishChecksum(&state, offsets.isUDP);
+    if (mbuf_copyback(m, offsets.l4ChecksumOffset, sizeof (checksum), &checksum, MBUF_DONTWAIT) != 0) {
+      return false;
+    }
+  }
+
+  if (demandMask & kChecksumIP) {
+    if (mbuf_copydata(m, offsets.l3Offset, offsets.l3Length, ipHeader) != 0) {
+      return false;
+    }
+    checksum = ~((UInt16)checksumData(ipHeader, offsets.l3Length));
+    if (mbuf_copyback(m, offsets.l3Offset + kHyperVNetworkIPv4ChecksumOffset, sizeof (checksum), &checksum, MBUF_DONTWAIT) != 0) {
+      return false;
+    }
+  }
+
+  mbuf_clear_csum_requested(m);
+  return true;
+}
@@ -0,0 +1,198 @@
+//
+//  HyperVNetworkChecksum.hpp
+//  Hyper-V network driver
+//
+//  Copyright © 2021-2022 Goldfish64. All rights reserved.
+//
+
+#ifndef HyperVNetworkChecksum_hpp
+#define HyperVNetworkChecksum_hpp
+
+//
+// Internet checksum routines.
+// This header has no IOKit dependencies so it can also be built in userspace by Tests.
+//
+#include <libkern/OSTypes.h>
+#include <stddef.h>
+#include <string.h>
+
+typedef struct {
+  UInt32 l3Offset;
+  UInt32 l3Length;
+  UInt32 l4Offset;
+  UInt32 l4ChecksumOffset;
+  bool   isUDP;
+} HyperVNetworkChecksumOffsets;
+
+//
+// Running checksum over a packet split into segments.
+//
+typedef struct {
+  size_t offset;
+  size_t sumOffset;
+  bool   sumEnabled;
+  UInt64 sum;
+} HyperVNetworkChecksumState;
+
+//
+// Folds a ones' complement sum to 16 bits.
+//
+static inline UInt32 foldChecksum(UInt64 sum) {
+  while (sum >> 16) {
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  }
+  return (UInt32) sum;
+}
+
+//
+// Copies data and returns the ones' complement sum of it folded to 16 bits.
+// Sum is computed in native byte order, 32 bits at a time into a 64-bit accumulator.
+//
+static inline UInt32 copyAndChecksum(UInt8 *dest, const UInt8 *src, size_t length) {
+  UInt64 sum = 0;
+  UInt32 value32;
+  UInt16 value16;
+
+  while (length >= 16) {
+    memcpy(&value32, src, sizeof (value32));
+    memcpy(dest, &value32, sizeof (value32));
+    sum += value32;
+    memcpy(&value32, src + 4, sizeof (value32));
+    memcpy(dest + 4, &value32, sizeof (value32));
+    sum += value32;
+    memcpy(&value32, src + 8, sizeof (value32));
+    memcpy(dest + 8, &value32, sizeof (value32));
+    sum += value32;
+    memcpy(&value32, src + 12, sizeof (value32));
+    memcpy(dest + 12, &value32, sizeof (value32));
+    sum += value32;
+
+    src    += 16;
+    dest   += 16;
+    length -= 16;
+  }
+  while (length >= sizeof (value32)) {
+    memcpy(&value32, src, sizeof (value32));
+    memcpy(dest, &value32, sizeof (value32));
+    sum += value32;
+
+    src    += sizeof (value32);
+    dest   += sizeof (value32);
+    length -= sizeof (value32);
+  }
+  if (length >= sizeof (value16)) {
+    memcpy(&value16, src, sizeof (value16));
+    memcpy(dest, &value16, sizeof (value16));
+    sum += value16;
+
+    src    += sizeof (value16);
+    dest   += sizeof (value16);
+    length -= sizeof (value16);
+  }
+  if (length > 0) {
+    //
+    // Trailing odd byte is the first byte of a 16-bit word.
+    //
+    value16 = 0;
+    memcpy(&value16, src, 1);
+    *dest = *src;
+    sum += value16;
+  }
+
+  return foldChecksum(sum);
+}
+
+//
+// Returns the ones' complement sum folded to 16 bits, without copying.
+//
+static inline UInt32 checksumData(const UInt8 *data, size_t length) {
+  UInt64 sum = 0;
+  UInt32 value32;
+  UInt16 value16;
+
+  while (length >= sizeof (value32)) {
+    memcpy(&value32, data, sizeof (value32));
+    sum    += value32;
+    data   += sizeof (value32);
+    length -= sizeof (value32);
+  }
+  if (length >= sizeof (value16)) {
+    memcpy(&value16, data, sizeof (value16));
+    sum    += value16;
+    data   += sizeof (value16);
+    length -= sizeof (value16);
+  }
+  if (length > 0) {
+    value16 = 0;
+    memcpy(&value16, data, 1);
+    sum += value16;
+  }
+
+  return foldChecksum(sum);
+}
+
+static inline void initChecksumState(HyperVNetworkChecksumState *state, bool sumEnabled, size_t sumOffset) {
+  state->offset     = 0;
+  state->sumOffset  = sumOffset;
+  state->sumEnabled = sumEnabled;
+  state->sum        = 0;
+}
+
+//
+// Processes the next segment of a packet, copying it to dest if not null.
+// Only data at or after the sum offset is included in the checksum.
+//
+static inline void checksumPacketSegment(HyperVNetworkChecksumState *state, UInt8 *dest, const UInt8 *src, size_t length) {
+  UInt32 partialSum;
+  size_t skip;
+
+  //
+  // Skip any bytes before the start of the summed region.
+  //
+  skip = length;
+  if (state->sumEnabled) {
+    skip = (state->offset < state->sumOffset) ? (state->sumOffset - state->offset) : 0;
+    if (skip > length) {
+      skip = length;
+    }
+  }
+  if (skip > 0) {
+    if (dest != nullptr) {
+      memcpy(dest, src, skip);
+      dest += skip;
+    }
+    src           += skip;
+    state->offset += skip;
+    length        -= skip;
+  }
+
+  if (length > 0) {
+    partialSum = (dest != nullptr) ? copyAndChecksum(dest, src, length) : checksumData(src, length);
+
+    //
+    // Data starting at an odd offset from the start of the summed region is byte swapped within each 16-bit word.
+    //
+    if ((state->offset - state->sumOffset) & 0x1) {
+      partialSum = ((partialSum & 0xFF) << 8) | (partialSum >> 8);
+    }
+    state->sum    += partialSum;
+    state->offset += length;
+  }
+}
+
+//
+// Returns the final checksum value to be stored in the header.
+//
+static inline UInt16 finishChecksum(const HyperVNetworkChecksumState *state, bool isUDP) {
+  UInt16 checksum = ~((UInt16) foldChecksum(state->sum));
+
+  //
+  // Zero indicates no checksum for UDP.
+  //
+  if (checksum == 0 && isUDP) {
+    checksum = 0xFFFF;
+  }
+  return checksum;
+}
+
+#endif
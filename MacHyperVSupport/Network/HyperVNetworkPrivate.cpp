@@ -22,6 +22,7 @@ void HyperVNetwork::handlePacket(VMBusPacketHeader *pktHeader, UInt32 pktHeaderL
   totalbytes += pktHeaderLength + pktDataLength + 8;
   switch (pktHeader->type) {
     case kVMBusPacketTypeDataInband:
+      handleInbandMessage((HyperVNetworkMessage*)pktData, pktDataLength);
       break;
     case kVMBusPacketTypeDataUsingTransferPages:
       handleRNDISRanges((VMBusPacketTransferPages*)pktHeader, pktHeaderLength + pktDataLength);
@@ -36,61 +37,72 @@ void HyperVNetwork::handlePacket(VMBusPacketHeader *pktHeader, UInt32 pktHeaderL
   }
 }
 
+void HyperVNetwork::handleInbandMessage(HyperVNetworkMessage *netMsg, UInt32 msgLength) {
+  if (msgLength < sizeof (netMsg->messageType)) {
+    return;
+  }
+
+  switch (netMsg->messageType) {
+    case kHyperVNetworkMessageTypeV4SendVFAssociation:
+      //
+      // SR-IOV VF has been added or removed by Hyper-V.
+      // On removal, stop using the VF for transmit immediately.
+      //
+      HVSYSLOG("VF association received, allocated: %u, serial: 0x%X",
+               netMsg->v4.sendVFAssociation.allocated, netMsg->v4.sendVFAssociation.serialNumber);
+      setVFAssociation(netMsg->v4.sendVFAssociation.allocated != 0, netMsg->v4.sendVFAssociation.serialNumber);
+      if (netMsg->v4.sendVFAssociation.allocated == 0) {
+        _vfDataPathActive = false;
+      }
+      scheduleVFUpdate();
+      break;
+
+    default:
+      HVDBGLOG("Unhandled inband message of type 0x%X received", netMsg->messageType);
+      break;
+  }
+}
+
 void HyperVNetwork::handleRNDISRanges(VMBusPacketTransferPages *pktPages, UInt32 pktSize) {
-  UInt32 pktHeaderSize = HV_GET_VMBUS_PACKETSIZE(pktPages->header.headerLength);
-  
-  HyperVNetworkMessage *netMsg = (HyperVNetworkMessage*) (((UInt8*)pktPages) + pktHeaderSize);
-  
+  HyperVNetworkMessage netMsg;
+  bool                 result;
+
   //
-  // Ensure packet is valid.
+  // Process each range which contains a packet.
   //
-  if (netMsg->messageType != kHyperVNetworkMessageTypeV1SendRNDISPacket ||
-      pktPages->transferPagesetId != kHyperVNetworkReceiveBufferID) {
-    HVSYSLOG("Invalid message of type 0x%X and pageset ID of 0x%X received", netMsg->messageType, pktPages->transferPagesetId);
+  HVDATADBGLOG("Received %u RNDIS ranges", pktPages->rangeCount);
+  result = processTransferPageRanges(pktPages, pktSize, _receiveBufferSize, [this](UInt32 offset, UInt32 length) {
+    HVDATADBGLOG("Got range of %u bytes at 0x%X", length, offset);
+    processRNDISPacket(_receiveBuffer.buffer + offset, length);
+  });
+  if (!result) {
+    HVSYSLOG("Invalid transfer page packet with pageset ID of 0x%X and %u ranges received", pktPages->transferPagesetId, pktPages->rangeCount);
     return;
   }
-  HVDATADBGLOG("Received %u RNDIS ranges, range[0] count = %u, offset = 0x%X", pktPages->rangeCount, pktPages->ranges[0].count, pktPages->ranges[0].offset);
-  
+
   //
-  // Process each range which contains a packet.
+  // Return the ranges to Hyper-V.
   //
-  for (int i = 0; i < pktPages->rangeCount; i++) {
-    UInt8 *data = ((UInt8*) _receiveBuffer.buffer) + pktPages->ranges[i].offset;
-    UInt32 dataLength = pktPages->ranges[i].count;
-    
-    HVDATADBGLOG("Got range of %u bytes at 0x%X", dataLength, pktPages->ranges[i].offset);
-    processRNDISPacket(data, dataLength);
-  }
-  
-  HyperVNetworkMessage netMsg2;
-  memset(&netMsg2, 0, sizeof (netMsg2));
-  netMsg2.messageType = kHyperVNetworkMessageTypeV1SendRNDISPacketComplete;
-  netMsg2.v1.sendRNDISPacketComplete.status = kHyperVNetworkMessageStatusSuccess;
-  
-  _hvDevice->writeCompletionPacketWithTransactionId(&netMsg2, sizeof (netMsg2), pktPages->header.transactionId, false);
- // postCycle++;
+  buildSendRNDISPacketCompleteMessage(&netMsg, kHyperVNetworkMessageStatusSuccess);
+  _hvDevice->writeCompletionPacketWithTransactionId(&netMsg, sizeof (netMsg), pktPages->header.transactionId, false);
 }
 
 void HyperVNetwork::handleCompletion(void *pktData, UInt32 pktLength) {
   VMBusPacketHeader *pktHeader = (VMBusPacketHeader*)pktData;
-  UInt32 pktHeaderSize = HV_GET_VMBUS_PACKETSIZE(pktHeader->headerLength);
-  
-  HyperVNetworkMessage *netMsg;
-    netMsg = (HyperVNetworkMessage*)(((UInt8*)pktData) + pktHeaderSize);
-    if (netMsg->messageType == kHyperVNetworkMessageTypeV1SendRNDISPacketComplete) {
-    //  completions++;
-      //HVSYSLOG("Got index %X", pktHeader->transactionId & ~kHyperVNetworkSendTransIdBits);
-     // if (completions % 100000 == 0)
-     // HVSYSLOG("pkt completion status %X %X %u comple trans %u (free indexes %u)", netMsg->messageType, netMsg->v1.sendRNDISPacketComplete.status, completions, pktHeader->transactionId, getFreeSendIndexCount());
-      
-      if (netMsg->v1.sendRNDISPacketComplete.status != 1) {
-        HVSYSLOG("Got a nonsuccess %u", netMsg->v1.sendRNDISPacketComplete.status);
-      }
-      //HyperVSendPacketThing *pktThing = (HyperVSendPacketThing*)pktHeader->transactionId;
-      releaseSendIndex((UInt32)(pktHeader->transactionId & ~kHyperVNetworkSendTransIdBits));
-    } else {
-      HVSYSLOG("Unknown completion type 0x%X received", netMsg->messageType);
-    }
+  UInt32            sendIndex;
+  UInt32            status;
+
+  //
+  // Release send section used by the completed packet.
+  //
+  if (!getSendCompletionIndex(pktHeader, pktLength, &sendIndex, &status)) {
+    HVSYSLOG("Unknown completion received for transaction 0x%llX", pktHeader->transactionId);
+    return;
+  }
+  if (status != kHyperVNetworkMessageStatusSuccess) {
+    HVSYSLOG("Send section %u completed with status 0x%X", sendIndex, status);
+  }
+  releaseSendIndex(sendIndex);
 }
 
 IOReturn HyperVNetwork::negotiateProtocol(HyperVNetworkProtocolVersion protocolVersion) {
@@ -100,10 +112,7 @@ IOReturn HyperVNetwork::negotiateProtocol(HyperVNetworkProtocolVersion protocolV
   //
   // Send requested network procotol version to Hyper-V.
   //
-  memset(&netMsg, 0, sizeof (netMsg));
-  netMsg.messageType = kHyperVNetworkMessageTypeInit;
-  netMsg.init.initVersion.maxProtocolVersion = protocolVersion;
-  netMsg.init.initVersion.minProtocolVersion = protocolVersion;
+  buildNetworkInitMessage(&netMsg, protocolVersion);
 
   status = _hvDevice->writeInbandPacket(&netMsg, sizeof (netMsg), true, &netMsg, sizeof (netMsg));
   if (status != kIOReturnSuccess) {
@@ -115,7 +124,7 @@ IOReturn HyperVNetwork::negotiateProtocol(HyperVNetworkProtocolVersion protocolV
   // Verify desired protocol version is supported.
   //
   if (netMsg.init.initComplete.status != kHyperVNetworkMessageStatusSuccess) {
-    HVSYSLOG("Error while negotiating protocol version: 0x%X", netMsg.init.initComplete.status);
+    HVDBGLOG("Protocol version 0x%X is not supported: 0x%X", protocolVersion, netMsg.init.initComplete.status);
     return kIOReturnUnsupported;
   }
 
@@ -128,17 +137,14 @@ IOReturn HyperVNetwork::initSendReceiveBuffers() {
   IOReturn             status;
   HyperVNetworkMessage netMsg;
   
-  //
-  // Older versions of the protocol have a lower recieve buffer size limit.
-  //
-  _receiveBufferSize = (_netVersion > kHyperVNetworkProtocolVersion2) ?
-    kHyperVNetworkReceiveBufferSize : kHyperVNetworkReceiveBufferSizeLegacy;
+  _receiveBufferSize = getNetworkReceiveBufferSize(_netVersion);
   _sendBufferSize    = kHyperVNetworkSendBufferSize;
 
   //
   // Allocate receive and send buffers and create GPADLs for them.
+  // Both buffers are large and only accessed through their GPADLs, allocate them page-by-page.
   //
-  if (!_hvDevice->getHvController()->allocateDmaBuffer(&_receiveBuffer, _receiveBufferSize)) {
+  if (!_hvDevice->getHvController()->allocateDmaBuffer(&_receiveBuffer, _receiveBufferSize, false)) {
     HVSYSLOG("Failed to allocate receive buffer");
     freeSendReceiveBuffers();
     return kIOReturnNoResources;
@@ -148,7 +154,7 @@ IOReturn HyperVNetwork::initSendReceiveBuffers() {
     freeSendReceiveBuffers();
     return kIOReturnIOError;
   }
-  if (!_hvDevice->getHvController()->allocateDmaBuffer(&_sendBuffer, _sendBufferSize)) {
+  if (!_hvDevice->getHvController()->allocateDmaBuffer(&_sendBuffer, _sendBufferSize, false)) {
     HVSYSLOG("Failed to allocate send buffer");
     freeSendReceiveBuffers();
     return kIOReturnNoResources;
@@ -163,10 +169,7 @@ IOReturn HyperVNetwork::initSendReceiveBuffers() {
   //
   // Configure Hyper-V Network with receive buffer GPADL.
   //
-  bzero(&netMsg, sizeof (netMsg));
-  netMsg.messageType                      = kHyperVNetworkMessageTypeV1SendReceiveBuffer;
-  netMsg.v1.sendReceiveBuffer.gpadlHandle = _receiveGpadlHandle;
-  netMsg.v1.sendReceiveBuffer.id          = kHyperVNetworkReceiveBufferID;
+  buildReceiveBufferMessage(&netMsg, _receiveGpadlHandle);
 
   status = _hvDevice->writeInbandPacket(&netMsg, sizeof (netMsg), true, &netMsg, sizeof (netMsg));
   if (status != kIOReturnSuccess) {
@@ -181,11 +184,7 @@ IOReturn HyperVNetwork::initSendReceiveBuffers() {
     return kIOReturnIOError;
   }
 
-  //
-  // Only allow 1 receive section.
-  // This is the same as what the Linux driver supports.
-  //
-  if (netMsg.v1.sendReceiveBufferComplete.numSections != 1 || netMsg.v1.sendReceiveBufferComplete.sections[0].offset != 0) {
+  if (!isValidReceiveBufferComplete(&netMsg)) {
     HVSYSLOG("Invalid receive buffer sections: %u", netMsg.v1.sendReceiveBufferComplete.numSections);
     freeSendReceiveBuffers();
     return kIOReturnUnsupported;
@@ -195,10 +194,7 @@ IOReturn HyperVNetwork::initSendReceiveBuffers() {
   //
   // Configure Hyper-V Network with send buffer GPADL.
   //
-  bzero(&netMsg, sizeof (netMsg));
-  netMsg.messageType                   = kHyperVNetworkMessageTypeV1SendSendBuffer;
-  netMsg.v1.sendSendBuffer.gpadlHandle = _sendGpadlHandle;
-  netMsg.v1.sendSendBuffer.id          = kHyperVNetworkSendBufferID;
+  buildSendBufferMessage(&netMsg, _sendGpadlHandle);
 
   status = _hvDevice->writeInbandPacket(&netMsg, sizeof (netMsg), true, &netMsg, sizeof (netMsg));
   if (status != kIOReturnSuccess) {
@@ -289,21 +285,35 @@ void HyperVNetwork::releaseSendIndex(UInt32 sendIndex) {
 }
 
 bool HyperVNetwork::connectNetwork() {
-  IOReturn status;
-  
+  IOReturn status = kIOReturnUnsupported;
+
+  //
   // Negotiate max protocol version with Hyper-V.
-  negotiateProtocol(kHyperVNetworkProtocolVersion1);
-  _netVersion = kHyperVNetworkProtocolVersion1;
+  //
+  for (UInt32 i = 0; i < kHyperVNetworkProtocolVersionCount; i++) {
+    status = negotiateProtocol(networkProtocolVersions[i]);
+    if (status == kIOReturnSuccess) {
+      _netVersion = networkProtocolVersions[i];
+      break;
+    }
+  }
+  if (status != kIOReturnSuccess) {
+    HVSYSLOG("Failed to negotiate a supported protocol version");
+    return false;
+  }
+  HVDBGLOG("Using protocol version 0x%X", _netVersion);
   
+  //
+  // Send NDIS configuration on protocol version 2 and newer.
+  // 802.1Q tagging is only offloaded once Hyper-V has been told it is supported.
+  //
+  if (_netVersion >= kHyperVNetworkProtocolVersion2) {
+    _isVLANEnabled = sendNDISConfig() == kIOReturnSuccess;
+  }
+
   // Send NDIS version.
-  UInt32 ndisVersion = _netVersion > kHyperVNetworkProtocolVersion4 ?
-    kHyperVNetworkNDISVersion6001E : kHyperVNetworkNDISVersion60001;
-  
   HyperVNetworkMessage netMsg;
-  memset(&netMsg, 0, sizeof (netMsg));
-  netMsg.messageType = kHyperVNetworkMessageTypeV1SendNDISVersion;
-  netMsg.v1.sendNDISVersion.major = (ndisVersion & 0xFFFF0000) >> 16;
-  netMsg.v1.sendNDISVersion.minor = ndisVersion & 0x0000FFFF;
+  buildNDISVersionMessage(&netMsg, _netVersion);
   
   if (_hvDevice->writeInbandPacket(&netMsg, sizeof (netMsg), false) != kIOReturnSuccess) {
     HVSYSLOG("failed to send NDIS version");
@@ -329,6 +339,21 @@ bool HyperVNetwork::connectNetwork() {
   return true;
 }
 
+IOReturn HyperVNetwork::sendNDISConfig() {
+  IOReturn             status;
+  HyperVNetworkMessage netMsg;
+
+  buildNDISConfigMessage(&netMsg, _netVersion, kIOEthernetMaxPacketSize - kIOEthernetCRCSize);
+  status = _hvDevice->writeInbandPacket(&netMsg, sizeof (netMsg), false);
+  if (status != kIOReturnSuccess) {
+    HVSYSLOG("Failed to send NDIS configuration with status 0x%X", status);
+    return status;
+  }
+
+  HVDBGLOG("Sent NDIS configuration with capabilities 0x%llX", netMsg.v2.sendNDISConfig.capabilities);
+  return kIOReturnSuccess;
+}
+
 bool HyperVNetwork::addNetworkMedium(OSDictionary *mediumDict, IOMediumType type) {
   bool            result = false;
   IONetworkMedium *medium = IONetworkMedium::medium(type, 0);
@@ -0,0 +1,297 @@
+//
+//  HyperVNetworkProtocol.hpp
+//  Hyper-V network driver
+//
+//  Copyright © 2021-2022 Goldfish64. All rights reserved.
+//
+
+#ifndef HyperVNetworkProtocol_hpp
+#define HyperVNetworkProtocol_hpp
+
+//
+// Network protocol message and RNDIS data packet framing routines.
+// This header has no IOKit dependencies so it can also be built in userspace by Tests.
+//
+#include <libkern/OSTypes.h>
+#include <stddef.h>
+#include <string.h>
+
+//
+// Register definitions use BIT() from HyperV.hpp in the driver.
+//
+#ifndef BIT
+#define BIT(a)                  (1 << (a))
+#endif
+
+#include "VMBusPacket.hpp"
+#include "HyperVNetworkRegs.hpp"
+
+//
+// Protocol versions, in order of preference.
+//
+static const HyperVNetworkProtocolVersion networkProtocolVersions[] = {
+  kHyperVNetworkProtocolVersion61,
+  kHyperVNetworkProtocolVersion6,
+  kHyperVNetworkProtocolVersion5,
+  kHyperVNetworkProtocolVersion4,
+  kHyperVNetworkProtocolVersion2,
+  kHyperVNetworkProtocolVersion1
+};
+#define kHyperVNetworkProtocolVersionCount  (sizeof (networkProtocolVersions) / sizeof (networkProtocolVersions[0]))
+
+//
+// Clears a network message and sets its type.
+//
+static inline void prepareNetworkMessage(HyperVNetworkMessage *netMsg, HyperVNetworkMessageType messageType) {
+  memset(netMsg, 0, sizeof (*netMsg));
+  netMsg->messageType = messageType;
+}
+
+static inline void buildNetworkInitMessage(HyperVNetworkMessage *netMsg, HyperVNetworkProtocolVersion protocolVersion) {
+  prepareNetworkMessage(netMsg, kHyperVNetworkMessageTypeInit);
+  netMsg->init.initVersion.maxProtocolVersion = protocolVersion;
+  netMsg->init.initVersion.minProtocolVersion = protocolVersion;
+}
+
+//
+// NDIS 6.30 is used on protocol version 5 and newer, NDIS 6.1 on older versions.
+//
+static inline void buildNDISVersionMessage(HyperVNetworkMessage *netMsg, HyperVNetworkProtocolVersion protocolVersion) {
+  UInt32 ndisVersion = protocolVersion > kHyperVNetworkProtocolVersion4 ?
+    kHyperVNetworkNDISVersion6001E : kHyperVNetworkNDISVersion60001;
+
+  prepareNetworkMessage(netMsg, kHyperVNetworkMessageTypeV1SendNDISVersion);
+  netMsg->v1.sendNDISVersion.major = (ndisVersion & 0xFFFF0000) >> 16;
+  netMsg->v1.sendNDISVersion.minor = ndisVersion & 0x0000FFFF;
+}
+
+//
+// Advertises 802.1Q tagging support so Hyper-V will pass VLAN info in per-packet info.
+// Hyper-V will only offer an SR-IOV VF on protocol version 5 and newer.
+//
+static inline void buildNDISConfigMessage(HyperVNetworkMessage *netMsg, HyperVNetworkProtocolVersion protocolVersion, UInt32 mtu) {
+  prepareNetworkMessage(netMsg, kHyperVNetworkMessageTypeV2SendNDISConfig);
+  netMsg->v2.sendNDISConfig.mtu          = mtu;
+  netMsg->v2.sendNDISConfig.capabilities = kHyperVNetworkV2CapabilityIEEE8021Q;
+  if (protocolVersion >= kHyperVNetworkProtocolVersion5) {
+    netMsg->v2.sendNDISConfig.capabilities |= kHyperVNetworkV2CapabilitySRIOV | kHyperVNetworkV2CapabilityTeaming;
+  }
+}
+
+//
+// Older versions of the protocol have a lower recieve buffer size limit.
+//
+static inline UInt32 getNetworkReceiveBufferSize(HyperVNetworkProtocolVersion protocolVersion) {
+  return (protocolVersion > kHyperVNetworkProtocolVersion2) ? kHyperVNetworkReceiveBufferSize : kHyperVNetworkReceiveBufferSizeLegacy;
+}
+
+static inline void buildReceiveBufferMessage(HyperVNetworkMessage *netMsg, UInt32 gpadlHandle) {
+  prepareNetworkMessage(netMsg, kHyperVNetworkMessageTypeV1SendReceiveBuffer);
+  netMsg->v1.sendReceiveBuffer.gpadlHandle = gpadlHandle;
+  netMsg->v1.sendReceiveBuffer.id          = kHyperVNetworkReceiveBufferID;
+}
+
+//
+// Only allow 1 receive section.
+// This is the same as what the Linux driver supports.
+//
+static inline bool isValidReceiveBufferComplete(const HyperVNetworkMessage *netMsg) {
+  return netMsg->v1.sendReceiveBufferComplete.numSections == 1 && netMsg->v1.sendReceiveBufferComplete.sections[0].offset == 0;
+}
+
+static inline void buildSendBufferMessage(HyperVNetworkMessage *netMsg, UInt32 gpadlHandle) {
+  prepareNetworkMessage(netMsg, kHyperVNetworkMessageTypeV1SendSendBuffer);
+  netMsg->v1.sendSendBuffer.gpadlHandle = gpadlHandle;
+  netMsg->v1.sendSendBuffer.id          = kHyperVNetworkSendBufferID;
+}
+
+//
+// Creates the message describing an RNDIS message to Hyper-V.
+// Data packets are placed in a send buffer section, other messages use kHyperVNetworkRNDISSendSectionIndexInvalid.
+//
+static inline void buildSendRNDISPacketMessage(HyperVNetworkMessage *netMsg, HyperVNetworkRNDISChannelType channelType,
+                                               UInt32 sendIndex, UInt32 sendSize) {
+  prepareNetworkMessage(netMsg, kHyperVNetworkMessageTypeV1SendRNDISPacket);
+  netMsg->v1.sendRNDISPacket.channelType            = channelType;
+  netMsg->v1.sendRNDISPacket.sendBufferSectionIndex = sendIndex;
+  netMsg->v1.sendRNDISPacket.sendBufferSectionSize  = sendSize;
+}
+
+static inline void buildSendRNDISPacketCompleteMessage(HyperVNetworkMessage *netMsg, HyperVNetworkMessageStatus status) {
+  prepareNetworkMessage(netMsg, kHyperVNetworkMessageTypeV1SendRNDISPacketComplete);
+  netMsg->v1.sendRNDISPacketComplete.status = status;
+}
+
+//
+// Transaction IDs for data packets carry the send section index.
+//
+static inline UInt64 getSendTransactionId(UInt32 sendIndex) {
+  return sendIndex | kHyperVNetworkSendTransIdBits;
+}
+
+//
+// Gets the send section index released by a completion packet.
+// Returns false if the completion is not for a sent RNDIS packet.
+//
+static inline bool getSendCompletionIndex(const VMBusPacketHeader *pktHeader, UInt32 pktLength, UInt32 *sendIndex, UInt32 *status) {
+  UInt32                      pktHeaderSize = HV_GET_VMBUS_PACKETSIZE(pktHeader->headerLength);
+  const HyperVNetworkMessage  *netMsg;
+
+  if (pktHeaderSize + sizeof (netMsg->messageType) + sizeof (netMsg->v1.sendRNDISPacketComplete) > pktLength) {
+    return false;
+  }
+
+  netMsg = (const HyperVNetworkMessage *) (((const UInt8 *) pktHeader) + pktHeaderSize);
+  if (netMsg->messageType != kHyperVNetworkMessageTypeV1SendRNDISPacketComplete) {
+    return false;
+  }
+
+  *sendIndex = (UInt32) (pktHeader->transactionId & ~kHyperVNetworkSendTransIdBits);
+  *status    = netMsg->v1.sendRNDISPacketComplete.status;
+  return true;
+}
+
+//
+// Invokes handleRange(offset, length) for each RNDIS message in a transfer page packet.
+// The ranges must be within the packet header and each range must lie within the receive buffer.
+// Returns false if the packet is not a valid RNDIS transfer page packet, no ranges are processed in that case.
+//
+template <typename RangeFunc>
+static inline bool processTransferPageRanges(const VMBusPacketTransferPages *pktPages, UInt32 pktLength,
+                                             UInt32 receiveBufferSize, RangeFunc handleRange) {
+  UInt32                      pktHeaderSize = HV_GET_VMBUS_PACKETSIZE(pktPages->header.headerLength);
+  const HyperVNetworkMessage  *netMsg;
+
+  if (pktHeaderSize < offsetof(VMBusPacketTransferPages, ranges)
+      || pktHeaderSize + sizeof (netMsg->messageType) > pktLength
+      || (pktHeaderSize - offsetof(VMBusPacketTransferPages, ranges)) / sizeof (VMBusTransferPageRange) < pktPages->rangeCount) {
+    return false;
+  }
+
+  netMsg = (const HyperVNetworkMessage *) (((const UInt8 *) pktPages) + pktHeaderSize);
+  if (netMsg->messageType != kHyperVNetworkMessageTypeV1SendRNDISPacket || pktPages->transferPagesetId != kHyperVNetworkReceiveBufferID) {
+    return false;
+  }
+
+  for (UInt32 i = 0; i < pktPages->rangeCount; i++) {
+    if (pktPages->ranges[i].offset > receiveBufferSize || pktPages->ranges[i].count > receiveBufferSize - pktPages->ranges[i].offset) {
+      return false;
+    }
+  }
+
+  for (UInt32 i = 0; i < pktPages->rangeCount; i++) {
+    handleRange(pktPages->ranges[i].offset, pktPages->ranges[i].count);
+  }
+  return true;
+}
+
+//
+// Starts an RNDIS data packet message. Per-packet info can then be added before the packet data.
+//
+static inline void initRNDISDataPacket(HyperVNetworkRNDISMessage *rndisMsg) {
+  memset(rndisMsg, 0, sizeof (*rndisMsg));
+  rndisMsg->header.type                    = kHyperVNetworkRNDISMessageTypePacket;
+  rndisMsg->dataPacket.perPacketInfoOffset = sizeof (rndisMsg->dataPacket);
+  rndisMsg->dataPacket.perPacketInfoLength = 0;
+}
+
+//
+// Appends a new per-packet info element to the end of existing ones.
+// Packet data must be placed after all per-packet info has been added.
+//
+static inline void *addRNDISPerPacketInfo(HyperVNetworkRNDISMessageDataPacket *dataPacket, HyperVNetworkRNDISPerPacketInfoType type, UInt32 size) {
+  HyperVNetworkRNDISPerPacketInfo *ppi;
+
+  ppi = (HyperVNetworkRNDISPerPacketInfo *)(((UInt8 *)dataPacket) + dataPacket->perPacketInfoOffset + dataPacket->perPacketInfoLength);
+  ppi->size      = sizeof (*ppi) + size;
+  ppi->type      = type;
+  ppi->ppiOffset = sizeof (*ppi);
+
+  dataPacket->perPacketInfoLength += ppi->size;
+  return ((UInt8 *)ppi) + ppi->ppiOffset;
+}
+
+//
+// Places packet data after any per-packet info and sets the total message length.
+// Returns the offset of the packet data from the start of the message.
+//
+static inline UInt32 finishRNDISDataPacket(HyperVNetworkRNDISMessage *rndisMsg, UInt32 dataLength) {
+  rndisMsg->dataPacket.dataOffset = rndisMsg->dataPacket.perPacketInfoOffset + rndisMsg->dataPacket.perPacketInfoLength;
+  rndisMsg->dataPacket.dataLength = dataLength;
+  rndisMsg->header.length         = sizeof (rndisMsg->header) + rndisMsg->dataPacket.dataOffset + rndisMsg->dataPacket.dataLength;
+  return sizeof (rndisMsg->header) + rndisMsg->dataPacket.dataOffset;
+}
+
+//
+// Finds a per-packet info element of the specified type with at least minSize bytes of data.
+// Offsets are from the start of the data packet message, all elements must be entirely within it.
+//
+static inline void *getRNDISPerPacketInfo(HyperVNetworkRNDISMessageDataPacket *dataPacket, UInt32 dataPacketLength,
+                                          HyperVNetworkRNDISPerPacketInfoType type, UInt32 minSize) {
+  HyperVNetworkRNDISPerPacketInfo *ppi;
+  UInt32                          ppiLength;
+
+  if (dataPacket->perPacketInfoOffset == 0 || dataPacket->perPacketInfoLength == 0) {
+    return nullptr;
+  }
+  if (dataPacket->perPacketInfoOffset > dataPacketLength
+      || dataPacket->perPacketInfoLength > dataPacketLength - dataPacket->perPacketInfoOffset) {
+    return nullptr;
+  }
+
+  ppi       = (HyperVNetworkRNDISPerPacketInfo *)(((UInt8 *)dataPacket) + dataPacket->perPacketInfoOffset);
+  ppiLength = dataPacket->perPacketInfoLength;
+  while (ppiLength >= sizeof (*ppi)) {
+    if (ppi->size < sizeof (*ppi) || ppi->size > ppiLength) {
+      break;
+    }
+
+    if (ppi->type == type && ppi->ppiOffset <= ppi->size && minSize <= ppi->size - ppi->ppiOffset) {
+      return ((UInt8 *)ppi) + ppi->ppiOffset;
+    }
+
+    ppiLength -= ppi->size;
+    ppi        = (HyperVNetworkRNDISPerPacketInfo *)(((UInt8 *)ppi) + ppi->size);
+  }
+
+  return nullptr;
+}
+
+//
+// Gets the packet data within a received RNDIS data packet message.
+// Returns false if the message is too short or the packet data is not entirely within it.
+//
+static inline bool getRNDISPacketData(HyperVNetworkRNDISMessage *rndisMsg, UInt32 msgLength, UInt8 **data, UInt32 *dataLength) {
+  UInt32 dataPacketLength;
+
+  if (msgLength < sizeof (rndisMsg->header) + sizeof (rndisMsg->dataPacket)) {
+    return false;
+  }
+
+  dataPacketLength = msgLength - sizeof (rndisMsg->header);
+  if (rndisMsg->dataPacket.dataOffset > dataPacketLength || rndisMsg->dataPacket.dataLength > dataPacketLength - rndisMsg->dataPacket.dataOffset) {
+    return false;
+  }
+
+  *data       = ((UInt8 *) &rndisMsg->dataPacket) + rndisMsg->dataPacket.dataOffset;
+  *dataLength = rndisMsg->dataPacket.dataLength;
+  return true;
+}
+
+//
+// Converts between 802.1Q tag control information and VLAN per-packet info.
+//
+static inline void setRNDISVLANInfo(HyperVNetworkRNDISPerPacketInfoIEEE8021Q *vlanInfo, UInt16 vlanTag) {
+  vlanInfo->value             = 0;
+  vlanInfo->vlanId            = vlanTag & kHyperVNetworkVLANIdMask;
+  vlanInfo->canonicalFormatId = (vlanTag >> kHyperVNetworkVLANCFIShift) & 0x1;
+  vlanInfo->userPriority      = (vlanTag >> kHyperVNetworkVLANPriorityShift) & 0x7;
+}
+
+static inline UInt16 getRNDISVLANTag(const HyperVNetworkRNDISPerPacketInfoIEEE8021Q *vlanInfo) {
+  return (vlanInfo->vlanId & kHyperVNetworkVLANIdMask)
+    | (vlanInfo->canonicalFormatId << kHyperVNetworkVLANCFIShift)
+    | (vlanInfo->userPriority << kHyperVNetworkVLANPriorityShift);
+}
+
+#endif
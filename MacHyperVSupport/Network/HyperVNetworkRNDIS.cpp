@@ -79,18 +79,34 @@ bool HyperVNetwork::processRNDISPacket(UInt8 *data, UInt32 dataLength) {
 
 void HyperVNetwork::processIncoming(UInt8 *data, UInt32 dataLength) {
   HyperVNetworkRNDISMessage *rndisPkt = (HyperVNetworkRNDISMessage*)data;
-  UInt8 *pktData = data + 8 + rndisPkt->dataPacket.dataOffset;
+  UInt8 *pktData;
+  UInt32 pktDataLength;
+  HyperVNetworkRNDISPerPacketInfoIEEE8021Q *vlanInfo;
+
+  if (!getRNDISPacketData(rndisPkt, dataLength, &pktData, &pktDataLength)) {
+    HVDATADBGLOG("Data packet message of %u bytes is invalid", dataLength);
+    return;
+  }
   
   preCycle++;
-  mbuf_t newPacket = allocatePacket(rndisPkt->dataPacket.dataLength);
+  mbuf_t newPacket = allocatePacket(pktDataLength);
   if (newPacket == nullptr) {
     panic("zero packet mbuf");
   }
   midCycle++;
   //memcpy(mbuf_data(newPacket), pktData, rndisPkt->dataPacket.dataLength);
-  mbuf_copyback(newPacket, 0, rndisPkt->dataPacket.dataLength, pktData, MBUF_WAITOK);
+  mbuf_copyback(newPacket, 0, pktDataLength, pktData, MBUF_WAITOK);
+
+  //
+  // Pass 802.1Q tag to the VLAN layer if Hyper-V stripped it from the frame.
+  //
+  vlanInfo = (HyperVNetworkRNDISPerPacketInfoIEEE8021Q *)getRNDISPerPacketInfo(&rndisPkt->dataPacket, dataLength - sizeof (rndisPkt->header),
+                                                                               kHyperVNetworkRNDISPerPacketInfoTypeIEEE8021Q, sizeof (*vlanInfo));
+  if (vlanInfo != nullptr) {
+    mbuf_set_vlan_tag(newPacket, getRNDISVLANTag(vlanInfo));
+  }
   
-  _ethInterface->inputPacket(newPacket, rndisPkt->dataPacket.dataLength);
+  _ethInterface->inputPacket(newPacket, pktDataLength);
   postCycle++;
 }
 
@@ -153,11 +169,7 @@ bool HyperVNetwork::sendRNDISRequest(HyperVNetworkRNDISRequest *rndisRequest, bo
   // Create packet for sending the RNDIS request.
   //
   HyperVNetworkMessage netMsg;
-  memset(&netMsg, 0, sizeof (netMsg));
-  netMsg.messageType = kHyperVNetworkMessageTypeV1SendRNDISPacket;
-  netMsg.v1.sendRNDISPacket.channelType = kHyperVNetworkRNDISChannelTypeControl;
-  netMsg.v1.sendRNDISPacket.sendBufferSectionIndex = -1;
-  netMsg.v1.sendRNDISPacket.sendBufferSectionSize = 0;
+  buildSendRNDISPacketMessage(&netMsg, kHyperVNetworkRNDISChannelTypeControl, kHyperVNetworkRNDISSendSectionIndexInvalid, 0);
   
   rndisRequest->isSleeping = true;
   rndisRequest->message.initRequest.requestId = getNextRNDISTransId();
@@ -24,6 +24,30 @@
 #define kHyperVNetworkMaximumTransId  0xFFFFFFFF
 #define kHyperVNetworkSendTransIdBits 0xFA00000000000000
 
+//
+// Header sizes and offsets used for software checksums.
+//
+#define kHyperVNetworkEthernetHeaderSize      14
+#define kHyperVNetworkVLANHeaderSize          4
+#define kHyperVNetworkEtherTypeIPv4           0x0800
+#define kHyperVNetworkEtherTypeVLAN           0x8100
+#define kHyperVNetworkIPv4MinHeaderSize       20
+#define kHyperVNetworkIPv4ProtocolOffset      9
+#define kHyperVNetworkIPv4ChecksumOffset      10
+#define kHyperVNetworkTCPChecksumOffset       16
+#define kHyperVNetworkUDPChecksumOffset       6
+#define kHyperVNetworkChecksumMaxHeaderSize   (kHyperVNetworkEthernetHeaderSize + kHyperVNetworkVLANHeaderSize + 60)
+
+//
+// 802.1Q tag control information fields.
+//
+#define kHyperVNetworkVLANIdMask        0xFFF
+#define kHyperVNetworkVLANCFIShift      12
+#define kHyperVNetworkVLANPriorityShift 13
+
+#define kHyperVNetworkVFFilterName        "fish.goldfish64.MacHyperVSupport.HyperVNetwork.vf"
+#define kHyperVNetworkVFDetachTimeoutMS   1000
+
 #define kHyperVNetworkVendor    "Microsoft"
 #define kHyperVNetworkModel     "Hyper-V Network Adapter"
 
@@ -58,7 +82,14 @@ typedef enum : UInt32 {
   kHyperVNetworkMessageTypeV1SendSendBufferComplete,
   kHyperVNetworkMessageTypeV1RevokeSendBuffer,
   kHyperVNetworkMessageTypeV1SendRNDISPacket,
-  kHyperVNetworkMessageTypeV1SendRNDISPacketComplete
+  kHyperVNetworkMessageTypeV1SendRNDISPacketComplete,
+
+  // Protocol version 2.
+  kHyperVNetworkMessageTypeV2SendNDISConfig               = 125,
+
+  // Protocol version 4.
+  kHyperVNetworkMessageTypeV4SendVFAssociation            = 128,
+  kHyperVNetworkMessageTypeV4SwitchDataPath               = 129
 } HyperVNetworkMessageType;
 
 //
@@ -241,6 +272,71 @@ typedef union __attribute__((packed)) {
   HyperVNetworkV1MessageSendRNDISPacketComplete     sendRNDISPacketComplete;
 } HyperVNetworkV1Message;
 
+//
+// Protocol version 2
+//
+
+//
+// VM capabilities sent with the NDIS configuration message.
+//
+#define kHyperVNetworkV2CapabilityVMQ           BIT(0)
+#define kHyperVNetworkV2CapabilityChimney       BIT(1)
+#define kHyperVNetworkV2CapabilitySRIOV         BIT(2)
+#define kHyperVNetworkV2CapabilityIEEE8021Q     BIT(3)
+#define kHyperVNetworkV2CapabilityCorrelationId BIT(4)
+#define kHyperVNetworkV2CapabilityTeaming       BIT(5)
+#define kHyperVNetworkV2CapabilityVirtualSubnet BIT(6)
+#define kHyperVNetworkV2CapabilityRSC           BIT(7)
+
+//
+// Send NDIS configuration to Hyper-V.
+//
+typedef struct __attribute__((packed)) {
+  UInt32 mtu;
+  UInt32 reserved;
+  UInt64 capabilities;
+} HyperVNetworkV2MessageSendNDISConfig;
+
+//
+// Protocol version 2 messages.
+//
+typedef union __attribute__((packed)) {
+  HyperVNetworkV2MessageSendNDISConfig              sendNDISConfig;
+} HyperVNetworkV2Message;
+
+//
+// Protocol version 4
+//
+
+//
+// VF association message from Hyper-V.
+// This message is sent when an SR-IOV virtual function paired with this adapter is added or removed.
+//
+typedef struct __attribute__((packed)) {
+  UInt32 allocated;
+  UInt32 serialNumber;
+} HyperVNetworkV4MessageSendVFAssociation;
+
+typedef enum : UInt32 {
+  kHyperVNetworkDataPathSynthetic = 0,
+  kHyperVNetworkDataPathVF        = 1
+} HyperVNetworkDataPath;
+
+//
+// Switch data path message sent to Hyper-V.
+//
+typedef struct __attribute__((packed)) {
+  HyperVNetworkDataPath activeDataPath;
+} HyperVNetworkV4MessageSwitchDataPath;
+
+//
+// Protocol version 4 messages.
+//
+typedef union __attribute__((packed)) {
+  HyperVNetworkV4MessageSendVFAssociation           sendVFAssociation;
+  HyperVNetworkV4MessageSwitchDataPath              switchDataPath;
+} HyperVNetworkV4Message;
+
 //
 // Main message structure.
 //
@@ -249,6 +345,8 @@ typedef struct __attribute__((packed)) {
   union {
     HyperVNetworkMessageInit    init;
     HyperVNetworkV1Message      v1;
+    HyperVNetworkV2Message      v2;
+    HyperVNetworkV4Message      v4;
   } __attribute__((packed));
   UInt8 padd[sizeof (HyperVNetworkMessageInit)]; // TODO: required for now for some reason, otherwise Hyper-V rejects message
 } HyperVNetworkMessage;
@@ -315,6 +413,52 @@ typedef struct {
   UInt32 reserved;
 } HyperVNetworkRNDISMessageDataPacket;
 
+//
+// Per-packet info types.
+//
+typedef enum : UInt32 {
+  kHyperVNetworkRNDISPerPacketInfoTypeTCPIPChecksum         = 0,
+  kHyperVNetworkRNDISPerPacketInfoTypeIPsec                 = 1,
+  kHyperVNetworkRNDISPerPacketInfoTypeTCPLargeSend          = 2,
+  kHyperVNetworkRNDISPerPacketInfoTypeClassificationHandle  = 3,
+  kHyperVNetworkRNDISPerPacketInfoTypeReserved              = 4,
+  kHyperVNetworkRNDISPerPacketInfoTypeScatterGatherList     = 5,
+  kHyperVNetworkRNDISPerPacketInfoTypeIEEE8021Q             = 6,
+  kHyperVNetworkRNDISPerPacketInfoTypeOriginal              = 7,
+  kHyperVNetworkRNDISPerPacketInfoTypePacketCancelId        = 8,
+  kHyperVNetworkRNDISPerPacketInfoTypeOriginalNetBufferList = 9,
+  kHyperVNetworkRNDISPerPacketInfoTypeCachedNetBufferList   = 10,
+  kHyperVNetworkRNDISPerPacketInfoTypeShortPacketPadding    = 11
+} HyperVNetworkRNDISPerPacketInfoType;
+
+#define kHyperVNetworkRNDISPerPacketInfoInternal  BIT(31)
+
+//
+// Per-packet info header.
+// Each per-packet info element in a data packet starts with this header, the offset
+// is from the beginning of this header to the element data.
+//
+typedef struct {
+  UInt32 size;
+  UInt32 type;
+  UInt32 ppiOffset;
+} HyperVNetworkRNDISPerPacketInfo;
+
+//
+// 802.1Q VLAN per-packet info.
+//
+typedef union {
+  struct {
+    UInt32 userPriority      : 3;
+    UInt32 canonicalFormatId : 1;
+    UInt32 vlanId            : 12;
+    UInt32 reserved          : 16;
+  };
+  UInt32 value;
+} HyperVNetworkRNDISPerPacketInfoIEEE8021Q;
+
+#define kHyperVNetworkRNDISPerPacketInfoSize(x) (sizeof (HyperVNetworkRNDISPerPacketInfo) + sizeof (x))
+
 //
 // Initialization message.
 //
@@ -0,0 +1,443 @@
+//
+//  HyperVNetworkVF.cpp
+//  Hyper-V network driver
+//
+//  Copyright © 2021-2022 Goldfish64. All rights reserved.
+//
+
+#include "HyperVNetwork.hpp"
+
+#include <IOKit/IOBSD.h>
+extern "C" {
+#include <sys/sockio.h>
+}
+
+IOReturn HyperVNetwork::initVF() {
+  OSDictionary *matching;
+
+  //
+  // SR-IOV virtual functions are only offered on protocol version 5 and newer.
+  //
+  if (_netVersion < kHyperVNetworkProtocolVersion5) {
+    HVDBGLOG("SR-IOV is not supported on protocol version 0x%X", _netVersion);
+    return kIOReturnUnsupported;
+  }
+
+#if __MAC_OS_X_VERSION_MIN_REQUIRED >= __MAC_10_5
+  _vfLock = IOLockAlloc();
+  if (_vfLock == nullptr) {
+    HVSYSLOG("Failed to allocate VF lock");
+    return kIOReturnNoResources;
+  }
+
+  _vfUpdateThread = thread_call_allocate(OSMemberFunctionCast(thread_call_func_t, this, &HyperVNetwork::updateVFDataPath), this);
+  if (_vfUpdateThread == nullptr) {
+    HVSYSLOG("Failed to allocate VF update thread");
+    freeVF();
+    return kIOReturnNoResources;
+  }
+
+  //
+  // A paired VF is attached below a HyperVPCIBridge instance and has the same MAC address as this adapter.
+  // Watch for Ethernet interfaces coming and going to determine when the VF datapath can be used.
+  //
+  matching = serviceMatching(kIOEthernetInterfaceClass);
+  if (matching == nullptr) {
+    HVSYSLOG("Failed to create VF matching dictionary");
+    freeVF();
+    return kIOReturnNoResources;
+  }
+
+  _vfPublishNotifier = addMatchingNotification(gIOPublishNotification, matching,
+                                               OSMemberFunctionCast(IOServiceMatchingNotificationHandler, this, &HyperVNetwork::handleVFPublished),
+                                               this);
+  _vfTerminateNotifier = addMatchingNotification(gIOTerminatedNotification, matching,
+                                                 OSMemberFunctionCast(IOServiceMatchingNotificationHandler, this, &HyperVNetwork::handleVFTerminated),
+                                                 this);
+  matching->release();
+  if (_vfPublishNotifier == nullptr || _vfTerminateNotifier == nullptr) {
+    HVSYSLOG("Failed to create VF notifiers");
+    freeVF();
+    return kIOReturnNoResources;
+  }
+
+  //
+  // VF association may have already been received while connecting.
+  //
+  scheduleVFUpdate();
+  HVDBGLOG("SR-IOV VF datapath support initialized");
+  return kIOReturnSuccess;
+#else
+  return kIOReturnUnsupported;
+#endif
+}
+
+void HyperVNetwork::freeVF() {
+  //
+  // Prevent any further updates from being queued.
+  //
+  _vfStopping = true;
+  __sync_synchronize();
+
+  if (_vfPublishNotifier != nullptr) {
+    _vfPublishNotifier->remove();
+    _vfPublishNotifier = nullptr;
+  }
+  if (_vfTerminateNotifier != nullptr) {
+    _vfTerminateNotifier->remove();
+    _vfTerminateNotifier = nullptr;
+  }
+  if (_vfUpdateThread != nullptr) {
+    //
+    // thread_call_cancel_wait is not available before 10.8, wait for any update
+    // that could not be cancelled to finish before freeing the call and lock.
+    //
+    if (thread_call_cancel(_vfUpdateThread)) {
+      OSDecrementAtomic(&_vfUpdatesOutstanding);
+    }
+    while (_vfUpdatesOutstanding != 0) {
+      IOSleep(1);
+    }
+    thread_call_free(_vfUpdateThread);
+    _vfUpdateThread = nullptr;
+  }
+
+  if (_vfLock != nullptr) {
+    //
+    // Return to synthetic datapath if VF is still in use.
+    //
+    IOLockLock(_vfLock);
+    if (_vfDataPathActive) {
+      _vfDataPathActive = false;
+      switchDataPath(kHyperVNetworkDataPathSynthetic);
+    }
+    detachVFDataPath();
+    OSSafeReleaseNULL(_vfInterface);
+    IOLockUnlock(_vfLock);
+
+    IOLockFree(_vfLock);
+    _vfLock = nullptr;
+  }
+}
+
+void HyperVNetwork::setVFAssociation(bool allocated, UInt32 serialNumber) {
+  UInt64 association = (((UInt64) (allocated ? 1 : 0)) << 32) | serialNumber;
+  UInt64 oldAssociation;
+
+  do {
+    oldAssociation = _vfAssociation;
+  } while (!__sync_bool_compare_and_swap(&_vfAssociation, oldAssociation, association));
+}
+
+bool HyperVNetwork::getVFAssociation(UInt32 *serialNumber) {
+  //
+  // 64-bit loads are not atomic on 32-bit, read through a compare and swap.
+  //
+  UInt64 association = __sync_val_compare_and_swap(&_vfAssociation, 0, 0);
+
+  if (serialNumber != nullptr) {
+    *serialNumber = (UInt32) association;
+  }
+  return (association >> 32) != 0;
+}
+
+void HyperVNetwork::scheduleVFUpdate(UInt64 deadline) {
+  bool pending;
+
+  //
+  // Each queued update is counted until it runs or is cancelled, so freeVF can wait for it.
+  // A call that was already pending will only run once and is not counted again.
+  //
+  OSIncrementAtomic(&_vfUpdatesOutstanding);
+  if (_vfStopping || _vfUpdateThread == nullptr) {
+    OSDecrementAtomic(&_vfUpdatesOutstanding);
+    return;
+  }
+
+  pending = (deadline != 0) ? thread_call_enter_delayed(_vfUpdateThread, deadline) : thread_call_enter(_vfUpdateThread);
+  if (pending) {
+    OSDecrementAtomic(&_vfUpdatesOutstanding);
+  }
+}
+
+bool HyperVNetwork::isPairedVFInterface(IOService *service) {
+  IOEthernetInterface *ethInterface;
+  IONetworkController *controller;
+  OSData              *macAddress;
+  OSNumber            *serialNumber;
+  IORegistryEntry     *entry;
+  UInt32              vfSerialNumber;
+  bool                vfAllocated;
+
+  ethInterface = OSDynamicCast(IOEthernetInterface, service);
+  if (ethInterface == nullptr || ethInterface == _ethInterface) {
+    return false;
+  }
+  controller = ethInterface->getController();
+  if (controller == nullptr || controller == this) {
+    return false;
+  }
+
+  //
+  // VF must have the same MAC address as this adapter.
+  //
+  macAddress = OSDynamicCast(OSData, controller->getProperty(kIOMACAddress));
+  if (macAddress == nullptr || macAddress->getLength() != kIOEthernetAddressSize
+      || memcmp(macAddress->getBytesNoCopy(), _ethAddress.bytes, kIOEthernetAddressSize) != 0) {
+    return false;
+  }
+
+  //
+  // VF must be behind a Hyper-V PCI bridge, and match the serial number Hyper-V associated with this adapter.
+  //
+  for (entry = controller->getParentEntry(gIOServicePlane); entry != nullptr; entry = entry->getParentEntry(gIOServicePlane)) {
+    if (entry->metaCast("HyperVPCIBridge") != nullptr) {
+      HVDBGLOG("Found paired VF controller %s", controller->getName());
+      return true;
+    }
+
+    serialNumber = OSDynamicCast(OSNumber, entry->getProperty(kHyperVPCIBridgeSerialNumberKey));
+    vfAllocated  = getVFAssociation(&vfSerialNumber);
+    if (serialNumber != nullptr && vfAllocated && serialNumber->unsigned32BitValue() != vfSerialNumber) {
+      HVDBGLOG("VF controller %s has serial 0x%X, expected 0x%X", controller->getName(), serialNumber->unsigned32BitValue(), vfSerialNumber);
+      return false;
+    }
+  }
+
+  return false;
+}
+
+bool HyperVNetwork::handleVFPublished(void *refCon, IOService *newService, IONotifier *notifier) {
+  if (!isPairedVFInterface(newService)) {
+    return true;
+  }
+
+  IOLockLock(_vfLock);
+  if (_vfInterface == nullptr) {
+    HVSYSLOG("Paired VF interface has been published");
+    _vfInterface = OSDynamicCast(IOEthernetInterface, newService);
+    _vfInterface->retain();
+  }
+  IOLockUnlock(_vfLock);
+
+  scheduleVFUpdate();
+  return true;
+}
+
+bool HyperVNetwork::handleVFTerminated(void *refCon, IOService *newService, IONotifier *notifier) {
+  if (newService != _vfInterface) {
+    return true;
+  }
+
+  //
+  // Stop transmitting on the VF immediately, the datapath will be switched back shortly.
+  //
+  HVSYSLOG("Paired VF interface is terminating, falling back to synthetic datapath");
+  _vfDataPathActive = false;
+  scheduleVFUpdate();
+  return true;
+}
+
+void HyperVNetwork::updateVFDataPath() {
+  IOReturn status;
+  bool     useVF;
+  bool     vfAllocated;
+  UInt64   deadline;
+
+  IOLockLock(_vfLock);
+  if (_vfStopping) {
+    IOLockUnlock(_vfLock);
+    OSDecrementAtomic(&_vfUpdatesOutstanding);
+    return;
+  }
+
+  //
+  // Drop any VF interface that has gone away.
+  //
+  if (_vfInterface != nullptr && _vfInterface->isInactive()) {
+    _vfDataPathActive = false;
+    OSSafeReleaseNULL(_vfInterface);
+  }
+
+  vfAllocated = getVFAssociation(nullptr);
+  useVF       = vfAllocated && (_vfInterface != nullptr);
+  HVDBGLOG("VF allocated: %u, VF interface: %u, VF datapath: %u", vfAllocated, _vfInterface != nullptr, _vfDataPathActive);
+
+  if (useVF && !_vfDataPathActive) {
+    //
+    // Start receiving from the VF before asking Hyper-V to steer traffic to it.
+    //
+    status = attachVFDataPath();
+    if (status == kIOReturnNotReady) {
+      //
+      // VF interface has not been attached to the network stack yet, check again later.
+      //
+      clock_interval_to_deadline(1, kSecondScale, &deadline);
+      scheduleVFUpdate(deadline);
+    } else if (status == kIOReturnSuccess) {
+      status = switchDataPath(kHyperVNetworkDataPathVF);
+      if (status == kIOReturnSuccess) {
+        _vfDataPathActive = true;
+        HVSYSLOG("Datapath switched to VF");
+      } else {
+        detachVFDataPath();
+      }
+    }
+
+  } else if (!useVF && _vfIfnet != nullptr) {
+    //
+    // Steer traffic back to synthetic before removing the VF receive hook
+    // so any packets still in flight on the VF are not lost.
+    //
+    _vfDataPathActive = false;
+    switchDataPath(kHyperVNetworkDataPathSynthetic);
+    detachVFDataPath();
+    HVSYSLOG("Datapath switched to synthetic");
+  }
+
+  IOLockUnlock(_vfLock);
+
+  //
+  // Must be last, freeVF may release the lock and thread call once this reaches zero.
+  //
+  OSDecrementAtomic(&_vfUpdatesOutstanding);
+}
+
+IOReturn HyperVNetwork::switchDataPath(HyperVNetworkDataPath dataPath) {
+  IOReturn             status;
+  HyperVNetworkMessage netMsg;
+
+  bzero(&netMsg, sizeof (netMsg));
+  netMsg.messageType                     = kHyperVNetworkMessageTypeV4SwitchDataPath;
+  netMsg.v4.switchDataPath.activeDataPath = dataPath;
+
+  status = _hvDevice->writeInbandPacket(&netMsg, sizeof (netMsg), true, &netMsg, sizeof (netMsg));
+  if (status != kIOReturnSuccess) {
+    HVSYSLOG("Failed to switch datapath to %s with status 0x%X",
+             dataPath == kHyperVNetworkDataPathVF ? "VF" : "synthetic", status);
+  }
+  return status;
+}
+
+IOReturn HyperVNetwork::attachVFDataPath() {
+  OSString         *bsdName;
+  struct iff_filter vfFilter = { };
+  errno_t          error;
+
+  //
+  // Locate BSD interface of the VF, this will not exist until the network stack has attached it.
+  //
+  bsdName = OSDynamicCast(OSString, _vfInterface->getProperty(kIOBSDNameKey));
+  if (bsdName == nullptr) {
+    return kIOReturnNotReady;
+  }
+  if (ifnet_find_by_name(bsdName->getCStringNoCopy(), &_vfIfnet) != 0) {
+    _vfIfnet = nullptr;
+    return kIOReturnNotReady;
+  }
+
+  //
+  // Ensure VF is up, it is not otherwise configured by the OS.
+  //
+  ifnet_set_flags(_vfIfnet, IFF_UP, IFF_UP);
+  ifnet_ioctl(_vfIfnet, 0, SIOCSIFFLAGS, nullptr);
+
+  //
+  // Attach filter to redirect inbound VF packets to this interface.
+  //
+  vfFilter.iff_cookie   = this;
+  vfFilter.iff_name     = kHyperVNetworkVFFilterName;
+  vfFilter.iff_input    = handleVFInput;
+  vfFilter.iff_detached = handleVFFilterDetached;
+
+  _vfFilterAttached = true;
+  error = iflt_attach(_vfIfnet, &vfFilter, &_vfFilter);
+  if (error != 0) {
+    HVSYSLOG("Failed to attach filter to VF interface %s with error %d", bsdName->getCStringNoCopy(), error);
+    _vfFilterAttached = false;
+    ifnet_release(_vfIfnet);
+    _vfIfnet = nullptr;
+    return kIOReturnError;
+  }
+
+  HVDBGLOG("Attached to VF interface %s", bsdName->getCStringNoCopy());
+  return kIOReturnSuccess;
+}
+
+void HyperVNetwork::detachVFDataPath() {
+  if (_vfIfnet == nullptr) {
+    return;
+  }
+
+  //
+  // Filter may have already been detached if the VF interface was detached.
+  // Wait for the detach to complete as the filter references this object.
+  //
+  if (_vfFilterAttached) {
+    iflt_detach(_vfFilter);
+    for (UInt32 i = 0; _vfFilterAttached && i < kHyperVNetworkVFDetachTimeoutMS; i++) {
+      IOSleep(1);
+    }
+  }
+  _vfFilter = nullptr;
+
+  ifnet_release(_vfIfnet);
+  _vfIfnet = nullptr;
+}
+
+bool HyperVNetwork::outputVFPacket(mbuf_t m, UInt32 checksumDemand) {
+  bool sent = false;
+
+  IOLockLock(_vfLock);
+  if (_vfDataPathActive && _vfIfnet != nullptr) {
+    //
+    // Checksum offload is advertised on this interface, compute any checksums
+    // in software that the VF cannot offload before handing the packet to it.
+    // IFNET_CSUM_IP/TCP/UDP have the same values as the IONetworkController checksum bits.
+    //
+    checksumDemand &= kChecksumIP | kChecksumTCP | kChecksumUDP;
+    if ((checksumDemand & ~((UInt32) ifnet_offload(_vfIfnet))) != 0 && !finalizePacketChecksum(m, checksumDemand)) {
+      HVDATADBGLOG("Failed to compute checksums 0x%X for VF packet", checksumDemand);
+    }
+
+    //
+    // Packet is consumed by the VF in all cases once handed off.
+    //
+    if (ifnet_output_raw(_vfIfnet, 0, m) != 0) {
+      HVDATADBGLOG("Failed to transmit packet on VF");
+    }
+    sent = true;
+  }
+  IOLockUnlock(_vfLock);
+
+  return sent;
+}
+
+errno_t HyperVNetwork::handleVFInput(void *cookie, ifnet_t interface, protocol_family_t protocol, mbuf_t *data, char **framePtr) {
+  HyperVNetwork *network = (HyperVNetwork *)cookie;
+  mbuf_t        m        = *data;
+  size_t        headerLength;
+
+  if (!network->_vfDataPathActive || !network->_isNetworkEnabled || framePtr == nullptr || *framePtr == nullptr) {
+    return 0;
+  }
+
+  //
+  // Frame header precedes the packet data in the first mbuf, restore it
+  // so the entire frame can be passed up through this interface.
+  //
+  if ((UInt8 *)*framePtr < (UInt8 *)mbuf_datastart(m) || (UInt8 *)*framePtr > (UInt8 *)mbuf_data(m)) {
+    return 0;
+  }
+  headerLength = (UInt8 *)mbuf_data(m) - (UInt8 *)*framePtr;
+  mbuf_setdata(m, *framePtr, mbuf_len(m) + headerLength);
+  mbuf_pkthdr_adjustlen(m, (int)headerLength);
+
+  network->_ethInterface->inputPacket(m);
+  return EJUSTRETURN;
+}
+
+void HyperVNetwork::handleVFFilterDetached(void *cookie, ifnet_t interface) {
+  HyperVNetwork *network = (HyperVNetwork *)cookie;
+  network->_vfFilterAttached = false;
+}
@@ -85,6 +85,7 @@ bool HyperVPCIBridge::start(IOService *provider) {
       HVSYSLOG("Failed to initialize PCI bus");
       break;
     }
+    _hvDevice->recordBootPhase(kHyperVVMBusDeviceBootPhaseProtocolNegotiated);
 
     //
     // Call super::start() to initiate macOS PCI configuration on bridge.
@@ -93,6 +94,7 @@ bool HyperVPCIBridge::start(IOService *provider) {
       HVSYSLOG("super::start() returned false");
       break;
     }
+    _hvDevice->recordBootPhase(kHyperVVMBusDeviceBootPhaseRegistered);
 
     result = true;
   } while (false);
@@ -271,5 +273,17 @@ bool HyperVPCIBridge::initializeNub(IOPCIDevice *nub, OSDictionary *from) {
   if (status != kIOReturnSuccess) {
     HVSYSLOG("Failed to merge device properties");
   }
+
+  //
+  // Publish serial number assigned by Hyper-V to the function in the nub's slot.
+  // SR-IOV VFs are paired with a synthetic network adapter using this value.
+  //
+  for (UInt32 i = 0; i < _pciFunctionsCount; i++) {
+    if (_pciFunctions[i].slot.bits.device == nub->getDeviceNumber()
+        && _pciFunctions[i].slot.bits.function == nub->getFunctionNumber()) {
+      nub->setProperty(kHyperVPCIBridgeSerialNumberKey, _pciFunctions[i].serialNumber, 32);
+      break;
+    }
+  }
   return super::initializeNub(nub, from);
 }
@@ -16,6 +16,9 @@
 #define kHyperVPCIConfigPageOffset      PAGE_SIZE
 
 #define kHyperVPCIBarCount              6
+
+// Serial number of PCI function, used to pair SR-IOV VFs with synthetic network adapters.
+#define kHyperVPCIBridgeSerialNumberKey "HVSerialNumber"
 #define kHyperVPCIBarSpaceIO            0x1
 #define kHyperVPCIBarMemoryType64Bit    0x4
 #define kHyperVPCIBarMemoryMask         ~(0x0FUL)
@@ -11,8 +11,24 @@
 #include <Headers/kern_patcher.hpp>
 #include <Headers/kern_util.hpp>
 
+extern "C" {
+#include <kern/cpu_number.h>
+#include <i386/machine_routines.h>
+}
+
 HyperVPlatformProvider *HyperVPlatformProvider::_instance;
 
+//
+// Local APIC interprocessor interrupt vector, offset from lapic_interrupt_base.
+//
+#define kLAPICDefaultInterruptBase          0xD0
+#define kLAPICInterprocessorInterrupt       0xE
+
+//
+// mp_sync_t mode where the sender waits for each CPU in turn.
+//
+#define kXNUMPSyncModeSync                  0
+
 void HyperVPlatformProvider::init() {
   HVCheckDebugArgs();
   HVDBGLOG("Initializing provider");
@@ -27,4 +43,256 @@ void HyperVPlatformProvider::init() {
 
 void HyperVPlatformProvider::onLiluPatcherLoad(KernelPatcher &patcher) {
   HVDBGLOG("Patcher loaded");
+  hookIPI(patcher);
+  hookTLBFlush(patcher);
+}
+
+void HyperVPlatformProvider::hookIPI(KernelPatcher &patcher) {
+  mach_vm_address_t lapicInterruptBase;
+
+  if (checkKernelArgument("-hvctrlnopvipi")) {
+    return;
+  }
+
+  //
+  // Get the interprocessor interrupt vector used by XNU.
+  //
+  lapicInterruptBase = patcher.solveSymbol(KernelPatcher::KernelID, "_lapic_interrupt_base");
+  if (lapicInterruptBase != 0) {
+    _ipiVector = *reinterpret_cast<int *>(lapicInterruptBase) + kLAPICInterprocessorInterrupt;
+  } else {
+    patcher.clearError();
+    _ipiVector = kLAPICDefaultInterruptBase + kLAPICInterprocessorInterrupt;
+  }
+
+  //
+  // Hook IPI sending, IPIs are sent through the local APIC until the controller installs a paravirtual action.
+  //
+  KernelPatcher::RouteRequest request("_i386_cpu_IPI", wrapI386CpuIPI, _origI386CpuIPI);
+  if (!patcher.routeMultiple(KernelPatcher::KernelID, &request, 1)) {
+    HVSYSLOG("Failed to hook IPI function with error %d", patcher.getError());
+    patcher.clearError();
+    _origI386CpuIPI = 0;
+    return;
+  }
+  HVDBGLOG("Hooked IPI function, IPI vector is 0x%X", _ipiVector);
+
+  //
+  // Hook signaling of all other CPUs, used by rendezvous and broadcasts.
+  // This is optional, without it each CPU is signaled with its own hypercall.
+  //
+  KernelPatcher::RouteRequest signalRequest("_i386_signal_cpus", wrapI386SignalCpus, _origI386SignalCpus);
+  if (!patcher.routeMultiple(KernelPatcher::KernelID, &signalRequest, 1)) {
+    HVDBGLOG("Failed to hook CPU signal function with error %d, IPIs will not be batched", patcher.getError());
+    patcher.clearError();
+    _origI386SignalCpus = 0;
+    return;
+  }
+  HVDBGLOG("Hooked CPU signal function");
+}
+
+void HyperVPlatformProvider::hookTLBFlush(KernelPatcher &patcher) {
+  if (checkKernelArgument("-hvctrlnopvtlb")) {
+    return;
+  }
+
+  //
+  // Hook TLB shootdowns, shootdowns use IPIs until the controller installs a paravirtual action.
+  // The address range is only passed on 10.7 and newer, older versions take only the pmap.
+  //
+  KernelPatcher::RouteRequest request("_pmap_flush_tlbs", wrapPmapFlushTlbs, _origPmapFlushTlbs);
+  KernelPatcher::RouteRequest requestLegacy("_pmap_flush_tlbs", wrapPmapFlushTlbsLegacy, _origPmapFlushTlbs);
+  if (!patcher.routeMultiple(KernelPatcher::KernelID, getKernelVersion() >= KernelVersion::Lion ? &request : &requestLegacy, 1)) {
+    HVSYSLOG("Failed to hook TLB flush function with error %d", patcher.getError());
+    patcher.clearError();
+    _origPmapFlushTlbs = 0;
+    return;
+  }
+  HVDBGLOG("Hooked TLB flush function");
+
+  resolvePmapAddressSpaces(patcher);
+}
+
+void HyperVPlatformProvider::resolvePmapAddressSpaces(KernelPatcher &patcher) {
+  mach_vm_address_t kernelPmap;
+#if defined(__x86_64__)
+  mach_vm_address_t noSharedCR3;
+#endif
+
+  kernelPmap = patcher.solveSymbol(KernelPatcher::KernelID, "_kernel_pmap");
+  if (kernelPmap == 0) {
+    patcher.clearError();
+    HVDBGLOG("Kernel pmap was not found, TLB flushes will cover all address spaces");
+    return;
+  }
+  _kernelPmap = *reinterpret_cast<void **>(kernelPmap);
+
+#if defined(__x86_64__)
+  //
+  // A single address space can only be flushed when the kernel runs on the current task's page tables.
+  // 10.13 and newer use separate user page tables, and no_shared_cr3 gives the kernel its own.
+  //
+  if (getKernelVersion() < KernelVersion::SnowLeopard || getKernelVersion() >= KernelVersion::HighSierra) {
+    HVDBGLOG("Kernel does not share page tables with tasks, TLB flushes will cover all address spaces");
+    return;
+  }
+
+  noSharedCR3 = patcher.solveSymbol(KernelPatcher::KernelID, "_no_shared_cr3");
+  _currentMap = reinterpret_cast<void *(*)()>(patcher.solveSymbol(KernelPatcher::KernelID, "_current_map"));
+  _getMapPmap = reinterpret_cast<void *(*)(void *)>(patcher.solveSymbol(KernelPatcher::KernelID, "_get_map_pmap"));
+  if (noSharedCR3 == 0 || _currentMap == nullptr || _getMapPmap == nullptr) {
+    patcher.clearError();
+    HVDBGLOG("Task pmap functions were not found, TLB flushes will cover all address spaces");
+    return;
+  }
+  if (*reinterpret_cast<int *>(noSharedCR3) != 0) {
+    HVDBGLOG("Kernel does not share page tables with tasks, TLB flushes will cover all address spaces");
+    return;
+  }
+
+  _isPmapAddressSpaceKnown = true;
+  HVDBGLOG("TLB flushes of the current task will cover only its address space");
+#endif
+}
+
+UInt64 HyperVPlatformProvider::getPmapAddressSpace(void *pmap) {
+  uintptr_t cr3;
+
+  //
+  // Kernel mappings are present in every address space, and other tasks' page table roots are not known.
+  // The current task's page tables are loaded while in the kernel, so its root is the current CR3.
+  //
+  if (!_instance->_isPmapAddressSpaceKnown || pmap == nullptr || pmap == _instance->_kernelPmap
+      || pmap != _instance->_getMapPmap(_instance->_currentMap())) {
+    return 0;
+  }
+
+  asm volatile ("mov %%cr3, %0" : "=r" (cr3));
+  return getTLBFlushAddressSpace(cr3);
+}
+
+void HyperVPlatformProvider::setPVTLBFlushAction(HyperVPVTLBFlushAction action, void *target) {
+  _pvTLBFlushAction = nullptr;
+  __sync_synchronize();
+  _pvTLBFlushTarget = target;
+  __sync_synchronize();
+  _pvTLBFlushAction = action;
+}
+
+#if DEBUG
+bool HyperVPlatformProvider::flushKernelTLBsNative(UInt64 startAddress, UInt64 endAddress) {
+  if (_origPmapFlushTlbs == 0 || _kernelPmap == nullptr) {
+    return false;
+  }
+
+  //
+  // Flush the kernel pmap through the original IPI-based shootdown, caller must have preemption disabled.
+  //
+  if (getKernelVersion() >= KernelVersion::Lion) {
+    FunctionCast(wrapPmapFlushTlbs, _origPmapFlushTlbs)(_kernelPmap, startAddress, endAddress, 0, nullptr);
+  } else {
+    FunctionCast(wrapPmapFlushTlbsLegacy, _origPmapFlushTlbs)(_kernelPmap);
+  }
+  return true;
+}
+#endif
+
+void HyperVPlatformProvider::setPVIPIAction(HyperVPVIPIAction action, void *target) {
+  //
+  // Target must be visible before the action on all CPUs.
+  //
+  _pvIPIAction = nullptr;
+  __sync_synchronize();
+  _pvIPITarget = target;
+  __sync_synchronize();
+  _pvIPIAction = action;
+}
+
+void HyperVPlatformProvider::wrapI386CpuIPI(int cpu) {
+  HyperVPVIPIAction action = _instance->_pvIPIAction;
+  UInt32            cpuCurrent;
+
+  if (action != nullptr && cpu >= 0 && cpu < kHyperVVPSetBankSize) {
+    //
+    // Defer the IPI while this CPU is signaling a set of CPUs, they are all sent with a single hypercall afterwards.
+    // Interrupts are disabled while batching, so the current CPU cannot change.
+    //
+    cpuCurrent = cpu_number();
+    if (cpuCurrent < kHyperVVPSetBankSize && _instance->_ipiBatching[cpuCurrent]) {
+      _instance->_ipiBatchMask[cpuCurrent] |= 1ULL << cpu;
+      return;
+    }
+
+    if (action(_instance->_pvIPITarget, 1ULL << cpu, _instance->_ipiVector)) {
+      return;
+    }
+  }
+  FunctionCast(wrapI386CpuIPI, _instance->_origI386CpuIPI)(cpu);
+}
+
+void HyperVPlatformProvider::wrapI386SignalCpus(int event, int mode) {
+  HyperVPVIPIAction action = _instance->_pvIPIAction;
+  boolean_t         intsEnabled;
+  UInt32            cpu;
+  UInt64            cpuMask;
+
+  //
+  // Synchronous signals wait for each CPU to respond before signaling the next, and cannot be batched.
+  //
+  if (action == nullptr || mode == kXNUMPSyncModeSync) {
+    FunctionCast(wrapI386SignalCpus, _instance->_origI386SignalCpus)(event, mode);
+    return;
+  }
+
+  //
+  // Interrupts are disabled so that no interrupt handler on this CPU has its IPIs deferred while waiting on them.
+  //
+  intsEnabled = ml_set_interrupts_enabled(false);
+  cpu         = cpu_number();
+  if (cpu >= kHyperVVPSetBankSize) {
+    ml_set_interrupts_enabled(intsEnabled);
+    FunctionCast(wrapI386SignalCpus, _instance->_origI386SignalCpus)(event, mode);
+    return;
+  }
+
+  //
+  // Collect the IPIs sent while signaling, and send them all at once.
+  //
+  _instance->_ipiBatchMask[cpu] = 0;
+  _instance->_ipiBatching[cpu]  = true;
+  FunctionCast(wrapI386SignalCpus, _instance->_origI386SignalCpus)(event, mode);
+  _instance->_ipiBatching[cpu]  = false;
+  cpuMask = _instance->_ipiBatchMask[cpu];
+
+  if (cpuMask != 0 && !action(_instance->_pvIPITarget, cpuMask, _instance->_ipiVector)) {
+    while (cpuMask != 0) {
+      FunctionCast(wrapI386CpuIPI, _instance->_origI386CpuIPI)(__builtin_ctzll(cpuMask));
+      cpuMask &= cpuMask - 1;
+    }
+  }
+  ml_set_interrupts_enabled(intsEnabled);
+}
+
+void HyperVPlatformProvider::wrapPmapFlushTlbs(void *pmap, UInt64 startv, UInt64 endv, int options, void *pfc) {
+  HyperVPVTLBFlushAction action = _instance->_pvTLBFlushAction;
+
+  //
+  // Options and flush context are only present on 10.9 and newer, and are only passed through.
+  // 10.7 and 10.8 ignore them.
+  // A paravirtual flush is immediate and does not track CPUs, so delayed flushes are completed early.
+  //
+  if (action == nullptr || !action(_instance->_pvTLBFlushTarget, getPmapAddressSpace(pmap), startv, endv)) {
+    FunctionCast(wrapPmapFlushTlbs, _instance->_origPmapFlushTlbs)(pmap, startv, endv, options, pfc);
+  }
+}
+
+void HyperVPlatformProvider::wrapPmapFlushTlbsLegacy(void *pmap) {
+  HyperVPVTLBFlushAction action = _instance->_pvTLBFlushAction;
+
+  //
+  // No address range is available, an empty range flushes the entire address space.
+  //
+  if (action == nullptr || !action(_instance->_pvTLBFlushTarget, getPmapAddressSpace(pmap), 0, 0)) {
+    FunctionCast(wrapPmapFlushTlbsLegacy, _instance->_origPmapFlushTlbs)(pmap);
+  }
 }
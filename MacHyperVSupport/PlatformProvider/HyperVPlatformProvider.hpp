@@ -13,6 +13,19 @@
 
 #include "HyperV.hpp"
 
+//
+// Paravirtual IPI action for a mask of the first 64 CPUs,
+// returns false if the IPIs should be sent through the local APIC instead.
+//
+typedef bool (*HyperVPVIPIAction)(void *target, UInt64 cpuMask, UInt32 vector);
+
+//
+// Paravirtual TLB flush action, returns false if the TLB shootdown should be performed with IPIs instead.
+// Address space is the page table root of the pmap being flushed, or 0 for all address spaces.
+// An empty range flushes the entire address space.
+//
+typedef bool (*HyperVPVTLBFlushAction)(void *target, UInt64 addressSpace, UInt64 startAddress, UInt64 endAddress);
+
 class HyperVPlatformProvider {
   HVDeclareLogFunctionsNonIOKit("prov", "HyperVPlatformProvider");
 
@@ -22,11 +35,53 @@ private:
   //
   static HyperVPlatformProvider *_instance;
 
+  //
+  // IPI hooking.
+  //
+  mach_vm_address_t           _origI386CpuIPI     = 0;
+  mach_vm_address_t           _origI386SignalCpus = 0;
+  UInt32                      _ipiVector          = 0;
+  HyperVPVIPIAction volatile  _pvIPIAction        = nullptr;
+  void * volatile             _pvIPITarget        = nullptr;
+
+  //
+  // IPIs deferred by each CPU while it signals a set of CPUs, only the first 64 CPUs are batched.
+  //
+  bool                        _ipiBatching[kHyperVVPSetBankSize]  = { };
+  UInt64                      _ipiBatchMask[kHyperVVPSetBankSize] = { };
+
+  //
+  // TLB flush hooking.
+  //
+  mach_vm_address_t               _origPmapFlushTlbs  = 0;
+  HyperVPVTLBFlushAction volatile _pvTLBFlushAction   = nullptr;
+  void * volatile                 _pvTLBFlushTarget   = nullptr;
+
+  //
+  // Pmap address space lookup, single address spaces are only flushed for the current task's pmap.
+  //
+  void                            *_kernelPmap              = nullptr;
+  void                            *(*_currentMap)()         = nullptr;
+  void                            *(*_getMapPmap)(void *)   = nullptr;
+  bool                            _isPmapAddressSpaceKnown  = false;
+
   //
   // Initialization function.
   //
   void init();
   void onLiluPatcherLoad(KernelPatcher &patcher);
+  void hookIPI(KernelPatcher &patcher);
+  void hookTLBFlush(KernelPatcher &patcher);
+  void resolvePmapAddressSpaces(KernelPatcher &patcher);
+  static UInt64 getPmapAddressSpace(void *pmap);
+
+  //
+  // Wrapped functions.
+  //
+  static void wrapI386CpuIPI(int cpu);
+  static void wrapI386SignalCpus(int event, int mode);
+  static void wrapPmapFlushTlbs(void *pmap, UInt64 startv, UInt64 endv, int options, void *pfc);
+  static void wrapPmapFlushTlbsLegacy(void *pmap);
 
 public:
   //
@@ -42,6 +97,21 @@ public:
 
     return _instance;
   }
+
+  //
+  // Paravirtual IPIs.
+  //
+  inline bool isIPIHookInstalled() { return _origI386CpuIPI != 0; }
+  void setPVIPIAction(HyperVPVIPIAction action, void *target);
+
+  //
+  // Paravirtual TLB flushes.
+  //
+  inline bool isTLBFlushHookInstalled() { return _origPmapFlushTlbs != 0; }
+  void setPVTLBFlushAction(HyperVPVTLBFlushAction action, void *target);
+#if DEBUG
+  bool flushKernelTLBsNative(UInt64 startAddress, UInt64 endAddress);
+#endif
 };
 
 #endif
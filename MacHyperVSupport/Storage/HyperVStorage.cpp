@@ -35,7 +35,7 @@ bool HyperVStorage::InitializeController() {
   //
   // Assume we are on an older host and take off the Windows 8 extensions by default.
   //
-  _packetSizeDelta = sizeof (HyperVStorageSCSIRequestWin8Extension);
+  _protocol.packetSizeDelta = sizeof (HyperVStorageSCSIRequestWin8Extension);
 
   do {
     //
@@ -60,36 +60,42 @@ bool HyperVStorage::InitializeController() {
     //
     // Open VMBus channel and connect to storage.
     //
-    status = _hvDevice->openVMBusChannel(kHyperVStorageRingBufferSize, kHyperVStorageRingBufferSize);
+    status = openStorageChannel();
     if (status != kIOReturnSuccess) {
-      HVSYSLOG("Failed to open VMBus channel with status 0x%X", status);
+      HVSYSLOG("Failed to open storage channel with status 0x%X", status);
       break;
     }
+    _hvDevice->recordBootPhase(kHyperVVMBusDeviceBootPhaseProtocolNegotiated);
 
-    status = connectStorage();
-    if (status != kIOReturnSuccess) {
-      HVSYSLOG("Failed to connect to storage device with status 0x%X", status);
+    if (!initBouncePool()) {
+      HVSYSLOG("Failed to initialize bounce buffer pool");
       break;
     }
 
-    //
-    // Initialize segments used for DMA.
-    //
-    _segs64 = (IODMACommand::Segment64*) IOMalloc(sizeof (IODMACommand::Segment64) * _maxPageSegments);
-    if (_segs64 == nullptr) {
-      HVSYSLOG("Failed to initialize segments");
+    if (!initIOStatistics()) {
+      HVSYSLOG("Failed to initialize I/O statistics");
+      break;
+    }
+
+    if (!initCompletionQueue()) {
+      HVSYSLOG("Failed to initialize completion queue");
       break;
     }
-    
+
     //
     // Populate HBA properties and create disk enumeration thread.
     //
     setHBAInfo();
-    _scanSCSIDiskThread = thread_call_allocate(OSMemberFunctionCast(thread_call_func_t, this, &HyperVStorage::scanSCSIDisks), this);
+    _scanSCSIDiskThread = thread_call_allocate(OSMemberFunctionCast(thread_call_func_t, this, &HyperVStorage::scanSCSIDisksThread), this);
     if (_scanSCSIDiskThread == nullptr) {
       HVSYSLOG("Failed to create disk enumeration thread");
       break;
     }
+    _completeRejectedTasksThread = thread_call_allocate(OSMemberFunctionCast(thread_call_func_t, this, &HyperVStorage::completeRejectedTasksThread), this);
+    if (_completeRejectedTasksThread == nullptr) {
+      HVSYSLOG("Failed to create rejected request completion thread");
+      break;
+    }
 
     result = true;
     HVDBGLOG("Initialized Hyper-V Synthetic Storage");
@@ -104,23 +110,22 @@ bool HyperVStorage::InitializeController() {
 void HyperVStorage::TerminateController() {
   HVDBGLOG("Stopping Hyper-V Synthetic Storage");
 
-  if (_scanSCSIDiskThread != nullptr) {
-    thread_call_free(_scanSCSIDiskThread);
-  }
+  cancelThreadCalls();
 
   if (_hvDevice != nullptr) {
     _hvDevice->closeVMBusChannel();
     _hvDevice->uninstallPacketActions();
+    freeBouncePool();
     OSSafeReleaseNULL(_hvDevice);
   }
 
-  if (_segs64 != nullptr) {
-    IOFree(_segs64, sizeof (IODMACommand::Segment64) * _maxPageSegments);
-  }
+  freeCompletionQueue();
+  freeIOStatistics();
 }
 
 bool HyperVStorage::StartController() {
   HVDBGLOG("Controller is now started");
+  _hvDevice->recordBootPhase(kHyperVVMBusDeviceBootPhaseRegistered);
   startDiskEnumeration();
   return true;
 }
@@ -170,13 +175,16 @@ SCSIDeviceIdentifier HyperVStorage::ReportHighestSupportedDeviceID() {
 }
 
 UInt32 HyperVStorage::ReportMaximumTaskCount() {
-  HVDBGLOG("start");
-  return 1;
+  //
+  // Ring buffers are sized to hold this many requests at once.
+  //
+  return _queueDepth;
 }
 
 UInt32 HyperVStorage::ReportHBASpecificTaskDataSize() {
   HVDBGLOG("start");
-  return sizeof (VMBusPacketMultiPageBuffer) + (sizeof (UInt64) * _maxPageSegments); //32 * 4096;
+  return sizeof (HyperVStorageTaskData) + sizeof (VMBusPacketMultiPageBuffer) + (sizeof (UInt64) * _maxPagePfns)
+    + (sizeof (IODMACommand::Segment64) * _maxPageSegments);
 }
 
 UInt32 HyperVStorage::ReportHBASpecificDeviceDataSize() {
@@ -239,9 +247,10 @@ SCSIServiceResponse HyperVStorage::TargetResetRequest(SCSITargetIdentifier theT)
 
 SCSIServiceResponse HyperVStorage::ProcessParallelTask(SCSIParallelTaskIdentifier parallelRequest) {
   IOReturn            status;
-  HyperVStoragePacket packet = { };
+  HyperVStoragePacket packet;
 
   UInt8                      dataDirection;
+  UInt8                      dataIn;
   VMBusPacketMultiPageBuffer *pagePacket;
   UInt32                     pagePacketLength;
 
@@ -256,41 +265,27 @@ SCSIServiceResponse HyperVStorage::ProcessParallelTask(SCSIParallelTaskIdentifie
   }
 
   //
-  // Create SCSI command execution packet.
-  // Each LUN is represented in macOS as a separate target, use that target ID for the LUN here.
-  //
-  packet.operation = kHyperVStoragePacketOperationExecuteSRB;
-  packet.flags     = kHyperVStoragePacketFlagRequestCompletion;
-
-  packet.scsiRequest.targetID                = _targetId;
-  packet.scsiRequest.lun                     = GetTargetIdentifier(parallelRequest);
-  packet.scsiRequest.win8Extension.srbFlags |= 0x00000008;
-  packet.scsiRequest.length                  = sizeof (packet.scsiRequest) - _packetSizeDelta;
-  packet.scsiRequest.senseInfoLength         = _senseBufferSize;
-
-  //
-  // Determine data direction flags.
+  // Determine data direction and create SCSI command execution packet.
   //
   dataDirection = GetDataTransferDirection(parallelRequest);
   switch (dataDirection) {
     case kSCSIDataTransfer_NoDataTransfer:
-      packet.scsiRequest.dataIn = kHyperVStorageSCSIRequestTypeUnknown;
+      dataIn = kHyperVStorageSCSIRequestTypeUnknown;
       break;
 
     case kSCSIDataTransfer_FromInitiatorToTarget:
-      packet.scsiRequest.dataIn = kHyperVStorageSCSIRequestTypeWrite;
-      packet.scsiRequest.win8Extension.srbFlags |= 0x00000080;
+      dataIn = kHyperVStorageSCSIRequestTypeWrite;
       break;
 
     case kSCSIDataTransfer_FromTargetToInitiator:
-      packet.scsiRequest.dataIn = kHyperVStorageSCSIRequestTypeRead;
-      packet.scsiRequest.win8Extension.srbFlags |= 0x00000040;
+      dataIn = kHyperVStorageSCSIRequestTypeRead;
       break;
 
     default:
       HVSYSLOG("Bad data direction 0x%X", dataDirection);
       return kSCSIServiceResponse_FUNCTION_REJECTED;
   }
+  prepareSCSIRequest(&packet, GetTargetIdentifier(parallelRequest), dataIn, 0);
   HVDATADBGLOG("Sending command to LUN %u (direction %X) with request %p", packet.scsiRequest.lun,
                dataDirection, parallelRequest);
 
@@ -305,6 +300,17 @@ SCSIServiceResponse HyperVStorage::ProcessParallelTask(SCSIParallelTaskIdentifie
                packet.scsiRequest.cdb[8], packet.scsiRequest.cdb[9], packet.scsiRequest.cdb[10], packet.scsiRequest.cdb[11],
                packet.scsiRequest.cdb[12], packet.scsiRequest.cdb[13], packet.scsiRequest.cdb[14], packet.scsiRequest.cdb[15]);
 
+  //
+  // UNMAP previously rejected by the host for this LUN is failed immediately.
+  //
+  if (packet.scsiRequest.cdb[0] == kHyperVStorageSCSICmdUnmap && _lunInfo[packet.scsiRequest.lun].unmapRejected) {
+    HVDATADBGLOG("Rejecting UNMAP for disk %u", packet.scsiRequest.lun);
+    setIllegalRequestSense(parallelRequest);
+    rejectParallelTask(parallelRequest);
+    return kSCSIServiceResponse_Request_In_Process;
+  }
+  recordIOStart(parallelRequest, packet.scsiRequest.cdb[0]);
+
   //
   // Prepare for data transfer if one is requested.
   // Otherwise send basic inband packet.
@@ -317,15 +323,16 @@ SCSIServiceResponse HyperVStorage::ProcessParallelTask(SCSIParallelTaskIdentifie
     }
 
     packet.scsiRequest.dataTransferLength = (UInt32) GetRequestedDataTransferCount(parallelRequest);
-    status = _hvDevice->writeGPADirectMultiPagePacket(&packet, sizeof (packet) - _packetSizeDelta, true,
+    status = _hvDevice->writeGPADirectMultiPagePacket(&packet, getStoragePacketLength(&_protocol), true,
                                                       pagePacket, pagePacketLength, nullptr, 0,
                                                       (UInt64)parallelRequest);
     if (status != kIOReturnSuccess) {
       HVSYSLOG("Failed to send data SCSI packet with status 0x%X", status);
+      cancelDataTransfer(parallelRequest);
       return kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
     }
   } else {
-    status = _hvDevice->writeInbandPacketWithTransactionId(&packet, sizeof (packet) - _packetSizeDelta, (UInt64)parallelRequest, true);
+    status = _hvDevice->writeInbandPacketWithTransactionId(&packet, getStoragePacketLength(&_protocol), (UInt64)parallelRequest, true);
     if (status != kIOReturnSuccess) {
       HVSYSLOG("Failed to send non-data SCSI packet with status 0x%X", status);
       return kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
@@ -19,7 +19,7 @@
 #pragma clang diagnostic pop
 
 #include "HyperVVMBusDevice.hpp"
-#include "HyperVStorageRegs.hpp"
+#include "HyperVStorageProtocol.hpp"
 
 class HyperVStorage : public IOSCSIParallelInterfaceController {
   OSDeclareDefaultStructors(HyperVStorage);
@@ -32,46 +32,137 @@ private:
   //
   // Storage protocol.
   //
-  UInt32 _protocolVersion = 0;
-  UInt32 _senseBufferSize = 0;
-  UInt32 _packetSizeDelta = 0;
-  bool   _isIDE           = false;
-  UInt32 _maxLuns         = kHyperVStorageMaxLunsSCSI;
-  UInt8  _targetId        = 0;
+  HyperVStorageProtocol _protocol = { };
+  bool   _isIDE                   = false;
+  UInt32 _maxLuns                 = kHyperVStorageMaxLunsSCSI;
+  UInt8  _targetId                = 0;
   
   bool   _subChannelsSupported = false;
   UInt16 _maxSubChannels       = 0;
   UInt32 _maxTransferBytes     = 0;
   UInt32 _maxPageSegments      = 0;
+  UInt32 _maxPagePfns          = 0;
 
   //
-  // Segments for DMA transfers.
+  // Channel sizing.
   //
-  IODMACommand::Segment64 *_segs64 = nullptr;
+  UInt32 _queueDepth       = kHyperVStorageDefaultQueueDepth;
+  UInt32 _txRingBufferSize = 0;
+  UInt32 _rxRingBufferSize = 0;
+
+  //
+  // Bounce buffer pool with PFNs computed at allocation time.
+  //
+  HyperVDMABuffer _bouncePool       = { };
+  UInt64          *_bouncePfns      = nullptr;
+  UInt32          _bouncePfnsSize   = 0;
+  volatile UInt32 _bounceSlotBitmap = 0;
+
+  //
+  // Completions queued during a ring drain.
+  //
+  HyperVStorageCompletion *_completionQueue        = nullptr;
+  UInt32                  _completionQueueSize     = 0;
+  UInt32                  _completionQueueCapacity = 0;
+  UInt32                  _completionQueueCount    = 0;
+  UInt64                  _numCompletionBatches    = 0;
+  UInt64                  _numCompletionsRetired   = 0;
+  UInt32                  _maxCompletionBatch      = 0;
 
   //
   // Thread for disk enumeration.
   //
   thread_call_t _scanSCSIDiskThread = nullptr;
 
+  //
+  // Requests failed before reaching the host, completed outside of the submission path.
+  //
+  SCSIParallelTaskIdentifier volatile _rejectedTasks               = nullptr;
+  thread_call_t                       _completeRejectedTasksThread = nullptr;
+
+  //
+  // Thread calls queued or running, waited on before the thread calls are freed.
+  //
+  volatile SInt32 _threadCallsOutstanding = 0;
+  volatile bool   _isStopping             = false;
+
+  //
+  // Per-LUN information snooped from responses.
+  //
+  HyperVStorageLunInfo _lunInfo[kHyperVStorageMaxLunsSCSI] = { };
+
+  //
+  // Per-LUN I/O statistics.
+  //
+  HyperVStorageLunStatistics *_lunStats     = nullptr;
+  UInt32                     _lunStatsSize  = 0;
+
   //
   // Packets and I/O.
   //
   bool wakePacketHandler(VMBusPacketHeader *pktHeader, UInt32 pktHeaderLength, UInt8 *pktData, UInt32 pktDataLength);
   void handlePacket(VMBusPacketHeader *pktHeader, UInt32 pktHeaderLength, UInt8 *pktData, UInt32 pktDataLength);
   void handleIOCompletion(UInt64 transactionId, HyperVStoragePacket *packet);
+  bool initCompletionQueue();
+  void freeCompletionQueue();
+  void queueIOCompletion(UInt64 transactionId, HyperVStoragePacket *packet, UInt32 packetLength);
+  void retireIOCompletions();
   IOReturn sendStorageCommand(HyperVStoragePacket *packet, bool checkCompletion);
   IOReturn prepareDataTransfer(SCSIParallelTaskIdentifier parallelRequest, VMBusPacketMultiPageBuffer **pagePacket, UInt32 *pagePacketLength);
   void completeDataTransfer(SCSIParallelTaskIdentifier parallelRequest, HyperVStoragePacket *packet);
+  void cancelDataTransfer(SCSIParallelTaskIdentifier parallelRequest);
+  bool initBouncePool();
+  void freeBouncePool();
+  UInt8 allocateBounceSlot();
+  void releaseBounceSlot(UInt8 slot);
+  IOReturn prepareBounceTransfer(SCSIParallelTaskIdentifier parallelRequest, VMBusPacketMultiPageBuffer *pagePacket, UInt32 *pagePacketLength);
+  void completeBounceTransfer(SCSIParallelTaskIdentifier parallelRequest, UInt32 realizedLength);
+  void inspectCompletion(SCSIParallelTaskIdentifier parallelRequest, HyperVStoragePacket *packet, SCSITaskStatus *taskStatus);
+  void snoopInquiryData(SCSIParallelTaskIdentifier parallelRequest, SCSICommandDescriptorBlock *cdb, UInt32 dataLength);
+  void snoopModeSenseData(SCSIParallelTaskIdentifier parallelRequest, SCSICommandDescriptorBlock *cdb, UInt32 dataLength);
+  void setIllegalRequestSense(SCSIParallelTaskIdentifier parallelRequest);
+  void rejectParallelTask(SCSIParallelTaskIdentifier parallelRequest);
+  void completeRejectedTasks();
+  void completeRejectedTasksThread();
+  void enterThreadCall(thread_call_t threadCall);
+  void cancelThreadCalls();
+  void publishLunInfo(UInt32 lun);
+  inline HyperVStorageTaskData *getTaskData(SCSIParallelTaskIdentifier parallelRequest) {
+    return (HyperVStorageTaskData*) GetHBADataPointer(parallelRequest);
+  }
+  inline VMBusPacketMultiPageBuffer *getTaskPagePacket(SCSIParallelTaskIdentifier parallelRequest) {
+    HyperVStorageTaskData *taskData = getTaskData(parallelRequest);
+    return (taskData != nullptr) ? (VMBusPacketMultiPageBuffer*) (taskData + 1) : nullptr;
+  }
+  inline IODMACommand::Segment64 *getTaskSegments(SCSIParallelTaskIdentifier parallelRequest) {
+    VMBusPacketMultiPageBuffer *pagePacket = getTaskPagePacket(parallelRequest);
+    return (pagePacket != nullptr) ? (IODMACommand::Segment64*) &pagePacket->range.pfns[_maxPagePfns] : nullptr;
+  }
+
+  //
+  // I/O statistics.
+  //
+  bool initIOStatistics();
+  void freeIOStatistics();
+  void recordIOStart(SCSIParallelTaskIdentifier parallelRequest, UInt8 opcode);
+  void recordIOCompletion(SCSIParallelTaskIdentifier parallelRequest, UInt64 bytes, bool success);
+  OSDictionary *copyIOStatistics(HyperVStorageIOStatistics *ioStats) const;
 
   //
   // Disk enumeration and misc.
   //
   void setHBAInfo();
+  UInt32 getControllerProperty(const char *key, UInt32 defaultValue);
+  UInt32 computeRingBufferSize(UInt32 packetSize);
+  IOReturn openStorageChannel();
   IOReturn connectStorage();
-  bool checkSCSIDiskPresent(UInt8 diskId);
+  void prepareSCSIRequest(HyperVStoragePacket *storPkt, UInt8 diskId, UInt8 dataIn, UInt32 dataTransferLength);
+  void prepareTestUnitReady(HyperVStoragePacket *storPkt, UInt8 diskId);
+  IOReturn reportSCSILuns(bool *lunsPresent);
+  IOReturn probeSCSIDisks(bool *lunsPresent);
   void startDiskEnumeration();
   void scanSCSIDisks();
+  void scanSCSIDisksThread();
 
 protected:
   //
@@ -108,6 +199,11 @@ public:
   SCSIServiceResponse TargetResetRequest(SCSITargetIdentifier theT) APPLE_KEXT_OVERRIDE;
   SCSIServiceResponse ProcessParallelTask(SCSIParallelTaskIdentifier parallelRequest) APPLE_KEXT_OVERRIDE;
   void ReportHBAConstraints(OSDictionary *constraints) APPLE_KEXT_OVERRIDE;
+
+  //
+  // IORegistryEntry overrides.
+  //
+  bool serializeProperties(OSSerialize *serialize) const APPLE_KEXT_OVERRIDE;
 };
 
 #endif
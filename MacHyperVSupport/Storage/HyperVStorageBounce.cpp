@@ -0,0 +1,153 @@
+//
+//  HyperVStorageBounce.cpp
+//  Hyper-V storage driver
+//
+//  Copyright © 2022 Goldfish64. All rights reserved.
+//
+
+#include "HyperVStorage.hpp"
+
+#define kHyperVStorageBouncePagesPerSlot  (kHyperVStorageBounceSlotSize >> PAGE_SHIFT)
+
+bool HyperVStorage::initBouncePool() {
+  UInt32 pageCount;
+
+  //
+  // Each bounce slot must fit within a single request's page list.
+  //
+  if (_maxPageSegments < kHyperVStorageBouncePagesPerSlot) {
+    HVDBGLOG("Bounce buffer pool disabled, max page segments %u too small", _maxPageSegments);
+    return true;
+  }
+
+  //
+  // Pool is only accessed by page number, and does not need to be physically contiguous.
+  //
+  if (!_hvDevice->getHvController()->allocateDmaBuffer(&_bouncePool, kHyperVStorageBounceSlotCount * kHyperVStorageBounceSlotSize, false)) {
+    return false;
+  }
+
+  //
+  // Compute PFNs for all pages once, so transfers can copy them directly into the request.
+  //
+  pageCount       = kHyperVStorageBounceSlotCount * kHyperVStorageBouncePagesPerSlot;
+  _bouncePfnsSize = pageCount * sizeof (UInt64);
+  _bouncePfns     = (UInt64*) IOMalloc(_bouncePfnsSize);
+  if (_bouncePfns == nullptr) {
+    freeBouncePool();
+    return false;
+  }
+
+  for (UInt32 i = 0; i < pageCount; i++) {
+    _bouncePfns[i] = _bouncePool.bufDesc->getPhysicalSegment(i << PAGE_SHIFT, nullptr) >> PAGE_SHIFT;
+  }
+  _bounceSlotBitmap = 0;
+
+  HVDBGLOG("Bounce buffer pool of %u slots of %u bytes initialized", kHyperVStorageBounceSlotCount, kHyperVStorageBounceSlotSize);
+  return true;
+}
+
+void HyperVStorage::freeBouncePool() {
+  if (_bouncePfns != nullptr) {
+    IOFree(_bouncePfns, _bouncePfnsSize);
+    _bouncePfns     = nullptr;
+    _bouncePfnsSize = 0;
+  }
+  if (_bouncePool.bufDesc != nullptr) {
+    _hvDevice->getHvController()->freeDmaBuffer(&_bouncePool);
+  }
+}
+
+UInt8 HyperVStorage::allocateBounceSlot() {
+  UInt32 bitmap;
+  UInt32 slot;
+
+  if (_bouncePfns == nullptr) {
+    return kHyperVStorageBounceSlotNone;
+  }
+
+  //
+  // Claim the lowest free slot.
+  //
+  do {
+    bitmap = _bounceSlotBitmap;
+    if (bitmap == UINT32_MAX) {
+      return kHyperVStorageBounceSlotNone;
+    }
+    slot = __builtin_ctz(~bitmap);
+  } while (!__sync_bool_compare_and_swap(&_bounceSlotBitmap, bitmap, bitmap | (1U << slot)));
+
+  return slot;
+}
+
+void HyperVStorage::releaseBounceSlot(UInt8 slot) {
+  __sync_fetch_and_and(&_bounceSlotBitmap, ~(1U << slot));
+}
+
+IOReturn HyperVStorage::prepareBounceTransfer(SCSIParallelTaskIdentifier parallelRequest, VMBusPacketMultiPageBuffer *pagePacket, UInt32 *pagePacketLength) {
+  HyperVStorageTaskData *taskData  = getTaskData(parallelRequest);
+  UInt64                dataLength = GetRequestedDataTransferCount(parallelRequest);
+  IOMemoryDescriptor    *dataBuffer;
+  UInt8                 *slotBuffer;
+  UInt32                pageCount;
+  UInt8                 slot;
+
+  if (dataLength > kHyperVStorageBounceSlotSize) {
+    return kIOReturnNoSpace;
+  }
+
+  slot = allocateBounceSlot();
+  if (slot == kHyperVStorageBounceSlotNone) {
+    return kIOReturnNoResources;
+  }
+  slotBuffer = &_bouncePool.buffer[slot * kHyperVStorageBounceSlotSize];
+
+  //
+  // Copy outgoing data into the slot.
+  //
+  if (GetDataTransferDirection(parallelRequest) == kSCSIDataTransfer_FromInitiatorToTarget) {
+    dataBuffer = GetDataBuffer(parallelRequest);
+    if (dataBuffer == nullptr
+        || dataBuffer->readBytes(GetDataBufferOffset(parallelRequest), slotBuffer, (IOByteCount) dataLength) != dataLength) {
+      HVSYSLOG("Failed to copy %u bytes into bounce slot %u", (UInt32) dataLength, slot);
+      releaseBounceSlot(slot);
+      return kIOReturnIOError;
+    }
+  }
+
+  //
+  // Populate PFNs from the precomputed list for the slot.
+  //
+  pageCount = (UInt32) ((dataLength + PAGE_MASK) >> PAGE_SHIFT);
+  pagePacket->range.length = (UInt32) dataLength;
+  pagePacket->range.offset = 0;
+  memcpy(pagePacket->range.pfns, &_bouncePfns[slot * kHyperVStorageBouncePagesPerSlot], pageCount * sizeof (UInt64));
+
+  *pagePacketLength    = sizeof (*pagePacket) + (sizeof (UInt64) * pageCount);
+  taskData->bounceSlot = slot;
+  HVDATADBGLOG("Request %p using bounce slot %u for %u bytes", parallelRequest, slot, (UInt32) dataLength);
+  return kIOReturnSuccess;
+}
+
+void HyperVStorage::completeBounceTransfer(SCSIParallelTaskIdentifier parallelRequest, UInt32 realizedLength) {
+  HyperVStorageTaskData *taskData   = getTaskData(parallelRequest);
+  UInt8                 slot        = taskData->bounceSlot;
+  IOMemoryDescriptor    *dataBuffer;
+
+  //
+  // Copy incoming data out of the slot.
+  //
+  if (GetDataTransferDirection(parallelRequest) == kSCSIDataTransfer_FromTargetToInitiator && realizedLength != 0) {
+    if (realizedLength > kHyperVStorageBounceSlotSize) {
+      realizedLength = kHyperVStorageBounceSlotSize;
+    }
+
+    dataBuffer = GetDataBuffer(parallelRequest);
+    if (dataBuffer != nullptr) {
+      dataBuffer->writeBytes(GetDataBufferOffset(parallelRequest), &_bouncePool.buffer[slot * kHyperVStorageBounceSlotSize], realizedLength);
+    }
+  }
+
+  releaseBounceSlot(slot);
+  taskData->bounceSlot = kHyperVStorageBounceSlotNone;
+}
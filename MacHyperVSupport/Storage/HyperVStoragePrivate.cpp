@@ -7,37 +7,6 @@
 
 #include "HyperVStorage.hpp"
 
-//
-// Hyper-V storage protocol list.
-//
-static const HyperVStorageProtocol storageProtocols[] = {
-  {
-    kHyperVStorageVersionWin10,
-    kHyperVStoragePostWin7SenseBufferSize,
-    0
-  },
-  {
-    kHyperVStorageVersionWin8_1,
-    kHyperVStoragePostWin7SenseBufferSize,
-    0
-  },
-  {
-    kHyperVStorageVersionWin8,
-    kHyperVStoragePostWin7SenseBufferSize,
-    0
-  },
-  {
-    kHyperVStorageVersionWin7,
-    kHyperVStoragePreWin8SenseBufferSize,
-    sizeof (HyperVStorageSCSIRequestWin8Extension)
-  },
-  {
-    kHyperVStorageVersionWin2008,
-    kHyperVStoragePreWin8SenseBufferSize,
-    sizeof (HyperVStorageSCSIRequestWin8Extension)
-  },
-};
-
 bool HyperVStorage::wakePacketHandler(VMBusPacketHeader *pktHeader, UInt32 pktHeaderLength, UInt8 *pktData, UInt32 pktDataLength) {
   //
   // Only CompleteIO requests should wake sleeping threads.
@@ -51,7 +20,7 @@ void HyperVStorage::handlePacket(VMBusPacketHeader *pktHeader, UInt32 pktHeaderL
 
   switch (storPkt->operation) {
     case kHyperVStoragePacketOperationCompleteIO:
-      handleIOCompletion(pktHeader->transactionId, storPkt);
+      queueIOCompletion(pktHeader->transactionId, storPkt, pktDataLength);
       break;
 
     case kHyperVStoragePacketOperationEnumerateBus:
@@ -65,8 +34,89 @@ void HyperVStorage::handlePacket(VMBusPacketHeader *pktHeader, UInt32 pktHeaderL
   }
 }
 
+bool HyperVStorage::initCompletionQueue() {
+  //
+  // Queue holds a full set of outstanding requests, as every request may complete within a single drain.
+  //
+  _completionQueueCapacity = _queueDepth;
+  _completionQueueSize     = sizeof (*_completionQueue) * _completionQueueCapacity;
+  _completionQueue         = (HyperVStorageCompletion*) IOMalloc(_completionQueueSize);
+  if (_completionQueue == nullptr) {
+    _completionQueueCapacity = 0;
+    _completionQueueSize     = 0;
+    return false;
+  }
+  _completionQueueCount = 0;
+
+  _hvDevice->setPacketsProcessedAction(OSMemberFunctionCast(HyperVVMBusDevice::PacketsProcessedAction, this, &HyperVStorage::retireIOCompletions));
+  return true;
+}
+
+void HyperVStorage::freeCompletionQueue() {
+  if (_completionQueue != nullptr) {
+    IOFree(_completionQueue, _completionQueueSize);
+    _completionQueue         = nullptr;
+    _completionQueueSize     = 0;
+    _completionQueueCapacity = 0;
+    _completionQueueCount    = 0;
+  }
+}
+
+void HyperVStorage::queueIOCompletion(UInt64 transactionId, HyperVStoragePacket *packet, UInt32 packetLength) {
+  HyperVStorageCompletion *completion;
+
+  //
+  // Complete immediately if the queue is not yet set up.
+  //
+  if (_completionQueue == nullptr) {
+    handleIOCompletion(transactionId, packet);
+    return;
+  }
+
+  //
+  // Retire what has been queued so far if the queue is full, this should not normally occur.
+  //
+  if (_completionQueueCount == _completionQueueCapacity) {
+    retireIOCompletions();
+  }
+
+  //
+  // Copy out the completion so the ring space and receive buffer can be reused immediately.
+  // Older hosts send packets without the Windows 8 extension, the remainder is left zeroed.
+  //
+  if (packetLength > sizeof (completion->packet)) {
+    packetLength = sizeof (completion->packet);
+  }
+  completion = &_completionQueue[_completionQueueCount++];
+  completion->transactionId = transactionId;
+  memcpy(&completion->packet, packet, packetLength);
+  if (packetLength < sizeof (completion->packet)) {
+    bzero(((UInt8*) &completion->packet) + packetLength, sizeof (completion->packet) - packetLength);
+  }
+}
+
+void HyperVStorage::retireIOCompletions() {
+  UInt32 count = _completionQueueCount;
+  if (count == 0) {
+    return;
+  }
+
+  HVDATADBGLOG("Retiring %u completions", count);
+  for (UInt32 i = 0; i < count; i++) {
+    handleIOCompletion(_completionQueue[i].transactionId, &_completionQueue[i].packet);
+  }
+  _completionQueueCount = 0;
+
+  _numCompletionBatches++;
+  _numCompletionsRetired += count;
+  if (count > _maxCompletionBatch) {
+    _maxCompletionBatch = count;
+  }
+}
+
 void HyperVStorage::handleIOCompletion(UInt64 transactionId, HyperVStoragePacket *packet) {
   SCSIParallelTaskIdentifier parallelRequest = (SCSIParallelTaskIdentifier) transactionId;
+  SCSITaskStatus             taskStatus      = (SCSITaskStatus) packet->scsiRequest.scsiStatus;
 
   HVDATADBGLOG("Completing request %p", parallelRequest);
   if (packet->scsiRequest.srbStatus != 1) {
@@ -76,7 +126,7 @@ void HyperVStorage::handleIOCompletion(UInt64 transactionId, HyperVStoragePacket
   //
   // Handle auto sense.
   //
-  if (packet->scsiRequest.scsiStatus == kSCSITaskStatus_CHECK_CONDITION) {
+  if (hasSCSIAutoSense(packet)) {
     HVDBGLOG("Doing a sense");
     SetAutoSenseData(parallelRequest, (SCSI_Sense_Data*)packet->scsiRequest.senseData, kSenseDefaultSize);
   }
@@ -87,11 +137,335 @@ void HyperVStorage::handleIOCompletion(UInt64 transactionId, HyperVStoragePacket
   if (packet->scsiRequest.dataIn != kHyperVStorageSCSIRequestTypeUnknown) {
     completeDataTransfer(parallelRequest, packet);
   }
+  inspectCompletion(parallelRequest, packet, &taskStatus);
 
   //
   // Complete the task.
   //
-  CompleteParallelTask(parallelRequest, (SCSITaskStatus)packet->scsiRequest.scsiStatus, kSCSIServiceResponse_TASK_COMPLETE);
+  recordIOCompletion(parallelRequest,
+                     (packet->scsiRequest.dataIn != kHyperVStorageSCSIRequestTypeUnknown) ? getSCSIRealizedLength(packet) : 0,
+                     taskStatus == kSCSITaskStatus_GOOD);
+  CompleteParallelTask(parallelRequest, taskStatus, kSCSIServiceResponse_TASK_COMPLETE);
+}
+
+void HyperVStorage::inspectCompletion(SCSIParallelTaskIdentifier parallelRequest, HyperVStoragePacket *packet, SCSITaskStatus *taskStatus) {
+  SCSICommandDescriptorBlock cdb;
+  UInt32                     lun       = (UInt32) GetTargetIdentifier(parallelRequest);
+  UInt8                      srbStatus = packet->scsiRequest.srbStatus & ~kHyperVSRBStatusAutosenseValid;
+
+  if (lun >= _maxLuns) {
+    return;
+  }
+  GetCommandDescriptorBlock(parallelRequest, &cdb);
+
+  switch (cdb[0]) {
+    case kSCSICmd_INQUIRY:
+      if (*taskStatus == kSCSITaskStatus_GOOD && packet->status == kHyperVStoragePacketSuccess) {
+        snoopInquiryData(parallelRequest, &cdb, packet->scsiRequest.dataTransferLength);
+      }
+      break;
+
+    case kSCSICmd_MODE_SENSE_6:
+    case kSCSICmd_MODE_SENSE_10:
+      //
+      // Hosts fail MODE SENSE for some unsupported pages without returning sense data.
+      // Report this as an illegal request so the page is treated as absent instead of the disk failing.
+      //
+      if (srbStatus == kHyperVSRBStatusError && !(packet->scsiRequest.srbStatus & kHyperVSRBStatusAutosenseValid)) {
+        HVDBGLOG("MODE SENSE page 0x%X failed by host for disk %u", cdb[2] & kHyperVStorageModePageCodeMask, lun);
+        setIllegalRequestSense(parallelRequest);
+        *taskStatus = kSCSITaskStatus_CHECK_CONDITION;
+      } else if (*taskStatus == kSCSITaskStatus_GOOD && packet->status == kHyperVStoragePacketSuccess) {
+        snoopModeSenseData(parallelRequest, &cdb, packet->scsiRequest.dataTransferLength);
+      }
+      break;
+
+    case kHyperVStorageSCSICmdUnmap:
+      //
+      // Hosts without discard support on the backing disk fail UNMAP without sense data.
+      // Report this as an unsupported command, and reject future UNMAPs for this LUN without sending them.
+      //
+      if ((srbStatus == kHyperVSRBStatusError || srbStatus == kHyperVSRBStatusInvalidRequest)
+          && !(packet->scsiRequest.srbStatus & kHyperVSRBStatusAutosenseValid)) {
+        HVDBGLOG("UNMAP rejected by host for disk %u with SRB status 0x%X", lun, packet->scsiRequest.srbStatus);
+        _lunInfo[lun].unmapRejected = true;
+        publishLunInfo(lun);
+
+        setIllegalRequestSense(parallelRequest);
+        *taskStatus = kSCSITaskStatus_CHECK_CONDITION;
+      }
+      break;
+
+    default:
+      break;
+  }
+}
+
+void HyperVStorage::snoopInquiryData(SCSIParallelTaskIdentifier parallelRequest, SCSICommandDescriptorBlock *cdb, UInt32 dataLength) {
+  IOMemoryDescriptor   *dataBuffer = GetDataBuffer(parallelRequest);
+  UInt64               dataOffset  = GetDataBufferOffset(parallelRequest);
+  UInt32               lun         = (UInt32) GetTargetIdentifier(parallelRequest);
+  HyperVStorageLunInfo *lunInfo    = &_lunInfo[lun];
+  UInt8                data[kHyperVStorageVPDPageBlockLimitsLength];
+  UInt8                version;
+
+  if (dataBuffer == nullptr) {
+    return;
+  }
+
+  if (!((*cdb)[1] & kHyperVStorageInquiryEVPD)) {
+    //
+    // Windows 8 and 8.1 hosts report SPC-2 for their virtual disks, but support SPC-3 features such as
+    // the Block Limits and Logical Block Provisioning VPD pages. Claim SPC-3 conformance so these are queried.
+    //
+    if ((_protocol.protocolVersion != kHyperVStorageVersionWin8 && _protocol.protocolVersion != kHyperVStorageVersionWin8_1)
+        || dataLength < kHyperVStorageInquiryVendorOffset + strlen(kHyperVStorageInquiryVendorMsft)
+        || dataBuffer->readBytes(dataOffset, data, kHyperVStorageInquiryVendorOffset + strlen(kHyperVStorageInquiryVendorMsft))
+           != kHyperVStorageInquiryVendorOffset + strlen(kHyperVStorageInquiryVendorMsft)) {
+      return;
+    }
+
+    if (strncmp((const char*) &data[kHyperVStorageInquiryVendorOffset], kHyperVStorageInquiryVendorMsft,
+                strlen(kHyperVStorageInquiryVendorMsft)) == 0
+        && data[kHyperVStorageInquiryVersionOffset] < kHyperVStorageInquiryVersionSPC3) {
+      HVDBGLOG("Raising disk %u INQUIRY version from %u to SPC-3", lun, data[kHyperVStorageInquiryVersionOffset]);
+      version = kHyperVStorageInquiryVersionSPC3;
+      dataBuffer->writeBytes(dataOffset + kHyperVStorageInquiryVersionOffset, &version, sizeof (version));
+    }
+    return;
+  }
+
+  switch ((*cdb)[2]) {
+    case kHyperVStorageVPDPageBlockLimits:
+      if (dataLength < kHyperVStorageVPDPageBlockLimitsLength
+          || dataBuffer->readBytes(dataOffset, data, kHyperVStorageVPDPageBlockLimitsLength) != kHyperVStorageVPDPageBlockLimitsLength) {
+        return;
+      }
+
+      lunInfo->maxUnmapBlockCount        = OSReadBigInt32(data, 20);
+      lunInfo->maxUnmapDescriptorCount   = OSReadBigInt32(data, 24);
+      lunInfo->unmapGranularity          = OSReadBigInt32(data, 28);
+      lunInfo->unmapGranularityAlignment = OSReadBigInt32(data, 32);
+      HVDBGLOG("Disk %u max unmap blocks: %u, max unmap descriptors: %u, granularity: %u, alignment: 0x%X", lun,
+               lunInfo->maxUnmapBlockCount, lunInfo->maxUnmapDescriptorCount,
+               lunInfo->unmapGranularity, lunInfo->unmapGranularityAlignment);
+      publishLunInfo(lun);
+      break;
+
+    case kHyperVStorageVPDPageProvisioning:
+      if (dataLength < kHyperVStorageVPDPageProvisioningLength
+          || dataBuffer->readBytes(dataOffset, data, kHyperVStorageVPDPageProvisioningLength) != kHyperVStorageVPDPageProvisioningLength) {
+        return;
+      }
+
+      lunInfo->unmapSupported  = (data[5] & kHyperVStorageVPDProvisioningLBPU) != 0;
+      lunInfo->thinProvisioned = (data[6] & kHyperVStorageVPDProvisioningTypeMask) == kHyperVStorageVPDProvisioningTypeThin;
+      HVDBGLOG("Disk %u unmap supported: %u, thin provisioned: %u", lun, lunInfo->unmapSupported, lunInfo->thinProvisioned);
+      publishLunInfo(lun);
+      break;
+
+    default:
+      break;
+  }
+}
+
+void HyperVStorage::snoopModeSenseData(SCSIParallelTaskIdentifier parallelRequest, SCSICommandDescriptorBlock *cdb, UInt32 dataLength) {
+  IOMemoryDescriptor   *dataBuffer = GetDataBuffer(parallelRequest);
+  UInt64               dataOffset  = GetDataBufferOffset(parallelRequest);
+  UInt32               lun         = (UInt32) GetTargetIdentifier(parallelRequest);
+  HyperVStorageLunInfo *lunInfo    = &_lunInfo[lun];
+  UInt8                data[kHyperVStorageModeSenseBufferLength];
+  UInt32               headerLength;
+  UInt32               offset;
+  UInt8                deviceSpecific;
+  bool                 fuaSupported;
+  bool                 writeCacheEnabled;
+
+  if (dataBuffer == nullptr) {
+    return;
+  }
+  if (dataLength > sizeof (data)) {
+    dataLength = sizeof (data);
+  }
+
+  headerLength = ((*cdb)[0] == kSCSICmd_MODE_SENSE_6) ? kHyperVStorageModeSense6HeaderLength : kHyperVStorageModeSense10HeaderLength;
+  if (dataLength < headerLength || dataBuffer->readBytes(dataOffset, data, dataLength) != dataLength) {
+    return;
+  }
+
+  //
+  // The DPOFUA bit in the device-specific parameter indicates the disk honors FUA on writes.
+  // Block descriptors are skipped to get to the returned mode pages.
+  //
+  if ((*cdb)[0] == kSCSICmd_MODE_SENSE_6) {
+    deviceSpecific = data[2];
+    offset         = headerLength + data[3];
+  } else {
+    deviceSpecific = data[3];
+    offset         = headerLength + OSReadBigInt16(data, 6);
+  }
+  fuaSupported      = (deviceSpecific & kHyperVStorageModeDeviceSpecificDPOFUA) != 0;
+  writeCacheEnabled = lunInfo->writeCacheEnabled;
+
+  //
+  // Locate the caching page, either requested directly or as part of all pages.
+  //
+  while (offset + kHyperVStorageModePageCachingLength <= dataLength) {
+    if ((data[offset] & kHyperVStorageModePageCodeMask) == kHyperVStorageModePageCaching) {
+      writeCacheEnabled = (data[offset + 2] & kHyperVStorageModePageCachingWCE) != 0;
+      break;
+    }
+    offset += data[offset + 1] + 2;
+  }
+
+  if (fuaSupported != lunInfo->fuaSupported || writeCacheEnabled != lunInfo->writeCacheEnabled) {
+    lunInfo->fuaSupported      = fuaSupported;
+    lunInfo->writeCacheEnabled = writeCacheEnabled;
+    HVDBGLOG("Disk %u write cache enabled: %u, FUA supported: %u", lun, lunInfo->writeCacheEnabled, lunInfo->fuaSupported);
+    publishLunInfo(lun);
+  }
+}
+
+void HyperVStorage::setIllegalRequestSense(SCSIParallelTaskIdentifier parallelRequest) {
+  SCSI_Sense_Data senseData = { };
+
+  //
+  // ILLEGAL REQUEST, INVALID COMMAND OPERATION CODE.
+  //
+  senseData.VALID_RESPONSE_CODE             = kSENSE_RESPONSE_CODE_Current_Errors;
+  senseData.SENSE_KEY                       = kSENSE_KEY_ILLEGAL_REQUEST;
+  senseData.ADDITIONAL_SENSE_LENGTH         = sizeof (senseData) - offsetof (SCSI_Sense_Data, COMMAND_SPECIFIC_INFORMATION_1);
+  senseData.ADDITIONAL_SENSE_CODE           = 0x20;
+  senseData.ADDITIONAL_SENSE_CODE_QUALIFIER = 0x00;
+  SetAutoSenseData(parallelRequest, &senseData, sizeof (senseData));
+}
+
+void HyperVStorage::rejectParallelTask(SCSIParallelTaskIdentifier parallelRequest) {
+  HyperVStorageTaskData      *taskData = getTaskData(parallelRequest);
+  SCSIParallelTaskIdentifier head;
+
+  //
+  // Completing from within ProcessParallelTask would re-enter the SCSI family from its own submission path.
+  // Queue the request and complete it with CHECK CONDITION from a thread call instead.
+  //
+  do {
+    head = _rejectedTasks;
+    taskData->nextRejected = head;
+  } while (!__sync_bool_compare_and_swap(&_rejectedTasks, head, parallelRequest));
+  enterThreadCall(_completeRejectedTasksThread);
+}
+
+void HyperVStorage::completeRejectedTasks() {
+  SCSIParallelTaskIdentifier parallelRequest;
+  SCSIParallelTaskIdentifier nextRequest;
+
+  parallelRequest = __sync_lock_test_and_set(&_rejectedTasks, nullptr);
+  while (parallelRequest != nullptr) {
+    nextRequest = (SCSIParallelTaskIdentifier) getTaskData(parallelRequest)->nextRejected;
+    HVDATADBGLOG("Completing rejected request %p", parallelRequest);
+    CompleteParallelTask(parallelRequest, kSCSITaskStatus_CHECK_CONDITION, kSCSIServiceResponse_TASK_COMPLETE);
+    parallelRequest = nextRequest;
+  }
+}
+
+void HyperVStorage::completeRejectedTasksThread() {
+  if (!_isStopping) {
+    completeRejectedTasks();
+  }
+
+  //
+  // Must be last, cancelThreadCalls may free the thread call once this reaches zero.
+  //
+  OSDecrementAtomic(&_threadCallsOutstanding);
+}
+
+void HyperVStorage::enterThreadCall(thread_call_t threadCall) {
+  //
+  // Each queued call is counted until it runs or is cancelled, so cancelThreadCalls can wait for it.
+  // A call that was already pending will only run once and is not counted again.
+  //
+  OSIncrementAtomic(&_threadCallsOutstanding);
+  if (_isStopping || threadCall == nullptr || thread_call_enter(threadCall)) {
+    OSDecrementAtomic(&_threadCallsOutstanding);
+  }
+}
+
+void HyperVStorage::cancelThreadCalls() {
+  thread_call_t threadCalls[] = { _scanSCSIDiskThread, _completeRejectedTasksThread };
+
+  //
+  // Prevent any further calls from being queued.
+  //
+  _isStopping = true;
+  __sync_synchronize();
+
+  //
+  // thread_call_cancel_wait is not available before 10.8, wait for any call
+  // that could not be cancelled to finish before freeing.
+  //
+  for (UInt32 i = 0; i < arrsize(threadCalls); i++) {
+    if (threadCalls[i] != nullptr && thread_call_cancel(threadCalls[i])) {
+      OSDecrementAtomic(&_threadCallsOutstanding);
+    }
+  }
+  while (_threadCallsOutstanding != 0) {
+    IOSleep(1);
+  }
+
+  for (UInt32 i = 0; i < arrsize(threadCalls); i++) {
+    if (threadCalls[i] != nullptr) {
+      thread_call_free(threadCalls[i]);
+    }
+  }
+  _scanSCSIDiskThread          = nullptr;
+  _completeRejectedTasksThread = nullptr;
+
+  //
+  // Complete any rejected requests whose completion call was cancelled.
+  //
+  completeRejectedTasks();
+}
+
+void HyperVStorage::publishLunInfo(UInt32 lun) {
+  IOSCSIParallelInterfaceDevice *target;
+  HyperVStorageLunInfo          *lunInfo = &_lunInfo[lun];
+  OSDictionary                  *dict;
+  OSNumber                      *number;
+
+  target = GetTargetForID(lun);
+  if (target == nullptr) {
+    return;
+  }
+
+  const struct {
+    const char *key;
+    UInt32     value;
+  } values[] = {
+    { "MaximumUnmapBlockCount",      lunInfo->maxUnmapBlockCount },
+    { "MaximumUnmapDescriptorCount", lunInfo->maxUnmapDescriptorCount },
+    { "UnmapGranularity",            lunInfo->unmapGranularity },
+    { "UnmapGranularityAlignment",   lunInfo->unmapGranularityAlignment }
+  };
+
+  dict = OSDictionary::withCapacity(arrsize(values) + 5);
+  if (dict == nullptr) {
+    return;
+  }
+  for (UInt32 i = 0; i < arrsize(values); i++) {
+    number = OSNumber::withNumber(values[i].value, 32);
+    if (number != nullptr) {
+      dict->setObject(values[i].key, number);
+      number->release();
+    }
+  }
+  dict->setObject("UnmapSupported", lunInfo->unmapSupported ? kOSBooleanTrue : kOSBooleanFalse);
+  dict->setObject("UnmapRejected", lunInfo->unmapRejected ? kOSBooleanTrue : kOSBooleanFalse);
+  dict->setObject("ThinProvisioned", lunInfo->thinProvisioned ? kOSBooleanTrue : kOSBooleanFalse);
+  dict->setObject("WriteCacheEnabled", lunInfo->writeCacheEnabled ? kOSBooleanTrue : kOSBooleanFalse);
+  dict->setObject("ForceUnitAccessSupported", lunInfo->fuaSupported ? kOSBooleanTrue : kOSBooleanFalse);
+
+  target->setProperty(kHyperVStorageLunInfoKey, dict);
+  dict->release();
 }
 
 IOReturn HyperVStorage::sendStorageCommand(HyperVStoragePacket *packet, bool checkCompletion) {
@@ -99,7 +473,7 @@ IOReturn HyperVStorage::sendStorageCommand(HyperVStoragePacket *packet, bool che
   // Send packet and get response.
   //
   packet->flags = kHyperVStoragePacketFlagRequestCompletion;
-  IOReturn status = _hvDevice->writeInbandPacket(packet, sizeof (HyperVStoragePacket) - _packetSizeDelta, true, packet, sizeof (HyperVStoragePacket));
+  IOReturn status = _hvDevice->writeInbandPacket(packet, getStoragePacketLength(&_protocol), true, packet, sizeof (HyperVStoragePacket));
   if (status != kIOReturnSuccess) {
     return status;
   }
@@ -116,22 +490,36 @@ IOReturn HyperVStorage::sendStorageCommand(HyperVStoragePacket *packet, bool che
 }
 
 IOReturn HyperVStorage::prepareDataTransfer(SCSIParallelTaskIdentifier parallelRequest, VMBusPacketMultiPageBuffer **pagePacket, UInt32 *pagePacketLength) {
-  IOReturn     status;
-  UInt64       offsetSeg   = 0;
-  UInt32       numSegs     = _maxPageSegments;
-  UInt64       dataLength  = GetRequestedDataTransferCount(parallelRequest);
-  IODMACommand *dmaCommand = GetDMACommand(parallelRequest);
+  IOReturn                status;
+  UInt64                  offsetSeg   = 0;
+  UInt32                  numSegs     = _maxPageSegments;
+  UInt64                  dataLength  = GetRequestedDataTransferCount(parallelRequest);
+  IODMACommand            *dmaCommand = GetDMACommand(parallelRequest);
+  HyperVStorageTaskData   *taskData   = getTaskData(parallelRequest);
+  IODMACommand::Segment64 *segs64;
+  UInt32                  numPfns;
 
   if (dataLength > UINT32_MAX) {
     HVSYSLOG("Attempted to request more than 4GB of data");
     return kIOReturnUnsupported;
   }
 
-  *pagePacket = (VMBusPacketMultiPageBuffer*) GetHBADataPointer(parallelRequest);
-  if (*pagePacket == nullptr) {
+  *pagePacket = getTaskPagePacket(parallelRequest);
+  segs64      = getTaskSegments(parallelRequest);
+  if (taskData == nullptr || *pagePacket == nullptr || segs64 == nullptr) {
     HVSYSLOG("Failed to get task HBA data");
     return kIOReturnIOError;
   }
+  taskData->bounceSlot = kHyperVStorageBounceSlotNone;
+
+  //
+  // Small transfers are copied through the bounce pool if a slot is free.
+  // This is cheaper than a full IODMACommand prepare and complete cycle.
+  //
+  if (dataLength <= kHyperVStorageBounceCopyThreshold
+      && prepareBounceTransfer(parallelRequest, *pagePacket, pagePacketLength) == kIOReturnSuccess) {
+    return kIOReturnSuccess;
+  }
 
   //
   // Get list of segments for DMA transfer.
@@ -142,7 +530,7 @@ IOReturn HyperVStorage::prepareDataTransfer(SCSIParallelTaskIdentifier parallelR
     return status;
   }
 
-  status = dmaCommand->gen64IOVMSegments(&offsetSeg, _segs64, &numSegs);
+  status = dmaCommand->gen64IOVMSegments(&offsetSeg, segs64, &numSegs);
   if (status != kIOReturnSuccess) {
     HVSYSLOG("Failed to generate segments for buffer of %u bytes", dataLength, status);
     dmaCommand->complete();
@@ -153,28 +541,46 @@ IOReturn HyperVStorage::prepareDataTransfer(SCSIParallelTaskIdentifier parallelR
   // Populate PFNs containing segments.
   //
   (*pagePacket)->range.length = (UInt32) dataLength;
-  (*pagePacket)->range.offset = 0;
+  if (!buildPageRange(segs64, numSegs, _maxPagePfns, &(*pagePacket)->range, &numPfns)) {
+    //
+    // Unaligned transfers are copied through the bounce pool instead.
+    //
+    HVDBGLOG("Unaligned segments for %u byte transfer across %u segments", (UInt32) dataLength, numSegs);
+    dmaCommand->complete();
 
-  for (UInt32 i = 0; i < numSegs; i++) {
-    if (i != 0 && i != (numSegs - 1)) {
-      if (_segs64[i].fLength != PAGE_SIZE && _segs64[i].fLength != 0) {
-        panic("Invalid segment %u: 0x%llX %llu bytes", (unsigned int) i, _segs64[i].fIOVMAddr, _segs64[i].fLength);
-      }
+    status = prepareBounceTransfer(parallelRequest, *pagePacket, pagePacketLength);
+    if (status != kIOReturnSuccess) {
+      HVSYSLOG("Unable to bounce unaligned transfer of %u bytes with status 0x%X", dataLength, status);
     }
-
-    (*pagePacket)->range.pfns[i] = _segs64[i].fIOVMAddr >> PAGE_SHIFT;
+    return status;
   }
 
-  *pagePacketLength = sizeof (**pagePacket) + (sizeof (UInt64) * numSegs);
+  *pagePacketLength = sizeof (**pagePacket) + (sizeof (UInt64) * numPfns);
   return kIOReturnSuccess;
 }
 
 void HyperVStorage::completeDataTransfer(SCSIParallelTaskIdentifier parallelRequest, HyperVStoragePacket *packet) {
-  IODMACommand *dmaCommand = GetDMACommand(parallelRequest);
-  dmaCommand->complete();
+  HyperVStorageTaskData *taskData = getTaskData(parallelRequest);
+  UInt32 realizedLength = getSCSIRealizedLength(packet);
+
+  if (taskData != nullptr && taskData->bounceSlot != kHyperVStorageBounceSlotNone) {
+    completeBounceTransfer(parallelRequest, realizedLength);
+  } else {
+    GetDMACommand(parallelRequest)->complete();
+  }
 
-  SetRealizedDataTransferCount(parallelRequest,
-                               (packet->status == kHyperVStoragePacketSuccess) ? packet->scsiRequest.dataTransferLength : 0);
+  SetRealizedDataTransferCount(parallelRequest, realizedLength);
+}
+
+void HyperVStorage::cancelDataTransfer(SCSIParallelTaskIdentifier parallelRequest) {
+  HyperVStorageTaskData *taskData = getTaskData(parallelRequest);
+
+  if (taskData != nullptr && taskData->bounceSlot != kHyperVStorageBounceSlotNone) {
+    releaseBounceSlot(taskData->bounceSlot);
+    taskData->bounceSlot = kHyperVStorageBounceSlotNone;
+  } else {
+    GetDMACommand(parallelRequest)->complete();
+  }
 }
 
 void HyperVStorage::setHBAInfo() {
@@ -200,8 +606,8 @@ void HyperVStorage::setHBAInfo() {
   // Populate protocol version.
   //
   snprintf(verString, sizeof (verString), "%u.%u",
-           (unsigned int) HYPERV_STORAGE_PROTCOL_VERSION_MAJOR(_protocolVersion),
-           (unsigned int) HYPERV_STORAGE_PROTCOL_VERSION_MINOR(_protocolVersion));
+           (unsigned int) HYPERV_STORAGE_PROTCOL_VERSION_MAJOR(_protocol.protocolVersion),
+           (unsigned int) HYPERV_STORAGE_PROTCOL_VERSION_MINOR(_protocol.protocolVersion));
   propString = OSString::withCString(verString);
   if (propString != nullptr) {
     SetHBAProperty(kIOPropertyProductRevisionLevelKey, propString);
@@ -209,9 +615,124 @@ void HyperVStorage::setHBAInfo() {
   }
 }
 
+UInt32 HyperVStorage::getControllerProperty(const char *key, UInt32 defaultValue) {
+  OSNumber *number;
+
+  //
+  // Properties may be set on the controller personality, or on the VMBus device nub for a specific controller.
+  //
+  number = OSDynamicCast(OSNumber, _hvDevice->getProperty(key));
+  if (number == nullptr) {
+    number = OSDynamicCast(OSNumber, getProperty(key));
+  }
+  return (number != nullptr) ? number->unsigned32BitValue() : defaultValue;
+}
+
+UInt32 HyperVStorage::computeRingBufferSize(UInt32 packetSize) {
+  UInt64 ringSize;
+
+  //
+  // Each packet in the ring is 8-byte aligned and followed by the 8-byte previous write index.
+  // Ring must hold a full queue of packets, plus one as the ring can never be completely full.
+  //
+  ringSize = (UInt64) (HV_PACKETALIGN(packetSize) + sizeof (UInt64)) * (_queueDepth + 1);
+  ringSize = (ringSize + PAGE_MASK) & ~((UInt64) PAGE_MASK);
+
+  if (ringSize < kHyperVStorageMinRingBufferSize) {
+    ringSize = kHyperVStorageMinRingBufferSize;
+  } else if (ringSize > kHyperVStorageMaxRingBufferSize) {
+    ringSize = kHyperVStorageMaxRingBufferSize;
+  }
+  return (UInt32) ringSize;
+}
+
+IOReturn HyperVStorage::openStorageChannel() {
+  IOReturn status;
+  UInt32   ringSizeOverride;
+  bool     ringSizeFixed;
+  UInt32   txRingSize;
+  UInt32   rxRingSize;
+  OSNumber *number;
+
+  _queueDepth = getControllerProperty(kHyperVStorageQueueDepthKey, kHyperVStorageDefaultQueueDepth);
+  if (_queueDepth == 0) {
+    _queueDepth = 1;
+  } else if (_queueDepth > kHyperVStorageMaxQueueDepth) {
+    _queueDepth = kHyperVStorageMaxQueueDepth;
+  }
+
+  //
+  // Use the overridden ring size if specified, otherwise start with the minimum.
+  // The maximum transfer size is only known after connecting, the channel is reopened if a different size is needed.
+  //
+  ringSizeOverride = getControllerProperty(kHyperVStorageRingBufferSizeKey, 0);
+  ringSizeFixed    = ringSizeOverride != 0;
+  if (ringSizeFixed) {
+    ringSizeOverride = (ringSizeOverride + PAGE_MASK) & ~PAGE_MASK;
+    if (ringSizeOverride < kHyperVStorageMinRingBufferSize) {
+      ringSizeOverride = kHyperVStorageMinRingBufferSize;
+    }
+    _txRingBufferSize = ringSizeOverride;
+    _rxRingBufferSize = ringSizeOverride;
+  } else {
+    _txRingBufferSize = kHyperVStorageMinRingBufferSize;
+    _rxRingBufferSize = kHyperVStorageMinRingBufferSize;
+  }
+
+  while (true) {
+    HVDBGLOG("Opening channel with TX ring size %u bytes, RX ring size %u bytes, queue depth %u",
+             _txRingBufferSize, _rxRingBufferSize, _queueDepth);
+    status = _hvDevice->openVMBusChannel(_txRingBufferSize, _rxRingBufferSize);
+    if (status != kIOReturnSuccess) {
+      HVSYSLOG("Failed to open VMBus channel with status 0x%X", status);
+      return status;
+    }
+
+    status = connectStorage();
+    if (status != kIOReturnSuccess) {
+      HVSYSLOG("Failed to connect to storage device with status 0x%X", status);
+      return status;
+    }
+
+    if (ringSizeFixed) {
+      break;
+    }
+
+    //
+    // Outgoing requests carry a page list covering the maximum transfer size.
+    // Incoming completions are plain storage packets.
+    //
+    txRingSize = computeRingBufferSize(sizeof (VMBusPacketMultiPageBuffer) + (sizeof (UInt64) * _maxPagePfns)
+                                       + sizeof (HyperVStoragePacket));
+    rxRingSize = computeRingBufferSize(sizeof (VMBusPacketHeader) + sizeof (HyperVStoragePacket));
+    if (txRingSize == _txRingBufferSize && rxRingSize == _rxRingBufferSize) {
+      break;
+    }
+
+    HVDBGLOG("Reopening channel for max transfer of %u bytes", _maxTransferBytes);
+    _hvDevice->closeVMBusChannel();
+    _txRingBufferSize = txRingSize;
+    _rxRingBufferSize = rxRingSize;
+    ringSizeFixed     = true;
+  }
+
+  number = OSNumber::withNumber(_txRingBufferSize, 32);
+  if (number != nullptr) {
+    setProperty(kHyperVStorageActiveRingBufferSizeKey, number);
+    number->release();
+  }
+  number = OSNumber::withNumber(_queueDepth, 32);
+  if (number != nullptr) {
+    setProperty(kHyperVStorageActiveQueueDepthKey, number);
+    number->release();
+  }
+  return kIOReturnSuccess;
+}
+
 IOReturn HyperVStorage::connectStorage() {
-  IOReturn            status;
-  HyperVStoragePacket storPkt;
+  IOReturn                    status;
+  HyperVStoragePacket         storPkt;
+  const HyperVStorageProtocol *protocol;
   
   //
   // Check if we are actually an IDE controller.
@@ -228,8 +749,7 @@ IOReturn HyperVStorage::connectStorage() {
   //
   // Begin controller initialization.
   //
-  bzero(&storPkt, sizeof (storPkt));
-  storPkt.operation = kHyperVStoragePacketOperationBeginInitialization;
+  prepareStoragePacket(&storPkt, kHyperVStoragePacketOperationBeginInitialization);
   status = sendStorageCommand(&storPkt, true);
   if (status != kIOReturnSuccess) {
     HVSYSLOG("Failed to send begin initialization command with status 0x%X", status);
@@ -239,39 +759,25 @@ IOReturn HyperVStorage::connectStorage() {
   //
   // Negotiate protocol version.
   //
-  for (UInt32 i = 0; i < arrsize(storageProtocols); i++) {
-    bzero(&storPkt, sizeof (storPkt));
-    storPkt.operation                  = kHyperVStoragePacketOperationQueryProtocolVersion;
-    storPkt.protocolVersion.majorMinor = storageProtocols[i].protocolVersion;
-    storPkt.protocolVersion.revision   = 0; // Revision is zero for non-Windows.
-
-    status = sendStorageCommand(&storPkt, false);
-    if (status != kIOReturnSuccess) {
-      HVSYSLOG("Failed to send query protocol command with status 0x%X", status);
-      return status;
-    }
-
-    //
-    // A success means this protocol version is acceptable.
-    //
-    if (storPkt.status == 0) {
-      _protocolVersion = storageProtocols[i].protocolVersion;
-      _senseBufferSize = storageProtocols[i].senseBufferSize;
-      _packetSizeDelta = storageProtocols[i].packetSizeDelta;
-      HVDBGLOG("SCSI protocol version: 0x%X, sense buffer size: %u", _protocolVersion, _senseBufferSize);
-      break;
-    }
+  protocol = negotiateStorageProtocol([this, &status](HyperVStoragePacket *packet) {
+    status = sendStorageCommand(packet, false);
+    return status == kIOReturnSuccess;
+  });
+  if (status != kIOReturnSuccess) {
+    HVSYSLOG("Failed to send query protocol command with status 0x%X", status);
+    return status;
   }
-  if (storPkt.status != 0) {
-    HVSYSLOG("Query protocol command return error status 0x%X", storPkt.status);
+  if (protocol == nullptr) {
+    HVSYSLOG("No storage protocol version was accepted by the host");
     return kIOReturnIOError;
   }
+  _protocol = *protocol;
+  HVDBGLOG("SCSI protocol version: 0x%X, sense buffer size: %u", _protocol.protocolVersion, _protocol.senseBufferSize);
 
   //
   // Query controller properties.
   //
-  bzero(&storPkt, sizeof (storPkt));
-  storPkt.operation = kHyperVStoragePacketOperationQueryProperties;
+  prepareStoragePacket(&storPkt, kHyperVStoragePacketOperationQueryProperties);
   status = sendStorageCommand(&storPkt, true);
   if (status != kIOReturnSuccess) {
     HVSYSLOG("Failed to send query properties command with status 0x%X", status);
@@ -282,14 +788,14 @@ IOReturn HyperVStorage::connectStorage() {
   _maxSubChannels       = storPkt.storageChannelProperties.maxChannelCount;
   _maxTransferBytes     = storPkt.storageChannelProperties.maxTransferBytes;
   _maxPageSegments      = _maxTransferBytes / PAGE_SIZE;
+  _maxPagePfns          = getMaxPageRangePfnCount(_maxTransferBytes);
   HVDBGLOG("Multi channel supported: %s, max sub channels: %u, max transfer bytes: %u (%u segments)",
            _subChannelsSupported ? "yes" : "no", _maxSubChannels, _maxTransferBytes, _maxPageSegments);
 
   //
   // Complete initialization.
   //
-  bzero(&storPkt, sizeof (storPkt));
-  storPkt.operation = kHyperVStoragePacketOperationEndInitialization;
+  prepareStoragePacket(&storPkt, kHyperVStoragePacketOperationEndInitialization);
   status = sendStorageCommand(&storPkt, true);
   if (status != kIOReturnSuccess) {
     HVSYSLOG("Failed to send end initialization command with status 0x%X", status);
@@ -299,44 +805,139 @@ IOReturn HyperVStorage::connectStorage() {
   return kIOReturnSuccess;
 }
 
-bool HyperVStorage::checkSCSIDiskPresent(UInt8 diskId) {
+void HyperVStorage::prepareSCSIRequest(HyperVStoragePacket *storPkt, UInt8 diskId, UInt8 dataIn, UInt32 dataTransferLength) {
+  //
+  // Each LUN is represented in macOS as a separate target, use that target ID for the LUN here.
+  //
+  buildSCSIRequestPacket(storPkt, &_protocol, _targetId, diskId, dataIn, dataTransferLength);
+}
+
+void HyperVStorage::prepareTestUnitReady(HyperVStoragePacket *storPkt, UInt8 diskId) {
+  buildTestUnitReadyPacket(storPkt, &_protocol, _targetId, diskId);
+}
+
+IOReturn HyperVStorage::reportSCSILuns(bool *lunsPresent) {
   IOReturn            status;
-  HyperVStoragePacket storPkt = { };
+  HyperVStoragePacket storPkt;
+  HyperVDMABuffer     lunsBuffer;
+  UInt32              lunListLength;
+  UInt8               *lunEntry;
+  UInt32              lun;
+
+  struct __attribute__((packed)) {
+    VMBusPacketMultiPageBuffer  pagePacket;
+    UInt64                      pfn;
+  } lunsPagePacket;
 
   //
-  // Prepare SCSI request packet and flags.
+  // Allocate single page to hold the returned LUN list.
   //
-  storPkt.operation = kHyperVStoragePacketOperationExecuteSRB;
+  if (!_hvDevice->getHvController()->allocateDmaBuffer(&lunsBuffer, kHyperVStorageReportLunsBufferSize)) {
+    HVSYSLOG("Failed to allocate REPORT LUNS buffer");
+    return kIOReturnNoResources;
+  }
 
-  storPkt.scsiRequest.targetID                = _targetId;
-  storPkt.scsiRequest.lun                     = diskId;
-  storPkt.scsiRequest.win8Extension.srbFlags |= 0x00000008;
-  storPkt.scsiRequest.length                  = sizeof (storPkt.scsiRequest) - _packetSizeDelta;
-  storPkt.scsiRequest.senseInfoLength         = _senseBufferSize;
-  storPkt.scsiRequest.dataIn                  = kHyperVStorageSCSIRequestTypeUnknown;
+  prepareSCSIRequest(&storPkt, 0, kHyperVStorageSCSIRequestTypeRead, kHyperVStorageReportLunsBufferSize);
 
   //
-  // Set CDB to TEST UNIT READY command.
+  // Set CDB to REPORT LUNS command, allocation length is big-endian.
   //
-  storPkt.scsiRequest.cdb[0]    = kSCSICmd_TEST_UNIT_READY;
-  storPkt.scsiRequest.cdb[1]    = 0x00;
-  storPkt.scsiRequest.cdb[2]    = 0x00;
-  storPkt.scsiRequest.cdb[3]    = 0x00;
-  storPkt.scsiRequest.cdb[4]    = 0x00;
-  storPkt.scsiRequest.cdb[5]    = 0x00;
-  storPkt.scsiRequest.cdbLength = 6;
+  storPkt.scsiRequest.cdb[0]    = kSCSICmd_REPORT_LUNS;
+  storPkt.scsiRequest.cdb[6]    = (kHyperVStorageReportLunsBufferSize >> 24) & 0xFF;
+  storPkt.scsiRequest.cdb[7]    = (kHyperVStorageReportLunsBufferSize >> 16) & 0xFF;
+  storPkt.scsiRequest.cdb[8]    = (kHyperVStorageReportLunsBufferSize >> 8) & 0xFF;
+  storPkt.scsiRequest.cdb[9]    = kHyperVStorageReportLunsBufferSize & 0xFF;
+  storPkt.scsiRequest.cdbLength = 12;
+
+  lunsPagePacket.pagePacket.range.length = kHyperVStorageReportLunsBufferSize;
+  lunsPagePacket.pagePacket.range.offset = 0;
+  lunsPagePacket.pfn                     = lunsBuffer.physAddr >> PAGE_SHIFT;
+
+  status = _hvDevice->writeGPADirectMultiPagePacket(&storPkt, getStoragePacketLength(&_protocol), true,
+                                                    &lunsPagePacket.pagePacket, sizeof (lunsPagePacket),
+                                                    &storPkt, sizeof (storPkt));
+  do {
+    if (status != kIOReturnSuccess) {
+      HVDBGLOG("Failed to send REPORT LUNS SCSI packet with status 0x%X", status);
+      break;
+    }
+
+    HVDBGLOG("REPORT LUNS status: 0x%X SCSI status: 0x%X SRB status: 0x%X",
+             storPkt.status, storPkt.scsiRequest.scsiStatus, storPkt.scsiRequest.srbStatus);
+    if (storPkt.status != kHyperVStoragePacketSuccess || storPkt.scsiRequest.scsiStatus != kSCSITaskStatus_GOOD
+        || (storPkt.scsiRequest.srbStatus & ~kHyperVSRBStatusAutosenseValid) != kHyperVSRBStatusSuccess) {
+      status = kIOReturnUnsupported;
+      break;
+    }
+
+    //
+    // Parse returned LUN list, truncating to what fits in the buffer.
+    // Each entry uses single level peripheral or flat addressing.
+    //
+    lunListLength = (lunsBuffer.buffer[0] << 24) | (lunsBuffer.buffer[1] << 16) | (lunsBuffer.buffer[2] << 8) | lunsBuffer.buffer[3];
+    if (lunListLength > kHyperVStorageReportLunsBufferSize - kHyperVStorageReportLunsHeaderSize) {
+      lunListLength = kHyperVStorageReportLunsBufferSize - kHyperVStorageReportLunsHeaderSize;
+    }
+
+    for (UInt32 i = 0; i + kHyperVStorageReportLunsEntrySize <= lunListLength; i += kHyperVStorageReportLunsEntrySize) {
+      lunEntry = &lunsBuffer.buffer[kHyperVStorageReportLunsHeaderSize + i];
+      lun      = ((lunEntry[0] & 0x3F) << 8) | lunEntry[1];
+      if (lun < _maxLuns) {
+        HVDBGLOG("REPORT LUNS returned disk %u", lun);
+        lunsPresent[lun] = true;
+      } else {
+        HVDBGLOG("REPORT LUNS returned unsupported disk %u", lun);
+      }
+    }
+  } while (false);
+
+  _hvDevice->getHvController()->freeDmaBuffer(&lunsBuffer);
+  return status;
+}
+
+IOReturn HyperVStorage::probeSCSIDisks(bool *lunsPresent) {
+  IOReturn status;
+
+  struct HyperVStorageProbe {
+    HyperVVMBusDeviceRequest  request;
+    HyperVStoragePacket       storPkt;
+    bool                      sent;
+  } *probes;
+  UInt32 probesSize = sizeof (*probes) * _maxLuns;
 
   //
-  // Send SCSI packet and check result to see if disk is present.
+  // Issue TEST UNIT READY to every possible disk at once, then collect the results.
   //
-  status = sendStorageCommand(&storPkt, false);
-  if (status != kIOReturnSuccess) {
-    HVDBGLOG("Failed to send TEST UNIT READY SCSI packet with status 0x%X", status);
-    return false;
+  probes = (HyperVStorageProbe*) IOMalloc(probesSize);
+  if (probes == nullptr) {
+    HVSYSLOG("Failed to allocate disk probes");
+    return kIOReturnNoResources;
+  }
+  bzero(probes, probesSize);
+
+  for (UInt32 lun = 0; lun < _maxLuns; lun++) {
+    prepareTestUnitReady(&probes[lun].storPkt, lun);
+    status = _hvDevice->writeInbandPacketAsync(&probes[lun].storPkt, getStoragePacketLength(&_protocol),
+                                               &probes[lun].request, &probes[lun].storPkt, sizeof (probes[lun].storPkt));
+    probes[lun].sent = status == kIOReturnSuccess;
+    if (!probes[lun].sent) {
+      HVDBGLOG("Failed to send TEST UNIT READY SCSI packet for disk %u with status 0x%X", lun, status);
+    }
+  }
+
+  for (UInt32 lun = 0; lun < _maxLuns; lun++) {
+    if (!probes[lun].sent) {
+      continue;
+    }
+
+    _hvDevice->waitForPacketResponse(&probes[lun].request);
+    HVDBGLOG("Disk %u status: 0x%X SRB status: 0x%X", lun,
+             probes[lun].storPkt.scsiRequest.scsiStatus, probes[lun].storPkt.scsiRequest.srbStatus);
+    lunsPresent[lun] = probes[lun].storPkt.scsiRequest.srbStatus != kHyperVSRBStatusInvalidLUN;
   }
 
-  HVDBGLOG("Disk %u status: 0x%X SRB status: 0x%X", diskId, storPkt.scsiRequest.scsiStatus, storPkt.scsiRequest.srbStatus);
-  return storPkt.scsiRequest.srbStatus != kHyperVSRBStatusInvalidLUN;
+  IOFree(probes, probesSize);
+  return kIOReturnSuccess;
 }
 
 void HyperVStorage::startDiskEnumeration() {
@@ -344,16 +945,60 @@ void HyperVStorage::startDiskEnumeration() {
   // Begin disk enumeration on separate thread.
   //
   HVDBGLOG("Starting disk enumeration thread");
-  thread_call_enter(_scanSCSIDiskThread);
+  enterThreadCall(_scanSCSIDiskThread);
+}
+
+void HyperVStorage::scanSCSIDisksThread() {
+  if (!_isStopping) {
+    scanSCSIDisks();
+  }
+
+  //
+  // Must be last, cancelThreadCalls may free the thread call once this reaches zero.
+  //
+  OSDecrementAtomic(&_threadCallsOutstanding);
 }
 
 void HyperVStorage::scanSCSIDisks() {
+  IOReturn   status;
+  bool       lunsPresent[kHyperVStorageMaxLunsSCSI] = { };
+  const char *method;
+  UInt64     startTime;
+  UInt64     endTime;
+  UInt64     elapsedNs;
+  OSNumber   *elapsedNumber;
+
   HVDBGLOG("Starting disk scan of %u disks", _maxLuns);
+  clock_get_uptime(&startTime);
+
+  //
+  // Use a single REPORT LUNS where supported, falling back to probing each disk.
+  // IDE controllers only have a single disk and are always probed.
+  //
+  status = kIOReturnUnsupported;
+  method = "TEST UNIT READY";
+  if (!_isIDE) {
+    status = reportSCSILuns(lunsPresent);
+    if (status == kIOReturnSuccess) {
+      method = "REPORT LUNS";
+    } else {
+      HVDBGLOG("REPORT LUNS failed with status 0x%X, probing disks", status);
+      bzero(lunsPresent, sizeof (lunsPresent));
+    }
+  }
+  if (status != kIOReturnSuccess) {
+    status = probeSCSIDisks(lunsPresent);
+    if (status != kIOReturnSuccess) {
+      HVSYSLOG("Failed to probe disks with status 0x%X", status);
+      return;
+    }
+  }
 
   for (UInt32 lun = 0; lun < _maxLuns; lun++) {
-    if (checkSCSIDiskPresent(lun)) {
+    if (lunsPresent[lun]) {
       if (GetTargetForID(lun) == nullptr) {
         HVDBGLOG("Disk %u is newly added", lun);
+        bzero(&_lunInfo[lun], sizeof (_lunInfo[lun]));
         CreateTargetForID(lun);
       } else {
         HVDBGLOG("Disk %u is still present", lun);
@@ -366,5 +1011,17 @@ void HyperVStorage::scanSCSIDisks() {
     }
   }
 
-  HVDBGLOG("Completed disk scan");
+  //
+  // Publish enumeration time.
+  //
+  clock_get_uptime(&endTime);
+  absolutetime_to_nanoseconds(endTime - startTime, &elapsedNs);
+  elapsedNumber = OSNumber::withNumber(elapsedNs / 1000, 64);
+  if (elapsedNumber != nullptr) {
+    setProperty(kHyperVStorageEnumerationTimeKey, elapsedNumber);
+    elapsedNumber->release();
+  }
+  setProperty(kHyperVStorageEnumerationMethodKey, method);
+
+  HVDBGLOG("Completed disk scan using %s in %llu us", method, elapsedNs / 1000);
 }
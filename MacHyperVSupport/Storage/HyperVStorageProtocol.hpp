@@ -0,0 +1,197 @@
+//
+//  HyperVStorageProtocol.hpp
+//  Hyper-V storage driver
+//
+//  Copyright © 2021-2022 Goldfish64. All rights reserved.
+//
+
+#ifndef HyperVStorageProtocol_hpp
+#define HyperVStorageProtocol_hpp
+
+//
+// Storage protocol negotiation, SCSI request packet and page range routines.
+// This header only depends on SCSI type definitions so it can also be built in userspace by Tests.
+//
+#include <libkern/OSTypes.h>
+#include <IOKit/scsi/SCSITask.h>
+#include <IOKit/scsi/SCSICommandOperationCodes.h>
+#include <string.h>
+
+#include "HyperVStorageRegs.hpp"
+
+//
+// Page numbers passed to Hyper-V always refer to 4KB pages.
+//
+#define kHyperVStoragePageShift   12
+#define kHyperVStoragePageSize    (1U << kHyperVStoragePageShift)
+#define kHyperVStoragePageMask    (kHyperVStoragePageSize - 1)
+
+//
+// Hyper-V storage protocol list, newest first.
+//
+static const HyperVStorageProtocol storageProtocols[] = {
+  {
+    kHyperVStorageVersionWin10,
+    kHyperVStoragePostWin7SenseBufferSize,
+    0
+  },
+  {
+    kHyperVStorageVersionWin8_1,
+    kHyperVStoragePostWin7SenseBufferSize,
+    0
+  },
+  {
+    kHyperVStorageVersionWin8,
+    kHyperVStoragePostWin7SenseBufferSize,
+    0
+  },
+  {
+    kHyperVStorageVersionWin7,
+    kHyperVStoragePreWin8SenseBufferSize,
+    sizeof (HyperVStorageSCSIRequestWin8Extension)
+  },
+  {
+    kHyperVStorageVersionWin2008,
+    kHyperVStoragePreWin8SenseBufferSize,
+    sizeof (HyperVStorageSCSIRequestWin8Extension)
+  },
+};
+#define kHyperVStorageProtocolCount   (sizeof (storageProtocols) / sizeof (storageProtocols[0]))
+
+//
+// Clears a storage packet and sets its operation.
+//
+static inline void prepareStoragePacket(HyperVStoragePacket *storPkt, HyperVStoragePacketOperation operation) {
+  memset(storPkt, 0, sizeof (*storPkt));
+  storPkt->operation = operation;
+}
+
+//
+// Offers each protocol version to the host, newest first, until one is accepted.
+// sendCommand(HyperVStoragePacket*) sends the packet and waits for the response to be written back into it,
+// returning false if it could not be sent.
+// Returns the accepted protocol, or nullptr if sending failed or no version was accepted.
+//
+template <typename SendFunc>
+static inline const HyperVStorageProtocol *negotiateStorageProtocol(SendFunc sendCommand) {
+  HyperVStoragePacket storPkt;
+
+  for (UInt32 i = 0; i < kHyperVStorageProtocolCount; i++) {
+    prepareStoragePacket(&storPkt, kHyperVStoragePacketOperationQueryProtocolVersion);
+    storPkt.protocolVersion.majorMinor = storageProtocols[i].protocolVersion;
+    storPkt.protocolVersion.revision   = 0; // Revision is zero for non-Windows.
+
+    if (!sendCommand(&storPkt)) {
+      return nullptr;
+    }
+
+    //
+    // A success means this protocol version is acceptable.
+    //
+    if (storPkt.status == kHyperVStoragePacketSuccess) {
+      return &storageProtocols[i];
+    }
+  }
+  return nullptr;
+}
+
+//
+// Prepares an execute SRB packet and data direction flags.
+// The CDB is left zeroed for the caller to fill in.
+//
+static inline void buildSCSIRequestPacket(HyperVStoragePacket *storPkt, const HyperVStorageProtocol *protocol,
+                                          UInt8 targetId, UInt8 lun, UInt8 dataIn, UInt32 dataTransferLength) {
+  prepareStoragePacket(storPkt, kHyperVStoragePacketOperationExecuteSRB);
+  storPkt->flags = kHyperVStoragePacketFlagRequestCompletion;
+
+  storPkt->scsiRequest.targetID                = targetId;
+  storPkt->scsiRequest.lun                     = lun;
+  storPkt->scsiRequest.win8Extension.srbFlags |= kHyperVSRBFlagsDisableSyncTransfer;
+  storPkt->scsiRequest.length                  = sizeof (storPkt->scsiRequest) - protocol->packetSizeDelta;
+  storPkt->scsiRequest.senseInfoLength         = protocol->senseBufferSize;
+  storPkt->scsiRequest.dataIn                  = (HyperVStorageSCSIRequestType) dataIn;
+  storPkt->scsiRequest.dataTransferLength      = dataTransferLength;
+
+  if (dataIn == kHyperVStorageSCSIRequestTypeWrite) {
+    storPkt->scsiRequest.win8Extension.srbFlags |= kHyperVSRBFlagsDataOut;
+  } else if (dataIn == kHyperVStorageSCSIRequestTypeRead) {
+    storPkt->scsiRequest.win8Extension.srbFlags |= kHyperVSRBFlagsDataIn;
+  }
+}
+
+static inline void buildTestUnitReadyPacket(HyperVStoragePacket *storPkt, const HyperVStorageProtocol *protocol,
+                                            UInt8 targetId, UInt8 lun) {
+  buildSCSIRequestPacket(storPkt, protocol, targetId, lun, kHyperVStorageSCSIRequestTypeUnknown, 0);
+  storPkt->scsiRequest.cdb[0]    = kSCSICmd_TEST_UNIT_READY;
+  storPkt->scsiRequest.cdbLength = 6;
+}
+
+//
+// Length of a storage packet sent with the given protocol.
+//
+static inline UInt32 getStoragePacketLength(const HyperVStorageProtocol *protocol) {
+  return sizeof (HyperVStoragePacket) - protocol->packetSizeDelta;
+}
+
+//
+// Populates the offset and page numbers of a range from a list of DMA segments with fIOVMAddr and fLength members.
+// Hyper-V requires a single range, only the first segment may start and only the last segment may end within a page.
+// Returns false if the segments cannot be described by a single range of at most maxPfns pages.
+//
+template <typename Segment, typename PageRange>
+static inline bool buildPageRange(const Segment *segs, UInt32 numSegs, UInt32 maxPfns, PageRange *range, UInt32 *pfnCount) {
+  UInt64 pageStart;
+  UInt64 pageEnd;
+  UInt32 count = 0;
+
+  if (numSegs == 0) {
+    return false;
+  }
+  range->offset = (UInt32) (segs[0].fIOVMAddr & kHyperVStoragePageMask);
+
+  for (UInt32 i = 0; i < numSegs; i++) {
+    if ((i != 0 && (segs[i].fIOVMAddr & kHyperVStoragePageMask) != 0)
+        || (i != (numSegs - 1) && ((segs[i].fIOVMAddr + segs[i].fLength) & kHyperVStoragePageMask) != 0)) {
+      return false;
+    }
+
+    //
+    // Segments spanning several pages contribute one page number per page.
+    //
+    pageStart = segs[i].fIOVMAddr >> kHyperVStoragePageShift;
+    pageEnd   = (segs[i].fIOVMAddr + segs[i].fLength + kHyperVStoragePageMask) >> kHyperVStoragePageShift;
+    if (pageEnd - pageStart > maxPfns - count) {
+      return false;
+    }
+    for (UInt64 page = pageStart; page < pageEnd; page++) {
+      range->pfns[count++] = page;
+    }
+  }
+
+  *pfnCount = count;
+  return true;
+}
+
+//
+// Number of page numbers needed to describe any transfer of up to maxTransferBytes.
+// A transfer not starting on a page boundary touches one page more than its length alone.
+//
+static inline UInt32 getMaxPageRangePfnCount(UInt32 maxTransferBytes) {
+  return (maxTransferBytes >> kHyperVStoragePageShift) + 1;
+}
+
+//
+// Number of bytes transferred by a completed request.
+//
+static inline UInt32 getSCSIRealizedLength(const HyperVStoragePacket *storPkt) {
+  return (storPkt->status == kHyperVStoragePacketSuccess) ? storPkt->scsiRequest.dataTransferLength : 0;
+}
+
+//
+// Sense data is returned in place of the CDB for requests completing with a check condition.
+//
+static inline bool hasSCSIAutoSense(const HyperVStoragePacket *storPkt) {
+  return storPkt->scsiRequest.scsiStatus == kSCSITaskStatus_CHECK_CONDITION;
+}
+
+#endif
@@ -8,7 +8,19 @@
 #ifndef HyperVStorageRegs_h
 #define HyperVStorageRegs_h
 
-#define kHyperVStorageRingBufferSize 0x200000// 0x1000000//0xF0000//0xF000 //(0x1000000)// (0x9000)
+//
+// Ring buffer sizes are computed from the negotiated maximum transfer size and queue depth.
+// Both can be overridden per controller with the below properties.
+//
+#define kHyperVStorageMinRingBufferSize       (8 * PAGE_SIZE)
+#define kHyperVStorageMaxRingBufferSize       0x200000
+#define kHyperVStorageDefaultQueueDepth       32
+#define kHyperVStorageMaxQueueDepth           256
+
+#define kHyperVStorageRingBufferSizeKey       "HVRingBufferSize"
+#define kHyperVStorageQueueDepthKey           "HVQueueDepth"
+#define kHyperVStorageActiveRingBufferSizeKey "HVActiveRingBufferSize"
+#define kHyperVStorageActiveQueueDepthKey     "HVActiveQueueDepth"
 
 #define kHyperVStorageMaxCommandLength        0x10
 #define kHyperVStoragePostWin7SenseBufferSize 0x14
@@ -26,6 +38,53 @@
 #define kHyperVStorageMaxLunsSCSI             64
 #define kHyperVStorageMaxLunsIDE              1
 
+#define kHyperVStorageReportLunsBufferSize    PAGE_SIZE
+#define kHyperVStorageReportLunsHeaderSize    8
+#define kHyperVStorageReportLunsEntrySize     8
+
+#define kHyperVStorageEnumerationTimeKey      "HVEnumerationTimeUS"
+#define kHyperVStorageEnumerationMethodKey    "HVEnumerationMethod"
+
+#define kHyperVStorageLunInfoKey              "HVLogicalUnitInfo"
+#define kHyperVStorageCompletionStatisticsKey "HVCompletionStatistics"
+
+//
+// Bounce buffer pool for small or unaligned transfers.
+// Transfers at or below the copy threshold always use the pool when a slot is free.
+//
+#define kHyperVStorageBounceSlotCount         32
+#define kHyperVStorageBounceSlotSize          (16 * PAGE_SIZE)
+#define kHyperVStorageBounceCopyThreshold     (4 * PAGE_SIZE)
+#define kHyperVStorageBounceSlotNone          0xFF
+
+//
+// SCSI opcodes and data not defined by all SDK versions.
+//
+#define kHyperVStorageSCSICmdUnmap                  0x42
+
+#define kHyperVStorageInquiryVendorOffset           8
+#define kHyperVStorageInquiryVendorMsft             "Msft"
+#define kHyperVStorageInquiryVersionOffset          2
+#define kHyperVStorageInquiryVersionSPC3            5
+#define kHyperVStorageInquiryEVPD                   BIT(0)
+
+#define kHyperVStorageVPDPageBlockLimits            0xB0
+#define kHyperVStorageVPDPageBlockLimitsLength      36
+#define kHyperVStorageVPDPageProvisioning           0xB2
+#define kHyperVStorageVPDPageProvisioningLength     8
+#define kHyperVStorageVPDProvisioningLBPU           BIT(7)
+#define kHyperVStorageVPDProvisioningTypeMask       0x07
+#define kHyperVStorageVPDProvisioningTypeThin       2
+
+#define kHyperVStorageModeSense6HeaderLength        4
+#define kHyperVStorageModeSense10HeaderLength       8
+#define kHyperVStorageModeDeviceSpecificDPOFUA      BIT(4)
+#define kHyperVStorageModePageCodeMask              0x3F
+#define kHyperVStorageModePageCaching               0x08
+#define kHyperVStorageModePageCachingLength         3
+#define kHyperVStorageModePageCachingWCE            BIT(2)
+#define kHyperVStorageModeSenseBufferLength         255
+
 #define kHyperVStorageSegmentSize             PAGE_SIZE
 #define kHyperVStorageSegmentAlignment        0xFFFFFFFFFFFFF000ULL
 #define kHyperVStorageSegmentBits             64
@@ -33,9 +92,14 @@
 #define kHyperVSRBStatusSuccess         0x01
 #define kHyperVSRBStatusAborted         0x02
 #define kHyperVSRBStatusError           0x04
+#define kHyperVSRBStatusInvalidRequest  0x06
 #define kHyperVSRBStatusInvalidLUN      0x20
 #define kHyperVSRBStatusAutosenseValid  0x80
 
+#define kHyperVSRBFlagsDisableSyncTransfer  0x00000008
+#define kHyperVSRBFlagsDataIn               0x00000040
+#define kHyperVSRBFlagsDataOut              0x00000080
+
 //
 // Packet operations.
 //
@@ -177,6 +241,67 @@ typedef struct __attribute__((packed)) {
   };
 } HyperVStoragePacket;
 
+//
+// Completion decoded during the ring drain, retired once the drain finishes.
+//
+typedef struct {
+  UInt64              transactionId;
+  HyperVStoragePacket packet;
+} HyperVStorageCompletion;
+
+//
+// Per-LUN information snooped from command responses.
+//
+typedef struct {
+  bool    unmapSupported;
+  bool    unmapRejected;
+  bool    thinProvisioned;
+  bool    writeCacheEnabled;
+  bool    fuaSupported;
+  UInt32  maxUnmapBlockCount;
+  UInt32  maxUnmapDescriptorCount;
+  UInt32  unmapGranularity;
+  UInt32  unmapGranularityAlignment;
+} HyperVStorageLunInfo;
+
+//
+// Per-task HBA data, followed by the multi-page packet used for data transfers
+// and the DMA segment list used to build it.
+//
+typedef struct {
+  UInt64  startTime;
+  void    *nextRejected;
+  UInt8   ioType;
+  UInt8   bounceSlot;
+  UInt8   reserved[6];
+} HyperVStorageTaskData;
+
+//
+// Per-LUN I/O statistics.
+// Latency bucket n counts requests that completed in under 2^n microseconds.
+//
+#define kHyperVStorageStatisticsKey         "HVIOStatistics"
+#define kHyperVStorageLatencyBucketCount    32
+
+typedef enum : UInt8 {
+  kHyperVStorageIOTypeRead  = 0,
+  kHyperVStorageIOTypeWrite = 1,
+  kHyperVStorageIOTypeOther = 2,
+  kHyperVStorageIOTypeCount = 3
+} HyperVStorageIOType;
+
+typedef struct {
+  volatile UInt64 operations;
+  volatile UInt64 bytes;
+  volatile UInt64 errors;
+  volatile UInt64 totalLatencyUS;
+  volatile UInt64 latencyBuckets[kHyperVStorageLatencyBucketCount];
+} HyperVStorageIOStatistics;
+
+typedef struct {
+  HyperVStorageIOStatistics ioTypes[kHyperVStorageIOTypeCount];
+} HyperVStorageLunStatistics;
+
 //
 // Driver data
 //
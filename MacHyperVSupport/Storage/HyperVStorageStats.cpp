@@ -0,0 +1,217 @@
+//
+//  HyperVStorageStats.cpp
+//  Hyper-V storage driver
+//
+//  Copyright © 2022 Goldfish64. All rights reserved.
+//
+
+#include "HyperVStorage.hpp"
+
+static const char *ioTypeNames[kHyperVStorageIOTypeCount] = {
+  "Read",
+  "Write",
+  "Other"
+};
+
+static HyperVStorageIOType getIOTypeForOpcode(UInt8 opcode) {
+  switch (opcode) {
+    case kSCSICmd_READ_6:
+    case kSCSICmd_READ_10:
+    case kSCSICmd_READ_12:
+    case kSCSICmd_READ_16:
+      return kHyperVStorageIOTypeRead;
+
+    case kSCSICmd_WRITE_6:
+    case kSCSICmd_WRITE_10:
+    case kSCSICmd_WRITE_12:
+    case kSCSICmd_WRITE_16:
+      return kHyperVStorageIOTypeWrite;
+
+    default:
+      return kHyperVStorageIOTypeOther;
+  }
+}
+
+bool HyperVStorage::initIOStatistics() {
+  _lunStatsSize = sizeof (*_lunStats) * _maxLuns;
+  _lunStats     = (HyperVStorageLunStatistics*) IOMalloc(_lunStatsSize);
+  if (_lunStats == nullptr) {
+    _lunStatsSize = 0;
+    return false;
+  }
+
+  bzero(_lunStats, _lunStatsSize);
+  return true;
+}
+
+void HyperVStorage::freeIOStatistics() {
+  if (_lunStats != nullptr) {
+    IOFree(_lunStats, _lunStatsSize);
+    _lunStats     = nullptr;
+    _lunStatsSize = 0;
+  }
+}
+
+void HyperVStorage::recordIOStart(SCSIParallelTaskIdentifier parallelRequest, UInt8 opcode) {
+  HyperVStorageTaskData *taskData = getTaskData(parallelRequest);
+  if (taskData == nullptr) {
+    return;
+  }
+
+  taskData->ioType = getIOTypeForOpcode(opcode);
+  clock_get_uptime(&taskData->startTime);
+}
+
+void HyperVStorage::recordIOCompletion(SCSIParallelTaskIdentifier parallelRequest, UInt64 bytes, bool success) {
+  HyperVStorageTaskData     *taskData = getTaskData(parallelRequest);
+  SCSITargetIdentifier      lun       = GetTargetIdentifier(parallelRequest);
+  HyperVStorageIOStatistics *ioStats;
+  UInt64                    endTime;
+  UInt64                    latencyNs;
+  UInt64                    latencyUS;
+  UInt32                    bucket;
+
+  if (_lunStats == nullptr || taskData == nullptr || lun >= _maxLuns || taskData->ioType >= kHyperVStorageIOTypeCount) {
+    return;
+  }
+
+  clock_get_uptime(&endTime);
+  absolutetime_to_nanoseconds(endTime - taskData->startTime, &latencyNs);
+  latencyUS = latencyNs / 1000;
+
+  //
+  // Bucket is the number of significant bits in the latency, clamped to the last bucket.
+  //
+  bucket = (latencyUS != 0) ? (64 - __builtin_clzll(latencyUS)) : 0;
+  if (bucket >= kHyperVStorageLatencyBucketCount) {
+    bucket = kHyperVStorageLatencyBucketCount - 1;
+  }
+
+  //
+  // Completions may arrive on any thread, counters are updated atomically without locking.
+  //
+  ioStats = &_lunStats[lun].ioTypes[taskData->ioType];
+  __sync_fetch_and_add(&ioStats->operations, 1);
+  __sync_fetch_and_add(&ioStats->bytes, bytes);
+  __sync_fetch_and_add(&ioStats->totalLatencyUS, latencyUS);
+  __sync_fetch_and_add(&ioStats->latencyBuckets[bucket], 1);
+  if (!success) {
+    __sync_fetch_and_add(&ioStats->errors, 1);
+  }
+}
+
+OSDictionary *HyperVStorage::copyIOStatistics(HyperVStorageIOStatistics *ioStats) const {
+  OSDictionary *dict;
+  OSArray      *buckets;
+  OSNumber     *number;
+
+  const struct {
+    const char *key;
+    UInt64     value;
+  } counters[] = {
+    { "Operations",     ioStats->operations },
+    { "Bytes",          ioStats->bytes },
+    { "Errors",         ioStats->errors },
+    { "TotalLatencyUS", ioStats->totalLatencyUS }
+  };
+
+  dict    = OSDictionary::withCapacity(arrsize(counters) + 1);
+  buckets = OSArray::withCapacity(kHyperVStorageLatencyBucketCount);
+  if (dict == nullptr || buckets == nullptr) {
+    OSSafeReleaseNULL(dict);
+    OSSafeReleaseNULL(buckets);
+    return nullptr;
+  }
+
+  for (UInt32 i = 0; i < arrsize(counters); i++) {
+    number = OSNumber::withNumber(counters[i].value, 64);
+    if (number != nullptr) {
+      dict->setObject(counters[i].key, number);
+      number->release();
+    }
+  }
+
+  for (UInt32 i = 0; i < kHyperVStorageLatencyBucketCount; i++) {
+    number = OSNumber::withNumber(ioStats->latencyBuckets[i], 64);
+    if (number != nullptr) {
+      buckets->setObject(number);
+      number->release();
+    }
+  }
+  dict->setObject("LatencyLog2US", buckets);
+  buckets->release();
+
+  return dict;
+}
+
+bool HyperVStorage::serializeProperties(OSSerialize *serialize) const {
+  HyperVStorage *storage = (HyperVStorage *) this;
+  OSDictionary  *statsDict;
+  OSDictionary  *lunDict;
+  OSDictionary  *ioTypeDict;
+  OSNumber      *number;
+  char          lunString[4];
+
+  //
+  // Refresh per-LUN statistics each time the registry is read.
+  // Only LUNs that have seen I/O are included.
+  //
+  if (_lunStats != nullptr) {
+    statsDict = OSDictionary::withCapacity(1);
+    if (statsDict != nullptr) {
+      for (UInt32 lun = 0; lun < _maxLuns; lun++) {
+        if (_lunStats[lun].ioTypes[kHyperVStorageIOTypeRead].operations == 0
+            && _lunStats[lun].ioTypes[kHyperVStorageIOTypeWrite].operations == 0
+            && _lunStats[lun].ioTypes[kHyperVStorageIOTypeOther].operations == 0) {
+          continue;
+        }
+
+        lunDict = OSDictionary::withCapacity(kHyperVStorageIOTypeCount);
+        if (lunDict == nullptr) {
+          continue;
+        }
+        for (UInt32 i = 0; i < kHyperVStorageIOTypeCount; i++) {
+          ioTypeDict = copyIOStatistics(&_lunStats[lun].ioTypes[i]);
+          if (ioTypeDict != nullptr) {
+            lunDict->setObject(ioTypeNames[i], ioTypeDict);
+            ioTypeDict->release();
+          }
+        }
+
+        snprintf(lunString, sizeof (lunString), "%u", (unsigned int) lun);
+        statsDict->setObject(lunString, lunDict);
+        lunDict->release();
+      }
+
+      storage->setProperty(kHyperVStorageStatisticsKey, statsDict);
+      statsDict->release();
+    }
+  }
+
+  //
+  // Refresh completion batching statistics.
+  //
+  const struct {
+    const char *key;
+    UInt64     value;
+  } completionCounters[] = {
+    { "Batches",            _numCompletionBatches },
+    { "CompletionsRetired", _numCompletionsRetired },
+    { "MaxBatchSize",       _maxCompletionBatch }
+  };
+
+  statsDict = OSDictionary::withCapacity(arrsize(completionCounters));
+  if (statsDict != nullptr) {
+    for (UInt32 i = 0; i < arrsize(completionCounters); i++) {
+      number = OSNumber::withNumber(completionCounters[i].value, 64);
+      if (number != nullptr) {
+        statsDict->setObject(completionCounters[i].key, number);
+        number->release();
+      }
+    }
+    storage->setProperty(kHyperVStorageCompletionStatisticsKey, statsDict);
+    statsDict->release();
+  }
+
+  return super::serializeProperties(serialize);
+}
@@ -16,7 +16,7 @@ OSDefineMetaClassAndStructors(HyperVVMBus, super);
 // Supported VMBus versions.
 //
 const UInt32 VMBusVersions[] = {
- // kVMBusVersionWIN10_V4_1,
+  kVMBusVersionWIN10_V4_1,
   kVMBusVersionWIN10,
   kVMBusVersionWIN8_1,
   kVMBusVersionWIN8,
@@ -63,6 +63,8 @@ bool HyperVVMBus::attach(IOService *provider) {
       HVSYSLOG("Provider is not HyperVController");
       break;
     }
+    _channelTargetingDisabled = checkKernelArgument("-hvvmbusnocpu");
+    _vmbusMnfDisabled         = checkKernelArgument("-hvvmbusnomnf");
     
     _cmdGate = IOCommandGate::commandGate(this);
     getWorkLoop()->addEventSource(_cmdGate);
@@ -84,6 +86,7 @@ bool HyperVVMBus::attach(IOService *provider) {
       HVSYSLOG("Failed to scan the VMBus");
       break;
     }
+    startChannelBalancer();
     
     result = true;
   } while (false);
@@ -91,36 +94,120 @@ bool HyperVVMBus::attach(IOService *provider) {
   return result;
 }
 
-bool HyperVVMBus::sendVMBusMessage(VMBusChannelMessage *message, VMBusChannelMessageType responseType, VMBusChannelMessage *response) {
-  if (responseType != kVMBusChannelMessageTypeInvalid && response == NULL) {
-    return false;
+bool HyperVVMBus::serializeProperties(OSSerialize *serialize) const {
+  HyperVVMBus  *vmbus = (HyperVVMBus *) this;
+  OSDictionary *statsDict;
+  OSNumber     *number;
+
+  //
+  // Refresh control message statistics each time the registry is read.
+  // 64-bit loads are not atomic on 32-bit, read through a compare and swap.
+  //
+  const struct {
+    const char *key;
+    UInt64     value;
+  } counters[] = {
+    { "RoundTrips",       __sync_val_compare_and_swap(&vmbus->_numControlRoundTrips, 0, 0) },
+    { "TotalRoundTripNS", __sync_val_compare_and_swap(&vmbus->_controlRoundTripTotalNs, 0, 0) },
+    { "MaxRoundTripNS",   __sync_val_compare_and_swap(&vmbus->_controlRoundTripMaxNs, 0, 0) }
+  };
+
+  statsDict = OSDictionary::withCapacity(arrsize(counters));
+  if (statsDict != nullptr) {
+    for (UInt32 i = 0; i < arrsize(counters); i++) {
+      number = OSNumber::withNumber(counters[i].value, 64);
+      if (number != nullptr) {
+        statsDict->setObject(counters[i].key, number);
+        number->release();
+      }
+    }
+    vmbus->setProperty(kVMBusControlMessageStatisticsKey, statsDict);
+    statsDict->release();
   }
-  return _cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &HyperVVMBus::sendVMBusMessageGated), message, NULL, &responseType, response) == kIOReturnSuccess;
+
+  return super::serializeProperties(serialize);
+}
+
+bool HyperVVMBus::sendVMBusMessage(VMBusChannelMessage *message, VMBusChannelMessageType responseType, VMBusChannelMessage *response) {
+  return sendVMBusMessageWithSize(message, VMBusMessageTypeTable[message->header.type].size, responseType, response);
 }
 
 bool HyperVVMBus::sendVMBusMessageWithSize(VMBusChannelMessage *message, UInt32 messageSize, VMBusChannelMessageType responseType, VMBusChannelMessage *response) {
-  if (responseType != kVMBusChannelMessageTypeInvalid && response == NULL) {
+  VMBusMessageTransaction transaction;
+
+  transaction.messages     = &message;
+  transaction.messageSizes = &messageSize;
+  transaction.messageCount = 1;
+  transaction.responseType = responseType;
+  transaction.response     = response;
+  return sendVMBusMessages(&transaction);
+}
+
+bool HyperVVMBus::sendVMBusMessages(VMBusMessageTransaction *transaction) {
+  if (transaction->messageCount == 0
+      || (transaction->responseType != kVMBusChannelMessageTypeInvalid && transaction->response == NULL)) {
     return false;
   }
-  return _cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &HyperVVMBus::sendVMBusMessageGated), message, &messageSize, &responseType, response) == kIOReturnSuccess;
+  return _cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &HyperVVMBus::sendVMBusMessagesGated), transaction) == kIOReturnSuccess;
 }
 
-IOReturn HyperVVMBus::sendVMBusMessageGated(VMBusChannelMessage *message, UInt32 *messageSize, VMBusChannelMessageType *responseType, VMBusChannelMessage *responseMessage) {
-  
+IOReturn HyperVVMBus::sendVMBusMessagesGated(VMBusMessageTransaction *transaction) {
+  VMBusMessageWaiter  *waiter = nullptr;
+  IOReturn            status;
+  UInt64              startTime;
+
+  clock_get_uptime(&startTime);
+
+  //
+  // Register for the response before posting, it may arrive as soon as the last message is posted.
+  // Waiting for a response releases the gate, allowing other transactions to be started.
+  //
+  if (transaction->responseType != kVMBusChannelMessageTypeInvalid) {
+    while ((waiter = allocateMessageWaiter(transaction->responseType, getVMBusMessageKey(transaction->messages[0]))) == nullptr) {
+      HVDBGLOG("All message waiters are in use, waiting for one to be freed");
+      _cmdGate->commandSleep(_vmbusMessageWaiters);
+    }
+  }
+
+  //
+  // Post all messages back to back, only the last one has a response.
+  //
+  for (UInt32 i = 0; i < transaction->messageCount; i++) {
+    status = postVMBusMessage(transaction->messages[i], transaction->messageSizes[i]);
+    if (status != kIOReturnSuccess) {
+      if (waiter != nullptr) {
+        freeMessageWaiter(waiter);
+      }
+      return status;
+    }
+  }
+
+  if (waiter != nullptr) {
+    while (!waiter->completed) {
+      _cmdGate->commandSleep(waiter);
+    }
+
+    HVDBGLOG("Awoken from sleep, message type is %u with size %u", waiter->response.type, waiter->response.size);
+    memcpy(transaction->response, waiter->response.data, VMBusMessageTypeTable[transaction->responseType].size);
+    freeMessageWaiter(waiter);
+    recordControlRoundTrip(startTime);
+  }
+
+  return kIOReturnSuccess;
+}
+
+IOReturn HyperVVMBus::postVMBusMessage(VMBusChannelMessage *message, UInt32 messageSize) {
   HypercallStatus hvStatus = kHypercallStatusSuccess;
   IOReturn returnStatus = kIOReturnSuccess;
   bool postCompleted = false;
-  
-  const VMBusMessageTypeTableEntry *msgEntry = &VMBusMessageTypeTable[message->header.type];
-  UInt32 size = messageSize != NULL ? *messageSize : msgEntry->size;
-  
+
   //
   // Multiple hypercalls may fail due to lack of resources on the host
   // side, just try again if that happens.
   //
   for (int i = 0; i < kHyperVHypercallRetryCount; i++) {
-    HVDBGLOG("Sending message on connection ID %u, type %u, %u bytes", _vmbusMsgConnectionId, msgEntry->type, size);
-    hvStatus = hvController->hypercallPostMessage(_vmbusMsgConnectionId, kHyperVMessageTypeChannel, message, (UInt32) size);
+    HVDBGLOG("Sending message on connection ID %u, type %u, %u bytes", _vmbusMsgConnectionId, message->header.type, messageSize);
+    hvStatus = hvController->hypercallPostMessage(_vmbusMsgConnectionId, kHyperVMessageTypeChannel, message, messageSize);
     
     switch (hvStatus) {
       case kHypercallStatusSuccess:
@@ -145,22 +232,81 @@ IOReturn HyperVVMBus::sendVMBusMessageGated(VMBusChannelMessage *message, UInt32
   }
   
   if (returnStatus != kIOReturnSuccess) {
-    HVSYSLOG("Hypercall message type 0x%X failed with status 0x%X", msgEntry->type, hvStatus);
-    return returnStatus;
+    HVSYSLOG("Hypercall message type 0x%X failed with status 0x%X", message->header.type, hvStatus);
   }
-  
-  if (*responseType != kVMBusChannelMessageTypeInvalid) {
-    //
-    // Wait for response.
-    //
-    _vmbusWaitForMessageType = *responseType;
-    _cmdGate->commandSleep(&_cmdGateEvent);
+  return returnStatus;
+}
 
-    HVDBGLOG("Awoken from sleep, message type is %u with size %u", _vmbusWaitMessage.type, _vmbusWaitMessage.size);
-    memcpy(responseMessage, _vmbusWaitMessage.data, VMBusMessageTypeTable[*responseType].size);
+UInt32 HyperVVMBus::getVMBusMessageKey(VMBusChannelMessage *message) {
+  //
+  // Requests and their responses share a key where the response carries one.
+  //
+  switch (message->header.type) {
+    case kVMBusChannelMessageTypeChannelOpen:
+      return ((VMBusChannelMessageChannelOpen*) message)->openId;
+    case kVMBusChannelMessageTypeChannelOpenResponse:
+      return ((VMBusChannelMessageChannelOpenResponse*) message)->openId;
+    case kVMBusChannelMessageTypeGPADLHeader:
+      return ((VMBusChannelMessageGPADLHeader*) message)->gpadl;
+    case kVMBusChannelMessageTypeGPADLBody:
+      return ((VMBusChannelMessageGPADLBody*) message)->gpadl;
+    case kVMBusChannelMessageTypeGPADLCreated:
+      return ((VMBusChannelMessageGPADLCreated*) message)->gpadl;
+    case kVMBusChannelMessageTypeGPADLTeardown:
+      return ((VMBusChannelMessageGPADLTeardown*) message)->gpadl;
+    case kVMBusChannelMessageTypeGPADLTeardownResponse:
+      return ((VMBusChannelMessageGPADLTeardownResponse*) message)->gpadl;
+    default:
+      return 0;
   }
-  
-  return kIOReturnSuccess;
+}
+
+VMBusMessageWaiter *HyperVVMBus::allocateMessageWaiter(VMBusChannelMessageType responseType, UInt32 key) {
+  for (UInt32 i = 0; i < kVMBusMaxMessageWaiters; i++) {
+    if (!_vmbusMessageWaiters[i].inUse) {
+      _vmbusMessageWaiters[i].inUse        = true;
+      _vmbusMessageWaiters[i].completed    = false;
+      _vmbusMessageWaiters[i].responseType = responseType;
+      _vmbusMessageWaiters[i].key          = key;
+      return &_vmbusMessageWaiters[i];
+    }
+  }
+  return nullptr;
+}
+
+void HyperVVMBus::freeMessageWaiter(VMBusMessageWaiter *waiter) {
+  waiter->inUse = false;
+  _cmdGate->commandWakeup(_vmbusMessageWaiters);
+}
+
+VMBusMessageWaiter *HyperVVMBus::findMessageWaiter(VMBusChannelMessage *message) {
+  UInt32 key = getVMBusMessageKey(message);
+
+  for (UInt32 i = 0; i < kVMBusMaxMessageWaiters; i++) {
+    if (_vmbusMessageWaiters[i].inUse && !_vmbusMessageWaiters[i].completed
+        && _vmbusMessageWaiters[i].responseType == message->header.type && _vmbusMessageWaiters[i].key == key) {
+      return &_vmbusMessageWaiters[i];
+    }
+  }
+  return nullptr;
+}
+
+void HyperVVMBus::recordControlRoundTrip(UInt64 startTime) {
+  UInt64 endTime;
+  UInt64 roundTripNs;
+  UInt64 maxNs;
+
+  //
+  // Track time from posting a control message to receiving its response.
+  // Statistics are published from serializeProperties().
+  //
+  clock_get_uptime(&endTime);
+  absolutetime_to_nanoseconds(endTime - startTime, &roundTripNs);
+  __sync_fetch_and_add(&_numControlRoundTrips, 1);
+  __sync_fetch_and_add(&_controlRoundTripTotalNs, roundTripNs);
+  do {
+    maxNs = _controlRoundTripMaxNs;
+  } while (roundTripNs > maxNs && !__sync_bool_compare_and_swap(&_controlRoundTripMaxNs, maxNs, roundTripNs));
 }
 
 void HyperVVMBus::processIncomingVMBusMessage(UInt32 cpu) {
@@ -182,17 +328,18 @@ void HyperVVMBus::processIncomingVMBusMessage(UInt32 cpu) {
     VMBusChannelMessage *msg = (VMBusChannelMessage*) &vmbusMessage->data[0];
     HVDBGLOG("Incoming VMBus message type %u on CPU %u", msg->header.type, cpu);
     
-    if (_vmbusWaitForMessageType != kVMBusChannelMessageTypeInvalid && _vmbusWaitForMessageType == msg->header.type) {
-      HVDBGLOG("Woke for response %u", _vmbusWaitForMessageType);
-      _vmbusWaitForMessageType = kVMBusChannelMessageTypeInvalid;
+    VMBusMessageWaiter *waiter = findMessageWaiter(msg);
+    if (waiter != nullptr) {
+      HVDBGLOG("Woke for response %u (key 0x%X)", waiter->responseType, waiter->key);
       
       //
       // Store message response.
       //
-      memcpy(&_vmbusWaitMessage, vmbusMessage, sizeof (_vmbusWaitMessage));
+      memcpy(&waiter->response, vmbusMessage, sizeof (waiter->response));
+      waiter->completed = true;
       hvController->sendSynICEOM(cpu);
       
-      _cmdGate->commandWakeup(&_cmdGateEvent);
+      _cmdGate->commandWakeup(waiter);
       return;
     }
     
@@ -335,6 +482,18 @@ bool HyperVVMBus::addVMBusDevice(VMBusChannelMessageChannelOffer *offerMessage)
     _vmbusChannels[channelId].connectionSignalId    = kVMBusConnIdEvent;
   }
 
+  //
+  // Channels with a monitor ID allocated by Hyper-V can be signaled through the monitor page.
+  // Dedicated interrupt channels are latency sensitive and always use the signal hypercall.
+  //
+  _vmbusChannels[channelId].useMonitor = !_vmbusMnfDisabled && _vmbusMnf2.buffer != nullptr
+    && _vmbusChannels[channelId].offerMessage.monitorAllocated && !_vmbusChannels[channelId].useDedicatedInterrupt
+    && _vmbusChannels[channelId].offerMessage.monitorId < kHyperVMonitorIdCount;
+  if (_vmbusChannels[channelId].useMonitor) {
+    _vmbusChannels[channelId].monitorGroup = _vmbusChannels[channelId].offerMessage.monitorId / kHyperVMonitorBitsPerGroup;
+    _vmbusChannels[channelId].monitorBit   = _vmbusChannels[channelId].offerMessage.monitorId % kHyperVMonitorBitsPerGroup;
+  }
+
   return true;
 }
 
@@ -439,8 +598,13 @@ bool HyperVVMBus::registerVMBusDevice(VMBusChannel *channel) {
     childDevice->release();
     return false;
   }
-  childDevice->registerService();
+  childDevice->recordBootPhase(kHyperVVMBusDeviceBootPhaseOfferReceived);
+
+  //
+  // Nub must be published before matching, as the driver may open the channel immediately.
+  //
   channel->deviceNub = childDevice;
+  childDevice->registerService();
 
   return true;
 }
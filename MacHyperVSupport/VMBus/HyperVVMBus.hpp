@@ -11,6 +11,7 @@
 #include <IOKit/IOCommandGate.h>
 #include <IOKit/IOEventSource.h>
 #include <IOKit/IOInterruptEventSource.h>
+#include <IOKit/IOTimerEventSource.h>
 #include <IOKit/IOService.h>
 
 #include "HyperV.hpp"
@@ -20,6 +21,20 @@
 
 #define kVMBusArrayInitialChildrenCount        10
 
+//
+// Channel interrupt balancing.
+// Channels are only moved when the busiest CPU exceeds the minimum rate, and the move reduces its load by the hysteresis
+// percentage. A moved channel is left in place for the cooldown period.
+//
+#define kVMBusBalancerIntervalMS              1000
+#define kVMBusBalancerMinInterruptRate        2000
+#define kVMBusBalancerHysteresisPercent       25
+#define kVMBusBalancerCooldownIntervals       10
+
+#define kVMBusChannelTargetCPUKey             "HVTargetCPU"
+#define kVMBusChannelRebalanceCountKey        "HVChannelRebalanceCount"
+#define kVMBusControlMessageStatisticsKey     "HVControlMessageStatistics"
+
 class HyperVVMBusDevice;
 class VMBusInterruptProcessor;
 
@@ -33,6 +48,31 @@ typedef enum {
   kVMBusChannelStatusOpen
 } VMBusChannelStatus;
 
+//
+// Control message transaction waiting for a response.
+// Responses are matched by type and key, the channel open ID or GPADL handle where the response carries one.
+//
+#define kVMBusMaxMessageWaiters   16
+
+typedef struct {
+  bool                    inUse;
+  bool                    completed;
+  VMBusChannelMessageType responseType;
+  UInt32                  key;
+  HyperVMessage           response;
+} VMBusMessageWaiter;
+
+//
+// One or more control messages posted back to back, with an optional response to the last one.
+//
+typedef struct {
+  VMBusChannelMessage     **messages;
+  UInt32                  *messageSizes;
+  UInt32                  messageCount;
+  VMBusChannelMessageType responseType;
+  VMBusChannelMessage     *response;
+} VMBusMessageTransaction;
+
 //
 // Used for per-channel tracking of buffers and stats.
 //
@@ -43,6 +83,21 @@ typedef struct {
   VMBusChannelMessageChannelOffer offerMessage;
   bool                            useDedicatedInterrupt;
   UInt32                          connectionSignalId;
+  UInt32                          targetCpu;
+
+  //
+  // Monitored notification, used in place of signal hypercall if allocated by Hyper-V.
+  //
+  bool                            useMonitor;
+  UInt8                           monitorGroup;
+  UInt8                           monitorBit;
+
+  //
+  // Interrupt rate tracking for balancing.
+  //
+  UInt64                          lastInterruptCount;
+  UInt64                          interruptRate;
+  UInt32                          balanceCooldown;
   
   //
   // Unique GPADL handle for this channel.
@@ -96,23 +151,37 @@ private:
   HyperVEventFlags    *vmbusTxEventFlags;
   HyperVDMABuffer     _vmbusMnf1 = { };
   HyperVDMABuffer     _vmbusMnf2 = { };
+  bool                _vmbusMnfDisabled = false;
   
   //
-  // Flag used for waiting for incoming message response.
-  // 0 = disable.
+  // Outstanding control message transactions waiting for a response.
   //
-  UInt8               _vmbusWaitForMessageType = 0;
-  UInt32              _vmbusWaitMessageCpu = 0;
-  HyperVMessage       _vmbusWaitMessage = { };
+  VMBusMessageWaiter  _vmbusMessageWaiters[kVMBusMaxMessageWaiters] = { };
   
   IOCommandGate           *_cmdGate = nullptr;
   bool                    _cmdShouldWake = false;
-  bool                    _cmdGateEvent = false;
   
   
   UInt32                  _nextGpadlHandle      = kHyperVGpadlNullHandle;
   UInt32                  _vmbusVersion         = 0;
   UInt16                  _vmbusMsgConnectionId = 0;
+
+  //
+  // Channel interrupt targeting.
+  //
+  bool                    _channelTargetingDisabled = false;
+  UInt32                  _nextTargetCpu            = 0;
+  IOTimerEventSource      *_balancerTimer           = nullptr;
+  UInt64                  *_balancerCpuLoads        = nullptr;
+  UInt32                  _balancerCpuLoadsSize     = 0;
+  UInt32                  _numChannelRebalances     = 0;
+
+  //
+  // Control message statistics, updated from concurrent transactions.
+  //
+  volatile UInt64         _numControlRoundTrips     = 0;
+  volatile UInt64         _controlRoundTripTotalNs  = 0;
+  volatile UInt64         _controlRoundTripMaxNs    = 0;
 public:
   VMBusChannel            _vmbusChannels[kVMBusMaxChannels] = { };
   
@@ -133,7 +202,13 @@ private:
   bool allocateVMBusBuffers();
   bool sendVMBusMessage(VMBusChannelMessage *message, VMBusChannelMessageType responseType = kVMBusChannelMessageTypeInvalid, VMBusChannelMessage *response = NULL);
   bool sendVMBusMessageWithSize(VMBusChannelMessage *message, UInt32 messageSize, VMBusChannelMessageType responseType = kVMBusChannelMessageTypeInvalid, VMBusChannelMessage *response = NULL);
-  IOReturn sendVMBusMessageGated(VMBusChannelMessage *message, UInt32 *messageSize, VMBusChannelMessageType *responseType, VMBusChannelMessage *response);
+  bool sendVMBusMessages(VMBusMessageTransaction *transaction);
+  IOReturn sendVMBusMessagesGated(VMBusMessageTransaction *transaction);
+  IOReturn postVMBusMessage(VMBusChannelMessage *message, UInt32 messageSize);
+  UInt32 getVMBusMessageKey(VMBusChannelMessage *message);
+  VMBusMessageWaiter *allocateMessageWaiter(VMBusChannelMessageType responseType, UInt32 key);
+  void freeMessageWaiter(VMBusMessageWaiter *waiter);
+  VMBusMessageWaiter *findMessageWaiter(VMBusChannelMessage *message);
   bool connectVMBus();
   bool negotiateVMBus(UInt32 version);
   bool scanVMBus();
@@ -145,6 +220,12 @@ private:
   //
   // VMBus channel management.
   //
+  UInt32 selectChannelTargetCpu();
+  void startChannelBalancer();
+  void handleBalancerTimer(IOTimerEventSource *sender);
+  void sampleChannelInterruptRates();
+  void publishChannelTargetCpu(VMBusChannel *channel);
+  void recordControlRoundTrip(UInt64 startTime);
   
 
   void freeVMBusChannel(UInt32 channelId);
@@ -154,6 +235,7 @@ public:
   // IOService overrides.
   //
   bool attach(IOService *provider) APPLE_KEXT_OVERRIDE;
+  bool serializeProperties(OSSerialize *serialize) const APPLE_KEXT_OVERRIDE;
   
   //
   // Misc functions.
@@ -167,7 +249,10 @@ public:
   VMBusChannelStatus getVMBusChannelStatus(UInt32 channelId);
   IOReturn openVMBusChannel(UInt32 channelId, UInt32 txBufferSize, VMBusRingBuffer **txBuffer, UInt32 rxBufferSize, VMBusRingBuffer **rxBuffer);
   IOReturn closeVMBusChannel(UInt32 channelId);
+  IOReturn modifyVMBusChannelTargetCpu(UInt32 channelId, UInt32 cpu);
   IOReturn initVMBusChannelGPADL(UInt32 channelId, HyperVDMABuffer *dmaBuffer, UInt32 *gpadlHandle);
+  IOReturn initVMBusChannelGPADL(UInt32 channelId, IOMemoryDescriptor *memDesc, UInt32 *gpadlHandle);
+  IOReturn initVMBusChannelGPADL(UInt32 channelId, const UInt64 *pfnArray, UInt32 pageCount, UInt32 *gpadlHandle);
   IOReturn freeVMBusChannelGPADL(UInt32 channelId, UInt32 gpadlHandle);
   void signalVMBusChannel(UInt32 channelId);
 };
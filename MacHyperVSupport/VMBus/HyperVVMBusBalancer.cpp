@@ -0,0 +1,157 @@
+//
+//  HyperVVMBusBalancer.cpp
+//  Hyper-V VMBus controller
+//
+//  Copyright © 2022 Goldfish64. All rights reserved.
+//
+
+#include "HyperVVMBus.hpp"
+#include "HyperVVMBusDevice.hpp"
+
+void HyperVVMBus::startChannelBalancer() {
+  //
+  // Balancing requires channels to be retargeted after opening.
+  //
+  if (_vmbusVersion < kVMBusVersionWIN10_V4_1 || _channelTargetingDisabled || hvController->getCPUCount() < 2) {
+    HVDBGLOG("Channel interrupt balancing is not supported");
+    return;
+  }
+  if (checkKernelArgument("-hvvmbusnobalance")) {
+    HVDBGLOG("Channel interrupt balancing is disabled");
+    return;
+  }
+
+  _balancerCpuLoadsSize = sizeof (*_balancerCpuLoads) * hvController->getCPUCount();
+  _balancerCpuLoads     = (UInt64*) IOMalloc(_balancerCpuLoadsSize);
+  if (_balancerCpuLoads == nullptr) {
+    HVSYSLOG("Failed to allocate channel balancer CPU loads");
+    return;
+  }
+
+  _balancerTimer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &HyperVVMBus::handleBalancerTimer));
+  if (_balancerTimer == nullptr) {
+    HVSYSLOG("Failed to create channel balancer timer");
+    IOFree(_balancerCpuLoads, _balancerCpuLoadsSize);
+    _balancerCpuLoads = nullptr;
+    return;
+  }
+  getWorkLoop()->addEventSource(_balancerTimer);
+  _balancerTimer->enable();
+  _balancerTimer->setTimeoutMS(kVMBusBalancerIntervalMS);
+  HVDBGLOG("Channel interrupt balancing started");
+}
+
+void HyperVVMBus::publishChannelTargetCpu(VMBusChannel *channel) {
+  OSNumber *number;
+
+  if (channel->deviceNub == nullptr) {
+    return;
+  }
+
+  number = OSNumber::withNumber(channel->targetCpu, 32);
+  if (number != nullptr) {
+    channel->deviceNub->setProperty(kVMBusChannelTargetCPUKey, number);
+    number->release();
+  }
+}
+
+void HyperVVMBus::sampleChannelInterruptRates() {
+  VMBusChannel *channel;
+  UInt64       interruptCount;
+
+  bzero(_balancerCpuLoads, _balancerCpuLoadsSize);
+
+  //
+  // Interrupt rates are per balancer interval, summed per CPU.
+  //
+  for (UInt32 i = 1; i < kVMBusMaxChannels; i++) {
+    channel = &_vmbusChannels[i];
+    if (channel->status != kVMBusChannelStatusOpen || channel->deviceNub == nullptr) {
+      continue;
+    }
+
+    interruptCount = channel->deviceNub->getInterruptCount();
+    channel->interruptRate = (channel->lastInterruptCount != 0 && interruptCount >= channel->lastInterruptCount)
+                               ? interruptCount - channel->lastInterruptCount : 0;
+    channel->lastInterruptCount = interruptCount;
+    if (channel->balanceCooldown > 0) {
+      channel->balanceCooldown--;
+    }
+
+    if (channel->targetCpu < hvController->getCPUCount()) {
+      _balancerCpuLoads[channel->targetCpu] += channel->interruptRate;
+    }
+  }
+}
+
+void HyperVVMBus::handleBalancerTimer(IOTimerEventSource *sender) {
+  UInt32       cpuCount = hvController->getCPUCount();
+  UInt32       busiestCpu;
+  UInt32       idlestCpu;
+  UInt32       moveChannelId;
+  UInt64       moveRate;
+  UInt64       loadDifference;
+  VMBusChannel *channel;
+  OSNumber     *number;
+
+  sampleChannelInterruptRates();
+
+  do {
+    //
+    // Find busiest and idlest CPUs that can receive channel interrupts.
+    //
+    busiestCpu = UINT32_MAX;
+    idlestCpu  = UINT32_MAX;
+    for (UInt32 cpu = 0; cpu < cpuCount; cpu++) {
+      if (!hvController->isCPUInterruptCapable(cpu)) {
+        continue;
+      }
+      if (busiestCpu == UINT32_MAX || _balancerCpuLoads[cpu] > _balancerCpuLoads[busiestCpu]) {
+        busiestCpu = cpu;
+      }
+      if (idlestCpu == UINT32_MAX || _balancerCpuLoads[cpu] < _balancerCpuLoads[idlestCpu]) {
+        idlestCpu = cpu;
+      }
+    }
+    if (busiestCpu == UINT32_MAX || busiestCpu == idlestCpu
+        || _balancerCpuLoads[busiestCpu] < kVMBusBalancerMinInterruptRate) {
+      break;
+    }
+    loadDifference = _balancerCpuLoads[busiestCpu] - _balancerCpuLoads[idlestCpu];
+
+    //
+    // Pick the busiest channel on the busiest CPU that still reduces the peak once moved, so the two CPUs do not swap roles.
+    // The reduction must be large enough to be worth the move.
+    //
+    moveChannelId = 0;
+    moveRate      = 0;
+    for (UInt32 i = 1; i < kVMBusMaxChannels; i++) {
+      channel = &_vmbusChannels[i];
+      if (channel->status != kVMBusChannelStatusOpen || channel->targetCpu != busiestCpu || channel->balanceCooldown > 0) {
+        continue;
+      }
+      if (channel->interruptRate > moveRate && channel->interruptRate < loadDifference) {
+        moveChannelId = i;
+        moveRate      = channel->interruptRate;
+      }
+    }
+    if (moveChannelId == 0 || (moveRate * 100) < (_balancerCpuLoads[busiestCpu] * kVMBusBalancerHysteresisPercent)) {
+      break;
+    }
+
+    HVDBGLOG("Moving channel %u (%llu interrupts) from CPU %u (%llu) to CPU %u (%llu)", moveChannelId, moveRate,
+             busiestCpu, _balancerCpuLoads[busiestCpu], idlestCpu, _balancerCpuLoads[idlestCpu]);
+    if (modifyVMBusChannelTargetCpu(moveChannelId, idlestCpu) == kIOReturnSuccess) {
+      _vmbusChannels[moveChannelId].balanceCooldown = kVMBusBalancerCooldownIntervals;
+      _numChannelRebalances++;
+
+      number = OSNumber::withNumber(_numChannelRebalances, 32);
+      if (number != nullptr) {
+        setProperty(kVMBusChannelRebalanceCountKey, number);
+        number->release();
+      }
+    }
+  } while (false);
+
+  sender->setTimeoutMS(kVMBusBalancerIntervalMS);
+}
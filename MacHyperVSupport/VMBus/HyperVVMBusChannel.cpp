@@ -6,6 +6,23 @@
 //
 
 #include "HyperVVMBus.hpp"
+#include "HyperVVMBusDevice.hpp"
+
+UInt32 HyperVVMBus::selectChannelTargetCpu() {
+  UInt32 cpuCount = getHvController()->getCPUCount();
+  UInt32 cpu;
+
+  //
+  // Distribute channels round-robin across processors with a working SynIC.
+  //
+  for (UInt32 i = 0; i < cpuCount; i++) {
+    cpu = __sync_fetch_and_add(&_nextTargetCpu, 1) % cpuCount;
+    if (getHvController()->isCPUInterruptCapable(cpu)) {
+      return cpu;
+    }
+  }
+  return 0;
+}
 
 VMBusChannelStatus HyperVVMBus::getVMBusChannelStatus(UInt32 channelId) {
   if (channelId == 0 || channelId >= kVMBusMaxChannels) {
@@ -64,8 +81,12 @@ IOReturn HyperVVMBus::openVMBusChannel(UInt32 channelId, UInt32 txBufferSize, VM
   //
   // Allocate channel ring buffers.
   // TX and RX ring buffers are allocated and provided to Hyper-V as a single large buffer.
+  // The ring buffers are only ever accessed through the GPADL, and do not need to be physically contiguous.
   //
-  getHvController()->allocateDmaBuffer(&channel->dataBuffer, totalBufferSize);
+  if (!getHvController()->allocateDmaBuffer(&channel->dataBuffer, totalBufferSize, false)) {
+    HVSYSLOG("Failed to allocate ring buffers for channel %u", channelId);
+    return kIOReturnNoResources;
+  }
   getHvController()->allocateDmaBuffer(&channel->eventBuffer, PAGE_SIZE);
   
   //
@@ -78,6 +99,9 @@ IOReturn HyperVVMBus::openVMBusChannel(UInt32 channelId, UInt32 txBufferSize, VM
     getHvController()->freeDmaBuffer(&channel->eventBuffer);
     return status;
   }
+  if (channel->deviceNub != nullptr) {
+    channel->deviceNub->recordBootPhase(kHyperVVMBusDeviceBootPhaseGPADLCreated);
+  }
   
   //
   // Configure TX and RX buffer pointers for channel state tracking.
@@ -96,15 +120,18 @@ IOReturn HyperVVMBus::openVMBusChannel(UInt32 channelId, UInt32 txBufferSize, VM
   openMsg.ringBufferGpadlHandle           = channel->dataGpadlHandle;
   openMsg.downstreamRingBufferPageOffset  = channel->rxPageIndex;
   openMsg.targetCpu                       = 0;
+  channel->targetCpu                      = 0;
 
   //
   // Windows Server 2012 / Windows 8, and newer, support specific CPUs for interrupts.
-  // TODO: Does not work on newer versions like Monterey, interrupts on other CPUs never arrive.
+  // Hyper-V expects the virtual processor index, which may differ from the XNU CPU number.
+  // Only processors where the controller has seen interrupts arrive are targeted.
   //
-  /*if (_vmbusVersion >= kVMBusVersionWIN8 && !checkKernelArgument("-hvvmbusnocpu")) {
-    openMsg.targetCpu = channelId % real_ncpus;
+  if (_vmbusVersion >= kVMBusVersionWIN8 && !_channelTargetingDisabled) {
+    channel->targetCpu = selectChannelTargetCpu();
+    openMsg.targetCpu  = getHvController()->getVirtualProcessorIndex(channel->targetCpu);
   }
-  HVDBGLOG("Channel %u target CPU: %u", channelId, openMsg.targetCpu);*/
+  HVDBGLOG("Channel %u target CPU: %u (VP %u)", channelId, channel->targetCpu, openMsg.targetCpu);
 
   //
   // Send channel open message to Hyper-V and wait for response.
@@ -121,7 +148,14 @@ IOReturn HyperVVMBus::openVMBusChannel(UInt32 channelId, UInt32 txBufferSize, VM
     return kIOReturnIOError;
   }
   
-  channel->status = kVMBusChannelStatusOpen;
+  channel->status             = kVMBusChannelStatusOpen;
+  channel->lastInterruptCount = 0;
+  channel->interruptRate      = 0;
+  channel->balanceCooldown    = kVMBusBalancerCooldownIntervals;
+  publishChannelTargetCpu(channel);
+  if (channel->deviceNub != nullptr) {
+    channel->deviceNub->recordBootPhase(kHyperVVMBusDeviceBootPhaseChannelOpened);
+  }
   *txBuffer = channel->txBuffer;
   *rxBuffer = channel->rxBuffer;
   
@@ -177,41 +211,147 @@ IOReturn HyperVVMBus::closeVMBusChannel(UInt32 channelId) {
   return kIOReturnSuccess;
 }
 
+IOReturn HyperVVMBus::modifyVMBusChannelTargetCpu(UInt32 channelId, UInt32 cpu) {
+  VMBusChannel                      *channel;
+  VMBusChannelMessageChannelModify  modifyMsg;
+
+  if (channelId == 0 || channelId >= kVMBusMaxChannels || !getHvController()->isCPUInterruptCapable(cpu)) {
+    HVDBGLOG("One or more incorrect arguments provided");
+    return kIOReturnBadArgument;
+  }
+
+  //
+  // Changing the target CPU of an open channel is only supported on VMBus 4.1 and newer.
+  // Hosts before VMBus 5.3 do not send a response, interrupts may still arrive on the previous CPU for a short time.
+  //
+  if (_vmbusVersion < kVMBusVersionWIN10_V4_1) {
+    return kIOReturnUnsupported;
+  }
+
+  channel = &_vmbusChannels[channelId];
+  if (channel->status != kVMBusChannelStatusOpen) {
+    HVDBGLOG("Channel %u is not open", channelId);
+    return kIOReturnNotOpen;
+  }
+
+  bzero(&modifyMsg, sizeof (modifyMsg));
+  modifyMsg.header.type = kVMBusChannelMessageTypeChannelModify;
+  modifyMsg.channelId   = channelId;
+  modifyMsg.targetCpu   = getHvController()->getVirtualProcessorIndex(cpu);
+  if (!sendVMBusMessageWithSize((VMBusChannelMessage*) &modifyMsg, sizeof (modifyMsg))) {
+    HVSYSLOG("Failed to send modify message for channel %u", channelId);
+    return kIOReturnIOError;
+  }
+
+  HVDBGLOG("Channel %u target CPU changed from %u to %u (VP %u)", channelId, channel->targetCpu, cpu, modifyMsg.targetCpu);
+  channel->targetCpu = cpu;
+  publishChannelTargetCpu(channel);
+  return kIOReturnSuccess;
+}
+
 IOReturn HyperVVMBus::initVMBusChannelGPADL(UInt32 channelId, HyperVDMABuffer *dmaBuffer, UInt32 *gpadlHandle) {
-  bool result;
+  if (dmaBuffer == nullptr || dmaBuffer->bufDesc == nullptr) {
+    HVDBGLOG("One or more incorrect arguments provided");
+    return kIOReturnBadArgument;
+  }
+  return initVMBusChannelGPADL(channelId, dmaBuffer->bufDesc, gpadlHandle);
+}
+
+IOReturn HyperVVMBus::initVMBusChannelGPADL(UInt32 channelId, IOMemoryDescriptor *memDesc, UInt32 *gpadlHandle) {
+  IOReturn    status;
+  UInt64      *pfnArray;
+  UInt32      pfnArraySize;
+  UInt32      pageCount;
+  UInt32      pageIndex;
+  IOByteCount offset;
+  IOByteCount segmentLength;
+  UInt64      segmentAddr;
+
+  //
+  // Memory descriptor must be prepared and its length page-aligned.
+  //
+  if (memDesc == nullptr || gpadlHandle == nullptr) {
+    HVDBGLOG("One or more incorrect arguments provided");
+    return kIOReturnBadArgument;
+  }
+  if (memDesc->getLength() & PAGE_MASK) {
+    HVDBGLOG("Buffer size must be page-aligned");
+    return kIOReturnNotAligned;
+  }
+
+  pageCount = (UInt32)(memDesc->getLength() >> PAGE_SHIFT);
+  if (pageCount == 0 || pageCount > kHyperVMaxGpadlPages) {
+    HVDBGLOG("%u is outside the supported number of GPADL pages", pageCount);
+    return kIOReturnBadArgument;
+  }
+
+  pfnArraySize = pageCount * sizeof (UInt64);
+  pfnArray     = (UInt64*) IOMalloc(pfnArraySize);
+  if (pfnArray == nullptr) {
+    HVSYSLOG("Failed to allocate GPADL PFN array for channel %u", channelId);
+    return kIOReturnNoResources;
+  }
+
+  //
+  // Walk the physical segments backing the descriptor.
+  // Each segment may cover any number of pages, but must start on a page boundary.
+  //
+  status    = kIOReturnSuccess;
+  offset    = 0;
+  pageIndex = 0;
+  while (pageIndex < pageCount) {
+    segmentAddr = memDesc->getPhysicalSegment(offset, &segmentLength);
+    if (segmentAddr == 0 || (segmentAddr & PAGE_MASK) || segmentLength < PAGE_SIZE) {
+      HVSYSLOG("Invalid physical segment 0x%llX (%u bytes) at offset 0x%X for channel %u",
+               segmentAddr, (UInt32) segmentLength, (UInt32) offset, channelId);
+      status = kIOReturnNotAligned;
+      break;
+    }
+
+    for (UInt64 segmentPfn = segmentAddr >> PAGE_SHIFT;
+         segmentLength >= PAGE_SIZE && pageIndex < pageCount;
+         segmentLength -= PAGE_SIZE, segmentPfn++) {
+      pfnArray[pageIndex++] = segmentPfn;
+      offset += PAGE_SIZE;
+    }
+  }
+
+  if (status == kIOReturnSuccess) {
+    status = initVMBusChannelGPADL(channelId, pfnArray, pageCount, gpadlHandle);
+  }
+  IOFree(pfnArray, pfnArraySize);
+  return status;
+}
+
+IOReturn HyperVVMBus::initVMBusChannelGPADL(UInt32 channelId, const UInt64 *pfnArray, UInt32 pageCount, UInt32 *gpadlHandle) {
+  bool result = false;
   
-  UInt32 pageCount;
   UInt32 pfnSize;
   UInt32 pageHeaderCount;
-  UInt32 messageSize;
-  UInt64 physPageIndex;
+  UInt32 pageIndex;
   UInt32 pagesRemaining;
   UInt32 pagesBodyCount;
-  bool needsMultipleMessages;
+  UInt32 messageCount;
+  UInt32 messageArraysSize;
   
+  VMBusChannelMessage             **messages;
+  UInt32                          *messageSizes;
   VMBusChannelMessageGPADLHeader  *gpadlHeader;
   VMBusChannelMessageGPADLBody    *gpadlBody;
   VMBusChannelMessageGPADLCreated gpadlCreated;
+  VMBusMessageTransaction         transaction;
   
-  //
-  // DMA buffer size must be page-aligned.
-  //
   if (channelId == 0 || channelId >= kVMBusMaxChannels
-      || dmaBuffer == nullptr || gpadlHandle == nullptr) {
+      || pfnArray == nullptr || pageCount == 0 || gpadlHandle == nullptr) {
     HVDBGLOG("One or more incorrect arguments provided");
     return kIOReturnBadArgument;
   }
-  if (dmaBuffer->size & PAGE_MASK) {
-    HVDBGLOG("Buffer size must be page-aligned");
-    return kIOReturnNotAligned;
-  }
   
   //
   // Maximum number of pages allowed is 8190 (8192 - 2 for TX and RX headers).
   //
-  pageCount = (UInt32)(dmaBuffer->size >> PAGE_SHIFT);
   if (pageCount > kHyperVMaxGpadlPages) {
-    HVDBGLOG("%u is above the maximum supported number of GPADL pages");
+    HVDBGLOG("%u is above the maximum supported number of GPADL pages", pageCount);
     return kIOReturnBadArgument;
   }
   
@@ -226,101 +366,98 @@ IOReturn HyperVVMBus::initVMBusChannelGPADL(UInt32 channelId, HyperVDMABuffer *d
   //
   pfnSize = kHyperVMessageDataSize - sizeof (VMBusChannelMessageGPADLHeader) - sizeof (HyperVGPARange);
   pageHeaderCount = pfnSize / sizeof (UInt64);
-  needsMultipleMessages = pageCount > pageHeaderCount;
-  HVDBGLOG("Configuring GPADL handle 0x%X for channel %u of %u pages, multiple messages: %u",
-           *gpadlHandle, channelId, pageCount, needsMultipleMessages);
-  
-  //
-  // Create GPADL header message.
-  //
-  messageSize = sizeof (VMBusChannelMessageGPADLHeader) + sizeof (HyperVGPARange) + (pageHeaderCount * sizeof (UInt64));
-  gpadlHeader = (VMBusChannelMessageGPADLHeader*) IOMalloc(messageSize);
-  if (gpadlHeader == nullptr) {
-    HVSYSLOG("Failed to allocate GPADL header message for channel %u", channelId);
-    return kIOReturnNoResources;
-  }
-  bzero(gpadlHeader, messageSize);
-  
-  //
-  // Header will contain the first batch of GPADL PFNs.
-  //
-  gpadlHeader->header.type         = kVMBusChannelMessageTypeGPADLHeader;
-  gpadlHeader->channelId           = channelId;
-  gpadlHeader->gpadl               = *gpadlHandle;
-  gpadlHeader->rangeCount          = kHyperVGpadlRangeCount;
-  gpadlHeader->rangeBufferLength   = sizeof (HyperVGPARange) + (pageCount * sizeof (UInt64)); // Max page count is 8190.
-  gpadlHeader->range[0].byteOffset = 0;
-  gpadlHeader->range[0].byteCount  = (UInt32)dmaBuffer->size;
-
-  physPageIndex = dmaBuffer->physAddr >> PAGE_SHIFT;
-  for (UInt32 i = 0; i < pageHeaderCount; i++) {
-    gpadlHeader->range[0].pfnArray[i] = physPageIndex;
-    physPageIndex++;
-  }
-  
-  //
-  // Send GPADL header message.
-  // If there are multiple messages required, wait for response after the last one.
-  //
-  if (needsMultipleMessages) {
-    result = sendVMBusMessageWithSize((VMBusChannelMessage*) gpadlHeader, messageSize);
-  } else {
-    result = sendVMBusMessageWithSize((VMBusChannelMessage*) gpadlHeader, messageSize,
-                                      kVMBusChannelMessageTypeGPADLCreated, (VMBusChannelMessage*) &gpadlCreated);
+  if (pageHeaderCount > pageCount) {
+    pageHeaderCount = pageCount;
   }
-  IOFree(gpadlHeader, messageSize);
-  if (!result) {
-    HVSYSLOG("Failed to send GPADL header message for channel %u", channelId);
-    return kIOReturnIOError; // TODO:
+  messageCount = 1 + (((pageCount - pageHeaderCount) + kHyperVMaxGpadlBodyPfns - 1) / kHyperVMaxGpadlBodyPfns);
+  HVDBGLOG("Configuring GPADL handle 0x%X for channel %u of %u pages, %u messages",
+           *gpadlHandle, channelId, pageCount, messageCount);
+  
+  messageArraysSize = messageCount * (sizeof (*messages) + sizeof (*messageSizes));
+  messages          = (VMBusChannelMessage**) IOMalloc(messageArraysSize);
+  if (messages == nullptr) {
+    HVSYSLOG("Failed to allocate GPADL messages for channel %u", channelId);
+    return kIOReturnNoResources;
   }
+  bzero(messages, messageArraysSize);
+  messageSizes = (UInt32*) &messages[messageCount];
   
-  if (needsMultipleMessages) {
+  do {
     //
-    // Send rest of GPADL pages as body messages.
+    // Create GPADL header message.
+    // Header will contain the first batch of GPADL PFNs.
+    //
+    messageSizes[0] = sizeof (VMBusChannelMessageGPADLHeader) + sizeof (HyperVGPARange) + (pageHeaderCount * sizeof (UInt64));
+    gpadlHeader     = (VMBusChannelMessageGPADLHeader*) IOMalloc(messageSizes[0]);
+    if (gpadlHeader == nullptr) {
+      HVSYSLOG("Failed to allocate GPADL header message for channel %u", channelId);
+      break;
+    }
+    bzero(gpadlHeader, messageSizes[0]);
+    messages[0] = (VMBusChannelMessage*) gpadlHeader;
+    
+    gpadlHeader->header.type         = kVMBusChannelMessageTypeGPADLHeader;
+    gpadlHeader->channelId           = channelId;
+    gpadlHeader->gpadl               = *gpadlHandle;
+    gpadlHeader->rangeCount          = kHyperVGpadlRangeCount;
+    gpadlHeader->rangeBufferLength   = sizeof (HyperVGPARange) + (pageCount * sizeof (UInt64)); // Max page count is 8190.
+    gpadlHeader->range[0].byteOffset = 0;
+    gpadlHeader->range[0].byteCount  = pageCount << PAGE_SHIFT;
+    memcpy(gpadlHeader->range[0].pfnArray, pfnArray, pageHeaderCount * sizeof (UInt64));
+    pageIndex = pageHeaderCount;
+    
+    //
+    // Create body messages for the rest of the GPADL pages.
     //
     pagesRemaining = pageCount - pageHeaderCount;
-    while (pagesRemaining > 0) {
+    for (UInt32 i = 1; i < messageCount; i++) {
       if (pagesRemaining > kHyperVMaxGpadlBodyPfns) {
         pagesBodyCount = kHyperVMaxGpadlBodyPfns;
       } else {
         pagesBodyCount = pagesRemaining;
       }
       
-      messageSize = (UInt32) (sizeof (VMBusChannelMessageGPADLBody) + (pagesBodyCount * sizeof (UInt64)));
-      gpadlBody = (VMBusChannelMessageGPADLBody*) IOMalloc(messageSize);
+      messageSizes[i] = (UInt32) (sizeof (VMBusChannelMessageGPADLBody) + (pagesBodyCount * sizeof (UInt64)));
+      gpadlBody       = (VMBusChannelMessageGPADLBody*) IOMalloc(messageSizes[i]);
       if (gpadlBody == nullptr) {
         HVSYSLOG("Failed to allocate GPADL body message for channel %u", channelId);
-        return kIOReturnNoResources;
+        break;
       }
-      bzero(gpadlBody, messageSize);
+      bzero(gpadlBody, messageSizes[i]);
+      messages[i] = (VMBusChannelMessage*) gpadlBody;
       
       gpadlBody->header.type = kVMBusChannelMessageTypeGPADLBody;
       gpadlBody->gpadl       = *gpadlHandle;
-      for (UInt32 i = 0; i < pagesBodyCount; i++) {
-        gpadlBody->pfn[i] = physPageIndex;
-        physPageIndex++;
-      }
-      
-      HVDBGLOG("Processed %u body pages for for channel %u, %u remaining", pagesBodyCount, channelId, pagesRemaining);
+      memcpy(gpadlBody->pfn, &pfnArray[pageIndex], pagesBodyCount * sizeof (UInt64));
+      pageIndex      += pagesBodyCount;
       pagesRemaining -= pagesBodyCount;
-      
-      //
-      // Send body message.
-      // For the last one, we want to wait for the creation response.
-      //
-      if (pagesRemaining == 0) {
-        result = sendVMBusMessageWithSize((VMBusChannelMessage*) gpadlBody, messageSize,
-                                          kVMBusChannelMessageTypeGPADLCreated, (VMBusChannelMessage*) &gpadlCreated);
-      } else {
-        result = sendVMBusMessageWithSize((VMBusChannelMessage*) gpadlBody, messageSize);
-      }
-
-      IOFree(gpadlBody, messageSize);
-      if (!result) {
-        HVSYSLOG("Failed to send GPADL body message for channel %u", channelId);
-        return kIOReturnIOError;
-      }
     }
+    if (messages[messageCount - 1] == nullptr) {
+      break;
+    }
+    
+    //
+    // Send all GPADL messages back to back, and wait for the creation response after the last one.
+    //
+    transaction.messages     = messages;
+    transaction.messageSizes = messageSizes;
+    transaction.messageCount = messageCount;
+    transaction.responseType = kVMBusChannelMessageTypeGPADLCreated;
+    transaction.response     = (VMBusChannelMessage*) &gpadlCreated;
+    result = sendVMBusMessages(&transaction);
+    if (!result) {
+      HVSYSLOG("Failed to send GPADL messages for channel %u", channelId);
+    }
+  } while (false);
+  
+  for (UInt32 i = 0; i < messageCount; i++) {
+    if (messages[i] != nullptr) {
+      IOFree(messages[i], messageSizes[i]);
+    }
+  }
+  IOFree(messages, messageArraysSize);
+  if (!result) {
+    return kIOReturnIOError;
   }
   
   HVDBGLOG("GPADL creation response for channel %u: 0x%X", channelId, gpadlCreated.status);
@@ -371,6 +508,16 @@ void HyperVVMBus::signalVMBusChannel(UInt32 channelId) {
     sync_set_bit(channelId, vmbusTxEventFlags->flags32);
   }
 
+  //
+  // Monitored channels set the pending bit in their trigger group instead.
+  // Hyper-V polls the monitor page and signals the host side, avoiding an exit for each signal.
+  //
+  if (channel->useMonitor) {
+    HyperVMonitorPage *monitorPage = (HyperVMonitorPage*) _vmbusMnf2.buffer;
+    sync_set_bit(channel->monitorBit, &monitorPage->triggerGroups[channel->monitorGroup].pending);
+    return;
+  }
+
   HypercallStatus status = hvController->hypercallSignalEvent(channel->connectionSignalId);
   if (status != kHypercallStatusSuccess) {
     HVDBGLOG("Failed to signal for channel %u using connection ID %u with status 0x%X",
@@ -9,6 +9,7 @@
 #define VMBus_hpp
 
 #include "HyperV.hpp"
+#include "VMBusPacket.hpp"
 
 //
 // Default VMBus interrupt slots on SynIC for messages and timers.
@@ -235,6 +236,13 @@ typedef struct __attribute__((packed)) {
   UInt32                    channelId;
 } VMBusChannelMessageChannelClose;
 
+// kVMBusChannelMessageTypeChannelModify
+typedef struct __attribute__((packed)) {
+  VMBusChannelMessageHeader header;
+  UInt32                    channelId;
+  UInt32                    targetCpu;
+} VMBusChannelMessageChannelModify;
+
 #define kHyperVMaxGpadlPages    8192
 #define kHyperVGpadlRangeCount  1
 
@@ -371,109 +379,4 @@ typedef struct __attribute__((packed)) {
   UInt8             buffer[];
 } VMBusRingBuffer;
 
-//
-// Packets.
-//
-#define kVMBusPacketSizeShift         3
-#define kVMBusPacketResponseRequired  1
-
-#define HV_GET_VMBUS_PACKETSIZE(p)    ((p) << kVMBusPacketSizeShift)
-#define HV_SET_VMBUS_PACKETSIZE(p)    ((p) >> kVMBusPacketSizeShift)
-
-#define HV_PACKETALIGN(a)         (((a) + (sizeof(UInt64) - 1)) &~ (sizeof(UInt64) - 1))
-
-typedef enum : UInt16 {
-  kVMBusPacketTypeInvalid                   = 0,
-  kVMBusPacketTypeSynch                     = 1,
-  kVMBusPacketTypeAddTransferPageset        = 2,
-  kVMBusPacketTypeRemoveTransferPageset     = 3,
-  kVMBusPacketTypeEstablishGPADL            = 4,
-  kVMBusPacketTypeTeardownGPADL             = 5,
-  kVMBusPacketTypeDataInband                = 6,
-  kVMBusPacketTypeDataUsingTransferPages    = 7,
-  kVMBusPacketTypeDataUsingGPADL            = 8,
-  kVMBusPacketTypeDataUsingGPADirect        = 9,
-  kVMBusPacketTypeCancelRequest             = 10,
-  kVMBusPacketTypeCompletion                = 11,
-  kVMBusPacketTypeDataUsingAdditionalPacket = 12,
-  kVMBusPacketTypeAdditionalData            = 13
-} VMBusPacketType;
-
-typedef struct __attribute__((packed)) {
-  //
-  // Packet type.
-  //
-  VMBusPacketType   type;
-  //
-  // Header length as a multiple of 8 bytes.
-  //
-  UInt16            headerLength;
-  //
-  // Total packet length as a multiple of 8 bytes.
-  //
-  UInt16            totalLength;
-  //
-  // Packet flags.
-  //
-  UInt16            flags;
-  //
-  // Packet transaction ID.
-  //
-  UInt64            transactionId;
-} VMBusPacketHeader;
-
-typedef struct __attribute__((packed)) {
-  UInt32 count;
-  UInt32 offset;
-} VMBusTransferPageRange;
-
-typedef struct __attribute__((packed)) {
-  VMBusPacketHeader       header;
-  
-  UInt16                  transferPagesetId;
-  UInt8                   senderOwnsSets;
-  UInt8                   reserved;
-  UInt32                  rangeCount;
-  VMBusTransferPageRange  ranges[1];
-} VMBusPacketTransferPages;
-
-#define kVMBusMaxPageBufferCount    32
-
-//
-// Single page buffer.
-//
-typedef struct __attribute__((packed)) {
-  UInt32  length;
-  UInt32  offset;
-  UInt64  pfn;
-} VMBusSinglePageBuffer;
-
-typedef struct __attribute__((packed)) {
-  VMBusPacketHeader         header;
-  
-  UInt32                    reserved;
-  //
-  // Number of single pages.
-  //
-  UInt32                    rangeCount;
-  VMBusSinglePageBuffer     ranges[kVMBusMaxPageBufferCount];
-} VMBusPacketSinglePageBuffer;
-
-//
-// Multiple page buffer.
-//
-typedef struct __attribute__((packed)) {
-  UInt32  length;
-  UInt32  offset;
-  UInt64  pfns[];
-} VMBusMultiPageBuffer;
-
-typedef struct __attribute__((packed)) {
-  VMBusPacketHeader         header;
-  
-  UInt32                    reserved;
-  UInt32                    rangeCount; // Always 1 for this driver.
-  VMBusMultiPageBuffer      range;
-} VMBusPacketMultiPageBuffer;
-
 #endif
@@ -9,6 +9,17 @@
 
 OSDefineMetaClassAndStructors(HyperVVMBusDevice, super);
 
+//
+// Registry keys for bring-up phases, nanoseconds since boot.
+//
+static const char *bootPhaseNames[kHyperVVMBusDeviceBootPhaseCount] = {
+  "OfferReceivedNS",
+  "GPADLCreatedNS",
+  "ChannelOpenedNS",
+  "ProtocolNegotiatedNS",
+  "RegisteredNS"
+};
+
 bool HyperVVMBusDevice::attach(IOService *provider) {
   bool result = false;
 
@@ -166,6 +177,82 @@ IOWorkLoop* HyperVVMBusDevice::getWorkLoop() const {
   return _workLoop;
 }
 
+bool HyperVVMBusDevice::serializeProperties(OSSerialize *serialize) const {
+  HyperVVMBusDevice *device = (HyperVVMBusDevice *) this;
+
+  const struct {
+    const char *key;
+    UInt64     value;
+  } stats[] = {
+    { "Interrupts",      _numInterrupts },
+    { "PacketsReceived", _numPacketsReceived },
+    { "BytesReceived",   _numBytesReceived },
+    { "PacketsSent",     _numPacketsSent },
+    { "BytesSent",       _numBytesSent },
+    { "HostSignals",     _numHostSignals },
+    { "TxRingFull",      _numTxRingFull },
+    { "TxRingSize",      _txBufferSize },
+    { "TxRingHighWater", _txRingHighWater },
+    { "RxRingSize",      _rxBufferSize },
+    { "RxRingHighWater", _rxRingHighWater }
+  };
+
+  //
+  // Refresh channel statistics each time the registry is read.
+  //
+  OSDictionary *dict = OSDictionary::withCapacity(arrsize(stats));
+  if (dict != nullptr) {
+    for (UInt32 i = 0; i < arrsize(stats); i++) {
+      OSNumber *number = OSNumber::withNumber(stats[i].value, 64);
+      if (number != nullptr) {
+        dict->setObject(stats[i].key, number);
+        number->release();
+      }
+    }
+    device->setProperty(kHyperVVMBusDeviceChannelStatisticsKey, dict);
+    dict->release();
+  }
+
+  //
+  // Refresh bring-up profile, phases not yet reached are omitted.
+  //
+  dict = OSDictionary::withCapacity(kHyperVVMBusDeviceBootPhaseCount);
+  if (dict != nullptr) {
+    for (UInt32 i = 0; i < kHyperVVMBusDeviceBootPhaseCount; i++) {
+      UInt64 phaseNs;
+      if (_bootPhaseTimes[i] == 0) {
+        continue;
+      }
+
+      absolutetime_to_nanoseconds(_bootPhaseTimes[i], &phaseNs);
+      OSNumber *number = OSNumber::withNumber(phaseNs, 64);
+      if (number != nullptr) {
+        dict->setObject(bootPhaseNames[i], number);
+        number->release();
+      }
+    }
+    device->setProperty(kHyperVVMBusDeviceBootProfileKey, dict);
+    dict->release();
+  }
+
+  return super::serializeProperties(serialize);
+}
+
+void HyperVVMBusDevice::recordBootPhase(HyperVVMBusDeviceBootPhase phase) {
+  UInt64 now;
+
+  //
+  // Only the first occurrence of each phase is kept, later reopens do not count towards boot.
+  //
+  if (phase >= kHyperVVMBusDeviceBootPhaseCount || _bootPhaseTimes[phase] != 0) {
+    return;
+  }
+
+  clock_get_uptime(&now);
+  _bootPhaseTimes[phase] = now;
+  HVDBGLOG("Boot phase %s reached", bootPhaseNames[phase]);
+}
+
 IOReturn HyperVVMBusDevice::installPacketActions(OSObject *target, PacketReadyAction packetReadyAction, WakePacketAction wakePacketAction,
                                                  UInt32 initialResponseBufferLength, bool registerInterrupt, bool flushPackets) {
   if (target == nullptr || packetReadyAction == nullptr) {
@@ -206,9 +293,10 @@ void HyperVVMBusDevice::uninstallPacketActions() {
     OSSafeReleaseNULL(_interruptSource);
   }
   
-  _wakePacketAction   = nullptr;
-  _packetReadyAction  = nullptr;
-  _packetActionTarget = nullptr;
+  _packetsProcessedAction = nullptr;
+  _wakePacketAction       = nullptr;
+  _packetReadyAction      = nullptr;
+  _packetActionTarget     = nullptr;
   
   if (_rxPacketBuffer != nullptr) {
     IOFree(_rxPacketBuffer, _rxPacketBufferLength);
@@ -279,6 +367,14 @@ IOReturn HyperVVMBusDevice::createGPADLBuffer(HyperVDMABuffer *dmaBuffer, UInt32
   return _vmbusProvider->initVMBusChannelGPADL(_channelId, dmaBuffer, gpadlHandle);
 }
 
+IOReturn HyperVVMBusDevice::createGPADLBuffer(IOMemoryDescriptor *memDesc, UInt32 *gpadlHandle) {
+  return _vmbusProvider->initVMBusChannelGPADL(_channelId, memDesc, gpadlHandle);
+}
+
+IOReturn HyperVVMBusDevice::createGPADLBuffer(const UInt64 *pfnArray, UInt32 pageCount, UInt32 *gpadlHandle) {
+  return _vmbusProvider->initVMBusChannelGPADL(_channelId, pfnArray, pageCount, gpadlHandle);
+}
+
 IOReturn HyperVVMBusDevice::freeGPADLBuffer(UInt32 gpadlHandle) {
   return _vmbusProvider->freeVMBusChannelGPADL(_channelId, gpadlHandle);
 }
@@ -470,6 +566,25 @@ IOReturn HyperVVMBusDevice::writeCompletionPacketWithTransactionId(void *buffer,
   return writePacketInternal(buffer, bufferLength, kVMBusPacketTypeCompletion, transactionId, responseRequired, NULL, 0);
 }
 
+IOReturn HyperVVMBusDevice::writeInbandPacketAsync(void *buffer, UInt32 bufferLength, HyperVVMBusDeviceRequest *request,
+                                                   void *responseBuffer, UInt32 responseBufferLength) {
+  if (request == nullptr || responseBuffer == nullptr) {
+    return kIOReturnBadArgument;
+  }
+  return writePacketInternal(buffer, bufferLength, kVMBusPacketTypeDataInband, getNextTransId(), true,
+                             responseBuffer, responseBufferLength, request);
+}
+
+void HyperVVMBusDevice::waitForPacketResponse(HyperVVMBusDeviceRequest *request) {
+  if (request == nullptr || request->lock == nullptr) {
+    return;
+  }
+
+  sleepPacketRequest(request);
+  IOLockFree(request->lock);
+  request->lock = nullptr;
+}
+
 bool HyperVVMBusDevice::getPendingTransaction(UInt64 transactionId, void **buffer, UInt32 *bufferLength) {
   IOLockLock(_vmbusRequestsLock);
 
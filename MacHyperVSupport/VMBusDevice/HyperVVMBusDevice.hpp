@@ -16,11 +16,27 @@
 #include "HyperVVMBus.hpp"
 #include "HyperV.hpp"
 #include "VMBus.hpp"
+#include "HyperVVMBusRing.hpp"
 
 #define kHyperVVMBusDeviceChannelTypeKey        "HVType"
 #define kHyperVVMBusDeviceChannelInstanceKey    "HVInstance"
 #define kHyperVVMBusDeviceChannelIDKey          "HVChannel"
 #define kHyperVVMBusDeviceChannelMMIOByteCount  "HVMMIOByteCount"
+#define kHyperVVMBusDeviceChannelStatisticsKey  "HVChannelStatistics"
+#define kHyperVVMBusDeviceBootProfileKey        "HVBootProfile"
+
+//
+// Device bring-up phases, timestamped for boot profiling.
+//
+typedef enum : UInt32 {
+  kHyperVVMBusDeviceBootPhaseOfferReceived = 0,
+  kHyperVVMBusDeviceBootPhaseGPADLCreated,
+  kHyperVVMBusDeviceBootPhaseChannelOpened,
+  kHyperVVMBusDeviceBootPhaseProtocolNegotiated,
+  kHyperVVMBusDeviceBootPhaseRegistered,
+
+  kHyperVVMBusDeviceBootPhaseCount
+} HyperVVMBusDeviceBootPhase;
 
 typedef struct HyperVVMBusDeviceRequest {
   HyperVVMBusDeviceRequest  *next;
@@ -43,6 +59,7 @@ public:
   //
   typedef void (*PacketReadyAction)(void *target, VMBusPacketHeader *pktHeader, UInt32 pktHeaderLength, UInt8 *pktData, UInt32 pktDataLength);
   typedef bool (*WakePacketAction)(void *target, VMBusPacketHeader *pktHeader, UInt32 pktHeaderLength, UInt8 *pktData, UInt32 pktDataLength);
+  typedef void (*PacketsProcessedAction)(void *target);
 
 #if DEBUG
   typedef void (*TimerDebugAction)(void *target);
@@ -68,6 +85,7 @@ private:
   OSObject               *_packetActionTarget = nullptr;
   PacketReadyAction     _packetReadyAction    = nullptr;
   WakePacketAction      _wakePacketAction     = nullptr;
+  PacketsProcessedAction _packetsProcessedAction = nullptr;
   bool                  _shouldFlushPackets   = true;
 
   //
@@ -88,12 +106,31 @@ private:
   IOTimerEventSource  *_debugTimerSource   = nullptr;
   OSObject            *_timerDebugTarget   = nullptr;
   TimerDebugAction    _timerDebugAction    = nullptr;
-  UInt64              _numInterrupts       = 0;
-  UInt64              _numPackets          = 0;
 
   void handleDebugPrintTimer(IOTimerEventSource *sender);
 #endif
 
+  //
+  // Channel statistics.
+  // Sampled from the I/O Registry to derive packet rates and signals per packet.
+  // Byte counts in both directions are the 8 byte aligned ring packet length, including the
+  // VMBus packet header but not the trailing ring index.
+  //
+  UInt64 _numInterrupts       = 0;
+  UInt64 _numPacketsReceived  = 0;
+  UInt64 _numBytesReceived    = 0;
+  UInt64 _numPacketsSent      = 0;
+  UInt64 _numBytesSent        = 0;
+  UInt64 _numHostSignals      = 0;
+  UInt64 _numTxRingFull       = 0;
+  UInt32 _txRingHighWater     = 0;
+  UInt32 _rxRingHighWater     = 0;
+
+  //
+  // Bring-up phase timestamps, in absolute time.
+  //
+  UInt64 _bootPhaseTimes[kHyperVVMBusDeviceBootPhaseCount] = { };
+
   //
   // VMBus packet requests.
   //
@@ -108,18 +145,14 @@ private:
   // Internal functions.
   //
   IOReturn writePacketInternal(void *buffer, UInt32 bufferLength, VMBusPacketType packetType, UInt64 transactionId,
-                               bool responseRequired, void *responseBuffer, UInt32 responseBufferLength);
+                               bool responseRequired, void *responseBuffer, UInt32 responseBufferLength,
+                               HyperVVMBusDeviceRequest *asyncRequest = nullptr);
 
   IOReturn nextPacketAvailableGated(VMBusPacketType *type, UInt32 *packetHeaderLength, UInt32 *packetTotalLength);
   IOReturn readRawPacketGated(void *header, UInt32 *headerLength, void *buffer, UInt32 *bufferLength);
   IOReturn writeRawPacketGated(void *header, UInt32 *headerLength, void *buffer, UInt32 *bufferLength);
   IOReturn writeInbandPacketGated(void *buffer, UInt32 *bufferLength, bool *responseRequired, UInt64 *transactionId);
 
-  UInt32 copyPacketDataFromRingBuffer(UInt32 readIndex, UInt32 readLength, void *data, UInt32 dataLength);
-  UInt32 seekPacketDataFromRingBuffer(UInt32 readIndex, UInt32 readLength);
-  UInt32 copyPacketDataToRingBuffer(UInt32 writeIndex, void *data, UInt32 length);
-  UInt32 zeroPacketDataToRingBuffer(UInt32 writeIndex, UInt32 length);
-
   void addPacketRequest(HyperVVMBusDeviceRequest *vmbusRequest);
   void sleepPacketRequest(HyperVVMBusDeviceRequest *vmbusRequest);
   void prepareSleepThread();
@@ -135,11 +168,7 @@ private:
   }
   inline void getAvailableRingSpace(VMBusRingBuffer *ringBuffer, UInt32 ringBufferSize, UInt32 *readBytes, UInt32 *writeBytes) {
     __sync_synchronize();
-    UInt32 writeIndex = getRingWriteIndex(ringBuffer);
-    UInt32 readIndex  = getRingReadIndex(ringBuffer);
-
-    *writeBytes = (writeIndex >= readIndex) ? (ringBufferSize - (writeIndex - readIndex)) : (readIndex - writeIndex);
-    *readBytes = ringBufferSize - *writeBytes;
+    getRingSpace(getRingReadIndex(ringBuffer), getRingWriteIndex(ringBuffer), ringBufferSize, readBytes, writeBytes);
   }
 
 private:
@@ -154,6 +183,7 @@ public:
   void detach(IOService *provider) APPLE_KEXT_OVERRIDE;
   bool matchPropertyTable(OSDictionary *table, SInt32 *score) APPLE_KEXT_OVERRIDE;
   IOWorkLoop* getWorkLoop() const APPLE_KEXT_OVERRIDE;
+  bool serializeProperties(OSSerialize *serialize) const APPLE_KEXT_OVERRIDE;
 
   //
   // Channel management.
@@ -161,12 +191,17 @@ public:
   IOReturn installPacketActions(OSObject *target, PacketReadyAction packetReadyAction, WakePacketAction wakePacketAction,
                                 UInt32 initialResponseBufferLength, bool registerInterrupt = true, bool flushPackets = true);
   void uninstallPacketActions();
+  void setPacketsProcessedAction(PacketsProcessedAction packetsProcessedAction) { _packetsProcessedAction = packetsProcessedAction; }
   void triggerPacketAction();
   IOReturn openVMBusChannel(UInt32 txSize, UInt32 rxSize, UInt64 maxAutoTransId = UINT64_MAX);
   IOReturn closeVMBusChannel();
   IOReturn createGPADLBuffer(HyperVDMABuffer *dmaBuffer, UInt32 *gpadlHandle);
+  IOReturn createGPADLBuffer(IOMemoryDescriptor *memDesc, UInt32 *gpadlHandle);
+  IOReturn createGPADLBuffer(const UInt64 *pfnArray, UInt32 pageCount, UInt32 *gpadlHandle);
   IOReturn freeGPADLBuffer(UInt32 gpadlHandle);
   UInt32 getChannelId() { return _channelId; }
+  UInt64 getInterruptCount() { return _numInterrupts; }
+  void recordBootPhase(HyperVVMBusDeviceBootPhase phase);
   uuid_t* getInstanceId() { return &_instanceId; }
   char* getTypeIdString() { return _typeId; }
 
@@ -222,6 +257,10 @@ public:
                                          void *responseBuffer = NULL, UInt32 responseBufferLength = 0, UInt64 transactionId = 0);
   IOReturn writeCompletionPacketWithTransactionId(void *buffer, UInt32 bufferLength, UInt64 transactionId, bool responseRequired);
 
+  IOReturn writeInbandPacketAsync(void *buffer, UInt32 bufferLength, HyperVVMBusDeviceRequest *request,
+                                  void *responseBuffer, UInt32 responseBufferLength);
+  void waitForPacketResponse(HyperVVMBusDeviceRequest *request);
+
   bool getPendingTransaction(UInt64 transactionId, void **buffer, UInt32 *bufferLength);
   void wakeTransaction(UInt64 transactionId);
   void sleepThreadZero();
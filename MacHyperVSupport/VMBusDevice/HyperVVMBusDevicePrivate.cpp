@@ -20,9 +20,7 @@ void HyperVVMBusDevice::handleInterrupt(IOInterruptEventSource *sender, int coun
   void *responseBuffer;
   UInt32 responseLength;
   
-#if DEBUG
   _numInterrupts++;
-#endif
   
   //
   // Flush RX buffer of all packets.
@@ -37,6 +35,14 @@ void HyperVVMBusDevice::handleInterrupt(IOInterruptEventSource *sender, int coun
       _rxBuffer->interruptMask = 1;
       __sync_synchronize();
     }
+
+    //
+    // Track RX ring occupancy before draining.
+    //
+    getAvailableRxSpace(&readBytes, &writeBytes);
+    if (readBytes > _rxRingHighWater) {
+      _rxRingHighWater = readBytes;
+    }
     
     while (true) {
       status = readRawPacket(_rxPacketBuffer, _rxPacketBufferLength);
@@ -61,9 +67,8 @@ void HyperVVMBusDevice::handleInterrupt(IOInterruptEventSource *sender, int coun
       pktDataLength = HV_GET_VMBUS_PACKETSIZE(pktHeader->totalLength) - pktHeaderLength;
       pktData = &_rxPacketBuffer[pktHeaderLength];
       
-#if DEBUG
-      _numPackets++;
-#endif
+      _numPacketsReceived++;
+      _numBytesReceived += getRingPacketLength(pktHeader);
       
       //
       // If a wake packet handler was specified, determine if this is a packet type that should be checked and woken up.
@@ -85,6 +90,13 @@ void HyperVVMBusDevice::handleInterrupt(IOInterruptEventSource *sender, int coun
       //
       (*_packetReadyAction)(_packetActionTarget, pktHeader, pktHeaderLength, pktData, pktDataLength);
     }
+
+    //
+    // Notify child that the ring has been drained, allowing any work deferred during the drain to be done in one batch.
+    //
+    if (_packetsProcessedAction != nullptr) {
+      (*_packetsProcessedAction)(_packetActionTarget);
+    }
     
     if (_shouldFlushPackets) {
       _rxBuffer->interruptMask = 0;
@@ -98,8 +110,10 @@ void HyperVVMBusDevice::handleInterrupt(IOInterruptEventSource *sender, int coun
 IOReturn HyperVVMBusDevice::openVMBusChannelGated(UInt32 *txSize, UInt32 *rxSize) {
   IOReturn status;
   
-  _txBufferSize = *txSize;
-  _rxBufferSize = *rxSize;
+  _txBufferSize    = *txSize;
+  _rxBufferSize    = *rxSize;
+  _txRingHighWater = 0;
+  _rxRingHighWater = 0;
   
   status = _vmbusProvider->openVMBusChannel(_channelId, _txBufferSize, &_txBuffer, _rxBufferSize, &_rxBuffer);
   if (status == kIOReturnSuccess) {
@@ -109,7 +123,8 @@ IOReturn HyperVVMBusDevice::openVMBusChannelGated(UInt32 *txSize, UInt32 *rxSize
 }
 
 IOReturn HyperVVMBusDevice::writePacketInternal(void *buffer, UInt32 bufferLength, VMBusPacketType packetType, UInt64 transactionId,
-                                                bool responseRequired, void *responseBuffer, UInt32 responseBufferLength) {
+                                                bool responseRequired, void *responseBuffer, UInt32 responseBufferLength,
+                                                HyperVVMBusDeviceRequest *asyncRequest) {
   //
   // Disallow 0 for a transaction ID.
   //
@@ -139,41 +154,51 @@ IOReturn HyperVVMBusDevice::writePacketInternal(void *buffer, UInt32 bufferLengt
            pktHeader.type, pktHeader.flags, pktHeader.transactionId,
            pktHeaderLength, pktTotalLength);
   
+  //
+  // Register the request before sending so a fast completion cannot be missed.
+  // Asynchronous requests are waited on later by the caller with waitForPacketResponse().
+  //
   HyperVVMBusDeviceRequest req;
+  HyperVVMBusDeviceRequest *request = (asyncRequest != nullptr) ? asyncRequest : &req;
   if (responseBuffer != NULL) {
-    req.isSleeping = true;
-    req.lock = IOLockAlloc();
-    req.responseData = responseBuffer;
-    req.responseDataLength = responseBufferLength;
-    req.transactionId = transactionId;
-    addPacketRequest(&req);
+    request->isSleeping = true;
+    request->lock = IOLockAlloc();
+    request->responseData = responseBuffer;
+    request->responseDataLength = responseBufferLength;
+    request->transactionId = transactionId;
+    if (request->lock == nullptr) {
+      return kIOReturnNoResources;
+    }
+    addPacketRequest(request);
   }
 
   IOReturn status = _commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &HyperVVMBusDevice::writeRawPacketGated),
                                            &pktHeader, &pktHeaderLength, buffer, &bufferLength);
   
   if (responseBuffer != NULL) {
-    if (status == kIOReturnSuccess) {
-      sleepPacketRequest(&req);
-    } else {
+    if (status != kIOReturnSuccess) {
       wakeTransaction(transactionId);
+    } else if (asyncRequest != nullptr) {
+      return status;
+    } else {
+      sleepPacketRequest(request);
     }
-    IOLockFree(req.lock);
+    IOLockFree(request->lock);
+    request->lock = nullptr;
   }
   return status;
 }
 
 IOReturn HyperVVMBusDevice::nextPacketAvailableGated(VMBusPacketType *type, UInt32 *packetHeaderLength, UInt32 *packetTotalLength) {
+  VMBusPacketHeader pktHeader;
+
   //
   // No data to read.
   //
   __sync_synchronize();
-  if (_rxBuffer->readIndex == _rxBuffer->writeIndex) {
+  if (!peekRingPacket(_rxBuffer->buffer, _rxBufferSize, _rxBuffer->readIndex, _rxBuffer->writeIndex, &pktHeader)) {
     return kIOReturnNotFound;
   }
-  
-  VMBusPacketHeader pktHeader;
-  copyPacketDataFromRingBuffer(_rxBuffer->readIndex, sizeof (VMBusPacketHeader), &pktHeader, sizeof (VMBusPacketHeader));
   HVMSGLOG("Packet type %u, header size %u, total size %u",
            pktHeader.type, pktHeader.headerLength << kVMBusPacketSizeShift, pktHeader.totalLength << kVMBusPacketSizeShift);
 
@@ -191,20 +216,16 @@ IOReturn HyperVVMBusDevice::nextPacketAvailableGated(VMBusPacketType *type, UInt
 }
 
 IOReturn HyperVVMBusDevice::readRawPacketGated(void *header, UInt32 *headerLength, void *buffer, UInt32 *bufferLength) {
+  VMBusPacketHeader pktHeader;
+
   //
   // No data to read.
   //
-  if (_rxBuffer->readIndex == _rxBuffer->writeIndex) {
+  if (!peekRingPacket(_rxBuffer->buffer, _rxBufferSize, _rxBuffer->readIndex, _rxBuffer->writeIndex, &pktHeader)) {
     return kIOReturnNotReady;
   }
-  
-  //
-  // Read packet header.
-  //
-  VMBusPacketHeader pktHeader;
-  copyPacketDataFromRingBuffer(_rxBuffer->readIndex, sizeof (VMBusPacketHeader), &pktHeader, sizeof (VMBusPacketHeader));
 
-  UInt32 packetTotalLength = pktHeader.totalLength << kVMBusPacketSizeShift;
+  UInt32 packetTotalLength = getRingPacketLength(&pktHeader);
   HVMSGLOG("RAW packet type %u, flags %u, trans %llu, header length %u, total length %u", pktHeader.type, pktHeader.flags,
            pktHeader.transactionId, pktHeader.headerLength << kVMBusPacketSizeShift, packetTotalLength);
   HVMSGLOG("RAW old RX read index 0x%X, RX write index 0x%X", _rxBuffer->readIndex, _rxBuffer->writeIndex);
@@ -218,14 +239,8 @@ IOReturn HyperVVMBusDevice::readRawPacketGated(void *header, UInt32 *headerLengt
   //
   // Read raw packet.
   //
-  UInt32 readIndexNew = _rxBuffer->readIndex;
-  if (headerLength != NULL) {
-    readIndexNew = copyPacketDataFromRingBuffer(readIndexNew, *headerLength, header, *headerLength);
-  }
-  readIndexNew = copyPacketDataFromRingBuffer(readIndexNew, packetDataLength, buffer, packetDataLength);
-  
-  UInt64 readIndexShifted;
-  readIndexNew = copyPacketDataFromRingBuffer(readIndexNew, sizeof (readIndexShifted), &readIndexShifted, sizeof (readIndexShifted));
+  UInt32 readIndexNew = readRingPacket(_rxBuffer->buffer, _rxBufferSize, _rxBuffer->readIndex,
+                                       header, headerLength != NULL ? *headerLength : 0, buffer, packetDataLength);
   __sync_synchronize();
   
   _rxBuffer->readIndex = readIndexNew;
@@ -239,21 +254,22 @@ IOReturn HyperVVMBusDevice::writeRawPacketGated(void *header, UInt32 *headerLeng
   UInt32 pktTotalLengthAligned  = HV_PACKETALIGN(pktTotalLength);
 
   UInt32 writeIndexOld          = _txBuffer->writeIndex;
-  UInt32 writeIndexNew          = writeIndexOld;
-  UInt64 writeIndexShifted      = ((UInt64)writeIndexOld) << 32;
+  UInt32 writeIndexNew;
 
   UInt32 readBytes;
   UInt32 writeBytes;
 
   //
-  // Ensure there is space for the packet.
+  // Ensure there is space for the packet and its trailing index.
   //
   // We cannot end up with read index == write index after the write, as that would indicate an empty buffer.
   // Notify Hyper-V if the buffer is full, as we don't always notify after every write to the buffer.
   //
   getAvailableTxSpace(&readBytes, &writeBytes);
-  if (writeBytes <= pktTotalLengthAligned) {
+  if (!canWriteRingPacket(writeBytes, pktTotalLengthAligned)) {
     HVSYSLOG("Packet is too large for buffer (%u bytes remaining)", writeBytes);
+    _numTxRingFull++;
+    _numHostSignals++;
     _txBuffer->guestToHostInterruptCount++;
     _vmbusProvider->signalVMBusChannel(_channelId);
     return kIOReturnNoResources;
@@ -263,12 +279,8 @@ IOReturn HyperVVMBusDevice::writeRawPacketGated(void *header, UInt32 *headerLeng
   // Copy header, data, padding, and index to this packet.
   //
   HVMSGLOG("RAW packet header length %u, total length %u, pad %u", pktHeaderLength, pktTotalLength, pktTotalLengthAligned - pktTotalLength);
-  if (header != NULL && headerLength != NULL) {
-    writeIndexNew = copyPacketDataToRingBuffer(writeIndexNew, header, *headerLength);
-  }
-  writeIndexNew = copyPacketDataToRingBuffer(writeIndexNew, buffer, *bufferLength);
-  writeIndexNew = zeroPacketDataToRingBuffer(writeIndexNew, pktTotalLengthAligned - pktTotalLength);
-  writeIndexNew = copyPacketDataToRingBuffer(writeIndexNew, &writeIndexShifted, sizeof (writeIndexShifted));
+  writeIndexNew = writeRingPacket(_txBuffer->buffer, _txBufferSize, writeIndexOld,
+                                  headerLength != NULL ? header : NULL, pktHeaderLength, buffer, *bufferLength);
   HVMSGLOG("RAW TX read index 0x%X, old TX write index 0x%X", _txBuffer->readIndex, _txBuffer->writeIndex);
   HVMSGLOG("RAW TX imask 0x%X, RX imask 0x%X, channel ID %u", _txBuffer->interruptMask, _rxBuffer->interruptMask, _channelId);
 
@@ -278,8 +290,14 @@ IOReturn HyperVVMBusDevice::writeRawPacketGated(void *header, UInt32 *headerLeng
   // It does not need notification if the buffer already has some amount of data, and we are just adding more.
   //
   _txBuffer->writeIndex = writeIndexNew;
+  _numPacketsSent++;
+  _numBytesSent += pktTotalLengthAligned;
+  if (_txBufferSize - writeBytes + pktTotalLengthAligned > _txRingHighWater) {
+    _txRingHighWater = _txBufferSize - writeBytes + pktTotalLengthAligned;
+  }
   __sync_synchronize();
-  if (_txBuffer->interruptMask == 0 && writeIndexOld == getTxReadIndex()) {
+  if (shouldSignalRingWrite(_txBuffer->interruptMask, writeIndexOld, getTxReadIndex())) {
+    _numHostSignals++;
     _txBuffer->guestToHostInterruptCount++;
     _vmbusProvider->signalVMBusChannel(_channelId);
   }
@@ -287,58 +305,6 @@ IOReturn HyperVVMBusDevice::writeRawPacketGated(void *header, UInt32 *headerLeng
   return kIOReturnSuccess;
 }
 
-UInt32 HyperVVMBusDevice::copyPacketDataFromRingBuffer(UInt32 readIndex, UInt32 readLength, void *data, UInt32 dataLength) {
-  //
-  // Check for wraparound.
-  //
-  if (dataLength > _rxBufferSize - readIndex) {
-    UInt32 fragmentLength = _rxBufferSize - readIndex;
-    HVMSGLOG("RX wraparound by %u bytes", fragmentLength);
-    memcpy(data, &_rxBuffer->buffer[readIndex], fragmentLength);
-    memcpy((UInt8*) data + fragmentLength, _rxBuffer->buffer, dataLength - fragmentLength);
-  } else {
-    memcpy(data, &_rxBuffer->buffer[readIndex], dataLength);
-  }
-  
-  return (readIndex + readLength) % _rxBufferSize;
-}
-
-UInt32 HyperVVMBusDevice::seekPacketDataFromRingBuffer(UInt32 readIndex, UInt32 readLength) {
-  return (readIndex + readLength) % _rxBufferSize;
-}
-
-UInt32 HyperVVMBusDevice::copyPacketDataToRingBuffer(UInt32 writeIndex, void *data, UInt32 length) {
-  //
-  // Check for wraparound.
-  //
-  if (length > _txBufferSize - writeIndex) {
-    UInt32 fragmentLength = _txBufferSize - writeIndex;
-    HVMSGLOG("TX wraparound by %u bytes", fragmentLength);
-    memcpy(&_txBuffer->buffer[writeIndex], data, fragmentLength);
-    memcpy(_txBuffer->buffer, (UInt8*) data + fragmentLength, length - fragmentLength);
-  } else {
-    memcpy(&_txBuffer->buffer[writeIndex], data, length);
-  }
-  
-  return (writeIndex + length) % _txBufferSize;
-}
-
-UInt32 HyperVVMBusDevice::zeroPacketDataToRingBuffer(UInt32 writeIndex, UInt32 length) {
-  //
-  // Check for wraparound.
-  //
-  if (length > _txBufferSize - writeIndex) {
-    UInt32 fragmentLength = _txBufferSize - writeIndex;
-    HVMSGLOG("TX wraparound by %u bytes", fragmentLength);
-    memset(&_txBuffer->buffer[writeIndex], 0, fragmentLength);
-    memset(_txBuffer->buffer, 0, length - fragmentLength);
-  } else {
-    memset(&_txBuffer->buffer[writeIndex], 0, length);
-  }
-  
-  return (writeIndex + length) % _txBufferSize;
-}
-
 void HyperVVMBusDevice::addPacketRequest(HyperVVMBusDeviceRequest *vmbusRequest) {
   IOLockLock(_vmbusRequestsLock);
   if (_vmbusRequests == nullptr) {
@@ -376,7 +342,7 @@ void HyperVVMBusDevice::handleDebugPrintTimer(IOTimerEventSource *sender) {
   if (_channelIsOpen) {
     HVSYSLOG("TXR 0x%X TXW 0x%X RXR 0x%X RXW 0x%X interrupts %llu (TX imask: %u) packets %llu",
              getTxReadIndex(), getTxWriteIndex(), getRxReadIndex(), getRxWriteIndex(),
-             _numInterrupts, _txBuffer->interruptMask, _numPackets);
+             _numInterrupts, _txBuffer->interruptMask, _numPacketsReceived);
     
     if (_timerDebugAction != nullptr) {
       (*_timerDebugAction)(_timerDebugTarget);
@@ -0,0 +1,139 @@
+//
+//  HyperVVMBusRing.hpp
+//  Hyper-V VMBus device nub
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#ifndef HyperVVMBusRing_hpp
+#define HyperVVMBusRing_hpp
+
+//
+// VMBus ring buffer packet read/write routines.
+// This header has no IOKit dependencies so it can also be built in userspace by Tests.
+//
+#include <libkern/OSTypes.h>
+#include <string.h>
+
+#include "VMBusPacket.hpp"
+
+//
+// Each packet in a ring is followed by the previous write index, shifted into the upper 32 bits.
+//
+#define kVMBusRingPacketIndexSize   sizeof (UInt64)
+
+//
+// Gets the number of bytes available to read and to write in a ring.
+// The write index can never catch up to the read index, as that would indicate an empty ring.
+//
+static inline void getRingSpace(UInt32 readIndex, UInt32 writeIndex, UInt32 ringSize, UInt32 *readBytes, UInt32 *writeBytes) {
+  *writeBytes = (writeIndex >= readIndex) ? (ringSize - (writeIndex - readIndex)) : (readIndex - writeIndex);
+  *readBytes  = ringSize - *writeBytes;
+}
+
+//
+// Copies data out of a ring, handling wraparound.
+// Returns the read index after readLength bytes, which may be more than the data copied.
+//
+static inline UInt32 copyFromRing(const UInt8 *ring, UInt32 ringSize, UInt32 readIndex, UInt32 readLength, void *data, UInt32 dataLength) {
+  if (dataLength > ringSize - readIndex) {
+    UInt32 fragmentLength = ringSize - readIndex;
+    memcpy(data, &ring[readIndex], fragmentLength);
+    memcpy((UInt8 *) data + fragmentLength, ring, dataLength - fragmentLength);
+  } else {
+    memcpy(data, &ring[readIndex], dataLength);
+  }
+
+  return (readIndex + readLength) % ringSize;
+}
+
+//
+// Copies data into a ring, handling wraparound. Data is zeroed if null.
+// Returns the write index after the data.
+//
+static inline UInt32 copyToRing(UInt8 *ring, UInt32 ringSize, UInt32 writeIndex, const void *data, UInt32 length) {
+  UInt32 fragmentLength = (length > ringSize - writeIndex) ? (ringSize - writeIndex) : length;
+
+  if (data != nullptr) {
+    memcpy(&ring[writeIndex], data, fragmentLength);
+    memcpy(ring, (const UInt8 *) data + fragmentLength, length - fragmentLength);
+  } else {
+    memset(&ring[writeIndex], 0, fragmentLength);
+    memset(ring, 0, length - fragmentLength);
+  }
+
+  return (writeIndex + length) % ringSize;
+}
+
+//
+// Length of a packet within the ring as described by its header, excluding the trailing index.
+// This is the 8 byte aligned length of the packet header and data.
+//
+static inline UInt32 getRingPacketLength(const VMBusPacketHeader *pktHeader) {
+  return HV_GET_VMBUS_PACKETSIZE(pktHeader->totalLength);
+}
+
+//
+// Checks if a packet of the specified aligned length and its trailing index can be written with writeBytes available.
+//
+static inline bool canWriteRingPacket(UInt32 writeBytes, UInt32 pktLengthAligned) {
+  return writeBytes > pktLengthAligned + kVMBusRingPacketIndexSize;
+}
+
+//
+// Writes a packet header, data, padding, and trailing index to a ring.
+// The caller must check space with canWriteRingPacket() first.
+// Returns the new write index, to be published once the write is complete.
+//
+static inline UInt32 writeRingPacket(UInt8 *ring, UInt32 ringSize, UInt32 writeIndex, const void *header, UInt32 headerLength,
+                                     const void *data, UInt32 dataLength) {
+  UInt32 pktLength         = headerLength + dataLength;
+  UInt64 writeIndexShifted = ((UInt64) writeIndex) << 32;
+  UInt32 writeIndexNew     = writeIndex;
+
+  if (header != nullptr) {
+    writeIndexNew = copyToRing(ring, ringSize, writeIndexNew, header, headerLength);
+  }
+  writeIndexNew = copyToRing(ring, ringSize, writeIndexNew, data, dataLength);
+  writeIndexNew = copyToRing(ring, ringSize, writeIndexNew, nullptr, HV_PACKETALIGN(pktLength) - pktLength);
+  return copyToRing(ring, ringSize, writeIndexNew, &writeIndexShifted, sizeof (writeIndexShifted));
+}
+
+//
+// The other end only needs to be signaled if the ring is changing state from empty to having some amount of data,
+// and it has not masked interrupts while it is already draining the ring.
+//
+static inline bool shouldSignalRingWrite(UInt32 interruptMask, UInt32 writeIndexOld, UInt32 readIndex) {
+  return interruptMask == 0 && writeIndexOld == readIndex;
+}
+
+//
+// Gets the header of the next packet in a ring.
+// Returns false if the ring is empty.
+//
+static inline bool peekRingPacket(const UInt8 *ring, UInt32 ringSize, UInt32 readIndex, UInt32 writeIndex, VMBusPacketHeader *pktHeader) {
+  if (readIndex == writeIndex) {
+    return false;
+  }
+
+  copyFromRing(ring, ringSize, readIndex, sizeof (*pktHeader), pktHeader, sizeof (*pktHeader));
+  return true;
+}
+
+//
+// Reads the next packet from a ring, skipping over the trailing index.
+// If header is null, the header is read as part of the data. The caller must check the data length with peekRingPacket() first.
+// Returns the new read index, to be published once the read is complete.
+//
+static inline UInt32 readRingPacket(const UInt8 *ring, UInt32 ringSize, UInt32 readIndex, void *header, UInt32 headerLength,
+                                    void *data, UInt32 dataLength) {
+  UInt32 readIndexNew = readIndex;
+
+  if (header != nullptr) {
+    readIndexNew = copyFromRing(ring, ringSize, readIndexNew, headerLength, header, headerLength);
+  }
+  readIndexNew = copyFromRing(ring, ringSize, readIndexNew, dataLength, data, dataLength);
+  return (readIndexNew + kVMBusRingPacketIndexSize) % ringSize;
+}
+
+#endif
@@ -0,0 +1,172 @@
+//
+//  EventFlagsTests.cpp
+//  Tests for the Hyper-V SynIC event flags scan
+//
+//  Copyright © 2022 Goldfish64. All rights reserved.
+//
+
+#include "HyperVTests.hpp"
+#include "HyperVEventFlags.hpp"
+
+#define kTestMaxChannels  256
+
+//
+// Previous scan, a locked bit test-and-clear for each channel.
+//
+static inline int testAndClearBit(long nr, volatile void *addr) {
+  int oldbit;
+
+  asm volatile("lock; btr %2,%1\n\tsbbl %0,%0"
+         : "=r" (oldbit), "+m" (*(volatile long *) addr)
+         : "Ir" (nr) : "memory");
+  return oldbit;
+}
+
+template <typename EventHandlerFunc>
+static void scanEventFlagsPerBit(volatile HyperVEventFlags *eventFlags, UInt32 channelCount, EventHandlerFunc handler) {
+  for (UInt32 i = 1; i < channelCount; i++) {
+    if (testAndClearBit(i, eventFlags->flags32)) {
+      handler(i);
+    }
+  }
+}
+
+static void setChannel(volatile HyperVEventFlags *eventFlags, UInt32 channelId) {
+  eventFlags->flags8[channelId / 8] |= (1 << (channelId % 8));
+}
+
+static void testScanMatchesPerBit() {
+  HyperVEventFlags wordFlags __attribute__((aligned(8)));
+  HyperVEventFlags bitFlags  __attribute__((aligned(8)));
+  bool             wordSeen[kTestMaxChannels];
+  bool             bitSeen[kTestMaxChannels];
+  UInt32           wordCount;
+  UInt32           bitCount;
+  UInt32           prevChannel;
+  bool             ordered;
+
+  for (UInt32 round = 0; round < 10000; round++) {
+    memset(&wordFlags, 0, sizeof (wordFlags));
+    memset(wordSeen, 0, sizeof (wordSeen));
+    memset(bitSeen, 0, sizeof (bitSeen));
+    wordCount   = 0;
+    bitCount    = 0;
+    prevChannel = 0;
+    ordered     = true;
+
+    //
+    // Random density, including channel 0 and flags beyond the scanned channels.
+    //
+    UInt32 active = testRandom() % kTestMaxChannels;
+    for (UInt32 i = 0; i < active; i++) {
+      setChannel(&wordFlags, testRandom() % kTestMaxChannels);
+    }
+    setChannel(&wordFlags, kTestMaxChannels + (testRandom() % kTestMaxChannels));
+    memcpy(&bitFlags, &wordFlags, sizeof (bitFlags));
+
+    scanEventFlags(&wordFlags, kTestMaxChannels, [&](UInt32 channelId) {
+      HVCHECK(channelId != 0 && channelId < kTestMaxChannels);
+      HVCHECK(!wordSeen[channelId]);
+      ordered = ordered && channelId > prevChannel;
+      prevChannel = channelId;
+      wordSeen[channelId] = true;
+      wordCount++;
+    });
+    scanEventFlagsPerBit(&bitFlags, kTestMaxChannels, [&](UInt32 channelId) {
+      bitSeen[channelId] = true;
+      bitCount++;
+    });
+
+    HVCHECK(ordered);
+    HVCHECK_EQ(wordCount, bitCount);
+    HVCHECK(memcmp(wordSeen, bitSeen, sizeof (wordSeen)) == 0);
+
+    //
+    // All scanned flags are cleared, flags past the scanned channels are left alone.
+    //
+    for (UInt32 i = 0; i < kTestMaxChannels / 8; i++) {
+      HVCHECK_EQ(wordFlags.flags8[i], 0);
+    }
+    HVCHECK(memcmp(&wordFlags.flags8[kTestMaxChannels / 8], &bitFlags.flags8[kTestMaxChannels / 8],
+                   sizeof (wordFlags) - (kTestMaxChannels / 8)) == 0);
+  }
+}
+
+static void testChannelZeroIgnored() {
+  HyperVEventFlags eventFlags __attribute__((aligned(8))) = { };
+  UInt32           calls      = 0;
+
+  setChannel(&eventFlags, 0);
+  scanEventFlags(&eventFlags, kTestMaxChannels, [&](UInt32) { calls++; });
+  HVCHECK_EQ(calls, 0);
+  HVCHECK_EQ(eventFlags.flags8[0], 0);
+}
+
+static void benchmark() {
+  static const UInt32 activeCounts[] = { 1, 8, 64 };
+  static const UInt32 iterations     = 2000000;
+  HyperVEventFlags    eventFlags __attribute__((aligned(8))) = { };
+  UInt32              channels[64];
+  volatile UInt32     sink           = 0;
+  UInt64              start;
+  UInt64              setNs;
+  UInt64              perBitNs;
+  UInt64              wordNs;
+
+  printf("Scan of %u channels, ns per interrupt (setting the flags excluded)\n", kTestMaxChannels);
+  printf("%-8s %14s %14s %10s\n", "Active", "Per-bit ns", "Word ns", "Speedup");
+  for (size_t i = 0; i < sizeof (activeCounts) / sizeof (activeCounts[0]); i++) {
+    //
+    // Spread the active channels over the whole range.
+    //
+    for (UInt32 j = 0; j < activeCounts[i]; j++) {
+      channels[j] = 1 + (j * (kTestMaxChannels - 1)) / activeCounts[i];
+    }
+
+    start = getTimeNs();
+    for (UInt32 j = 0; j < iterations; j++) {
+      for (UInt32 k = 0; k < activeCounts[i]; k++) {
+        setChannel(&eventFlags, channels[k]);
+      }
+      sink += eventFlags.flags32[0];
+      memset(&eventFlags, 0, kTestMaxChannels / 8);
+      __asm__ volatile ("" ::: "memory");
+    }
+    setNs = getTimeNs() - start;
+
+    start = getTimeNs();
+    for (UInt32 j = 0; j < iterations; j++) {
+      for (UInt32 k = 0; k < activeCounts[i]; k++) {
+        setChannel(&eventFlags, channels[k]);
+      }
+      scanEventFlagsPerBit(&eventFlags, kTestMaxChannels, [&](UInt32 channelId) { sink += channelId; });
+    }
+    perBitNs = getTimeNs() - start;
+
+    start = getTimeNs();
+    for (UInt32 j = 0; j < iterations; j++) {
+      for (UInt32 k = 0; k < activeCounts[i]; k++) {
+        setChannel(&eventFlags, channels[k]);
+      }
+      scanEventFlags(&eventFlags, kTestMaxChannels, [&](UInt32 channelId) { sink += channelId; });
+    }
+    wordNs = getTimeNs() - start;
+
+    perBitNs = (perBitNs > setNs) ? perBitNs - setNs : 0;
+    wordNs   = (wordNs > setNs) ? wordNs - setNs : 0;
+    printf("%-8u %14.1f %14.1f %9.1fx\n", activeCounts[i], (double) perBitNs / iterations,
+           (double) wordNs / iterations, wordNs != 0 ? (double) perBitNs / wordNs : 0.0);
+  }
+  (void) sink;
+}
+
+int main(int argc, char **argv) {
+  if (isBenchmarkRun(argc, argv)) {
+    benchmark();
+    return 0;
+  }
+
+  testScanMatchesPerBit();
+  testChannelZeroIgnored();
+  return finishTests("EventFlagsTests");
+}
@@ -0,0 +1,69 @@
+//
+//  HyperVTests.hpp
+//  Userspace test helpers
+//
+//  Copyright © 2022 Goldfish64. All rights reserved.
+//
+
+#ifndef HyperVTests_hpp
+#define HyperVTests_hpp
+
+#include <libkern/OSTypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static unsigned int testFailures = 0;
+
+#define HVCHECK(cond) do {                                                  \
+  if (!(cond)) {                                                            \
+    fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+    testFailures++;                                                         \
+  }                                                                         \
+} while (false)
+
+#define HVCHECK_EQ(a, b) do {                                               \
+  unsigned long long _a = (unsigned long long) (a);                         \
+  unsigned long long _b = (unsigned long long) (b);                         \
+  if (_a != _b) {                                                           \
+    fprintf(stderr, "%s:%d: check failed: %s == %s (0x%llX != 0x%llX)\n",   \
+            __FILE__, __LINE__, #a, #b, _a, _b);                            \
+    testFailures++;                                                         \
+  }                                                                         \
+} while (false)
+
+//
+// Returns true if the test binary was asked to run benchmarks instead of tests.
+//
+static inline bool isBenchmarkRun(int argc, char **argv) {
+  return argc > 1 && strcmp(argv[1], "--bench") == 0;
+}
+
+static inline UInt64 getTimeNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (UInt64) ts.tv_sec * 1000000000ULL + (UInt64) ts.tv_nsec;
+}
+
+//
+// Simple deterministic generator so failures are reproducible.
+//
+static UInt32 testRandomState = 0x12345678;
+static inline UInt32 testRandom() {
+  testRandomState ^= testRandomState << 13;
+  testRandomState ^= testRandomState >> 17;
+  testRandomState ^= testRandomState << 5;
+  return testRandomState;
+}
+
+static inline int finishTests(const char *name) {
+  if (testFailures != 0) {
+    fprintf(stderr, "%s: %u check(s) failed\n", name, testFailures);
+    return 1;
+  }
+  printf("%s: all checks passed\n", name);
+  return 0;
+}
+
+#endif
@@ -0,0 +1,259 @@
+//
+//  NetworkChecksumTests.cpp
+//  Tests for the Hyper-V network driver transmit checksum routines
+//
+//  Copyright © 2022 Goldfish64. All rights reserved.
+//
+
+#include "HyperVTests.hpp"
+#include "HyperVNetworkChecksum.hpp"
+
+#define kTestEthernetHeaderSize   14
+#define kTestIPv4HeaderSize       20
+#define kTestTCPHeaderSize        20
+#define kTestUDPHeaderSize        8
+#define kTestMaxPacketSize        9018
+#define kTestProtocolTCP          6
+#define kTestProtocolUDP          17
+
+//
+// Scalar reference, RFC 1071 sum of big-endian 16-bit words.
+//
+static UInt32 referenceSum(const UInt8 *data, size_t length, UInt32 sum = 0) {
+  while (length > 1) {
+    sum    += (data[0] << 8) | data[1];
+    data   += 2;
+    length -= 2;
+  }
+  if (length > 0) {
+    sum += data[0] << 8;
+  }
+  while (sum >> 16) {
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  }
+  return sum;
+}
+
+static void referenceCopyAndChecksum(UInt8 *dest, const UInt8 *src, size_t length, UInt32 *sum) {
+  memcpy(dest, src, length);
+  *sum = referenceSum(src, length);
+}
+
+static void storeBE16(UInt8 *dest, UInt16 value) {
+  dest[0] = value >> 8;
+  dest[1] = value & 0xFF;
+}
+
+//
+// Builds an Ethernet/IPv4/TCP or UDP packet as the stack hands it to the driver
+// with checksum offload: IPv4 checksum zeroed, L4 checksum holding the pseudo-header sum.
+//
+static size_t buildPacket(UInt8 *packet, bool isUDP, size_t payloadLength, HyperVNetworkChecksumOffsets *offsets) {
+  size_t l4HeaderLength = isUDP ? kTestUDPHeaderSize : kTestTCPHeaderSize;
+  size_t l4Length       = l4HeaderLength + payloadLength;
+  size_t ipLength       = kTestIPv4HeaderSize + l4Length;
+  UInt8  *ip            = packet + kTestEthernetHeaderSize;
+  UInt8  *l4            = ip + kTestIPv4HeaderSize;
+  UInt32 pseudoSum;
+
+  for (size_t i = 0; i < kTestEthernetHeaderSize + ipLength; i++) {
+    packet[i] = (UInt8) testRandom();
+  }
+  storeBE16(&packet[12], 0x0800);
+
+  ip[0] = 0x45;
+  storeBE16(&ip[2], (UInt16) ipLength);
+  ip[9] = isUDP ? kTestProtocolUDP : kTestProtocolTCP;
+  storeBE16(&ip[10], 0);
+
+  if (isUDP) {
+    storeBE16(&l4[4], (UInt16) l4Length);
+  } else {
+    l4[12] = 0x50;
+  }
+
+  pseudoSum = referenceSum(&ip[12], 8, (UInt32) (ip[9] + l4Length));
+  storeBE16(&l4[isUDP ? 6 : 16], (UInt16) pseudoSum);
+
+  offsets->l3Offset         = kTestEthernetHeaderSize;
+  offsets->l3Length         = kTestIPv4HeaderSize;
+  offsets->l4Offset         = kTestEthernetHeaderSize + kTestIPv4HeaderSize;
+  offsets->l4ChecksumOffset = offsets->l4Offset + (isUDP ? 6 : 16);
+  offsets->isUDP            = isUDP;
+  return kTestEthernetHeaderSize + ipLength;
+}
+
+//
+// Mirrors HyperVNetwork::copyPacketWithChecksum over a packet split into random segments.
+// A null destination sums in place as HyperVNetwork::finalizePacketChecksum does.
+//
+static void checksumSegmentedPacket(UInt8 *dest, const UInt8 *packet, size_t length, const HyperVNetworkChecksumOffsets *offsets) {
+  HyperVNetworkChecksumState state;
+  UInt8                      *buffer = (dest != nullptr) ? dest : (UInt8 *) packet;
+  size_t                     offset  = 0;
+  size_t                     segmentLength;
+  UInt16                     checksum;
+
+  initChecksumState(&state, true, offsets->l4Offset);
+  while (offset < length) {
+    segmentLength = 1 + (testRandom() % 300);
+    if (segmentLength > length - offset) {
+      segmentLength = length - offset;
+    }
+    checksumPacketSegment(&state, (dest != nullptr) ? (dest + offset) : nullptr, packet + offset, segmentLength);
+    offset += segmentLength;
+  }
+
+  checksum = finishChecksum(&state, offsets->isUDP);
+  memcpy(&buffer[offsets->l4ChecksumOffset], &checksum, sizeof (checksum));
+  checksum = ~((UInt16) checksumData(&buffer[offsets->l3Offset], offsets->l3Length));
+  memcpy(&buffer[offsets->l3Offset + 10], &checksum, sizeof (checksum));
+}
+
+static void verifyPacket(const UInt8 *packet, size_t length, const HyperVNetworkChecksumOffsets *offsets) {
+  const UInt8 *ip = &packet[offsets->l3Offset];
+  size_t      l4Length = length - offsets->l4Offset;
+  UInt32      sum;
+
+  //
+  // Valid IPv4 header and TCP/UDP data sum to all ones including the checksum field.
+  //
+  HVCHECK_EQ(referenceSum(ip, offsets->l3Length), 0xFFFF);
+  sum = referenceSum(&ip[12], 8, (UInt32) (ip[9] + l4Length));
+  HVCHECK_EQ(referenceSum(&packet[offsets->l4Offset], l4Length, sum), 0xFFFF);
+}
+
+static void testKernelsMatchReference() {
+  UInt8  src[kTestMaxPacketSize + 8];
+  UInt8  dest[kTestMaxPacketSize + 8];
+  UInt8  refDest[kTestMaxPacketSize + 8];
+  UInt32 refSum;
+  UInt32 sum;
+
+  for (size_t length = 0; length < 600; length++) {
+    for (size_t align = 0; align < 4; align++) {
+      for (size_t i = 0; i < length; i++) {
+        src[align + i] = (UInt8) testRandom();
+      }
+
+      //
+      // Native order sum stored in memory must have the same bytes as the big-endian reference sum.
+      //
+      sum = copyAndChecksum(&dest[align], &src[align], length);
+      referenceCopyAndChecksum(refDest, &src[align], length, &refSum);
+      HVCHECK(memcmp(&dest[align], refDest, length) == 0);
+
+      UInt16 native = (UInt16) sum;
+      UInt8  bytes[2];
+      memcpy(bytes, &native, sizeof (bytes));
+      HVCHECK_EQ((bytes[0] << 8) | bytes[1], refSum);
+      HVCHECK_EQ(checksumData(&src[align], length), sum);
+    }
+  }
+}
+
+static void testPackets() {
+  static const size_t payloadLengths[] = { 0, 1, 2, 3, 17, 64, 511, 512, 1460, 1472, 8960, 8977 };
+  UInt8                        packet[kTestMaxPacketSize];
+  UInt8                        copy[kTestMaxPacketSize];
+  HyperVNetworkChecksumOffsets offsets;
+  size_t                       length;
+
+  for (size_t i = 0; i < sizeof (payloadLengths) / sizeof (payloadLengths[0]); i++) {
+    for (int isUDP = 0; isUDP <= 1; isUDP++) {
+      for (int iteration = 0; iteration < 32; iteration++) {
+        //
+        // Copy path, as used for the send buffer.
+        //
+        length = buildPacket(packet, isUDP, payloadLengths[i], &offsets);
+        checksumSegmentedPacket(copy, packet, length, &offsets);
+        verifyPacket(copy, length, &offsets);
+        HVCHECK(memcmp(copy, packet, offsets.l3Offset + 10) == 0);
+        HVCHECK(memcmp(&copy[offsets.l4Offset], &packet[offsets.l4Offset], offsets.l4ChecksumOffset - offsets.l4Offset) == 0);
+        HVCHECK(memcmp(&copy[offsets.l4ChecksumOffset + 2], &packet[offsets.l4ChecksumOffset + 2], length - offsets.l4ChecksumOffset - 2) == 0);
+
+        //
+        // In-place path, as used before handing packets to the VF.
+        //
+        checksumSegmentedPacket(nullptr, packet, length, &offsets);
+        HVCHECK(memcmp(copy, packet, length) == 0);
+      }
+    }
+  }
+}
+
+static void testUDPZeroChecksum() {
+  HyperVNetworkChecksumState state;
+
+  //
+  // A computed checksum of zero is sent as all ones for UDP only.
+  //
+  initChecksumState(&state, true, 0);
+  state.sum = 0xFFFF;
+  HVCHECK_EQ(finishChecksum(&state, true), 0xFFFF);
+  HVCHECK_EQ(finishChecksum(&state, false), 0x0000);
+}
+
+static void benchmark() {
+  static const size_t frameSizes[] = { 64, 512, 1500, 9000 };
+  static UInt8        src[kTestMaxPacketSize];
+  static UInt8        dest[kTestMaxPacketSize];
+  volatile UInt32     sink = 0;
+  UInt64              start;
+  UInt64              fusedNs;
+  UInt64              twoPassNs;
+  UInt64              referenceNs;
+  UInt32              iterations;
+  UInt32              refSum;
+
+  for (size_t i = 0; i < sizeof (src); i++) {
+    src[i] = (UInt8) testRandom();
+  }
+
+  printf("%-8s %14s %14s %14s\n", "Frame", "Fused MB/s", "Two-pass MB/s", "Ref MB/s");
+  for (size_t i = 0; i < sizeof (frameSizes) / sizeof (frameSizes[0]); i++) {
+    iterations = (UInt32) ((256ULL * 1024 * 1024) / frameSizes[i]);
+
+    start = getTimeNs();
+    for (UInt32 j = 0; j < iterations; j++) {
+      sink += copyAndChecksum(dest, src, frameSizes[i]);
+    }
+    fusedNs = getTimeNs() - start;
+
+    //
+    // Previous transmit path: sum the data, then copy it into the send buffer.
+    //
+    start = getTimeNs();
+    for (UInt32 j = 0; j < iterations; j++) {
+      sink += checksumData(src, frameSizes[i]);
+      memcpy(dest, src, frameSizes[i]);
+      __asm__ volatile ("" ::: "memory");
+    }
+    twoPassNs = getTimeNs() - start;
+
+    start = getTimeNs();
+    for (UInt32 j = 0; j < iterations; j++) {
+      referenceCopyAndChecksum(dest, src, frameSizes[i], &refSum);
+      sink += refSum;
+    }
+    referenceNs = getTimeNs() - start;
+
+    printf("%-8zu %14.1f %14.1f %14.1f\n", frameSizes[i],
+           (double) iterations * frameSizes[i] * 1000.0 / fusedNs,
+           (double) iterations * frameSizes[i] * 1000.0 / twoPassNs,
+           (double) iterations * frameSizes[i] * 1000.0 / referenceNs);
+  }
+  (void) sink;
+}
+
+int main(int argc, char **argv) {
+  if (isBenchmarkRun(argc, argv)) {
+    benchmark();
+    return 0;
+  }
+
+  testKernelsMatchReference();
+  testPackets();
+  testUDPZeroChecksum();
+  return finishTests("NetworkChecksumTests");
+}
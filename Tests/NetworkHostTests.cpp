@@ -0,0 +1,1292 @@
+//
+//  NetworkHostTests.cpp
+//  Tests and benchmarks for the VMBus ring and network protocol routines against a simulated NVSP host
+//
+//  Copyright © 2022 Goldfish64. All rights reserved.
+//
+
+#include "HyperVTests.hpp"
+#include "HyperVVMBusRing.hpp"
+#include "HyperVNetworkProtocol.hpp"
+
+#include <vector>
+
+#define kTestRingSize               (128 * 4096)
+#define kTestSendSectionSize        6144
+#define kTestReceiveSlotSize        10240
+#define kTestReceiveGpadl           0x1000
+#define kTestSendGpadl              0x2000
+#define kTestMaxRingPacketSize      256
+#define kTestEthernetMTU            1514
+#define kTestMaxFrameSize           9000
+#define kTestMaxMdlChainLength      34
+#define kTestBenchRunNs             100000000ULL
+
+typedef enum {
+  kTestSendSuccess,
+  kTestSendStall,
+  kTestSendDropped
+} TestSendStatus;
+
+//
+// 64-bit FNV-1a over a frame and its 802.1Q tag, used to compare what was sent with what arrived.
+//
+static UInt64 hashFrame(UInt64 hash, const UInt8 *frame, UInt32 length, UInt16 vlanTag) {
+  hash = (hash ^ vlanTag) * 0x100000001B3ULL;
+  for (UInt32 i = 0; i < length; i++) {
+    hash = (hash ^ frame[i]) * 0x100000001B3ULL;
+  }
+  return hash;
+}
+
+static void fillRandom(UInt8 *data, UInt32 length) {
+  for (UInt32 i = 0; i < length; i++) {
+    data[i] = (UInt8) testRandom();
+  }
+}
+
+static void initPacketHeader(VMBusPacketHeader *pktHeader, VMBusPacketType type, UInt32 headerLength, UInt32 dataLength,
+                             UInt64 transactionId, bool responseRequired) {
+  pktHeader->type          = type;
+  pktHeader->headerLength  = headerLength >> kVMBusPacketSizeShift;
+  pktHeader->totalLength   = HV_PACKETALIGN(headerLength + dataLength) >> kVMBusPacketSizeShift;
+  pktHeader->flags         = responseRequired ? kVMBusPacketResponseRequired : 0;
+  pktHeader->transactionId = transactionId;
+}
+
+//
+// One direction of a VMBus channel.
+// Packets are written and read in the same way as HyperVVMBusDevice, using the same byte count units.
+//
+class TestRing {
+public:
+  explicit TestRing(UInt32 size) : _buffer(size, 0), _size(size) {}
+
+  UInt8 *getBuffer() { return _buffer.data(); }
+  UInt32 getReadIndex() const { return _readIndex; }
+  UInt32 getWriteIndex() const { return _writeIndex; }
+  UInt64 getSignalCount() const { return _signalCount; }
+  UInt64 getPacketsWritten() const { return _packetsWritten; }
+  UInt64 getBytesWritten() const { return _bytesWritten; }
+  UInt64 getBytesRead() const { return _bytesRead; }
+  UInt64 getFullCount() const { return _fullCount; }
+  bool isEmpty() const { return _readIndex == _writeIndex; }
+
+  void setIndexes(UInt32 readIndex, UInt32 writeIndex) {
+    _readIndex  = readIndex;
+    _writeIndex = writeIndex;
+  }
+  void setInterruptMask(UInt32 interruptMask) { _interruptMask = interruptMask; }
+
+  bool writePacket(const void *header, UInt32 headerLength, const void *data, UInt32 dataLength) {
+    UInt32 pktLengthAligned = HV_PACKETALIGN(headerLength + dataLength);
+    UInt32 writeIndexOld    = _writeIndex;
+    UInt32 readBytes;
+    UInt32 writeBytes;
+
+    getRingSpace(_readIndex, _writeIndex, _size, &readBytes, &writeBytes);
+    if (!canWriteRingPacket(writeBytes, pktLengthAligned)) {
+      //
+      // The other end is always signaled when the ring is full.
+      //
+      _fullCount++;
+      _signalCount++;
+      return false;
+    }
+
+    _writeIndex = writeRingPacket(_buffer.data(), _size, _writeIndex, header, headerLength, data, dataLength);
+    _packetsWritten++;
+    _bytesWritten += pktLengthAligned;
+    if (shouldSignalRingWrite(_interruptMask, writeIndexOld, _readIndex)) {
+      _signalCount++;
+    }
+    return true;
+  }
+
+  //
+  // Reads the next packet including its header.
+  // Returns the packet length, or zero if the ring is empty or the packet does not fit.
+  //
+  UInt32 readPacket(void *buffer, UInt32 bufferLength) {
+    VMBusPacketHeader pktHeader;
+    UInt32            pktLength;
+
+    if (!peekRingPacket(_buffer.data(), _size, _readIndex, _writeIndex, &pktHeader)) {
+      return 0;
+    }
+    pktLength = getRingPacketLength(&pktHeader);
+    if (pktLength > bufferLength) {
+      return 0;
+    }
+
+    _readIndex  = readRingPacket(_buffer.data(), _size, _readIndex, nullptr, 0, buffer, pktLength);
+    _bytesRead += pktLength;
+    return pktLength;
+  }
+
+private:
+  std::vector<UInt8> _buffer;
+  UInt32             _size;
+  UInt32             _readIndex      = 0;
+  UInt32             _writeIndex     = 0;
+  UInt32             _interruptMask  = 0;
+  UInt64             _signalCount    = 0;
+  UInt64             _packetsWritten = 0;
+  UInt64             _bytesWritten   = 0;
+  UInt64             _bytesRead      = 0;
+  UInt64             _fullCount      = 0;
+};
+
+//
+// Guest to host and host to guest rings.
+//
+class TestChannel {
+public:
+  TestChannel() : txRing(kTestRingSize), rxRing(kTestRingSize) {}
+
+  TestRing txRing;
+  TestRing rxRing;
+};
+
+//
+// Simulated NVSP host.
+// Serves protocol negotiation, NDIS configuration and receive/send buffer setup, consumes RNDIS data packets
+// from send buffer sections with send completions, and delivers frames through transfer pages of the receive buffer.
+//
+class TestNetworkHost {
+public:
+  TestNetworkHost(TestChannel *channel, HyperVNetworkProtocolVersion maxVersion) : _channel(channel), _maxVersion(maxVersion) {}
+
+  HyperVNetworkProtocolVersion getVersion() const { return _version; }
+  UInt32 getNDISMajor() const { return _ndisMajor; }
+  UInt32 getNDISMinor() const { return _ndisMinor; }
+  UInt32 getMTU() const { return _mtu; }
+  UInt64 getCapabilities() const { return _capabilities; }
+  UInt64 getFramesReceived() const { return _framesReceived; }
+  UInt64 getBytesReceived() const { return _bytesReceived; }
+  UInt64 getFrameHash() const { return _frameHash; }
+  UInt64 getInvalidCount() const { return _invalidCount; }
+  size_t getFreeReceiveSlotCount() const { return _freeSlots.size(); }
+  size_t getReceiveSlotCount() const { return _receiveSlotCount; }
+
+  void setReceiveSectionCount(UInt32 count) { _receiveSectionCount = count; }
+  void setVerifyPayload(bool verify) { _verifyPayload = verify; }
+
+  //
+  // Guest memory described by a GPADL.
+  //
+  void addGPADL(UInt32 gpadlHandle, UInt8 *buffer, UInt32 size) {
+    if (gpadlHandle == kTestReceiveGpadl) {
+      _receiveBuffer     = buffer;
+      _receiveBufferSize = size;
+    } else if (gpadlHandle == kTestSendGpadl) {
+      _sendBuffer     = buffer;
+      _sendBufferSize = size;
+    }
+  }
+
+  //
+  // Handles all packets sent by the guest.
+  //
+  void process() {
+    UInt64 pkt[kTestMaxRingPacketSize / sizeof (UInt64)];
+    UInt32 pktLength;
+
+    while ((pktLength = _channel->txRing.readPacket(pkt, sizeof (pkt))) != 0) {
+      handlePacket((const VMBusPacketHeader *) pkt, pktLength);
+    }
+  }
+
+  //
+  // Places a frame in a free receive buffer slot and passes it to the guest with a transfer page packet.
+  //
+  bool deliverFrame(const UInt8 *frame, UInt32 length, bool hasVLAN, UInt16 vlanTag) {
+    VMBusPacketTransferPages                  pktPages;
+    HyperVNetworkMessage                      netMsg;
+    HyperVNetworkRNDISMessage                 *rndisMsg;
+    HyperVNetworkRNDISPerPacketInfoIEEE8021Q  *vlanInfo;
+    UInt8                                     *slotBuffer;
+    UInt32                                    slot;
+    UInt32                                    dataOffset;
+
+    if (_freeSlots.empty()) {
+      return false;
+    }
+    slot       = _freeSlots.back();
+    slotBuffer = &_receiveBuffer[slot * kTestReceiveSlotSize];
+    rndisMsg   = (HyperVNetworkRNDISMessage *) slotBuffer;
+
+    initRNDISDataPacket(rndisMsg);
+    if (hasVLAN) {
+      vlanInfo = (HyperVNetworkRNDISPerPacketInfoIEEE8021Q *) addRNDISPerPacketInfo(&rndisMsg->dataPacket,
+                                                                                     kHyperVNetworkRNDISPerPacketInfoTypeIEEE8021Q,
+                                                                                     sizeof (*vlanInfo));
+      setRNDISVLANInfo(vlanInfo, vlanTag);
+    }
+    dataOffset = finishRNDISDataPacket(rndisMsg, length);
+    memcpy(&slotBuffer[dataOffset], frame, length);
+
+    memset(&pktPages, 0, sizeof (pktPages));
+    initPacketHeader(&pktPages.header, kVMBusPacketTypeDataUsingTransferPages, sizeof (pktPages), sizeof (netMsg), slot + 1, true);
+    pktPages.transferPagesetId = kHyperVNetworkReceiveBufferID;
+    pktPages.rangeCount        = 1;
+    pktPages.ranges[0].count   = rndisMsg->header.length;
+    pktPages.ranges[0].offset  = slot * kTestReceiveSlotSize;
+    buildSendRNDISPacketMessage(&netMsg, kHyperVNetworkRNDISChannelTypeData, kHyperVNetworkRNDISSendSectionIndexInvalid, 0);
+
+    if (!_channel->rxRing.writePacket(&pktPages, sizeof (pktPages), &netMsg, sizeof (netMsg))) {
+      return false;
+    }
+    _freeSlots.pop_back();
+    return true;
+  }
+
+private:
+  TestChannel                  *_channel;
+  HyperVNetworkProtocolVersion _maxVersion;
+  HyperVNetworkProtocolVersion _version             = (HyperVNetworkProtocolVersion) 0;
+  UInt32                       _ndisMajor           = 0;
+  UInt32                       _ndisMinor           = 0;
+  UInt32                       _mtu                 = 0;
+  UInt64                       _capabilities        = 0;
+  UInt32                       _receiveSectionCount = 1;
+  bool                         _verifyPayload       = true;
+
+  UInt8                        *_receiveBuffer      = nullptr;
+  UInt32                       _receiveBufferSize   = 0;
+  UInt32                       _receiveSlotCount    = 0;
+  std::vector<UInt32>          _freeSlots;
+  UInt8                        *_sendBuffer         = nullptr;
+  UInt32                       _sendBufferSize      = 0;
+
+  UInt64                       _framesReceived      = 0;
+  UInt64                       _bytesReceived       = 0;
+  UInt64                       _frameHash           = 0;
+  UInt64                       _invalidCount        = 0;
+
+  void respond(const VMBusPacketHeader *pktHeader, const HyperVNetworkMessage *netMsg) {
+    VMBusPacketHeader respHeader;
+
+    if ((pktHeader->flags & kVMBusPacketResponseRequired) == 0) {
+      return;
+    }
+    initPacketHeader(&respHeader, kVMBusPacketTypeCompletion, sizeof (respHeader), sizeof (*netMsg), pktHeader->transactionId, false);
+    _channel->rxRing.writePacket(&respHeader, sizeof (respHeader), netMsg, sizeof (*netMsg));
+  }
+
+  bool acceptVersion(HyperVNetworkProtocolVersion version) {
+    for (UInt32 i = 0; i < kHyperVNetworkProtocolVersionCount; i++) {
+      if (networkProtocolVersions[i] == version) {
+        return version <= _maxVersion;
+      }
+    }
+    return false;
+  }
+
+  void handlePacket(const VMBusPacketHeader *pktHeader, UInt32 pktLength) {
+    HyperVNetworkMessage netMsg;
+    UInt32               pktHeaderLength = HV_GET_VMBUS_PACKETSIZE(pktHeader->headerLength);
+    UInt32               msgLength       = pktLength - pktHeaderLength;
+
+    memset(&netMsg, 0, sizeof (netMsg));
+    memcpy(&netMsg, ((const UInt8 *) pktHeader) + pktHeaderLength, msgLength < sizeof (netMsg) ? msgLength : sizeof (netMsg));
+
+    switch (pktHeader->type) {
+      case kVMBusPacketTypeDataInband:
+        handleMessage(pktHeader, &netMsg);
+        break;
+
+      case kVMBusPacketTypeCompletion:
+        //
+        // Guest has finished with a receive buffer slot.
+        //
+        if (netMsg.messageType == kHyperVNetworkMessageTypeV1SendRNDISPacketComplete
+            && pktHeader->transactionId != 0 && pktHeader->transactionId <= _receiveSlotCount) {
+          _freeSlots.push_back((UInt32) (pktHeader->transactionId - 1));
+        } else {
+          _invalidCount++;
+        }
+        break;
+
+      default:
+        _invalidCount++;
+        break;
+    }
+  }
+
+  void handleMessage(const VMBusPacketHeader *pktHeader, HyperVNetworkMessage *netMsg) {
+    HyperVNetworkProtocolVersion version;
+    UInt32                       gpadlHandle;
+
+    switch (netMsg->messageType) {
+      case kHyperVNetworkMessageTypeInit:
+        version = netMsg->init.initVersion.maxProtocolVersion;
+        netMsg->messageType                                = kHyperVNetworkMessageTypeInitComplete;
+        netMsg->init.initComplete.negotiatedProtocolVersion = version;
+        netMsg->init.initComplete.maxMdlChainLength         = kTestMaxMdlChainLength;
+        netMsg->init.initComplete.status                    = kHyperVNetworkMessageStatusFailure;
+        if (acceptVersion(version)) {
+          _version                         = version;
+          netMsg->init.initComplete.status = kHyperVNetworkMessageStatusSuccess;
+        }
+        respond(pktHeader, netMsg);
+        break;
+
+      case kHyperVNetworkMessageTypeV2SendNDISConfig:
+        _mtu          = netMsg->v2.sendNDISConfig.mtu;
+        _capabilities = netMsg->v2.sendNDISConfig.capabilities;
+        break;
+
+      case kHyperVNetworkMessageTypeV1SendNDISVersion:
+        _ndisMajor = netMsg->v1.sendNDISVersion.major;
+        _ndisMinor = netMsg->v1.sendNDISVersion.minor;
+        break;
+
+      case kHyperVNetworkMessageTypeV1SendReceiveBuffer:
+        gpadlHandle = netMsg->v1.sendReceiveBuffer.gpadlHandle;
+        prepareNetworkMessage(netMsg, kHyperVNetworkMessageTypeV1SendReceiveBufferComplete);
+        netMsg->v1.sendReceiveBufferComplete.status = kHyperVNetworkMessageStatusFailure;
+        if (gpadlHandle == kTestReceiveGpadl && _receiveBuffer != nullptr) {
+          _receiveSlotCount = _receiveBufferSize / kTestReceiveSlotSize;
+          _freeSlots.clear();
+          for (UInt32 i = _receiveSlotCount; i > 0; i--) {
+            _freeSlots.push_back(i - 1);
+          }
+
+          netMsg->v1.sendReceiveBufferComplete.status                  = kHyperVNetworkMessageStatusSuccess;
+          netMsg->v1.sendReceiveBufferComplete.numSections             = _receiveSectionCount;
+          netMsg->v1.sendReceiveBufferComplete.sections[0].offset      = 0;
+          netMsg->v1.sendReceiveBufferComplete.sections[0].subAllocSize = kTestReceiveSlotSize;
+          netMsg->v1.sendReceiveBufferComplete.sections[0].numSubAllocs = _receiveSlotCount;
+          netMsg->v1.sendReceiveBufferComplete.sections[0].endOffset    = _receiveSlotCount * kTestReceiveSlotSize;
+        }
+        respond(pktHeader, netMsg);
+        break;
+
+      case kHyperVNetworkMessageTypeV1SendSendBuffer:
+        gpadlHandle = netMsg->v1.sendSendBuffer.gpadlHandle;
+        prepareNetworkMessage(netMsg, kHyperVNetworkMessageTypeV1SendSendBufferComplete);
+        netMsg->v1.sendSendBufferComplete.status = kHyperVNetworkMessageStatusFailure;
+        if (gpadlHandle == kTestSendGpadl && _sendBuffer != nullptr) {
+          netMsg->v1.sendSendBufferComplete.status      = kHyperVNetworkMessageStatusSuccess;
+          netMsg->v1.sendSendBufferComplete.sectionSize = kTestSendSectionSize;
+        }
+        respond(pktHeader, netMsg);
+        break;
+
+      case kHyperVNetworkMessageTypeV1SendRNDISPacket:
+        consumeRNDISPacket(netMsg);
+        respond(pktHeader, netMsg);
+        break;
+
+      default:
+        _invalidCount++;
+        break;
+    }
+  }
+
+  //
+  // Takes the frame out of the send buffer section and fills in the send completion.
+  //
+  void consumeRNDISPacket(HyperVNetworkMessage *netMsg) {
+    HyperVNetworkRNDISMessage                 *rndisMsg;
+    HyperVNetworkRNDISPerPacketInfoIEEE8021Q  *vlanInfo;
+    UInt32                                    sendIndex = netMsg->v1.sendRNDISPacket.sendBufferSectionIndex;
+    UInt32                                    sendSize  = netMsg->v1.sendRNDISPacket.sendBufferSectionSize;
+    HyperVNetworkMessageStatus                status    = kHyperVNetworkMessageStatusInvalidRNDISPacket;
+    UInt8                                     *frame;
+    UInt32                                    frameLength;
+
+    if (_sendBuffer != nullptr && sendIndex < _sendBufferSize / kTestSendSectionSize && sendSize <= kTestSendSectionSize) {
+      rndisMsg = (HyperVNetworkRNDISMessage *) &_sendBuffer[sendIndex * kTestSendSectionSize];
+      if (rndisMsg->header.type == kHyperVNetworkRNDISMessageTypePacket && rndisMsg->header.length == sendSize
+          && getRNDISPacketData(rndisMsg, sendSize, &frame, &frameLength)) {
+        _framesReceived++;
+        _bytesReceived += frameLength;
+        if (_verifyPayload) {
+          vlanInfo = (HyperVNetworkRNDISPerPacketInfoIEEE8021Q *) getRNDISPerPacketInfo(&rndisMsg->dataPacket,
+                                                                                         sendSize - sizeof (rndisMsg->header),
+                                                                                         kHyperVNetworkRNDISPerPacketInfoTypeIEEE8021Q,
+                                                                                         sizeof (*vlanInfo));
+          _frameHash = hashFrame(_frameHash, frame, frameLength, vlanInfo != nullptr ? getRNDISVLANTag(vlanInfo) : 0);
+        }
+        status = kHyperVNetworkMessageStatusSuccess;
+      }
+    }
+    if (status != kHyperVNetworkMessageStatusSuccess) {
+      _invalidCount++;
+    }
+    buildSendRNDISPacketCompleteMessage(netMsg, status);
+  }
+};
+
+//
+// Guest side of the channel, following the same steps as HyperVNetwork and HyperVVMBusDevice.
+// Payload bytes copied by the guest are counted to measure copies per packet.
+//
+class TestNetworkClient {
+public:
+  TestNetworkClient(TestChannel *channel, TestNetworkHost *host) : _channel(channel), _host(host), _mbufBuffer(kTestMaxFrameSize, 0) {}
+
+  HyperVNetworkProtocolVersion getVersion() const { return _netVersion; }
+  UInt32 getReceiveBufferSize() const { return _receiveBufferSize; }
+  UInt32 getSendSectionCount() const { return _sendSectionCount; }
+  UInt32 getSendIndexesOutstanding() const { return _sendIndexesOutstanding; }
+  UInt64 getFramesReceived() const { return _framesReceived; }
+  UInt64 getBytesReceived() const { return _bytesReceived; }
+  UInt64 getFrameHash() const { return _frameHash; }
+  UInt64 getPayloadBytesCopied() const { return _payloadBytesCopied; }
+  UInt64 getInvalidCount() const { return _invalidCount; }
+  UInt64 getCompletionErrorCount() const { return _completionErrorCount; }
+
+  void setVerifyPayload(bool verify) { _verifyPayload = verify; }
+
+  bool connect() {
+    HyperVNetworkMessage netMsg;
+    bool                 result = false;
+
+    for (UInt32 i = 0; i < kHyperVNetworkProtocolVersionCount; i++) {
+      buildNetworkInitMessage(&netMsg, networkProtocolVersions[i]);
+      if (!sendAndWait(&netMsg)) {
+        return false;
+      }
+      if (netMsg.init.initComplete.status == kHyperVNetworkMessageStatusSuccess) {
+        _netVersion = networkProtocolVersions[i];
+        result      = true;
+        break;
+      }
+    }
+    if (!result) {
+      return false;
+    }
+
+    if (_netVersion >= kHyperVNetworkProtocolVersion2) {
+      buildNDISConfigMessage(&netMsg, _netVersion, kTestEthernetMTU);
+      send(&netMsg, false);
+    }
+    buildNDISVersionMessage(&netMsg, _netVersion);
+    send(&netMsg, false);
+
+    _receiveBufferSize = getNetworkReceiveBufferSize(_netVersion);
+    _receiveBuffer.assign(_receiveBufferSize, 0);
+    _host->addGPADL(kTestReceiveGpadl, _receiveBuffer.data(), _receiveBufferSize);
+    buildReceiveBufferMessage(&netMsg, kTestReceiveGpadl);
+    if (!sendAndWait(&netMsg) || netMsg.v1.sendReceiveBufferComplete.status != kHyperVNetworkMessageStatusSuccess
+        || !isValidReceiveBufferComplete(&netMsg)) {
+      return false;
+    }
+
+    _sendBuffer.assign(kHyperVNetworkSendBufferSize, 0);
+    _host->addGPADL(kTestSendGpadl, _sendBuffer.data(), kHyperVNetworkSendBufferSize);
+    buildSendBufferMessage(&netMsg, kTestSendGpadl);
+    if (!sendAndWait(&netMsg) || netMsg.v1.sendSendBufferComplete.status != kHyperVNetworkMessageStatusSuccess) {
+      return false;
+    }
+    _sendSectionSize  = netMsg.v1.sendSendBufferComplete.sectionSize;
+    _sendSectionCount = kHyperVNetworkSendBufferSize / _sendSectionSize;
+    _sendIndexMap.assign((_sendSectionCount + 31) / 32, 0);
+    return true;
+  }
+
+  //
+  // Same steps as HyperVNetwork::outputPacket().
+  //
+  TestSendStatus sendFrame(const UInt8 *frame, UInt32 length, bool hasVLAN, UInt16 vlanTag) {
+    HyperVNetworkMessage                      netMsg;
+    VMBusPacketHeader                         pktHeader;
+    HyperVNetworkRNDISMessage                 *rndisMsg;
+    HyperVNetworkRNDISPerPacketInfoIEEE8021Q  *vlanInfo;
+    UInt8                                     *rndisBuffer;
+    UInt32                                    sendIndex;
+    UInt32                                    dataOffset;
+
+    sendIndex = getNextSendIndex();
+    if (sendIndex == (UInt32) kHyperVNetworkRNDISSendSectionIndexInvalid) {
+      return kTestSendStall;
+    }
+
+    rndisBuffer = &_sendBuffer[_sendSectionSize * sendIndex];
+    rndisMsg    = (HyperVNetworkRNDISMessage *) rndisBuffer;
+    initRNDISDataPacket(rndisMsg);
+    if (hasVLAN) {
+      vlanInfo = (HyperVNetworkRNDISPerPacketInfoIEEE8021Q *) addRNDISPerPacketInfo(&rndisMsg->dataPacket,
+                                                                                     kHyperVNetworkRNDISPerPacketInfoTypeIEEE8021Q,
+                                                                                     sizeof (*vlanInfo));
+      setRNDISVLANInfo(vlanInfo, vlanTag);
+    }
+    dataOffset = finishRNDISDataPacket(rndisMsg, length);
+    if (length == 0 || rndisMsg->header.length > _sendSectionSize) {
+      releaseSendIndex(sendIndex);
+      return kTestSendDropped;
+    }
+    copyPayload(rndisBuffer + dataOffset, frame, length);
+
+    buildSendRNDISPacketMessage(&netMsg, kHyperVNetworkRNDISChannelTypeData, sendIndex, rndisMsg->header.length);
+    initPacketHeader(&pktHeader, kVMBusPacketTypeDataInband, sizeof (pktHeader), sizeof (netMsg), getSendTransactionId(sendIndex), true);
+    if (!_channel->txRing.writePacket(&pktHeader, sizeof (pktHeader), &netMsg, sizeof (netMsg))) {
+      releaseSendIndex(sendIndex);
+      return kTestSendStall;
+    }
+    return kTestSendSuccess;
+  }
+
+  //
+  // Same steps as HyperVVMBusDevice::handleInterrupt(), interrupts are masked while the ring is drained.
+  //
+  void handleInterrupt() {
+    UInt64 pkt[kTestMaxRingPacketSize / sizeof (UInt64)];
+    UInt32 pktLength;
+
+    _channel->rxRing.setInterruptMask(1);
+    while ((pktLength = _channel->rxRing.readPacket(pkt, sizeof (pkt))) != 0) {
+      handlePacket((VMBusPacketHeader *) pkt, pktLength);
+    }
+    _channel->rxRing.setInterruptMask(0);
+  }
+
+private:
+  TestChannel                  *_channel;
+  TestNetworkHost              *_host;
+  HyperVNetworkProtocolVersion _netVersion             = (HyperVNetworkProtocolVersion) 0;
+  bool                         _verifyPayload          = true;
+
+  std::vector<UInt8>           _receiveBuffer;
+  UInt32                       _receiveBufferSize      = 0;
+  std::vector<UInt8>           _sendBuffer;
+  UInt32                       _sendSectionSize        = 0;
+  UInt32                       _sendSectionCount       = 0;
+  std::vector<UInt32>          _sendIndexMap;
+  UInt32                       _sendIndexesOutstanding = 0;
+  std::vector<UInt8>           _mbufBuffer;
+
+  UInt64                       _nextTransId            = 1;
+  UInt64                       _waitTransId            = 0;
+  HyperVNetworkMessage         *_waitResponse          = nullptr;
+
+  UInt64                       _framesReceived         = 0;
+  UInt64                       _bytesReceived          = 0;
+  UInt64                       _frameHash              = 0;
+  UInt64                       _payloadBytesCopied     = 0;
+  UInt64                       _invalidCount           = 0;
+  UInt64                       _completionErrorCount   = 0;
+
+  void copyPayload(UInt8 *dest, const UInt8 *src, UInt32 length) {
+    memcpy(dest, src, length);
+    _payloadBytesCopied += length;
+  }
+
+  bool send(HyperVNetworkMessage *netMsg, bool responseRequired, UInt64 transactionId = 0) {
+    VMBusPacketHeader pktHeader;
+
+    initPacketHeader(&pktHeader, kVMBusPacketTypeDataInband, sizeof (pktHeader), sizeof (*netMsg),
+                     transactionId != 0 ? transactionId : _nextTransId++, responseRequired);
+    return _channel->txRing.writePacket(&pktHeader, sizeof (pktHeader), netMsg, sizeof (*netMsg));
+  }
+
+  //
+  // Sends a message and has the host process it, the response is written back into the message.
+  //
+  bool sendAndWait(HyperVNetworkMessage *netMsg) {
+    _waitTransId  = _nextTransId++;
+    _waitResponse = netMsg;
+    if (!send(netMsg, true, _waitTransId)) {
+      return false;
+    }
+    _host->process();
+    handleInterrupt();
+    return _waitResponse == nullptr;
+  }
+
+  UInt32 getNextSendIndex() {
+    for (UInt32 i = 0; i < _sendSectionCount; i++) {
+      if ((_sendIndexMap[i / 32] & (1U << (i % 32))) == 0) {
+        _sendIndexMap[i / 32] |= 1U << (i % 32);
+        _sendIndexesOutstanding++;
+        return i;
+      }
+    }
+    return kHyperVNetworkRNDISSendSectionIndexInvalid;
+  }
+
+  void releaseSendIndex(UInt32 sendIndex) {
+    _sendIndexMap[sendIndex / 32] &= ~(1U << (sendIndex % 32));
+    _sendIndexesOutstanding--;
+  }
+
+  void handlePacket(VMBusPacketHeader *pktHeader, UInt32 pktLength) {
+    UInt32 pktHeaderLength = HV_GET_VMBUS_PACKETSIZE(pktHeader->headerLength);
+    UInt32 sendIndex;
+    UInt32 status;
+
+    switch (pktHeader->type) {
+      case kVMBusPacketTypeCompletion:
+        if (_waitResponse != nullptr && pktHeader->transactionId == _waitTransId) {
+          memcpy(_waitResponse, ((UInt8 *) pktHeader) + pktHeaderLength, sizeof (*_waitResponse));
+          _waitResponse = nullptr;
+        } else if (getSendCompletionIndex(pktHeader, pktLength, &sendIndex, &status) && sendIndex < _sendSectionCount) {
+          if (status != kHyperVNetworkMessageStatusSuccess) {
+            _completionErrorCount++;
+          }
+          releaseSendIndex(sendIndex);
+        } else {
+          _invalidCount++;
+        }
+        break;
+
+      case kVMBusPacketTypeDataUsingTransferPages:
+        handleRNDISRanges((VMBusPacketTransferPages *) pktHeader, pktLength);
+        break;
+
+      default:
+        _invalidCount++;
+        break;
+    }
+  }
+
+  void handleRNDISRanges(VMBusPacketTransferPages *pktPages, UInt32 pktLength) {
+    HyperVNetworkMessage netMsg;
+    VMBusPacketHeader    pktHeader;
+
+    if (!processTransferPageRanges(pktPages, pktLength, _receiveBufferSize, [this](UInt32 offset, UInt32 length) {
+      processIncoming(&_receiveBuffer[offset], length);
+    })) {
+      _invalidCount++;
+      return;
+    }
+
+    buildSendRNDISPacketCompleteMessage(&netMsg, kHyperVNetworkMessageStatusSuccess);
+    initPacketHeader(&pktHeader, kVMBusPacketTypeCompletion, sizeof (pktHeader), sizeof (netMsg), pktPages->header.transactionId, false);
+    _channel->txRing.writePacket(&pktHeader, sizeof (pktHeader), &netMsg, sizeof (netMsg));
+  }
+
+  void processIncoming(UInt8 *data, UInt32 dataLength) {
+    HyperVNetworkRNDISMessage                 *rndisPkt = (HyperVNetworkRNDISMessage *) data;
+    HyperVNetworkRNDISPerPacketInfoIEEE8021Q  *vlanInfo;
+    UInt8                                     *pktData;
+    UInt32                                    pktDataLength;
+
+    if (rndisPkt->header.type != kHyperVNetworkRNDISMessageTypePacket
+        || !getRNDISPacketData(rndisPkt, dataLength, &pktData, &pktDataLength) || pktDataLength > _mbufBuffer.size()) {
+      _invalidCount++;
+      return;
+    }
+    copyPayload(_mbufBuffer.data(), pktData, pktDataLength);
+
+    vlanInfo = (HyperVNetworkRNDISPerPacketInfoIEEE8021Q *) getRNDISPerPacketInfo(&rndisPkt->dataPacket, dataLength - sizeof (rndisPkt->header),
+                                                                                   kHyperVNetworkRNDISPerPacketInfoTypeIEEE8021Q, sizeof (*vlanInfo));
+    _framesReceived++;
+    _bytesReceived += pktDataLength;
+    if (_verifyPayload) {
+      _frameHash = hashFrame(_frameHash, _mbufBuffer.data(), pktDataLength, vlanInfo != nullptr ? getRNDISVLANTag(vlanInfo) : 0);
+    }
+  }
+};
+
+static void testRing() {
+  TestRing          ring(4096);
+  VMBusPacketHeader pktHeader;
+  UInt8             data[13];
+  UInt8             readBuffer[64];
+  UInt64            trailingIndex;
+  UInt32            readBytes;
+  UInt32            writeBytes;
+  UInt32            readIndex;
+  UInt32            writeIndex;
+  UInt32            written;
+  UInt32            read;
+
+  getRingSpace(0, 0, 4096, &readBytes, &writeBytes);
+  HVCHECK_EQ(readBytes, 0);
+  HVCHECK_EQ(writeBytes, 4096);
+  getRingSpace(100, 300, 4096, &readBytes, &writeBytes);
+  HVCHECK_EQ(readBytes, 200);
+  HVCHECK_EQ(writeBytes, 3896);
+  getRingSpace(300, 100, 4096, &readBytes, &writeBytes);
+  HVCHECK_EQ(readBytes, 3896);
+  HVCHECK_EQ(writeBytes, 200);
+
+  //
+  // Packet wrapping around the end of the ring, padding must be zeroed and the trailing index is the old write index.
+  //
+  memset(ring.getBuffer(), 0xAA, 4096);
+  fillRandom(data, sizeof (data));
+  ring.setIndexes(4096 - 24, 4096 - 24);
+  initPacketHeader(&pktHeader, kVMBusPacketTypeDataInband, sizeof (pktHeader), sizeof (data), 0x1234, true);
+  HVCHECK(ring.writePacket(&pktHeader, sizeof (pktHeader), data, sizeof (data)));
+  HVCHECK_EQ(ring.getWriteIndex(), (4096 - 24 + 32 + kVMBusRingPacketIndexSize) % 4096);
+  HVCHECK_EQ(ring.getBytesWritten(), HV_PACKETALIGN(sizeof (pktHeader) + sizeof (data)));
+  HVCHECK_EQ(ring.getSignalCount(), 1);
+  for (UInt32 i = 0; i < 3; i++) {
+    HVCHECK_EQ(ring.getBuffer()[(4096 - 24 + sizeof (pktHeader) + sizeof (data) + i) % 4096], 0);
+  }
+  copyFromRing(ring.getBuffer(), 4096, (4096 - 24 + 32) % 4096, sizeof (trailingIndex), &trailingIndex, sizeof (trailingIndex));
+  HVCHECK_EQ(trailingIndex, ((UInt64) (4096 - 24)) << 32);
+
+  memset(readBuffer, 0, sizeof (readBuffer));
+  HVCHECK_EQ(ring.readPacket(readBuffer, 16), 0);
+  HVCHECK_EQ(ring.readPacket(readBuffer, sizeof (readBuffer)), 32);
+  HVCHECK_EQ(((VMBusPacketHeader *) readBuffer)->transactionId, 0x1234);
+  HVCHECK(memcmp(&readBuffer[sizeof (pktHeader)], data, sizeof (data)) == 0);
+  HVCHECK(ring.isEmpty());
+  HVCHECK_EQ(ring.getBytesRead(), ring.getBytesWritten());
+  HVCHECK_EQ(ring.readPacket(readBuffer, sizeof (readBuffer)), 0);
+
+  //
+  // Reading with a separate header buffer.
+  //
+  readIndex  = 4000;
+  writeIndex = writeRingPacket(ring.getBuffer(), 4096, readIndex, &pktHeader, sizeof (pktHeader), data, sizeof (data));
+  HVCHECK(peekRingPacket(ring.getBuffer(), 4096, readIndex, writeIndex, &pktHeader));
+  HVCHECK_EQ(getRingPacketLength(&pktHeader), 32);
+  memset(readBuffer, 0, sizeof (readBuffer));
+  HVCHECK_EQ(readRingPacket(ring.getBuffer(), 4096, readIndex, &readBuffer[0], sizeof (pktHeader), &readBuffer[32], 16), writeIndex);
+  HVCHECK(memcmp(&readBuffer[32], data, sizeof (data)) == 0);
+  HVCHECK(!peekRingPacket(ring.getBuffer(), 4096, writeIndex, writeIndex, &pktHeader));
+
+  //
+  // A packet and its trailing index may not fill the ring completely, as it would then look empty.
+  //
+  HVCHECK(!canWriteRingPacket(56 + 8, 56));
+  HVCHECK(canWriteRingPacket(56 + 9, 56));
+  ring.setIndexes(0, 0);
+  initPacketHeader(&pktHeader, kVMBusPacketTypeDataInband, sizeof (pktHeader), 40, 0, false);
+  written = 0;
+  while (written <= 4096 / 64 && ring.writePacket(&pktHeader, sizeof (pktHeader), readBuffer, 40)) {
+    written++;
+  }
+  HVCHECK_EQ(written, 4096 / 64 - 1);
+  HVCHECK(!ring.isEmpty());
+  HVCHECK_EQ(ring.getFullCount(), 1);
+  read = 0;
+  while (ring.readPacket(readBuffer, sizeof (readBuffer)) != 0) {
+    read++;
+  }
+  HVCHECK_EQ(read, written);
+
+  //
+  // Only signal on the empty to non-empty transition while interrupts are not masked.
+  //
+  HVCHECK(shouldSignalRingWrite(0, 64, 64));
+  HVCHECK(!shouldSignalRingWrite(0, 128, 64));
+  HVCHECK(!shouldSignalRingWrite(1, 64, 64));
+}
+
+static void testProtocolMessages() {
+  HyperVNetworkMessage netMsg;
+  UInt64               pkt[8];
+  VMBusPacketHeader    *pktHeader = (VMBusPacketHeader *) pkt;
+  UInt32               sendIndex;
+  UInt32               status;
+
+  buildNetworkInitMessage(&netMsg, kHyperVNetworkProtocolVersion5);
+  HVCHECK_EQ(netMsg.messageType, kHyperVNetworkMessageTypeInit);
+  HVCHECK_EQ(netMsg.init.initVersion.minProtocolVersion, kHyperVNetworkProtocolVersion5);
+  HVCHECK_EQ(netMsg.init.initVersion.maxProtocolVersion, kHyperVNetworkProtocolVersion5);
+
+  buildNDISVersionMessage(&netMsg, kHyperVNetworkProtocolVersion4);
+  HVCHECK_EQ(netMsg.v1.sendNDISVersion.major, 6);
+  HVCHECK_EQ(netMsg.v1.sendNDISVersion.minor, 1);
+  buildNDISVersionMessage(&netMsg, kHyperVNetworkProtocolVersion5);
+  HVCHECK_EQ(netMsg.v1.sendNDISVersion.major, 6);
+  HVCHECK_EQ(netMsg.v1.sendNDISVersion.minor, 30);
+
+  buildNDISConfigMessage(&netMsg, kHyperVNetworkProtocolVersion4, kTestEthernetMTU);
+  HVCHECK_EQ(netMsg.v2.sendNDISConfig.mtu, kTestEthernetMTU);
+  HVCHECK_EQ(netMsg.v2.sendNDISConfig.capabilities, kHyperVNetworkV2CapabilityIEEE8021Q);
+  buildNDISConfigMessage(&netMsg, kHyperVNetworkProtocolVersion5, kTestEthernetMTU);
+  HVCHECK_EQ(netMsg.v2.sendNDISConfig.capabilities,
+             kHyperVNetworkV2CapabilityIEEE8021Q | kHyperVNetworkV2CapabilitySRIOV | kHyperVNetworkV2CapabilityTeaming);
+
+  HVCHECK_EQ(getNetworkReceiveBufferSize(kHyperVNetworkProtocolVersion2), kHyperVNetworkReceiveBufferSizeLegacy);
+  HVCHECK_EQ(getNetworkReceiveBufferSize(kHyperVNetworkProtocolVersion4), kHyperVNetworkReceiveBufferSize);
+
+  buildReceiveBufferMessage(&netMsg, kTestReceiveGpadl);
+  HVCHECK_EQ(netMsg.v1.sendReceiveBuffer.gpadlHandle, kTestReceiveGpadl);
+  HVCHECK_EQ(netMsg.v1.sendReceiveBuffer.id, kHyperVNetworkReceiveBufferID);
+  buildSendBufferMessage(&netMsg, kTestSendGpadl);
+  HVCHECK_EQ(netMsg.v1.sendSendBuffer.gpadlHandle, kTestSendGpadl);
+  HVCHECK_EQ(netMsg.v1.sendSendBuffer.id, kHyperVNetworkSendBufferID);
+
+  //
+  // Send completions return the section index carried in the transaction ID.
+  //
+  buildSendRNDISPacketCompleteMessage(&netMsg, kHyperVNetworkMessageStatusSuccess);
+  initPacketHeader(pktHeader, kVMBusPacketTypeCompletion, sizeof (*pktHeader), sizeof (netMsg), getSendTransactionId(1234), false);
+  memcpy(&pkt[2], &netMsg, sizeof (netMsg));
+  HVCHECK(getSendCompletionIndex(pktHeader, getRingPacketLength(pktHeader), &sendIndex, &status));
+  HVCHECK_EQ(sendIndex, 1234);
+  HVCHECK_EQ(status, kHyperVNetworkMessageStatusSuccess);
+  HVCHECK(!getSendCompletionIndex(pktHeader, sizeof (*pktHeader) + 4, &sendIndex, &status));
+
+  buildSendRNDISPacketMessage(&netMsg, kHyperVNetworkRNDISChannelTypeData, 1, 100);
+  memcpy(&pkt[2], &netMsg, sizeof (netMsg));
+  HVCHECK(!getSendCompletionIndex(pktHeader, getRingPacketLength(pktHeader), &sendIndex, &status));
+}
+
+static void testRNDISFraming() {
+  UInt64                                    buffer[512];
+  HyperVNetworkRNDISMessage                 *rndisMsg = (HyperVNetworkRNDISMessage *) buffer;
+  HyperVNetworkRNDISPerPacketInfoIEEE8021Q  *vlanInfo;
+  HyperVNetworkRNDISPerPacketInfo           *ppi;
+  UInt8                                     frame[100];
+  UInt8                                     *data;
+  UInt32                                    dataLength;
+  UInt32                                    dataOffset;
+  UInt32                                    msgLength;
+
+  //
+  // Data packet without per-packet info.
+  //
+  fillRandom(frame, sizeof (frame));
+  initRNDISDataPacket(rndisMsg);
+  dataOffset = finishRNDISDataPacket(rndisMsg, sizeof (frame));
+  HVCHECK_EQ(rndisMsg->header.type, kHyperVNetworkRNDISMessageTypePacket);
+  HVCHECK_EQ(dataOffset, sizeof (rndisMsg->header) + sizeof (rndisMsg->dataPacket));
+  HVCHECK_EQ(rndisMsg->header.length, dataOffset + sizeof (frame));
+  memcpy(((UInt8 *) buffer) + dataOffset, frame, sizeof (frame));
+  HVCHECK(getRNDISPacketData(rndisMsg, rndisMsg->header.length, &data, &dataLength));
+  HVCHECK_EQ(dataLength, sizeof (frame));
+  HVCHECK(memcmp(data, frame, sizeof (frame)) == 0);
+  HVCHECK(getRNDISPerPacketInfo(&rndisMsg->dataPacket, rndisMsg->header.length - sizeof (rndisMsg->header),
+                                kHyperVNetworkRNDISPerPacketInfoTypeIEEE8021Q, sizeof (*vlanInfo)) == nullptr);
+
+  //
+  // Data packet with VLAN per-packet info, the priority, CFI and VLAN ID must all be preserved.
+  //
+  initRNDISDataPacket(rndisMsg);
+  vlanInfo = (HyperVNetworkRNDISPerPacketInfoIEEE8021Q *) addRNDISPerPacketInfo(&rndisMsg->dataPacket,
+                                                                                 kHyperVNetworkRNDISPerPacketInfoTypeIEEE8021Q, sizeof (*vlanInfo));
+  setRNDISVLANInfo(vlanInfo, 0xB123);
+  dataOffset = finishRNDISDataPacket(rndisMsg, sizeof (frame));
+  HVCHECK_EQ(dataOffset, sizeof (rndisMsg->header) + sizeof (rndisMsg->dataPacket) + kHyperVNetworkRNDISPerPacketInfoSize(*vlanInfo));
+  memcpy(((UInt8 *) buffer) + dataOffset, frame, sizeof (frame));
+  msgLength = rndisMsg->header.length;
+
+  HVCHECK(getRNDISPacketData(rndisMsg, msgLength, &data, &dataLength));
+  HVCHECK(memcmp(data, frame, sizeof (frame)) == 0);
+  vlanInfo = (HyperVNetworkRNDISPerPacketInfoIEEE8021Q *) getRNDISPerPacketInfo(&rndisMsg->dataPacket, msgLength - sizeof (rndisMsg->header),
+                                                                                 kHyperVNetworkRNDISPerPacketInfoTypeIEEE8021Q, sizeof (*vlanInfo));
+  HVCHECK(vlanInfo != nullptr);
+  if (vlanInfo != nullptr) {
+    HVCHECK_EQ(vlanInfo->userPriority, 5);
+    HVCHECK_EQ(vlanInfo->canonicalFormatId, 1);
+    HVCHECK_EQ(vlanInfo->vlanId, 0x123);
+    HVCHECK_EQ(getRNDISVLANTag(vlanInfo), 0xB123);
+  }
+  HVCHECK(getRNDISPerPacketInfo(&rndisMsg->dataPacket, msgLength - sizeof (rndisMsg->header),
+                                kHyperVNetworkRNDISPerPacketInfoTypeTCPIPChecksum, sizeof (UInt32)) == nullptr);
+  HVCHECK(getRNDISPerPacketInfo(&rndisMsg->dataPacket, msgLength - sizeof (rndisMsg->header),
+                                kHyperVNetworkRNDISPerPacketInfoTypeIEEE8021Q, sizeof (*vlanInfo) + 1) == nullptr);
+
+  //
+  // Malformed messages.
+  //
+  HVCHECK(!getRNDISPacketData(rndisMsg, sizeof (rndisMsg->header) + sizeof (rndisMsg->dataPacket) - 1, &data, &dataLength));
+  HVCHECK(!getRNDISPacketData(rndisMsg, msgLength - 1, &data, &dataLength));
+  rndisMsg->dataPacket.dataOffset = 0xFFFFFFF0;
+  HVCHECK(!getRNDISPacketData(rndisMsg, msgLength, &data, &dataLength));
+
+  HVCHECK(getRNDISPerPacketInfo(&rndisMsg->dataPacket, rndisMsg->dataPacket.perPacketInfoOffset + 4,
+                                kHyperVNetworkRNDISPerPacketInfoTypeIEEE8021Q, sizeof (*vlanInfo)) == nullptr);
+  ppi = (HyperVNetworkRNDISPerPacketInfo *) (((UInt8 *) &rndisMsg->dataPacket) + rndisMsg->dataPacket.perPacketInfoOffset);
+  ppi->size = 0;
+  HVCHECK(getRNDISPerPacketInfo(&rndisMsg->dataPacket, msgLength - sizeof (rndisMsg->header),
+                                kHyperVNetworkRNDISPerPacketInfoTypeIEEE8021Q, sizeof (*vlanInfo)) == nullptr);
+  ppi->size      = kHyperVNetworkRNDISPerPacketInfoSize(*vlanInfo);
+  ppi->ppiOffset = 0xFFFFFFFC;
+  HVCHECK(getRNDISPerPacketInfo(&rndisMsg->dataPacket, msgLength - sizeof (rndisMsg->header),
+                                kHyperVNetworkRNDISPerPacketInfoTypeIEEE8021Q, sizeof (*vlanInfo)) == nullptr);
+}
+
+static void testTransferPages() {
+  UInt64                    pkt[16];
+  VMBusPacketTransferPages  *pktPages = (VMBusPacketTransferPages *) pkt;
+  HyperVNetworkMessage      netMsg;
+  UInt32                    headerLength = offsetof(VMBusPacketTransferPages, ranges) + 3 * sizeof (VMBusTransferPageRange);
+  UInt32                    pktLength;
+  UInt32                    offsets[3];
+  UInt32                    count;
+
+  auto buildPacket = [&]() {
+    memset(pkt, 0, sizeof (pkt));
+    initPacketHeader(&pktPages->header, kVMBusPacketTypeDataUsingTransferPages, headerLength, sizeof (netMsg), 1, true);
+    pktPages->transferPagesetId = kHyperVNetworkReceiveBufferID;
+    pktPages->rangeCount        = 3;
+    for (UInt32 i = 0; i < 3; i++) {
+      pktPages->ranges[i].offset = i * 0x1000;
+      pktPages->ranges[i].count  = 0x100 + i;
+    }
+    buildSendRNDISPacketMessage(&netMsg, kHyperVNetworkRNDISChannelTypeData, kHyperVNetworkRNDISSendSectionIndexInvalid, 0);
+    memcpy(((UInt8 *) pkt) + HV_PACKETALIGN(headerLength), &netMsg, sizeof (netMsg));
+    pktLength = getRingPacketLength(&pktPages->header);
+  };
+  auto handleRange = [&](UInt32 offset, UInt32 length) {
+    if (count < 3) {
+      offsets[count] = offset;
+    }
+    HVCHECK_EQ(length, 0x100 + count);
+    count++;
+  };
+
+  buildPacket();
+  count = 0;
+  HVCHECK(processTransferPageRanges(pktPages, pktLength, 0x4000, handleRange));
+  HVCHECK_EQ(count, 3);
+  HVCHECK_EQ(offsets[0], 0);
+  HVCHECK_EQ(offsets[1], 0x1000);
+  HVCHECK_EQ(offsets[2], 0x2000);
+
+  //
+  // Invalid packets are rejected before any range is handled.
+  //
+  count = 0;
+  HVCHECK(!processTransferPageRanges(pktPages, pktLength, 0x2100, handleRange));
+  HVCHECK(!processTransferPageRanges(pktPages, HV_PACKETALIGN(headerLength), 0x4000, handleRange));
+  pktPages->transferPagesetId = kHyperVNetworkSendBufferID;
+  HVCHECK(!processTransferPageRanges(pktPages, pktLength, 0x4000, handleRange));
+  buildPacket();
+  pktPages->rangeCount = 4;
+  HVCHECK(!processTransferPageRanges(pktPages, pktLength, 0x4000, handleRange));
+  buildPacket();
+  pktPages->ranges[2].offset = 0xFFFFFF00;
+  HVCHECK(!processTransferPageRanges(pktPages, pktLength, 0x4000, handleRange));
+  buildPacket();
+  ((HyperVNetworkMessage *) (((UInt8 *) pkt) + HV_PACKETALIGN(headerLength)))->messageType = kHyperVNetworkMessageTypeV1SendRNDISPacketComplete;
+  HVCHECK(!processTransferPageRanges(pktPages, pktLength, 0x4000, handleRange));
+  HVCHECK_EQ(count, 0);
+}
+
+static void testConnect() {
+  static const struct {
+    HyperVNetworkProtocolVersion maxVersion;
+    UInt32                       ndisMinor;
+    UInt32                       receiveBufferSize;
+    UInt32                       mtu;
+  } connectCases[] = {
+    { kHyperVNetworkProtocolVersion61, 30, kHyperVNetworkReceiveBufferSize,       kTestEthernetMTU },
+    { kHyperVNetworkProtocolVersion5,  30, kHyperVNetworkReceiveBufferSize,       kTestEthernetMTU },
+    { kHyperVNetworkProtocolVersion4,  1,  kHyperVNetworkReceiveBufferSize,       kTestEthernetMTU },
+    { kHyperVNetworkProtocolVersion2,  1,  kHyperVNetworkReceiveBufferSizeLegacy, kTestEthernetMTU },
+    { kHyperVNetworkProtocolVersion1,  1,  kHyperVNetworkReceiveBufferSizeLegacy, 0                }
+  };
+
+  for (size_t i = 0; i < sizeof (connectCases) / sizeof (connectCases[0]); i++) {
+    TestChannel       channel;
+    TestNetworkHost   host(&channel, connectCases[i].maxVersion);
+    TestNetworkClient client(&channel, &host);
+
+    HVCHECK(client.connect());
+    HVCHECK_EQ(client.getVersion(), connectCases[i].maxVersion);
+    HVCHECK_EQ(host.getVersion(), connectCases[i].maxVersion);
+    HVCHECK_EQ(host.getNDISMajor(), 6);
+    HVCHECK_EQ(host.getNDISMinor(), connectCases[i].ndisMinor);
+    HVCHECK_EQ(host.getMTU(), connectCases[i].mtu);
+    HVCHECK_EQ(client.getReceiveBufferSize(), connectCases[i].receiveBufferSize);
+    HVCHECK_EQ(client.getSendSectionCount(), kHyperVNetworkSendBufferSize / kTestSendSectionSize);
+    HVCHECK_EQ(host.getFreeReceiveSlotCount(), connectCases[i].receiveBufferSize / kTestReceiveSlotSize);
+    HVCHECK_EQ(host.getInvalidCount(), 0);
+    HVCHECK_EQ(client.getInvalidCount(), 0);
+  }
+
+  //
+  // More than one receive section is not supported.
+  //
+  {
+    TestChannel       channel;
+    TestNetworkHost   host(&channel, kHyperVNetworkProtocolVersion61);
+    TestNetworkClient client(&channel, &host);
+
+    host.setReceiveSectionCount(2);
+    HVCHECK(!client.connect());
+  }
+}
+
+static void testDataPath(UInt32 batch) {
+  TestChannel       channel;
+  TestNetworkHost   host(&channel, kHyperVNetworkProtocolVersion61);
+  TestNetworkClient client(&channel, &host);
+  UInt8             frame[kTestMaxFrameSize];
+  UInt64            hash;
+  UInt64            bytes;
+  UInt32            length;
+  UInt16            vlanTag;
+  UInt32            frames = 1024;
+
+  HVCHECK(client.connect());
+  HVCHECK(channel.txRing.isEmpty() && channel.rxRing.isEmpty());
+
+  //
+  // Transmit frames of random sizes and tags, the host must see exactly the same frames.
+  //
+  UInt64 txSignals = channel.txRing.getSignalCount();
+  UInt64 rxSignals = channel.rxRing.getSignalCount();
+  hash  = 0;
+  bytes = 0;
+  for (UInt32 i = 0; i < frames; i++) {
+    length  = 60 + testRandom() % (kTestEthernetMTU - 60 + 1);
+    vlanTag = (testRandom() & 1) ? (UInt16) testRandom() : 0;
+    fillRandom(frame, length);
+    HVCHECK_EQ(client.sendFrame(frame, length, vlanTag != 0, vlanTag), kTestSendSuccess);
+    hash   = hashFrame(hash, frame, length, vlanTag);
+    bytes += length;
+
+    if ((i + 1) % batch == 0) {
+      host.process();
+      client.handleInterrupt();
+    }
+  }
+  HVCHECK_EQ(host.getFramesReceived(), frames);
+  HVCHECK_EQ(host.getBytesReceived(), bytes);
+  HVCHECK_EQ(host.getFrameHash(), hash);
+  HVCHECK_EQ(client.getSendIndexesOutstanding(), 0);
+  HVCHECK_EQ(client.getPayloadBytesCopied(), bytes);
+  HVCHECK_EQ(channel.txRing.getSignalCount() - txSignals, frames / batch);
+  HVCHECK_EQ(channel.rxRing.getSignalCount() - rxSignals, frames / batch);
+
+  //
+  // Receive frames of random sizes and tags through the receive buffer, every slot must be returned.
+  //
+  txSignals = channel.txRing.getSignalCount();
+  rxSignals = channel.rxRing.getSignalCount();
+  hash  = 0;
+  bytes = 0;
+  for (UInt32 i = 0; i < frames; i++) {
+    length  = 60 + testRandom() % (kTestMaxFrameSize - 60 + 1);
+    vlanTag = (testRandom() & 1) ? (UInt16) testRandom() : 0;
+    fillRandom(frame, length);
+    HVCHECK(host.deliverFrame(frame, length, vlanTag != 0, vlanTag));
+    hash   = hashFrame(hash, frame, length, vlanTag);
+    bytes += length;
+
+    if ((i + 1) % batch == 0) {
+      client.handleInterrupt();
+      host.process();
+    }
+  }
+  HVCHECK_EQ(client.getFramesReceived(), frames);
+  HVCHECK_EQ(client.getBytesReceived(), bytes);
+  HVCHECK_EQ(client.getFrameHash(), hash);
+  HVCHECK_EQ(host.getFreeReceiveSlotCount(), host.getReceiveSlotCount());
+  HVCHECK_EQ(channel.rxRing.getSignalCount() - rxSignals, frames / batch);
+  HVCHECK_EQ(channel.txRing.getSignalCount() - txSignals, frames / batch);
+
+  //
+  // Both ends count the same bytes for the same packets.
+  //
+  HVCHECK_EQ(channel.txRing.getBytesWritten(), channel.txRing.getBytesRead());
+  HVCHECK_EQ(channel.rxRing.getBytesWritten(), channel.rxRing.getBytesRead());
+  HVCHECK_EQ(channel.txRing.getFullCount() + channel.rxRing.getFullCount(), 0);
+  HVCHECK_EQ(host.getInvalidCount(), 0);
+  HVCHECK_EQ(client.getInvalidCount(), 0);
+  HVCHECK_EQ(client.getCompletionErrorCount(), 0);
+}
+
+static void testSendLimits() {
+  TestChannel       channel;
+  TestNetworkHost   host(&channel, kHyperVNetworkProtocolVersion61);
+  TestNetworkClient client(&channel, &host);
+  UInt8             frame[kTestMaxFrameSize];
+  UInt64            signals;
+  UInt32            maxFrameLength;
+  UInt32            sections;
+
+  HVCHECK(client.connect());
+  signals = channel.txRing.getSignalCount();
+  fillRandom(frame, sizeof (frame));
+
+  //
+  // Frames that do not fit in a send section are dropped without leaking the section.
+  //
+  maxFrameLength = kTestSendSectionSize - sizeof (HyperVNetworkRNDISMessageHeader) - sizeof (HyperVNetworkRNDISMessageDataPacket);
+  HVCHECK_EQ(client.sendFrame(frame, 0, false, 0), kTestSendDropped);
+  HVCHECK_EQ(client.sendFrame(frame, maxFrameLength + 1, false, 0), kTestSendDropped);
+  HVCHECK_EQ(client.sendFrame(frame, kTestMaxFrameSize, false, 0), kTestSendDropped);
+  HVCHECK_EQ(client.getSendIndexesOutstanding(), 0);
+  HVCHECK_EQ(client.sendFrame(frame, maxFrameLength, false, 0), kTestSendSuccess);
+  HVCHECK_EQ(client.sendFrame(frame, maxFrameLength, true, 1), kTestSendDropped);
+  HVCHECK_EQ(client.getSendIndexesOutstanding(), 1);
+
+  //
+  // Once all sections are outstanding the output queue must stall until completions arrive.
+  //
+  sections = client.getSendSectionCount();
+  for (UInt32 i = 1; i < sections; i++) {
+    HVCHECK_EQ(client.sendFrame(frame, 64, false, 0), kTestSendSuccess);
+  }
+  HVCHECK_EQ(client.sendFrame(frame, 64, false, 0), kTestSendStall);
+  HVCHECK_EQ(client.getSendIndexesOutstanding(), sections);
+  HVCHECK_EQ(channel.txRing.getSignalCount() - signals, 1);
+
+  host.process();
+  client.handleInterrupt();
+  HVCHECK_EQ(client.getSendIndexesOutstanding(), 0);
+  HVCHECK_EQ(host.getFramesReceived(), sections);
+  HVCHECK_EQ(client.sendFrame(frame, 64, false, 0), kTestSendSuccess);
+}
+
+//
+// Benchmark run description and results.
+//
+typedef struct {
+  bool   isTransmit;
+  UInt32 frameSize;
+  UInt32 batch;
+} TestRun;
+
+typedef struct {
+  UInt64 frames;
+  UInt64 bytes;
+  UInt64 dropped;
+  UInt64 payloadBytesCopied;
+  UInt64 ringBytes;
+  UInt64 guestSignals;
+  UInt64 hostSignals;
+  UInt64 elapsedNs;
+} TestRunResult;
+
+//
+// Passes frames through the channel until the frame count or duration is reached.
+// The host runs after every batch of frames, as if it were woken once per batch.
+//
+static void runFrames(const TestRun *run, UInt64 maxFrames, UInt64 durationNs, TestRunResult *result) {
+  TestChannel       channel;
+  TestNetworkHost   host(&channel, kHyperVNetworkProtocolVersion61);
+  TestNetworkClient client(&channel, &host);
+  UInt8             frame[kTestMaxFrameSize];
+  UInt64            txSignals;
+  UInt64            rxSignals;
+  UInt64            txBytes;
+  UInt64            rxBytes;
+  UInt64            attempts = 0;
+  UInt64            start;
+
+  memset(result, 0, sizeof (*result));
+  if (!client.connect()) {
+    result->dropped++;
+    return;
+  }
+  host.setVerifyPayload(false);
+  client.setVerifyPayload(false);
+  fillRandom(frame, run->frameSize);
+
+  txSignals = channel.txRing.getSignalCount();
+  rxSignals = channel.rxRing.getSignalCount();
+  txBytes   = channel.txRing.getBytesWritten();
+  rxBytes   = channel.rxRing.getBytesWritten();
+
+  start = getTimeNs();
+  while ((maxFrames == 0 || attempts < maxFrames) && (durationNs == 0 || getTimeNs() - start < durationNs)) {
+    for (UInt32 i = 0; i < run->batch; i++) {
+      attempts++;
+      if (run->isTransmit) {
+        if (client.sendFrame(frame, run->frameSize, false, 0) != kTestSendSuccess) {
+          result->dropped++;
+        }
+      } else if (!host.deliverFrame(frame, run->frameSize, false, 0)) {
+        result->dropped++;
+      }
+    }
+
+    if (run->isTransmit) {
+      host.process();
+      client.handleInterrupt();
+    } else {
+      client.handleInterrupt();
+      host.process();
+    }
+  }
+  result->elapsedNs = getTimeNs() - start;
+
+  result->frames             = run->isTransmit ? host.getFramesReceived() : client.getFramesReceived();
+  result->bytes              = run->isTransmit ? host.getBytesReceived() : client.getBytesReceived();
+  result->payloadBytesCopied = client.getPayloadBytesCopied();
+  result->ringBytes          = (channel.txRing.getBytesWritten() - txBytes) + (channel.rxRing.getBytesWritten() - rxBytes);
+  result->guestSignals       = channel.txRing.getSignalCount() - txSignals;
+  result->hostSignals        = channel.rxRing.getSignalCount() - rxSignals;
+}
+
+static const TestRun benchmarkRuns[] = {
+  { true,  64,   1  },
+  { true,  64,   32 },
+  { true,  512,  32 },
+  { true,  1500, 1  },
+  { true,  1500, 32 },
+  { true,  9000, 32 },
+  { false, 64,   1  },
+  { false, 64,   32 },
+  { false, 512,  32 },
+  { false, 1500, 1  },
+  { false, 1500, 32 },
+  { false, 9000, 32 }
+};
+
+static void testRuns() {
+  TestRunResult result;
+
+  for (size_t i = 0; i < sizeof (benchmarkRuns) / sizeof (benchmarkRuns[0]); i++) {
+    const TestRun *run = &benchmarkRuns[i];
+
+    runFrames(run, 256, 0, &result);
+
+    //
+    // Jumbo frames do not fit in a send section and are dropped on transmit.
+    //
+    if (run->isTransmit && run->frameSize > kTestEthernetMTU) {
+      HVCHECK_EQ(result.frames, 0);
+      HVCHECK_EQ(result.dropped, 256);
+      HVCHECK_EQ(result.payloadBytesCopied, 0);
+      HVCHECK_EQ(result.guestSignals, 0);
+      continue;
+    }
+
+    //
+    // Each frame is copied exactly once by the guest, and each end is signaled once per batch.
+    //
+    HVCHECK_EQ(result.frames, 256);
+    HVCHECK_EQ(result.dropped, 0);
+    HVCHECK_EQ(result.bytes, 256ULL * run->frameSize);
+    HVCHECK_EQ(result.payloadBytesCopied, result.bytes);
+    HVCHECK_EQ(result.guestSignals, 256 / run->batch);
+    HVCHECK_EQ(result.hostSignals, 256 / run->batch);
+  }
+}
+
+static void benchmark() {
+  TestRunResult result;
+
+  printf("Simulated NVSP host, protocol 0x%X, %u byte send sections, %u byte receive slots, %llu ms per run\n",
+         kHyperVNetworkProtocolVersion61, kTestSendSectionSize, kTestReceiveSlotSize, kTestBenchRunNs / 1000000);
+  printf("Batch is the number of frames queued per host wakeup, host processing time is included\n");
+  printf("%-3s %6s %6s %11s %9s %10s %10s %11s %11s %8s\n",
+         "Dir", "Frame", "Batch", "pps", "MB/s", "Copies/pkt", "Ring B/pkt", "G>H sig/pkt", "H>G sig/pkt", "Dropped");
+  for (size_t i = 0; i < sizeof (benchmarkRuns) / sizeof (benchmarkRuns[0]); i++) {
+    const TestRun *run = &benchmarkRuns[i];
+    double        frames;
+
+    runFrames(run, 0, kTestBenchRunNs, &result);
+    frames = result.frames != 0 ? (double) result.frames : 1.0;
+    printf("%-3s %6u %6u %11.0f %9.1f %10.2f %10.1f %11.3f %11.3f %8llu\n",
+           run->isTransmit ? "TX" : "RX", run->frameSize, run->batch,
+           result.frames * 1e9 / result.elapsedNs, result.bytes * 1e3 / result.elapsedNs,
+           result.payloadBytesCopied / (frames * run->frameSize), result.ringBytes / frames,
+           result.guestSignals / frames, result.hostSignals / frames, (unsigned long long) result.dropped);
+  }
+}
+
+int main(int argc, char **argv) {
+  if (isBenchmarkRun(argc, argv)) {
+    benchmark();
+    return 0;
+  }
+
+  testRing();
+  testProtocolMessages();
+  testRNDISFraming();
+  testTransferPages();
+  testConnect();
+  testDataPath(1);
+  testDataPath(32);
+  testSendLimits();
+  testRuns();
+  return finishTests("NetworkHostTests");
+}
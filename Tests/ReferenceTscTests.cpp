@@ -0,0 +1,173 @@
+//
+//  ReferenceTscTests.cpp
+//  Tests for the Hyper-V reference TSC page read routines
+//
+//  Copyright © 2022 Goldfish64. All rights reserved.
+//
+
+#include "HyperVTests.hpp"
+#include "HyperVReferenceTsc.hpp"
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+#define kTestScaleHalf  0x8000000000000000ULL
+
+static UInt64 referenceMultiplyHigh64(UInt64 a, UInt64 b) {
+  return (UInt64) (((unsigned __int128) a * b) >> 64);
+}
+
+static void testMultiplyHigh64() {
+  static const UInt64 values[] = {
+    0, 1, 2, UINT32_MAX, (UInt64) UINT32_MAX + 1, 0x00000001FFFFFFFFULL,
+    0x7FFFFFFFFFFFFFFFULL, kTestScaleHalf, 0xFFFFFFFF00000000ULL, UINT64_MAX
+  };
+  UInt64 a;
+  UInt64 b;
+
+  for (size_t i = 0; i < sizeof (values) / sizeof (values[0]); i++) {
+    for (size_t j = 0; j < sizeof (values) / sizeof (values[0]); j++) {
+      HVCHECK_EQ(multiplyHigh64Partial(values[i], values[j]), referenceMultiplyHigh64(values[i], values[j]));
+      HVCHECK_EQ(multiplyHigh64(values[i], values[j]), referenceMultiplyHigh64(values[i], values[j]));
+    }
+  }
+
+  for (UInt32 i = 0; i < 100000; i++) {
+    a = ((UInt64) testRandom() << 32) | testRandom();
+    b = ((UInt64) testRandom() << 32) | testRandom();
+    HVCHECK_EQ(multiplyHigh64Partial(a, b), referenceMultiplyHigh64(a, b));
+    HVCHECK_EQ(multiplyHigh64(a, b), referenceMultiplyHigh64(a, b));
+  }
+}
+
+static void testPageRead() {
+  HyperVReferenceTscPage page     = { };
+  UInt64                 refCount = 0x1234;
+  UInt32                 reads    = 0;
+
+  //
+  // Invalid page must not be used, and must not touch the output.
+  //
+  page.sequence = kHyperVReferenceTscSequenceInvalid;
+  HVCHECK(!readReferenceTscPage(&page, [&]() { reads++; return 1000ULL; }, &refCount));
+  HVCHECK_EQ(refCount, 0x1234);
+  HVCHECK_EQ(reads, 0);
+
+  //
+  // Half scale with a negative offset.
+  //
+  page.sequence = 1;
+  page.scale    = kTestScaleHalf;
+  page.offset   = -100;
+  HVCHECK(readReferenceTscPage(&page, [&]() { reads++; return 1000ULL; }, &refCount));
+  HVCHECK_EQ(refCount, 400);
+  HVCHECK_EQ(reads, 1);
+
+  //
+  // Full TSC range with a scale just under one.
+  //
+  page.scale  = UINT64_MAX;
+  page.offset = 0;
+  HVCHECK(readReferenceTscPage(&page, []() { return UINT64_MAX; }, &refCount));
+  HVCHECK_EQ(refCount, UINT64_MAX - 1);
+}
+
+static void testPageUpdatedDuringRead() {
+  HyperVReferenceTscPage page     = { };
+  UInt64                 refCount = 0;
+  UInt32                 reads    = 0;
+
+  //
+  // Host updates the scale between the sequence read and the TSC read.
+  // The first sample must be discarded and the new scale used.
+  //
+  page.sequence = 5;
+  page.scale    = kTestScaleHalf;
+  page.offset   = 0;
+  HVCHECK(readReferenceTscPage(&page, [&]() {
+    if (reads++ == 0) {
+      page.scale    = kTestScaleHalf >> 1;
+      page.sequence = 6;
+    }
+    return 4000ULL;
+  }, &refCount));
+  HVCHECK_EQ(reads, 2);
+  HVCHECK_EQ(refCount, 1000);
+
+  //
+  // Host invalidates the page during the read, the caller must fall back.
+  //
+  reads = 0;
+  HVCHECK(!readReferenceTscPage(&page, [&]() {
+    reads++;
+    page.sequence = kHyperVReferenceTscSequenceInvalid;
+    return 4000ULL;
+  }, &refCount));
+  HVCHECK_EQ(reads, 1);
+}
+
+static inline UInt64 readTestTsc() {
+#if defined(__i386__) || defined(__x86_64__)
+  _mm_lfence();
+  return __rdtsc();
+#else
+  return getTimeNs();
+#endif
+}
+
+static void benchmark() {
+  static const UInt32    iterations = 50000000;
+  HyperVReferenceTscPage page       = { };
+  volatile UInt64        sink       = 0;
+  UInt64                 refCount   = 0;
+  UInt64                 start;
+  UInt64                 a;
+  UInt64                 b;
+
+  page.sequence = 1;
+  page.scale    = 0x0010000000000000ULL;
+  page.offset   = 12345;
+
+  printf("%-28s %10s\n", "Operation", "ns/op");
+
+  start = getTimeNs();
+  for (UInt32 i = 0; i < iterations; i++) {
+    sink += readTestTsc();
+  }
+  printf("%-28s %10.2f\n", "lfence+rdtsc", (double) (getTimeNs() - start) / iterations);
+
+  start = getTimeNs();
+  for (UInt32 i = 0; i < iterations; i++) {
+    readReferenceTscPage(&page, readTestTsc, &refCount);
+    sink += refCount;
+  }
+  printf("%-28s %10.2f\n", "readReferenceTscPage", (double) (getTimeNs() - start) / iterations);
+
+  a = ((UInt64) testRandom() << 32) | testRandom();
+  b = ((UInt64) testRandom() << 32) | testRandom();
+  start = getTimeNs();
+  for (UInt32 i = 0; i < iterations; i++) {
+    sink += multiplyHigh64(a + i, b);
+  }
+  printf("%-28s %10.2f\n", "multiplyHigh64", (double) (getTimeNs() - start) / iterations);
+
+  start = getTimeNs();
+  for (UInt32 i = 0; i < iterations; i++) {
+    sink += multiplyHigh64Partial(a + i, b);
+  }
+  printf("%-28s %10.2f\n", "multiplyHigh64Partial", (double) (getTimeNs() - start) / iterations);
+  (void) sink;
+}
+
+int main(int argc, char **argv) {
+  if (isBenchmarkRun(argc, argv)) {
+    benchmark();
+    return 0;
+  }
+
+  testMultiplyHigh64();
+  testPageRead();
+  testPageUpdatedDuringRead();
+  return finishTests("ReferenceTscTests");
+}
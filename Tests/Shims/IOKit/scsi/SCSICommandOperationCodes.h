@@ -0,0 +1,25 @@
+//
+//  SCSICommandOperationCodes.h
+//  Userspace stand-in for SCSI operation codes used by the driver headers under test
+//
+//  Copyright © 2022 Goldfish64. All rights reserved.
+//
+
+#ifndef _IOKIT_SCSI_COMMAND_OPERATION_CODES_H_
+#if defined(__APPLE__)
+#include_next <IOKit/scsi/SCSICommandOperationCodes.h>
+#else
+#define _IOKIT_SCSI_COMMAND_OPERATION_CODES_H_
+
+enum {
+  kSCSICmd_TEST_UNIT_READY              = 0x00,
+  kSCSICmd_INQUIRY                      = 0x12,
+  kSCSICmd_READ_10                      = 0x28,
+  kSCSICmd_WRITE_10                     = 0x2A,
+  kSCSICmd_READ_16                      = 0x88,
+  kSCSICmd_WRITE_16                     = 0x8A,
+  kSCSICmd_REPORT_LUNS                  = 0xA0
+};
+
+#endif
+#endif
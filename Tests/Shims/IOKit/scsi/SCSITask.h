@@ -0,0 +1,27 @@
+//
+//  SCSITask.h
+//  Userspace stand-in for SCSI task types used by the driver headers under test
+//
+//  Copyright © 2022 Goldfish64. All rights reserved.
+//
+
+#ifndef _IOKIT_SCSI_TASK_H_
+#if defined(__APPLE__)
+#include_next <IOKit/scsi/SCSITask.h>
+#else
+#define _IOKIT_SCSI_TASK_H_
+
+#include <libkern/OSTypes.h>
+
+typedef UInt8 SCSICommandDescriptorBlock[16];
+
+typedef enum SCSITaskStatus {
+  kSCSITaskStatus_GOOD                  = 0x00,
+  kSCSITaskStatus_CHECK_CONDITION       = 0x02,
+  kSCSITaskStatus_BUSY                  = 0x08,
+  kSCSITaskStatus_TASK_SET_FULL         = 0x28,
+  kSCSITaskStatus_No_Status             = 0xFF
+} SCSITaskStatus;
+
+#endif
+#endif
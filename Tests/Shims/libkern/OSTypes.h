@@ -0,0 +1,27 @@
+//
+//  OSTypes.h
+//  Userspace stand-in for libkern types used by the driver headers under test
+//
+//  Copyright © 2022 Goldfish64. All rights reserved.
+//
+
+#ifndef _OS_OSTYPES_H
+#if defined(__APPLE__)
+#include_next <libkern/OSTypes.h>
+#else
+#define _OS_OSTYPES_H
+
+#include <stdint.h>
+
+typedef uint8_t   UInt8;
+typedef int8_t    SInt8;
+typedef uint16_t  UInt16;
+typedef int16_t   SInt16;
+typedef uint32_t  UInt32;
+typedef int32_t   SInt32;
+typedef uint64_t  UInt64;
+typedef int64_t   SInt64;
+typedef UInt8     Boolean;
+
+#endif
+#endif
@@ -0,0 +1,984 @@
+//
+//  StorageHostTests.cpp
+//  Tests and benchmarks for the storage protocol routines against a simulated StorVSP host
+//
+//  Copyright © 2022 Goldfish64. All rights reserved.
+//
+
+#include "HyperVTests.hpp"
+#include "HyperVStorageProtocol.hpp"
+
+#include <algorithm>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define kTestBlockSize              512
+#define kTestMaxLuns                4
+#define kTestMaxTransferBytes       (256 * 1024)
+#define kTestMaxPageSegments        (kTestMaxTransferBytes / kHyperVStoragePageSize)
+#define kTestMaxQueueDepth          32
+#define kTestGuestPages             (kTestMaxPageSegments * kTestMaxQueueDepth)
+#define kTestDiskSize               (16 * 1024 * 1024)
+#define kTestBenchDiskSize          (256 * 1024 * 1024)
+#define kTestBenchJobNs             250000000ULL
+
+#define kTestStatusInvalidParameter 0xC000000D
+
+#define kTestSenseResponseCode      0x70
+#define kTestSenseAdditionalLength  10
+#define kTestSenseKeyIllegalRequest 0x05
+#define kTestSenseASCInvalidOpcode  0x20
+#define kTestSenseASCLBAOutOfRange  0x21
+
+//
+// Single page range, in the same layout as the range of a VMBus multi-page buffer packet.
+//
+typedef struct {
+  UInt32 length;
+  UInt32 offset;
+  UInt64 pfns[kTestMaxPageSegments + 1];
+} TestPageRange;
+
+//
+// Same members as IODMACommand::Segment64.
+//
+typedef struct {
+  UInt64 fIOVMAddr;
+  UInt64 fLength;
+} TestSegment;
+
+static inline UInt64 readBigEndian(const UInt8 *data, UInt32 length) {
+  UInt64 value = 0;
+  for (UInt32 i = 0; i < length; i++) {
+    value = (value << 8) | data[i];
+  }
+  return value;
+}
+
+static inline void writeBigEndian(UInt8 *data, UInt64 value, UInt32 length) {
+  for (UInt32 i = length; i > 0; i--) {
+    data[i - 1] = value & 0xFF;
+    value >>= 8;
+  }
+}
+
+static inline UInt64 testRandom64() {
+  return ((UInt64) testRandom() << 32) | testRandom();
+}
+
+//
+// Guest physical memory, page numbers are page offsets from the start of the buffer.
+//
+class TestGuestMemory {
+public:
+  explicit TestGuestMemory(UInt32 pageCount) : _pageCount(pageCount) {
+    _base = (UInt8*) calloc(pageCount, kHyperVStoragePageSize);
+  }
+  ~TestGuestMemory() {
+    free(_base);
+  }
+
+  UInt8 *getPage(UInt64 pfn) {
+    return (pfn < _pageCount) ? &_base[pfn << kHyperVStoragePageShift] : nullptr;
+  }
+
+private:
+  UInt8  *_base;
+  UInt32 _pageCount;
+};
+
+//
+// LUN backing store.
+//
+class TestBacking {
+public:
+  virtual ~TestBacking() {}
+  virtual bool read(UInt64 offset, UInt8 *data, UInt32 length) = 0;
+  virtual bool write(UInt64 offset, const UInt8 *data, UInt32 length) = 0;
+  UInt64 getBlockCount() const { return _blockCount; }
+
+protected:
+  UInt64 _blockCount = 0;
+};
+
+class TestRamBacking : public TestBacking {
+public:
+  explicit TestRamBacking(UInt64 size) : _data(size, 0) {
+    _blockCount = size / kTestBlockSize;
+  }
+
+  bool read(UInt64 offset, UInt8 *data, UInt32 length) override {
+    memcpy(data, &_data[offset], length);
+    return true;
+  }
+  bool write(UInt64 offset, const UInt8 *data, UInt32 length) override {
+    memcpy(&_data[offset], data, length);
+    return true;
+  }
+
+private:
+  std::vector<UInt8> _data;
+};
+
+//
+// Sparse file backing, a temporary file is used and unlinked if no path is given.
+//
+class TestFileBacking : public TestBacking {
+public:
+  TestFileBacking(const char *path, UInt64 size) {
+    char tempPath[] = "/tmp/hvstorXXXXXX";
+
+    if (path != nullptr) {
+      _fd = open(path, O_RDWR | O_CREAT, 0600);
+    } else {
+      _fd = mkstemp(tempPath);
+      if (_fd >= 0) {
+        unlink(tempPath);
+      }
+    }
+    if (_fd >= 0 && ftruncate(_fd, (off_t) size) == 0) {
+      _blockCount = size / kTestBlockSize;
+    }
+  }
+  ~TestFileBacking() override {
+    if (_fd >= 0) {
+      close(_fd);
+    }
+  }
+
+  bool isValid() const { return _blockCount != 0; }
+  bool read(UInt64 offset, UInt8 *data, UInt32 length) override {
+    return pread(_fd, data, length, (off_t) offset) == (ssize_t) length;
+  }
+  bool write(UInt64 offset, const UInt8 *data, UInt32 length) override {
+    return pwrite(_fd, data, length, (off_t) offset) == (ssize_t) length;
+  }
+
+private:
+  int _fd = -1;
+};
+
+//
+// Simulated StorVSP host.
+// Serves initialization, protocol negotiation, channel properties and TEST UNIT READY, READ and WRITE SRBs
+// from its LUN backing stores, accessing guest memory through the page numbers sent with each request.
+//
+class TestStorageHost {
+public:
+  TestStorageHost(TestGuestMemory *memory, UInt16 maxVersion) : _memory(memory), _maxVersion(maxVersion) {}
+
+  void attachLun(UInt8 lun, TestBacking *backing) { _luns[lun] = backing; }
+  UInt16 getVersion() const { return _version; }
+  UInt32 getPacketCount() const { return _packetCount; }
+
+  void handlePacket(HyperVStoragePacket *storPkt, UInt32 pktLength, const TestPageRange *range, UInt32 pfnCount) {
+    UInt32 status = kHyperVStoragePacketSuccess;
+
+    _packetCount++;
+    if (pktLength != sizeof (HyperVStoragePacket) - _packetSizeDelta) {
+      status = kTestStatusInvalidParameter;
+    } else {
+      switch (storPkt->operation) {
+        case kHyperVStoragePacketOperationBeginInitialization:
+        case kHyperVStoragePacketOperationEndInitialization:
+          break;
+
+        case kHyperVStoragePacketOperationQueryProtocolVersion:
+          if (!acceptVersion(storPkt->protocolVersion.majorMinor)) {
+            status = kTestStatusInvalidParameter;
+          }
+          break;
+
+        case kHyperVStoragePacketOperationQueryProperties:
+          memset(&storPkt->storageChannelProperties, 0, sizeof (storPkt->storageChannelProperties));
+          storPkt->storageChannelProperties.maxTransferBytes = kTestMaxTransferBytes;
+          break;
+
+        case kHyperVStoragePacketOperationExecuteSRB:
+          status = executeSRB(&storPkt->scsiRequest, range, pfnCount);
+          break;
+
+        default:
+          status = kTestStatusInvalidParameter;
+          break;
+      }
+    }
+
+    storPkt->operation = kHyperVStoragePacketOperationCompleteIO;
+    storPkt->status    = status;
+  }
+
+private:
+  TestGuestMemory *_memory;
+  TestBacking     *_luns[kTestMaxLuns] = { };
+  UInt16          _maxVersion;
+  UInt16          _version             = 0;
+  UInt32          _packetSizeDelta     = sizeof (HyperVStorageSCSIRequestWin8Extension);
+  UInt32          _senseBufferSize     = kHyperVStoragePreWin8SenseBufferSize;
+  UInt32          _packetCount         = 0;
+
+  bool acceptVersion(UInt16 version) {
+    if (version > _maxVersion
+        || (version != kHyperVStorageVersionWin2008 && version != kHyperVStorageVersionWin7
+            && version != kHyperVStorageVersionWin8 && version != kHyperVStorageVersionWin8_1
+            && version != kHyperVStorageVersionWin10)) {
+      return false;
+    }
+
+    //
+    // Windows 8 and newer add the SRB extension and the larger sense buffer.
+    //
+    _version         = version;
+    _packetSizeDelta = (version >= kHyperVStorageVersionWin8) ? 0 : sizeof (HyperVStorageSCSIRequestWin8Extension);
+    _senseBufferSize = (version >= kHyperVStorageVersionWin8)
+      ? kHyperVStoragePostWin7SenseBufferSize : kHyperVStoragePreWin8SenseBufferSize;
+    return true;
+  }
+
+  void setSense(HyperVStorageSCSIRequest *request, UInt8 senseKey, UInt8 asc) {
+    memset(request->senseData, 0, _senseBufferSize);
+    request->senseData[0]           = kTestSenseResponseCode;
+    request->senseData[2]           = senseKey;
+    request->senseData[7]           = kTestSenseAdditionalLength;
+    request->senseData[12]          = asc;
+    request->scsiStatus             = kSCSITaskStatus_CHECK_CONDITION;
+    request->srbStatus              = kHyperVSRBStatusError | kHyperVSRBStatusAutosenseValid;
+    request->dataTransferLength     = 0;
+  }
+
+  bool transferRange(TestBacking *lun, UInt64 diskOffset, const TestPageRange *range, UInt32 pfnCount,
+                     UInt32 length, bool toGuest) {
+    UInt32 pageOffset = range->offset;
+    UInt32 done       = 0;
+    UInt32 chunk;
+    UInt8  *page;
+
+    for (UInt32 i = 0; done < length; i++) {
+      if (i >= pfnCount || (page = _memory->getPage(range->pfns[i])) == nullptr) {
+        return false;
+      }
+
+      chunk = std::min(kHyperVStoragePageSize - pageOffset, length - done);
+      if (!(toGuest ? lun->read(diskOffset + done, &page[pageOffset], chunk)
+                    : lun->write(diskOffset + done, &page[pageOffset], chunk))) {
+        return false;
+      }
+      done       += chunk;
+      pageOffset  = 0;
+    }
+    return true;
+  }
+
+  UInt32 executeSRB(HyperVStorageSCSIRequest *request, const TestPageRange *range, UInt32 pfnCount) {
+    TestBacking *lun;
+    UInt64      lba;
+    UInt64      blocks;
+    UInt64      length;
+    bool        isRead;
+
+    if (request->length != sizeof (*request) - _packetSizeDelta) {
+      return kTestStatusInvalidParameter;
+    }
+
+    request->scsiStatus = kSCSITaskStatus_GOOD;
+    request->srbStatus  = kHyperVSRBStatusSuccess;
+    if (request->lun >= kTestMaxLuns || (lun = _luns[request->lun]) == nullptr) {
+      request->srbStatus          = kHyperVSRBStatusInvalidLUN;
+      request->dataTransferLength = 0;
+      return kHyperVStoragePacketSuccess;
+    }
+
+    switch (request->cdb[0]) {
+      case kSCSICmd_TEST_UNIT_READY:
+        request->dataTransferLength = 0;
+        return kHyperVStoragePacketSuccess;
+
+      case kSCSICmd_READ_10:
+      case kSCSICmd_WRITE_10:
+        lba    = readBigEndian(&request->cdb[2], 4);
+        blocks = readBigEndian(&request->cdb[7], 2);
+        break;
+
+      case kSCSICmd_READ_16:
+      case kSCSICmd_WRITE_16:
+        lba    = readBigEndian(&request->cdb[2], 8);
+        blocks = readBigEndian(&request->cdb[10], 4);
+        break;
+
+      default:
+        setSense(request, kTestSenseKeyIllegalRequest, kTestSenseASCInvalidOpcode);
+        return kHyperVStoragePacketSuccess;
+    }
+    isRead = request->cdb[0] == kSCSICmd_READ_10 || request->cdb[0] == kSCSICmd_READ_16;
+    length = blocks * kTestBlockSize;
+
+    //
+    // Direction, SRB flags and transfer length must agree with the CDB.
+    // The SRB flags are only present in the Windows 8 extension.
+    //
+    if (request->dataIn != (isRead ? kHyperVStorageSCSIRequestTypeRead : kHyperVStorageSCSIRequestTypeWrite)
+        || (_packetSizeDelta == 0
+            && !(request->win8Extension.srbFlags & (isRead ? kHyperVSRBFlagsDataIn : kHyperVSRBFlagsDataOut)))
+        || length != request->dataTransferLength || range == nullptr || range->length < length) {
+      request->srbStatus          = kHyperVSRBStatusInvalidRequest;
+      request->dataTransferLength = 0;
+      return kHyperVStoragePacketSuccess;
+    }
+
+    if (lba >= lun->getBlockCount() || blocks > lun->getBlockCount() - lba) {
+      setSense(request, kTestSenseKeyIllegalRequest, kTestSenseASCLBAOutOfRange);
+      return kHyperVStoragePacketSuccess;
+    }
+
+    if (!transferRange(lun, lba * kTestBlockSize, range, pfnCount, (UInt32) length, isRead)) {
+      request->srbStatus          = kHyperVSRBStatusError;
+      request->dataTransferLength = 0;
+    }
+    return kHyperVStoragePacketSuccess;
+  }
+};
+
+//
+// Outstanding request, with the page numbers sent alongside the packet.
+//
+typedef struct {
+  HyperVStoragePacket storPkt;
+  TestPageRange       range;
+  UInt32              pfnCount;
+  UInt32              slot;
+  UInt32              offset;
+  UInt32              length;
+  UInt64              lba;
+  UInt64              submitTime;
+} TestRequest;
+
+//
+// Guest side of the channel, following the same steps as HyperVStorage.
+// Requests are queued in order and the host is signaled only when the queue was empty, as with a VMBus ring.
+//
+class TestStorageClient {
+public:
+  explicit TestStorageClient(TestStorageHost *host) : _host(host) {
+    //
+    // Assume we are on an older host and take off the Windows 8 extensions by default.
+    //
+    _protocol.packetSizeDelta = sizeof (HyperVStorageSCSIRequestWin8Extension);
+  }
+
+  const HyperVStorageProtocol *getProtocol() const { return &_protocol; }
+  UInt32 getMaxTransferBytes() const { return _maxTransferBytes; }
+  UInt64 getSignalCount() const { return _signalCount; }
+  bool isQueueEmpty() const { return _queueHead == _queueTail; }
+
+  bool sendCommand(HyperVStoragePacket *storPkt) {
+    storPkt->flags = kHyperVStoragePacketFlagRequestCompletion;
+    _host->handlePacket(storPkt, getStoragePacketLength(&_protocol), nullptr, 0);
+    return true;
+  }
+
+  bool sendCommandChecked(HyperVStoragePacket *storPkt) {
+    return sendCommand(storPkt)
+      && storPkt->operation == kHyperVStoragePacketOperationCompleteIO && storPkt->status == kHyperVStoragePacketSuccess;
+  }
+
+  bool connect() {
+    HyperVStoragePacket         storPkt;
+    const HyperVStorageProtocol *protocol;
+
+    prepareStoragePacket(&storPkt, kHyperVStoragePacketOperationBeginInitialization);
+    if (!sendCommandChecked(&storPkt)) {
+      return false;
+    }
+
+    protocol = negotiateStorageProtocol([this](HyperVStoragePacket *packet) {
+      return sendCommand(packet);
+    });
+    if (protocol == nullptr) {
+      return false;
+    }
+    _protocol = *protocol;
+
+    prepareStoragePacket(&storPkt, kHyperVStoragePacketOperationQueryProperties);
+    if (!sendCommandChecked(&storPkt)) {
+      return false;
+    }
+    _maxTransferBytes = storPkt.storageChannelProperties.maxTransferBytes;
+
+    prepareStoragePacket(&storPkt, kHyperVStoragePacketOperationEndInitialization);
+    return sendCommandChecked(&storPkt);
+  }
+
+  void submit(TestRequest *request) {
+    if (isQueueEmpty()) {
+      _signalCount++;
+    }
+    request->submitTime             = getTimeNs();
+    _queue[_queueTail % kQueueSize] = request;
+    _queueTail++;
+  }
+
+  //
+  // Has the host process the oldest queued request and returns it.
+  //
+  TestRequest *processNext() {
+    TestRequest *request;
+
+    if (isQueueEmpty()) {
+      return nullptr;
+    }
+    request = _queue[_queueHead % kQueueSize];
+    _queueHead++;
+    _host->handlePacket(&request->storPkt, getStoragePacketLength(&_protocol),
+                        request->pfnCount != 0 ? &request->range : nullptr, request->pfnCount);
+    return request;
+  }
+
+private:
+  static const UInt32 kQueueSize = kTestMaxQueueDepth + 1;
+
+  TestStorageHost       *_host;
+  HyperVStorageProtocol _protocol         = { };
+  UInt32                _maxTransferBytes = 0;
+  UInt64                _signalCount      = 0;
+  TestRequest           *_queue[kQueueSize];
+  UInt32                _queueHead        = 0;
+  UInt32                _queueTail        = 0;
+};
+
+//
+// Each request slot owns a data buffer made of scattered guest pages.
+//
+class TestSlotBuffers {
+public:
+  explicit TestSlotBuffers(TestGuestMemory *memory) : _memory(memory) {
+    std::vector<UInt64> pages(kTestGuestPages);
+    for (UInt32 i = 0; i < kTestGuestPages; i++) {
+      pages[i] = i;
+    }
+    for (UInt32 i = kTestGuestPages - 1; i > 0; i--) {
+      std::swap(pages[i], pages[testRandom() % (i + 1)]);
+    }
+    memcpy(_pages, pages.data(), sizeof (_pages));
+  }
+
+  //
+  // Builds the DMA segment list for a buffer starting at the given offset into the slot, one segment per page.
+  //
+  UInt32 getSegments(UInt32 slot, UInt32 offset, UInt32 length, TestSegment *segs) {
+    UInt32 numSegs = 0;
+    UInt32 chunk;
+
+    while (length > 0) {
+      chunk = std::min(kHyperVStoragePageSize - offset, length);
+      segs[numSegs].fIOVMAddr = (_pages[slot][numSegs] << kHyperVStoragePageShift) + offset;
+      segs[numSegs].fLength   = chunk;
+      numSegs++;
+      length -= chunk;
+      offset  = 0;
+    }
+    return numSegs;
+  }
+
+  void copy(UInt32 slot, UInt32 offset, UInt8 *data, UInt32 length, bool toGuest) {
+    UInt32 chunk;
+    UInt8  *page;
+
+    for (UInt32 i = 0; length > 0; i++) {
+      page  = _memory->getPage(_pages[slot][i]);
+      chunk = std::min(kHyperVStoragePageSize - offset, length);
+      if (toGuest) {
+        memcpy(&page[offset], data, chunk);
+      } else {
+        memcpy(data, &page[offset], chunk);
+      }
+      data   += chunk;
+      length -= chunk;
+      offset  = 0;
+    }
+  }
+
+private:
+  TestGuestMemory *_memory;
+  UInt64          _pages[kTestMaxQueueDepth][kTestMaxPageSegments];
+};
+
+//
+// Builds a READ or WRITE request for a slot buffer.
+//
+static bool prepareIORequest(TestStorageClient *client, TestSlotBuffers *slots, TestRequest *request, UInt32 slot,
+                             UInt8 lun, bool isWrite, bool use16, UInt64 lba, UInt32 blocks, UInt32 offset) {
+  TestSegment segs[kTestMaxPageSegments];
+  UInt32      numSegs;
+  UInt32      length = blocks * kTestBlockSize;
+  UInt8       *cdb;
+
+  buildSCSIRequestPacket(&request->storPkt, client->getProtocol(), 0, lun,
+                         isWrite ? kHyperVStorageSCSIRequestTypeWrite : kHyperVStorageSCSIRequestTypeRead, length);
+  cdb = request->storPkt.scsiRequest.cdb;
+  if (use16) {
+    cdb[0] = isWrite ? kSCSICmd_WRITE_16 : kSCSICmd_READ_16;
+    writeBigEndian(&cdb[2], lba, 8);
+    writeBigEndian(&cdb[10], blocks, 4);
+    request->storPkt.scsiRequest.cdbLength = 16;
+  } else {
+    cdb[0] = isWrite ? kSCSICmd_WRITE_10 : kSCSICmd_READ_10;
+    writeBigEndian(&cdb[2], lba, 4);
+    writeBigEndian(&cdb[7], blocks, 2);
+    request->storPkt.scsiRequest.cdbLength = 10;
+  }
+
+  request->slot         = slot;
+  request->offset       = offset;
+  request->length       = length;
+  request->lba          = lba;
+  request->range.length = length;
+  numSegs = slots->getSegments(slot, offset, length, segs);
+  return buildPageRange(segs, numSegs, kTestMaxPageSegments, &request->range, &request->pfnCount);
+}
+
+static bool isRequestGood(const TestRequest *request) {
+  return !hasSCSIAutoSense(&request->storPkt)
+    && request->storPkt.scsiRequest.srbStatus == kHyperVSRBStatusSuccess
+    && getSCSIRealizedLength(&request->storPkt) == request->length;
+}
+
+static void testNegotiation() {
+  static const struct {
+    UInt16 maxVersion;
+    UInt32 senseBufferSize;
+    UInt32 packetSizeDelta;
+  } hosts[] = {
+    { kHyperVStorageVersionWin10,   kHyperVStoragePostWin7SenseBufferSize, 0 },
+    { kHyperVStorageVersionWin8_1,  kHyperVStoragePostWin7SenseBufferSize, 0 },
+    { kHyperVStorageVersionWin8,    kHyperVStoragePostWin7SenseBufferSize, 0 },
+    { kHyperVStorageVersionWin7,    kHyperVStoragePreWin8SenseBufferSize,  sizeof (HyperVStorageSCSIRequestWin8Extension) },
+    { kHyperVStorageVersionWin2008, kHyperVStoragePreWin8SenseBufferSize,  sizeof (HyperVStorageSCSIRequestWin8Extension) }
+  };
+  TestGuestMemory memory(1);
+
+  for (size_t i = 0; i < sizeof (hosts) / sizeof (hosts[0]); i++) {
+    TestStorageHost   host(&memory, hosts[i].maxVersion);
+    TestStorageClient client(&host);
+
+    HVCHECK(client.connect());
+    HVCHECK_EQ(host.getVersion(), hosts[i].maxVersion);
+    HVCHECK_EQ(client.getProtocol()->protocolVersion, hosts[i].maxVersion);
+    HVCHECK_EQ(client.getProtocol()->senseBufferSize, hosts[i].senseBufferSize);
+    HVCHECK_EQ(client.getProtocol()->packetSizeDelta, hosts[i].packetSizeDelta);
+    HVCHECK_EQ(client.getMaxTransferBytes(), kTestMaxTransferBytes);
+
+    //
+    // Begin, one query per version offered, properties and end.
+    //
+    HVCHECK_EQ(host.getPacketCount(), 3 + i + 1);
+  }
+
+  //
+  // No version accepted, and sending failures.
+  //
+  {
+    TestStorageHost   host(&memory, HYPERV_STORAGE_PROTCOL_VERSION(1, 0));
+    TestStorageClient client(&host);
+    HVCHECK(!client.connect());
+    HVCHECK_EQ(host.getPacketCount(), 1 + kHyperVStorageProtocolCount);
+  }
+  {
+    UInt32 sendCount = 0;
+    HVCHECK(negotiateStorageProtocol([&](HyperVStoragePacket *storPkt) {
+      HVCHECK_EQ(storPkt->operation, kHyperVStoragePacketOperationQueryProtocolVersion);
+      HVCHECK_EQ(storPkt->protocolVersion.revision, 0);
+      sendCount++;
+      return false;
+    }) == nullptr);
+    HVCHECK_EQ(sendCount, 1);
+  }
+}
+
+static void testRequestPackets() {
+  HyperVStoragePacket storPkt;
+
+  for (UInt32 i = 0; i < kHyperVStorageProtocolCount; i++) {
+    const HyperVStorageProtocol *protocol = &storageProtocols[i];
+
+    memset(&storPkt, 0xA5, sizeof (storPkt));
+    buildSCSIRequestPacket(&storPkt, protocol, 3, 7, kHyperVStorageSCSIRequestTypeRead, 0x1000);
+    HVCHECK_EQ(storPkt.operation, kHyperVStoragePacketOperationExecuteSRB);
+    HVCHECK_EQ(storPkt.flags, kHyperVStoragePacketFlagRequestCompletion);
+    HVCHECK_EQ(storPkt.status, 0);
+    HVCHECK_EQ(storPkt.scsiRequest.targetID, 3);
+    HVCHECK_EQ(storPkt.scsiRequest.lun, 7);
+    HVCHECK_EQ(storPkt.scsiRequest.length, sizeof (storPkt.scsiRequest) - protocol->packetSizeDelta);
+    HVCHECK_EQ(storPkt.scsiRequest.senseInfoLength, protocol->senseBufferSize);
+    HVCHECK_EQ(storPkt.scsiRequest.dataIn, kHyperVStorageSCSIRequestTypeRead);
+    HVCHECK_EQ(storPkt.scsiRequest.dataTransferLength, 0x1000);
+    HVCHECK_EQ(storPkt.scsiRequest.win8Extension.srbFlags, kHyperVSRBFlagsDisableSyncTransfer | kHyperVSRBFlagsDataIn);
+    HVCHECK_EQ(storPkt.scsiRequest.cdb[0], 0);
+    HVCHECK_EQ(getStoragePacketLength(protocol), sizeof (storPkt) - protocol->packetSizeDelta);
+
+    buildSCSIRequestPacket(&storPkt, protocol, 0, 0, kHyperVStorageSCSIRequestTypeWrite, 0x200);
+    HVCHECK_EQ(storPkt.scsiRequest.win8Extension.srbFlags, kHyperVSRBFlagsDisableSyncTransfer | kHyperVSRBFlagsDataOut);
+
+    buildTestUnitReadyPacket(&storPkt, protocol, 1, 2);
+    HVCHECK_EQ(storPkt.scsiRequest.win8Extension.srbFlags, kHyperVSRBFlagsDisableSyncTransfer);
+    HVCHECK_EQ(storPkt.scsiRequest.dataIn, kHyperVStorageSCSIRequestTypeUnknown);
+    HVCHECK_EQ(storPkt.scsiRequest.dataTransferLength, 0);
+    HVCHECK_EQ(storPkt.scsiRequest.cdb[0], kSCSICmd_TEST_UNIT_READY);
+    HVCHECK_EQ(storPkt.scsiRequest.cdbLength, 6);
+    HVCHECK_EQ(storPkt.scsiRequest.lun, 2);
+  }
+}
+
+static void testPageRanges() {
+  TestPageRange range;
+  TestSegment   segs[4];
+  UInt32        pfnCount;
+
+  //
+  // Page sized segments, first starting and last ending within a page.
+  //
+  segs[0] = { 0x5200, 0xE00 };
+  segs[1] = { 0x9000, 0x1000 };
+  segs[2] = { 0x2000, 0x200 };
+  HVCHECK(buildPageRange(segs, 3, kTestMaxPageSegments, &range, &pfnCount));
+  HVCHECK_EQ(range.offset, 0x200);
+  HVCHECK_EQ(pfnCount, 3);
+  HVCHECK_EQ(range.pfns[0], 5);
+  HVCHECK_EQ(range.pfns[1], 9);
+  HVCHECK_EQ(range.pfns[2], 2);
+
+  //
+  // Segments spanning pages contribute every page.
+  //
+  segs[0] = { 0x10800, 0x1800 };
+  segs[1] = { 0x40000, 0x2001 };
+  HVCHECK(buildPageRange(segs, 2, kTestMaxPageSegments, &range, &pfnCount));
+  HVCHECK_EQ(range.offset, 0x800);
+  HVCHECK_EQ(pfnCount, 5);
+  HVCHECK_EQ(range.pfns[0], 0x10);
+  HVCHECK_EQ(range.pfns[1], 0x11);
+  HVCHECK_EQ(range.pfns[2], 0x40);
+  HVCHECK_EQ(range.pfns[3], 0x41);
+  HVCHECK_EQ(range.pfns[4], 0x42);
+  HVCHECK(!buildPageRange(segs, 2, 4, &range, &pfnCount));
+
+  //
+  // Holes within the range cannot be described.
+  //
+  segs[0] = { 0x1000, 0x1000 };
+  segs[1] = { 0x3200, 0xE00 };
+  HVCHECK(!buildPageRange(segs, 2, kTestMaxPageSegments, &range, &pfnCount));
+  segs[0] = { 0x1000, 0x800 };
+  segs[1] = { 0x3000, 0x1000 };
+  HVCHECK(!buildPageRange(segs, 2, kTestMaxPageSegments, &range, &pfnCount));
+  HVCHECK(!buildPageRange(segs, 0, kTestMaxPageSegments, &range, &pfnCount));
+
+  //
+  // A maximum length transfer not starting on a page boundary needs one more page than its length.
+  //
+  segs[0] = { 0x10200, kTestMaxTransferBytes - 0x200 };
+  segs[1] = { 0x80000, 0x200 };
+  HVCHECK_EQ(getMaxPageRangePfnCount(kTestMaxTransferBytes), kTestMaxPageSegments + 1);
+  HVCHECK(!buildPageRange(segs, 2, kTestMaxPageSegments, &range, &pfnCount));
+  HVCHECK(buildPageRange(segs, 2, getMaxPageRangePfnCount(kTestMaxTransferBytes), &range, &pfnCount));
+  HVCHECK_EQ(pfnCount, kTestMaxPageSegments + 1);
+  HVCHECK_EQ(range.offset, 0x200);
+}
+
+static void testUnitReady() {
+  TestGuestMemory     memory(1);
+  TestRamBacking      backing(kTestDiskSize);
+  TestStorageHost     host(&memory, kHyperVStorageVersionWin10);
+  TestStorageClient   client(&host);
+  HyperVStoragePacket storPkt;
+
+  host.attachLun(1, &backing);
+  HVCHECK(client.connect());
+
+  for (UInt8 lun = 0; lun < kTestMaxLuns + 1; lun++) {
+    buildTestUnitReadyPacket(&storPkt, client.getProtocol(), 0, lun);
+    HVCHECK(client.sendCommand(&storPkt));
+    HVCHECK_EQ(storPkt.status, kHyperVStoragePacketSuccess);
+    HVCHECK_EQ(storPkt.scsiRequest.srbStatus, lun == 1 ? kHyperVSRBStatusSuccess : kHyperVSRBStatusInvalidLUN);
+    HVCHECK(!hasSCSIAutoSense(&storPkt));
+  }
+}
+
+static void testDataIntegrity(TestBacking *backing, UInt16 version) {
+  TestGuestMemory    memory(kTestGuestPages);
+  TestSlotBuffers    slots(&memory);
+  TestStorageHost    host(&memory, version);
+  TestStorageClient  client(&host);
+  TestRequest        requests[8];
+  TestRequest        *request;
+  std::vector<UInt8> shadow(backing->getBlockCount() * kTestBlockSize, 0);
+  std::vector<UInt8> data(kTestMaxTransferBytes);
+  UInt32             offset;
+  UInt32             blocks;
+  UInt64             lba;
+  bool               isWrite;
+
+  host.attachLun(0, backing);
+  HVCHECK(client.connect());
+
+  for (UInt32 round = 0; round < 200; round++) {
+    //
+    // Queue a batch of random sized reads and writes, some starting within a page.
+    //
+    for (UInt32 slot = 0; slot < 8; slot++) {
+      offset  = (testRandom() % 4 == 0) ? (testRandom() % 8) * kTestBlockSize : 0;
+      blocks  = 1 + testRandom() % ((kTestMaxTransferBytes - offset) / kTestBlockSize);
+      lba     = testRandom64() % (backing->getBlockCount() - blocks + 1);
+      isWrite = testRandom() % 2;
+
+      HVCHECK(prepareIORequest(&client, &slots, &requests[slot], slot, 0, isWrite, testRandom() % 2, lba, blocks, offset));
+      if (isWrite) {
+        for (UInt32 i = 0; i < blocks * kTestBlockSize; i++) {
+          data[i] = (UInt8) testRandom();
+        }
+        slots.copy(slot, offset, data.data(), blocks * kTestBlockSize, true);
+      }
+      client.submit(&requests[slot]);
+    }
+
+    //
+    // Requests are processed in order, so the shadow copy tracks the disk at each completion.
+    //
+    while ((request = client.processNext()) != nullptr) {
+      HVCHECK(isRequestGood(request));
+      if (request->storPkt.scsiRequest.dataIn == kHyperVStorageSCSIRequestTypeWrite) {
+        slots.copy(request->slot, request->offset, &shadow[request->lba * kTestBlockSize], request->length, false);
+      } else {
+        slots.copy(request->slot, request->offset, data.data(), request->length, false);
+        HVCHECK(memcmp(data.data(), &shadow[request->lba * kTestBlockSize], request->length) == 0);
+      }
+    }
+  }
+  HVCHECK_EQ(client.getSignalCount(), 200);
+}
+
+static void testErrors() {
+  TestGuestMemory     memory(kTestGuestPages);
+  TestSlotBuffers     slots(&memory);
+  TestRamBacking      backing(kTestDiskSize);
+  TestStorageHost     host(&memory, kHyperVStorageVersionWin10);
+  TestStorageClient   client(&host);
+  TestRequest         request;
+  HyperVStoragePacket storPkt;
+
+  host.attachLun(0, &backing);
+  HVCHECK(client.connect());
+
+  //
+  // Out of range transfers fail with sense data and nothing transferred.
+  //
+  HVCHECK(prepareIORequest(&client, &slots, &request, 0, 0, false, true, backing.getBlockCount() - 1, 2, 0));
+  client.submit(&request);
+  HVCHECK(client.processNext() == &request);
+  HVCHECK(hasSCSIAutoSense(&request.storPkt));
+  HVCHECK_EQ(getSCSIRealizedLength(&request.storPkt), 0);
+  HVCHECK_EQ(request.storPkt.scsiRequest.srbStatus, kHyperVSRBStatusError | kHyperVSRBStatusAutosenseValid);
+  HVCHECK_EQ(request.storPkt.scsiRequest.senseData[2], kTestSenseKeyIllegalRequest);
+  HVCHECK_EQ(request.storPkt.scsiRequest.senseData[12], kTestSenseASCLBAOutOfRange);
+
+  //
+  // Unsupported commands.
+  //
+  buildSCSIRequestPacket(&storPkt, client.getProtocol(), 0, 0, kHyperVStorageSCSIRequestTypeUnknown, 0);
+  storPkt.scsiRequest.cdb[0] = 0xFF;
+  HVCHECK(client.sendCommand(&storPkt));
+  HVCHECK(hasSCSIAutoSense(&storPkt));
+  HVCHECK_EQ(storPkt.scsiRequest.senseData[12], kTestSenseASCInvalidOpcode);
+
+  //
+  // Direction flags that do not match the command.
+  //
+  HVCHECK(prepareIORequest(&client, &slots, &request, 0, 0, true, false, 0, 8, 0));
+  request.storPkt.scsiRequest.win8Extension.srbFlags &= ~kHyperVSRBFlagsDataOut;
+  client.submit(&request);
+  HVCHECK(client.processNext() == &request);
+  HVCHECK_EQ(request.storPkt.scsiRequest.srbStatus, kHyperVSRBStatusInvalidRequest);
+  HVCHECK(!isRequestGood(&request));
+
+  //
+  // Packets sized for another protocol version are failed by the host, and nothing is considered transferred.
+  //
+  HVCHECK(prepareIORequest(&client, &slots, &request, 0, 0, false, false, 0, 8, 0));
+  request.storPkt.scsiRequest.length -= sizeof (HyperVStorageSCSIRequestWin8Extension);
+  client.submit(&request);
+  HVCHECK(client.processNext() == &request);
+  HVCHECK_EQ(request.storPkt.status, kTestStatusInvalidParameter);
+  HVCHECK_EQ(getSCSIRealizedLength(&request.storPkt), 0);
+}
+
+//
+// fio-like job description and results.
+//
+typedef struct {
+  const char *name;
+  bool       isWrite;
+  bool       isRandom;
+  UInt32     blockSize;
+  UInt32     queueDepth;
+} TestJob;
+
+typedef struct {
+  UInt64 ios;
+  UInt64 bytes;
+  UInt64 errors;
+  UInt64 signals;
+  UInt64 elapsedNs;
+  UInt64 p50Ns;
+  UInt64 p99Ns;
+  UInt64 p999Ns;
+} TestJobResult;
+
+//
+// Runs a job until the I/O count or duration is reached, keeping the queue depth constant.
+//
+static void runJob(TestBacking *backing, const TestJob *job, UInt64 maxIOs, UInt64 durationNs, TestJobResult *result) {
+  TestGuestMemory     memory(kTestGuestPages);
+  TestSlotBuffers     slots(&memory);
+  TestStorageHost     host(&memory, kHyperVStorageVersionWin10);
+  TestStorageClient   client(&host);
+  TestRequest         requests[kTestMaxQueueDepth];
+  TestRequest         *request;
+  std::vector<UInt64> latencies;
+  UInt32              blocks       = job->blockSize / kTestBlockSize;
+  UInt64              blockRanges  = backing->getBlockCount() / blocks;
+  UInt64              nextRange    = 0;
+  UInt64              submitted    = 0;
+  UInt64              start;
+  UInt64              now;
+
+  memset(result, 0, sizeof (*result));
+  host.attachLun(0, backing);
+  if (!client.connect()) {
+    result->errors++;
+    return;
+  }
+  latencies.reserve(maxIOs != 0 ? maxIOs : 1000000);
+
+  auto submitNext = [&](UInt32 slot) {
+    UInt64 range = job->isRandom ? testRandom64() % blockRanges : nextRange++ % blockRanges;
+    if (!prepareIORequest(&client, &slots, &requests[slot], slot, 0, job->isWrite, false, range * blocks, blocks, 0)) {
+      result->errors++;
+      return;
+    }
+    client.submit(&requests[slot]);
+    submitted++;
+  };
+
+  start = getTimeNs();
+  for (UInt32 slot = 0; slot < job->queueDepth; slot++) {
+    submitNext(slot);
+  }
+  while ((request = client.processNext()) != nullptr) {
+    now = getTimeNs();
+    latencies.push_back(now - request->submitTime);
+    result->ios++;
+    if (isRequestGood(request)) {
+      result->bytes += getSCSIRealizedLength(&request->storPkt);
+    } else {
+      result->errors++;
+    }
+
+    if ((maxIOs == 0 || submitted < maxIOs) && (durationNs == 0 || now - start < durationNs)) {
+      submitNext(request->slot);
+    }
+  }
+  result->elapsedNs = getTimeNs() - start;
+  result->signals   = client.getSignalCount();
+
+  if (!latencies.empty()) {
+    std::sort(latencies.begin(), latencies.end());
+    result->p50Ns  = latencies[latencies.size() / 2];
+    result->p99Ns  = latencies[std::min(latencies.size() - 1, (latencies.size() * 99) / 100)];
+    result->p999Ns = latencies[std::min(latencies.size() - 1, (latencies.size() * 999) / 1000)];
+  }
+}
+
+static const TestJob benchmarkJobs[] = {
+  { "randread",  false, true,  4096,   1  },
+  { "randread",  false, true,  4096,   32 },
+  { "randwrite", true,  true,  4096,   1  },
+  { "randwrite", true,  true,  4096,   32 },
+  { "randread",  false, true,  65536,  8  },
+  { "randwrite", true,  true,  65536,  8  },
+  { "read",      false, false, 131072, 4  },
+  { "write",     true,  false, 131072, 4  },
+  { "read",      false, false, 262144, 1  },
+  { "write",     true,  false, 262144, 1  }
+};
+
+static void testJobs() {
+  TestRamBacking backing(kTestDiskSize);
+  TestJobResult  result;
+
+  for (size_t i = 0; i < sizeof (benchmarkJobs) / sizeof (benchmarkJobs[0]); i++) {
+    runJob(&backing, &benchmarkJobs[i], 256, 0, &result);
+    HVCHECK_EQ(result.errors, 0);
+    HVCHECK_EQ(result.ios, 256);
+    HVCHECK_EQ(result.bytes, 256ULL * benchmarkJobs[i].blockSize);
+    HVCHECK(result.p50Ns <= result.p99Ns && result.p99Ns <= result.p999Ns);
+
+    //
+    // The host is only signaled when the queue was empty, so only once for queue depths above one.
+    //
+    HVCHECK_EQ(result.signals, benchmarkJobs[i].queueDepth == 1 ? 256 : 1);
+  }
+}
+
+static void benchmark(const char *filePath) {
+  TestBacking   *backing;
+  TestJobResult result;
+
+  if (filePath != nullptr) {
+    TestFileBacking *fileBacking = new TestFileBacking(filePath, kTestBenchDiskSize);
+    if (!fileBacking->isValid()) {
+      fprintf(stderr, "Unable to use %s as a sparse LUN\n", filePath);
+      delete fileBacking;
+      return;
+    }
+    backing = fileBacking;
+  } else {
+    backing = new TestRamBacking(kTestBenchDiskSize);
+  }
+
+  printf("Simulated StorVSP host, %u MB %s LUN, %llu ms per job\n", kTestBenchDiskSize / (1024 * 1024),
+         filePath != nullptr ? "sparse file" : "RAM", kTestBenchJobNs / 1000000);
+  printf("%-10s %7s %4s %10s %10s %10s %10s %10s %8s\n",
+         "Pattern", "BS", "QD", "IOPS", "MB/s", "p50 us", "p99 us", "p99.9 us", "Errors");
+  for (size_t i = 0; i < sizeof (benchmarkJobs) / sizeof (benchmarkJobs[0]); i++) {
+    runJob(backing, &benchmarkJobs[i], 0, kTestBenchJobNs, &result);
+    printf("%-10s %6uK %4u %10.0f %10.1f %10.2f %10.2f %10.2f %8llu\n",
+           benchmarkJobs[i].name, benchmarkJobs[i].blockSize / 1024, benchmarkJobs[i].queueDepth,
+           result.ios * 1e9 / result.elapsedNs, result.bytes * 1e3 / result.elapsedNs,
+           result.p50Ns / 1e3, result.p99Ns / 1e3, result.p999Ns / 1e3, (unsigned long long) result.errors);
+  }
+  delete backing;
+}
+
+int main(int argc, char **argv) {
+  if (isBenchmarkRun(argc, argv)) {
+    benchmark((argc > 3 && strcmp(argv[2], "--file") == 0) ? argv[3] : nullptr);
+    return 0;
+  }
+
+  testNegotiation();
+  testRequestPackets();
+  testPageRanges();
+  testUnitReady();
+  {
+    TestRamBacking ramBacking(kTestDiskSize);
+    testDataIntegrity(&ramBacking, kHyperVStorageVersionWin10);
+  }
+  {
+    TestFileBacking fileBacking(nullptr, kTestDiskSize);
+    HVCHECK(fileBacking.isValid());
+    testDataIntegrity(&fileBacking, kHyperVStorageVersionWin7);
+  }
+  testErrors();
+  testJobs();
+  return finishTests("StorageHostTests");
+}
@@ -0,0 +1,87 @@
+//
+//  TLBFlushTests.cpp
+//  Tests for the Hyper-V paravirtual TLB flush range helpers
+//
+//  Copyright © 2022 Goldfish64. All rights reserved.
+//
+
+#include "HyperVTests.hpp"
+#include "HyperVTLBFlush.hpp"
+
+#define kTestPageSize   (1ULL << kHyperVTLBFlushPageShift)
+
+static void testPageCounts() {
+  //
+  // Empty and reversed ranges flush everything.
+  //
+  HVCHECK_EQ(getTLBFlushListPageCount(0, 0), 0);
+  HVCHECK_EQ(getTLBFlushListPageCount(0x1000, 0x1000), 0);
+  HVCHECK_EQ(getTLBFlushListPageCount(0x2000, 0x1000), 0);
+
+  HVCHECK_EQ(getTLBFlushListPageCount(0x1000, 0x2000), 1);
+  HVCHECK_EQ(getTLBFlushListPageCount(0x1000, 0x1001), 1);
+  HVCHECK_EQ(getTLBFlushListPageCount(0x1FFF, 0x2000), 1);
+
+  //
+  // Unaligned ranges count every page they touch.
+  //
+  HVCHECK_EQ(getTLBFlushListPageCount(0x1FFF, 0x2001), 2);
+  HVCHECK_EQ(getTLBFlushListPageCount(0x1800, 0x2800), 2);
+
+  //
+  // Ranges beyond the list limit flush everything.
+  //
+  HVCHECK_EQ(getTLBFlushListPageCount(0x100000, 0x100000 + kHyperVTLBFlushListMaxPages * kTestPageSize),
+             kHyperVTLBFlushListMaxPages);
+  HVCHECK_EQ(getTLBFlushListPageCount(0x100000, 0x100000 + kHyperVTLBFlushListMaxPages * kTestPageSize + 1), 0);
+  HVCHECK_EQ(getTLBFlushListPageCount(0x100800, 0x100000 + kHyperVTLBFlushListMaxPages * kTestPageSize + 1), 0);
+  HVCHECK_EQ(getTLBFlushListPageCount(0, UINT64_MAX), 0);
+
+  //
+  // Ranges at the top of the address space must not overflow.
+  //
+  HVCHECK_EQ(getTLBFlushListPageCount(UINT64_MAX - kTestPageSize + 1, UINT64_MAX), 1);
+  HVCHECK_EQ(getTLBFlushListPageCount(0xFFFFFF8000000000ULL, 0xFFFFFF8000003000ULL), 3);
+}
+
+static void testRandomRanges() {
+  UInt64 startAddress;
+  UInt64 length;
+  UInt64 expected;
+
+  for (UInt32 round = 0; round < 100000; round++) {
+    startAddress = (((UInt64) testRandom() << 32) | testRandom()) & 0x00007FFFFFFFFFFFULL;
+    length       = testRandom() % ((kHyperVTLBFlushListMaxPages + 4) * kTestPageSize);
+
+    expected = 0;
+    if (length != 0) {
+      for (UInt64 page = startAddress / kTestPageSize; page * kTestPageSize < startAddress + length; page++) {
+        expected++;
+      }
+    }
+    if (expected > kHyperVTLBFlushListMaxPages) {
+      expected = 0;
+    }
+    HVCHECK_EQ(getTLBFlushListPageCount(startAddress, startAddress + length), expected);
+  }
+}
+
+static void testAddressSpaces() {
+  //
+  // PCID and cache control bits are not part of the address space.
+  //
+  HVCHECK_EQ(getTLBFlushAddressSpace(0x12345000ULL), 0x12345000ULL);
+  HVCHECK_EQ(getTLBFlushAddressSpace(0x12345FFFULL), 0x12345000ULL);
+  HVCHECK_EQ(getTLBFlushAddressSpace(0x8000000012345018ULL), 0x12345000ULL);
+}
+
+int main(int argc, char **argv) {
+  if (isBenchmarkRun(argc, argv)) {
+    return 0;
+  }
+
+  testPageCounts();
+  testRandomRanges();
+  testAddressSpaces();
+  return finishTests("TLBFlushTests");
+}
@@ -0,0 +1,150 @@
+//
+//  VPSetTests.cpp
+//  Tests for the Hyper-V virtual processor mask and set encoders
+//
+//  Copyright © 2022 Goldfish64. All rights reserved.
+//
+
+#include "HyperVTests.hpp"
+#include "HyperVVPSet.hpp"
+
+#define kTestMaxCPUs    64
+#define kTestMaxVPs     (kHyperVVPSetBankSize * kHyperVVPSetMaxBanks)
+
+//
+// VP set header followed by room for every bank.
+//
+typedef struct {
+  UInt64 buffer[(sizeof (HyperVVPSet) / sizeof (UInt64)) + kHyperVVPSetMaxBanks];
+  HyperVVPSet *get() { return (HyperVVPSet*) buffer; }
+} TestVPSet;
+
+//
+// Reference encoding, walking every bank in order and checking every CPU against it.
+//
+static UInt32 referenceVPSet(const UInt32 *cpuVPIndexes, UInt64 cpuMask, UInt64 *validBankMask, UInt64 *banks) {
+  UInt32 bankCount = 0;
+  UInt64 contents;
+
+  *validBankMask = 0;
+  for (UInt32 bank = 0; bank < kHyperVVPSetMaxBanks; bank++) {
+    contents = 0;
+    for (UInt32 cpu = 0; cpu < kTestMaxCPUs; cpu++) {
+      if ((cpuMask & (1ULL << cpu)) && (cpuVPIndexes[cpu] / kHyperVVPSetBankSize) == bank) {
+        contents |= 1ULL << (cpuVPIndexes[cpu] % kHyperVVPSetBankSize);
+      }
+    }
+    if (contents != 0) {
+      *validBankMask       |= 1ULL << bank;
+      banks[bankCount++]    = contents;
+    }
+  }
+  return bankCount;
+}
+
+static void testIdentityMap() {
+  UInt32    cpuVPIndexes[kTestMaxCPUs];
+  UInt64    vpMask;
+  TestVPSet vpSet;
+
+  for (UInt32 i = 0; i < kTestMaxCPUs; i++) {
+    cpuVPIndexes[i] = i;
+  }
+
+  HVCHECK(encodeVPMask(cpuVPIndexes, kTestMaxCPUs, 0, &vpMask));
+  HVCHECK_EQ(vpMask, 0);
+  HVCHECK(encodeVPMask(cpuVPIndexes, kTestMaxCPUs, 0x8000000000000001ULL, &vpMask));
+  HVCHECK_EQ(vpMask, 0x8000000000000001ULL);
+  HVCHECK(encodeVPMask(cpuVPIndexes, kTestMaxCPUs, UINT64_MAX, &vpMask));
+  HVCHECK_EQ(vpMask, UINT64_MAX);
+
+  HVCHECK_EQ(encodeVPSet(cpuVPIndexes, kTestMaxCPUs, UINT64_MAX, vpSet.get()), 1);
+  HVCHECK_EQ(vpSet.get()->format, kHyperVVPSetFormatSparse4K);
+  HVCHECK_EQ(vpSet.get()->validBankMask, 1);
+  HVCHECK_EQ(vpSet.get()->bankContents[0], UINT64_MAX);
+
+  //
+  // No CPUs is not a valid set.
+  //
+  HVCHECK_EQ(encodeVPSet(cpuVPIndexes, kTestMaxCPUs, 0, vpSet.get()), 0);
+}
+
+static void testOutOfRange() {
+  UInt32    cpuVPIndexes[4] = { 0, 63, 64, kTestMaxVPs };
+  UInt64    vpMask;
+  TestVPSet vpSet;
+
+  //
+  // CPUs beyond the map cannot be encoded.
+  //
+  HVCHECK(!encodeVPMask(cpuVPIndexes, 2, 0x4, &vpMask));
+  HVCHECK_EQ(encodeVPSet(cpuVPIndexes, 2, 0x4, vpSet.get()), 0);
+
+  //
+  // Simple mask only covers VP indexes below 64, sets cover the first 4096.
+  //
+  HVCHECK(encodeVPMask(cpuVPIndexes, 4, 0x3, &vpMask));
+  HVCHECK_EQ(vpMask, 0x8000000000000001ULL);
+  HVCHECK(!encodeVPMask(cpuVPIndexes, 4, 0x4, &vpMask));
+  HVCHECK_EQ(encodeVPSet(cpuVPIndexes, 4, 0x7, vpSet.get()), 2);
+  HVCHECK_EQ(vpSet.get()->validBankMask, 0x3);
+  HVCHECK_EQ(vpSet.get()->bankContents[0], 0x8000000000000001ULL);
+  HVCHECK_EQ(vpSet.get()->bankContents[1], 0x1);
+  HVCHECK_EQ(encodeVPSet(cpuVPIndexes, 4, 0x8, vpSet.get()), 0);
+}
+
+static void testRandomMaps() {
+  UInt32    cpuVPIndexes[kTestMaxCPUs];
+  UInt64    banks[kHyperVVPSetMaxBanks];
+  UInt64    validBankMask;
+  UInt64    cpuMask;
+  UInt64    vpMask;
+  UInt64    expectedMask;
+  UInt32    bankCount;
+  TestVPSet vpSet;
+  bool      allLow;
+
+  for (UInt32 round = 0; round < 20000; round++) {
+    //
+    // Alternate between VP indexes clustered in a few banks and spread over all of them.
+    //
+    UInt32 vpRange = (round & 1) ? kTestMaxVPs : 256;
+    for (UInt32 i = 0; i < kTestMaxCPUs; i++) {
+      cpuVPIndexes[i] = testRandom() % vpRange;
+    }
+    cpuMask = ((UInt64) testRandom() << 32) | testRandom();
+    if (round & 2) {
+      cpuMask &= ((UInt64) testRandom() << 32) | testRandom();
+    }
+
+    bankCount = referenceVPSet(cpuVPIndexes, cpuMask, &validBankMask, banks);
+    memset(&vpSet, 0xA5, sizeof (vpSet));
+    HVCHECK_EQ(encodeVPSet(cpuVPIndexes, kTestMaxCPUs, cpuMask, vpSet.get()), bankCount);
+    HVCHECK_EQ(vpSet.get()->validBankMask, validBankMask);
+    HVCHECK(memcmp(vpSet.get()->bankContents, banks, bankCount * sizeof (banks[0])) == 0);
+
+    allLow       = true;
+    expectedMask = 0;
+    for (UInt32 i = 0; i < kTestMaxCPUs; i++) {
+      if (cpuMask & (1ULL << i)) {
+        allLow        = allLow && cpuVPIndexes[i] < kHyperVVPSetBankSize;
+        expectedMask |= (cpuVPIndexes[i] < kHyperVVPSetBankSize) ? (1ULL << cpuVPIndexes[i]) : 0;
+      }
+    }
+    HVCHECK_EQ(encodeVPMask(cpuVPIndexes, kTestMaxCPUs, cpuMask, &vpMask), allLow);
+    if (allLow) {
+      HVCHECK_EQ(vpMask, expectedMask);
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  if (isBenchmarkRun(argc, argv)) {
+    return 0;
+  }
+
+  testIdentityMap();
+  testOutOfRange();
+  testRandomMaps();
+  return finishTests("VPSetTests");
+}